@@ -214,14 +214,14 @@ bool CalculateAccumulatorCheckpoint(int nHeight, uint256& nCheckpoint)
         }
 
         //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex)) {
+        CBlockRef pblock;
+        if(!ReadBlockFromDisk(pblock, pindex)) {
             LogPrint("zero","%s: failed to read block from disk\n", __func__);
             return false;
         }
 
         std::list<PublicCoin> listPubcoins;
-        if (!BlockToPubcoinList(block, listPubcoins, fFilterInvalid)) {
+        if (!BlockToPubcoinList(*pblock, listPubcoins, fFilterInvalid)) {
             LogPrint("zero","%s: failed to get zerocoin mintlist from block %n\n", __func__, pindex->nHeight);
             return false;
         }
@@ -357,15 +357,15 @@ bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator
 
         // if this block contains mints of the denomination that is being spent, then add them to the witness
         if (pindex->MintedDenomination(coin.getDenomination())) {
-            //grab mints from this block
-            CBlock block;
-            if(!ReadBlockFromDisk(block, pindex)) {
+            //grab mints from this block, the witness walks old blocks so they are not kept in the cache
+            CBlockRef pblock;
+            if(!ReadBlockFromDisk(pblock, pindex, false)) {
                 LogPrintf("%s: failed to read block from disk while adding pubcoins to witness\n", __func__);
                 return false;
             }
 
             list<PublicCoin> listPubcoins;
-            if(!BlockToPubcoinList(block, listPubcoins, true)) {
+            if(!BlockToPubcoinList(*pblock, listPubcoins, true)) {
                 LogPrintf("%s: failed to get zerocoin mintlist from block %n\n", __func__, pindex->nHeight);
                 return false;
             }
@@ -396,7 +396,7 @@ bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator
     int nZerocoinStartHeight = GetZerocoinStartHeight();
     pindex = chainActive[nZerocoinStartHeight];
     while (pindex->nHeight < nAccStartHeight) {
-        nMintsAdded += count(pindex->vMintDenominationsInBlock.begin(), pindex->vMintDenominationsInBlock.end(), coin.getDenomination());
+        nMintsAdded += pindex->mintDenominationsInBlock.Count(coin.getDenomination());
         pindex = chainActive[pindex->nHeight + 1];
     }
 
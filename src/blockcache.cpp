@@ -0,0 +1,112 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "memusage.h"
+
+size_t BlockDynamicUsage(const CBlock& block)
+{
+    size_t nUsage = memusage::DynamicUsage(block.vtx) + memusage::DynamicUsage(block.vchBlockSig) +
+                    memusage::DynamicUsage(block.vMerkleTree) + memusage::DynamicUsage(block.payee);
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        nUsage += memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+        for (unsigned int j = 0; j < tx.vin.size(); j++)
+            nUsage += memusage::DynamicUsage(tx.vin[j].scriptSig) + memusage::DynamicUsage(tx.vin[j].prevPubKey);
+        for (unsigned int j = 0; j < tx.vout.size(); j++)
+            nUsage += memusage::DynamicUsage(tx.vout[j].scriptPubKey);
+    }
+    return nUsage;
+}
+
+CBlockCache::CBlockCache(size_t nMaxUsageIn) : nUsage(0), nMaxUsage(nMaxUsageIn), nHits(0), nMisses(0)
+{
+}
+
+CBlockRef CBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, EntryList::iterator>::iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end()) {
+        nMisses++;
+        return CBlockRef();
+    }
+    nHits++;
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    return it->second->block;
+}
+
+void CBlockCache::Insert(const uint256& hash, const CBlockRef& block)
+{
+    LOCK(cs);
+    std::map<uint256, EntryList::iterator>::iterator it = mapEntries.find(hash);
+    if (it != mapEntries.end()) {
+        listEntries.splice(listEntries.begin(), listEntries, it->second);
+        return;
+    }
+
+    // The list and map nodes of the entry come on top of the block itself
+    Entry entry;
+    entry.hash = hash;
+    entry.block = block;
+    entry.nUsage = memusage::MallocUsage(sizeof(CBlock)) + BlockDynamicUsage(*block) +
+                   memusage::MallocUsage(sizeof(Entry) + 2 * sizeof(void*)) +
+                   memusage::MallocUsage(sizeof(uint256) + sizeof(EntryList::iterator) + 4 * sizeof(void*));
+    if (entry.nUsage > nMaxUsage)
+        return;
+
+    listEntries.push_front(entry);
+    mapEntries[hash] = listEntries.begin();
+    nUsage += entry.nUsage;
+    Trim();
+}
+
+void CBlockCache::Erase(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, EntryList::iterator>::iterator it = mapEntries.find(hash);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+}
+
+void CBlockCache::Clear()
+{
+    LOCK(cs);
+    listEntries.clear();
+    mapEntries.clear();
+    nUsage = 0;
+}
+
+void CBlockCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim();
+}
+
+CBlockCacheStats CBlockCache::GetStats() const
+{
+    LOCK(cs);
+    CBlockCacheStats stats;
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    stats.nBlocks = mapEntries.size();
+    stats.nUsage = nUsage;
+    stats.nMaxUsage = nMaxUsage;
+    return stats;
+}
+
+void CBlockCache::EraseEntry(std::map<uint256, EntryList::iterator>::iterator it)
+{
+    nUsage -= it->second->nUsage;
+    listEntries.erase(it->second);
+    mapEntries.erase(it);
+}
+
+void CBlockCache::Trim()
+{
+    while (nUsage > nMaxUsage && !listEntries.empty())
+        EraseEntry(mapEntries.find(listEntries.back().hash));
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include "primitives/block.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+
+//! -blockcache default (MiB)
+static const int64_t DEFAULT_BLOCK_CACHE_SIZE = 32;
+
+/**
+ * A block shared by its readers. It must stay unmodified, which includes not calling
+ * BuildMerkleTree on it: that fills the merkle tree cached in the block.
+ */
+typedef boost::shared_ptr<const CBlock> CBlockRef;
+
+/** Heap memory held by a deserialized block */
+size_t BlockDynamicUsage(const CBlock& block);
+
+/** Hit and miss counts and the size of a CBlockCache */
+struct CBlockCacheStats {
+    uint64_t nHits;
+    uint64_t nMisses;
+    size_t nBlocks;
+    size_t nUsage;
+    size_t nMaxUsage;
+};
+
+/**
+ * Recently read or connected blocks by hash, handed out as shared immutable instances.
+ * The least recently used blocks are dropped once their estimated memory passes the limit;
+ * readers still holding one keep it alive until they let go of it.
+ */
+class CBlockCache
+{
+public:
+    explicit CBlockCache(size_t nMaxUsageIn);
+
+    /** The cached block with hash, counted as a hit or a miss; null if it is not cached */
+    CBlockRef Get(const uint256& hash);
+    /** Cache block under hash as the most recently used one */
+    void Insert(const uint256& hash, const CBlockRef& block);
+    void Erase(const uint256& hash);
+    void Clear();
+
+    /** Change the memory limit, 0 disables the cache */
+    void SetMaxUsage(size_t nMaxUsageIn);
+    CBlockCacheStats GetStats() const;
+
+private:
+    struct Entry {
+        uint256 hash;
+        CBlockRef block;
+        size_t nUsage;
+    };
+    typedef std::list<Entry> EntryList;
+
+    mutable CCriticalSection cs;
+    EntryList listEntries; // most recently used first
+    std::map<uint256, EntryList::iterator> mapEntries;
+    size_t nUsage;
+    size_t nMaxUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void EraseEntry(std::map<uint256, EntryList::iterator>::iterator it);
+    /** Drop the least recently used blocks until the limit is met */
+    void Trim();
+};
+
+#endif // BITCOIN_BLOCKCACHE_H
@@ -0,0 +1,154 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <boost/unordered_map.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, uint64_t nonceIn) : header(block.GetBlockHeader()),
+                                                                                               vchBlockSig(block.vchBlockSig),
+                                                                                               nonce(nonceIn)
+{
+    FillSalt();
+
+    // The coinbase, and the coinstake of a proof-of-stake block, are never in the receiver's mempool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        if (i < nPrefilled) {
+            PrefilledTransaction prefilled;
+            prefilled.index = i;
+            prefilled.tx = block.vtx[i];
+            prefilledtxn.push_back(prefilled);
+        } else
+            shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillSalt()
+{
+    CHashWriter ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nonce;
+    salt = ss.GetHash();
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return txhash.GetHash(salt) & 0xffffffffffffULL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > std::min((size_t)std::numeric_limits<uint16_t>::max(), (size_t)MAX_BLOCK_SIZE_CURRENT / 60))
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vAvailable.assign(cmpctblock.BlockTxCount(), false);
+
+    int32_t nLastIndex = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const PrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull() || (int32_t)prefilled.index <= nLastIndex || prefilled.index >= txn_available.size())
+            return READ_STATUS_INVALID;
+        nLastIndex = prefilled.index;
+        txn_available[prefilled.index] = prefilled.tx;
+        vAvailable[prefilled.index] = true;
+    }
+
+    // Positions left for the short ids, in block order
+    boost::unordered_map<uint64_t, uint16_t> mapShortIds;
+    size_t nShortId = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vAvailable[i])
+            continue;
+        if (!mapShortIds.insert(std::make_pair(cmpctblock.shorttxids[nShortId++], (uint16_t)i)).second) {
+            // two transactions of the block share a short id, only the full block can tell them apart
+            LogPrint("net", "%s : short id collision in block %s\n", __func__, header.GetHash().ToString());
+            return READ_STATUS_FAILED;
+        }
+    }
+
+    int nMempoolCount = 0;
+    std::vector<bool> vCollided(txn_available.size(), false);
+    {
+        LOCK(pool.cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it) {
+            boost::unordered_map<uint64_t, uint16_t>::const_iterator itShort = mapShortIds.find(cmpctblock.GetShortID(it->first));
+            if (itShort == mapShortIds.end())
+                continue;
+            uint16_t nIndex = itShort->second;
+            if (vCollided[nIndex])
+                continue;
+            if (vAvailable[nIndex]) {
+                // two mempool transactions match, ask the peer which one it is
+                vAvailable[nIndex] = false;
+                txn_available[nIndex] = CTransaction();
+                vCollided[nIndex] = true;
+                nMempoolCount--;
+                continue;
+            }
+            txn_available[nIndex] = it->second.GetTx();
+            vAvailable[nIndex] = true;
+            nMempoolCount++;
+        }
+    }
+
+    LogPrint("net", "Initialized compact block %s: %u transactions, %d from the mempool, %u prefilled\n",
+        header.GetHash().ToString(), txn_available.size(), nMempoolCount, cmpctblock.prefilledtxn.size());
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(index < vAvailable.size());
+    return vAvailable[index];
+}
+
+std::vector<uint16_t> PartiallyDownloadedBlock::GetMissingIndexes() const
+{
+    std::vector<uint16_t> vMissing;
+    for (size_t i = 0; i < vAvailable.size(); i++) {
+        if (!vAvailable[i])
+            vMissing.push_back(i);
+    }
+    return vMissing;
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vchBlockSig = vchBlockSig;
+    block.vtx.reserve(txn_available.size());
+
+    size_t nMissing = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vAvailable[i])
+            block.vtx.push_back(txn_available[i]);
+        else {
+            if (nMissing >= vtxMissing.size())
+                return READ_STATUS_INVALID;
+            block.vtx.push_back(vtxMissing[nMissing++]);
+        }
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A short id that matched the wrong mempool transaction shows up here; the block itself may be fine
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != header.hashMerkleRoot || fMutated) {
+        LogPrint("net", "%s : reconstructed block %s does not match its merkle root\n", __func__, header.GetHash().ToString());
+        return READ_STATUS_FAILED;
+    }
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,193 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <limits>
+#include <vector>
+
+class CTxMemPool;
+
+/** Short transaction ids are the low 6 bytes of a salted 64 bit hash of the txid */
+static const unsigned int SHORTTXIDS_LENGTH = 6;
+
+/** Transactions of a block requested by their position, answered with "blocktxn" */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes; // absolute, sent differentially encoded
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        WriteCompactSize(s, indexes.size());
+        for (size_t i = 0; i < indexes.size(); i++)
+            WriteCompactSize(s, (uint64_t)(indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1)));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64_t nCount = ReadCompactSize(s);
+        indexes.clear();
+        uint64_t nIndex = 0;
+        for (uint64_t i = 0; i < nCount; i++) {
+            nIndex += ReadCompactSize(s);
+            if (nIndex > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("index overflowed 16 bits");
+            indexes.push_back(nIndex);
+            nIndex++;
+        }
+    }
+};
+
+/** Answer to a BlockTransactionsRequest, the transactions in the requested order */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    explicit BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent along with a compact block because the receiver cannot have it (coinbase, coinstake) */
+struct PrefilledTransaction {
+    uint16_t index; // position in the block
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint64_t nIndex = index;
+        READWRITE(VARINT(nIndex));
+        if (nIndex > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = nIndex;
+        READWRITE(tx);
+    }
+};
+
+/**
+ * Block announced as its header, block signature and short ids of its transactions ("cmpctblock").
+ * The short ids are salted with the header and a sender chosen nonce, so nobody can predict
+ * collisions between transactions across blocks or peers.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+    uint64_t nonce;
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+    CBlockHeaderAndShortTxIDs() : nonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block, uint64_t nonceIn);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, vchBlockSig, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            ::Serialize(s, lsb, nType, nVersion);
+            ::Serialize(s, msb, nType, nVersion);
+        }
+        ::Serialize(s, prefilledtxn, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, vchBlockSig, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+        // grow with the data actually received, the count alone could ask for gigabytes
+        uint64_t nShortIds = ReadCompactSize(s);
+        shorttxids.clear();
+        for (uint64_t i = 0; i < nShortIds; i++) {
+            uint32_t lsb;
+            uint16_t msb;
+            ::Unserialize(s, lsb, nType, nVersion);
+            ::Unserialize(s, msb, nType, nVersion);
+            shorttxids.push_back(((uint64_t)msb << 32) | (uint64_t)lsb);
+        }
+        ::Unserialize(s, prefilledtxn, nType, nVersion);
+        FillSalt();
+    }
+
+private:
+    uint256 salt;
+
+    void FillSalt();
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // malformed, the peer is misbehaving
+    READ_STATUS_FAILED,  // could not be reconstructed (short id collision or wrong transactions), ask for the full block
+};
+
+/** A block being rebuilt from a compact block, the mempool and a "blocktxn" answer */
+class PartiallyDownloadedBlock
+{
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool);
+    bool IsTxAvailable(size_t index) const;
+    /** Indexes of the transactions that still have to be requested */
+    std::vector<uint16_t> GetMissingIndexes() const;
+    /** Complete the block with the missing transactions, in GetMissingIndexes() order, and check its merkle root */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vAvailable;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
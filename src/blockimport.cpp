@@ -0,0 +1,202 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+
+CBlockImportPipeline::CBlockImportPipeline(FILE* fileIn, int nThreads) : blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION),
+                                                                        nReadAhead(0),
+                                                                        nGeneration(0),
+                                                                        nRewindPos(0),
+                                                                        fReadDone(false),
+                                                                        fStop(false)
+{
+    threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadRead, this));
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadCheck, this));
+}
+
+CBlockImportPipeline::~CBlockImportPipeline()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condRead.notify_all();
+        condWork.notify_all();
+        condDone.notify_all();
+    }
+    threads.join_all();
+}
+
+bool CBlockImportPipeline::Next(boost::shared_ptr<CImportedBlock>& pblock)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        if (!queueBlocks.empty() && queueBlocks.front()->fDone) {
+            pblock = queueBlocks.front();
+            queueBlocks.pop_front();
+            nReadAhead -= pblock->nSize;
+            condRead.notify_all();
+            return true;
+        }
+        if (queueBlocks.empty() && (fReadDone || !strError.empty() || fStop))
+            return false;
+        condDone.wait(lock);
+    }
+}
+
+void CBlockImportPipeline::Rewind(uint64_t nPos)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // Blocks being checked are let go of by their thread once it is done with them
+    nGeneration++;
+    nRewindPos = nPos;
+    queueBlocks.clear();
+    queueWork.clear();
+    nReadAhead = 0;
+    fReadDone = false;
+    condRead.notify_all();
+}
+
+std::string CBlockImportPipeline::GetError() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return strError;
+}
+
+bool CBlockImportPipeline::Push(const boost::shared_ptr<CImportedBlock>& pblock, int nGen)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // A block bigger than the read-ahead goes through on its own
+    while (!fStop && nGen == nGeneration && !queueBlocks.empty() && nReadAhead + pblock->nSize > IMPORT_READAHEAD_SIZE)
+        condRead.wait(lock);
+    if (fStop || nGen != nGeneration)
+        return false;
+    queueBlocks.push_back(pblock);
+    queueWork.push_back(pblock);
+    nReadAhead += pblock->nSize;
+    condWork.notify_one();
+    return true;
+}
+
+void CBlockImportPipeline::ThreadRead()
+{
+    RenameThread("donate-blkread");
+
+    int nGen = 0;
+    uint64_t nRewind = blkdat.GetPos();
+    bool fEnd = false;
+    try {
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (fEnd || blkdat.eof()) {
+                    // Done unless the consumer rewinds
+                    if (nGen == nGeneration) {
+                        fReadDone = true;
+                        condDone.notify_all();
+                    }
+                    while (!fStop && nGen == nGeneration)
+                        condRead.wait(lock);
+                    fEnd = false;
+                }
+                if (fStop)
+                    return;
+                if (nGen != nGeneration) {
+                    nGen = nGeneration;
+                    nRewind = nRewindPos;
+                    if (!blkdat.Seek(nRewind))
+                        throw std::runtime_error(strprintf("seeking to position %u failed", nRewind));
+                }
+            }
+
+            blkdat.SetPos(nRewind);
+            nRewind++;         // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[MESSAGE_START_SIZE];
+                blkdat.FindByte(Params().MessageStart()[0]);
+                nRewind = blkdat.GetPos() + 1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                fEnd = true;
+                continue;
+            }
+            try {
+                // read block, it is decoded by the checking threads
+                boost::shared_ptr<CImportedBlock> pblock(new CImportedBlock());
+                pblock->nPos = blkdat.GetPos();
+                pblock->nSize = nSize;
+                pblock->vData.resize(nSize);
+                blkdat.SetLimit(pblock->nPos + nSize);
+                blkdat.read(&pblock->vData[0], nSize);
+                nRewind = blkdat.GetPos();
+                Push(pblock, nGen);
+            } catch (const std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+        }
+    } catch (const std::exception& e) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        strError = e.what();
+        condDone.notify_all();
+    }
+}
+
+void CBlockImportPipeline::ThreadCheck()
+{
+    RenameThread("donate-blkcheck");
+
+    while (true) {
+        boost::shared_ptr<CImportedBlock> pblock;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && queueWork.empty())
+                condWork.wait(lock);
+            if (fStop)
+                return;
+            pblock = queueWork.front();
+            queueWork.pop_front();
+        }
+
+        try {
+            CDataStream ssBlock(&pblock->vData[0], &pblock->vData[0] + pblock->vData.size(), SER_DISK, CLIENT_VERSION);
+            ssBlock >> pblock->block;
+            pblock->nDecodedSize = pblock->nSize - ssBlock.size();
+            pblock->fDecoded = true;
+        } catch (const std::exception& e) {
+            pblock->strError = e.what();
+        }
+        std::vector<char>().swap(pblock->vData);
+
+        // Only checks that read nothing but the block run here; CheckBlock depends on the chain and
+        // sporks and records zerocoin mints, so it runs in file order when the block is connected.
+        // A block failing these is checked again then, to report why.
+        if (pblock->fDecoded) {
+            const CBlock& block = pblock->block;
+            bool fMutated = false;
+            pblock->fPrechecked = block.BuildMerkleTree(&fMutated) == block.hashMerkleRoot && !fMutated &&
+                                  block.CheckBlockSignature();
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        pblock->fDone = true;
+        condDone.notify_all();
+    }
+}
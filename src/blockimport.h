@@ -0,0 +1,92 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKIMPORT_H
+#define BITCOIN_BLOCKIMPORT_H
+
+#include "primitives/block.h"
+#include "streams.h"
+
+#include <deque>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Maximum number of threads decoding and prechecking imported blocks */
+static const int MAX_IMPORT_CHECK_THREADS = 16;
+/** Bytes of blocks read ahead of the one being connected */
+static const uint64_t IMPORT_READAHEAD_SIZE = 64 * 1024 * 1024;
+
+/** A block of an import file, read and then decoded and checked ahead of being connected */
+struct CImportedBlock {
+    uint64_t nPos;           // file position of the block data, after its header
+    std::vector<char> vData; // the bytes as read, until they are decoded
+    unsigned int nSize;      // size given in the header
+    CBlock block;
+    bool fDecoded;
+    unsigned int nDecodedSize; // bytes the block took, can be less than nSize
+    std::string strError;      // why the bytes did not decode
+    bool fPrechecked;          // merkle root and block signature verified, the checks needing no chain state
+    bool fDone;
+
+    CImportedBlock() : nPos(0), nSize(0), fDecoded(false), nDecodedSize(0), fPrechecked(false), fDone(false) {}
+};
+
+/**
+ * Block import in stages: a reader thread scans the file for block headers and reads the blocks
+ * up to IMPORT_READAHEAD_SIZE ahead, a pool of threads deserializes them and verifies their merkle
+ * root and signature, and Next hands them out in file order to be checked and connected.
+ *
+ * The reader assumes every block takes the size in its header. When one turns out not to, the
+ * consumer calls Rewind with where scanning would have gone on, which drops everything read after
+ * that block and restarts the reader there.
+ */
+class CBlockImportPipeline
+{
+public:
+    /** Start reading fileIn, which is taken over and closed, with nThreads checking threads */
+    CBlockImportPipeline(FILE* fileIn, int nThreads);
+    /** Stop and join the threads */
+    ~CBlockImportPipeline();
+
+    /** Wait for the next block in file order; false once the file is read to the end, or reading failed */
+    bool Next(boost::shared_ptr<CImportedBlock>& pblock);
+    /** Drop the blocks after the last one handed out and continue scanning the file at nPos */
+    void Rewind(uint64_t nPos);
+    /** The I/O error that stopped the reader, empty if there was none */
+    std::string GetError() const;
+
+private:
+    CBufferedFile blkdat;
+
+    mutable boost::mutex mutex;
+    boost::condition_variable condRead; // read-ahead space freed or rewind asked for
+    boost::condition_variable condWork; // blocks to decode or stop
+    boost::condition_variable condDone; // a block decoded or reading ended
+    std::deque<boost::shared_ptr<CImportedBlock> > queueBlocks; // in file order, protected by mutex
+    std::deque<boost::shared_ptr<CImportedBlock> > queueWork;   // not yet taken by a checking thread
+    uint64_t nReadAhead;                                        // bytes in queueBlocks
+    int nGeneration;                                            // increased by every rewind
+    uint64_t nRewindPos;
+    bool fReadDone; // the reader reached the end of the file in the current generation
+    bool fStop;
+    std::string strError;
+
+    boost::thread_group threads;
+
+    /** Queue a block read in generation nGen, waiting for read-ahead space; false if it is stale or stopping */
+    bool Push(const boost::shared_ptr<CImportedBlock>& pblock, int nGen);
+    /** Scan the file from the start or a rewind position */
+    void ThreadRead();
+    /** Decode queued blocks and verify their merkle root and signature */
+    void ThreadCheck();
+};
+
+#endif // BITCOIN_BLOCKIMPORT_H
@@ -0,0 +1,228 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cachejournal.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+CCacheJournal::CCacheJournal(const std::string& strFilenameIn, const std::string& strMagicMessageIn)
+    : strFilename(strFilenameIn), strMagicMessage(strMagicMessageIn), file(NULL), hashSnapshot(0), nSnapshotSize(0), nSize(0), fDirty(false)
+{
+}
+
+CCacheJournal::~CCacheJournal()
+{
+    Close();
+}
+
+boost::filesystem::path CCacheJournal::GetPath() const
+{
+    return GetDataDir() / strFilename;
+}
+
+bool CCacheJournal::WriteHeader()
+{
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader << strMagicMessage;                   // cache file specific magic message
+    ssHeader << FLATDATA(Params().MessageStart()); // network specific magic number
+    ssHeader << hashSnapshot;                      // checksum of the snapshot this journal extends
+
+    if (fwrite(&ssHeader[0], 1, ssHeader.size(), file) != ssHeader.size())
+        return error("%s : Failed to write header to %s", __func__, GetPath().string());
+
+    nSize = ssHeader.size();
+    FileCommit(file);
+    fDirty = false;
+    return true;
+}
+
+bool CCacheJournal::Reset(const uint256& hashSnapshotIn, int64_t nSnapshotSizeIn)
+{
+    LOCK(cs);
+
+    if (file) fclose(file);
+    file = fopen(GetPath().string().c_str(), "wb");
+    if (!file)
+        return error("%s : Failed to open file %s", __func__, GetPath().string());
+
+    hashSnapshot = hashSnapshotIn;
+    nSnapshotSize = nSnapshotSizeIn;
+    if (!WriteHeader()) {
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+bool CCacheJournal::Replay(const uint256& hashSnapshotIn, int64_t nSnapshotSizeIn, const ApplyFn& fnApply)
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathJournal = GetPath();
+
+    {
+        LOCK(cs);
+        if (file) {
+            fclose(file);
+            file = NULL;
+        }
+    }
+
+    FILE* filein = fopen(pathJournal.string().c_str(), "rb+");
+    if (!filein) {
+        LogPrint("masternode", "No journal %s, starting a new one\n", strFilename);
+        return Reset(hashSnapshotIn, nSnapshotSizeIn);
+    }
+
+    std::vector<char> vchData;
+    vchData.resize(boost::filesystem::file_size(pathJournal));
+    if (!vchData.empty() && fread(&vchData[0], 1, vchData.size(), filein) != vchData.size()) {
+        fclose(filein);
+        error("%s : Failed to read %s, starting a new journal", __func__, pathJournal.string());
+        return Reset(hashSnapshotIn, nSnapshotSizeIn);
+    }
+
+    CDataStream ssJournal(vchData, SER_DISK, CLIENT_VERSION);
+    std::string strMagicMessageTmp;
+    unsigned char pchMsgTmp[4];
+    uint256 hashSnapshotTmp;
+    try {
+        ssJournal >> strMagicMessageTmp;
+        ssJournal >> FLATDATA(pchMsgTmp);
+        ssJournal >> hashSnapshotTmp;
+    } catch (std::exception& e) {
+        fclose(filein);
+        LogPrintf("Unreadable journal header in %s, starting a new journal\n", strFilename);
+        return Reset(hashSnapshotIn, nSnapshotSizeIn);
+    }
+
+    if (strMagicMessageTmp != strMagicMessage || memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)) ||
+        hashSnapshotTmp != hashSnapshotIn) {
+        // written against another (older) snapshot -- everything in it is already part of the one we loaded
+        fclose(filein);
+        LogPrint("masternode", "Journal %s does not belong to the loaded snapshot, starting a new one\n", strFilename);
+        return Reset(hashSnapshotIn, nSnapshotSizeIn);
+    }
+
+    int64_t nValidSize = vchData.size() - ssJournal.size();
+    int nRecords = 0;
+    while (!ssJournal.empty()) {
+        uint32_t nPayloadSize;
+        uint256 hashRecord;
+        CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+        try {
+            ssJournal >> nPayloadSize;
+            if (nPayloadSize == 0 || nPayloadSize > MAX_SIZE || nPayloadSize + sizeof(uint256) > ssJournal.size())
+                break;
+            ssPayload.resize(nPayloadSize);
+            ssJournal.read(&ssPayload[0], nPayloadSize);
+            ssJournal >> hashRecord;
+        } catch (std::exception& e) {
+            break;
+        }
+
+        if (hashRecord != Hash(ssPayload.begin(), ssPayload.end())) {
+            LogPrintf("Checksum mismatch in journal %s after %d records, dropping the rest\n", strFilename, nRecords);
+            break;
+        }
+
+        try {
+            unsigned char nType;
+            ssPayload >> nType;
+            if (!fnApply(nType, ssPayload)) {
+                LogPrintf("Unknown record in journal %s after %d records, dropping the rest\n", strFilename, nRecords);
+                break;
+            }
+        } catch (std::exception& e) {
+            LogPrintf("Malformed record in journal %s after %d records, dropping the rest - %s\n", strFilename, nRecords, e.what());
+            break;
+        }
+
+        nValidSize = vchData.size() - ssJournal.size();
+        nRecords++;
+    }
+
+    // cut off a partially written tail so new records follow the last good one
+    if (nValidSize != (int64_t)vchData.size() && !TruncateFile(filein, nValidSize)) {
+        fclose(filein);
+        error("%s : Failed to truncate %s, starting a new journal", __func__, pathJournal.string());
+        return Reset(hashSnapshotIn, nSnapshotSizeIn);
+    }
+    fseek(filein, 0, SEEK_END);
+
+    LOCK(cs);
+    file = filein;
+    hashSnapshot = hashSnapshotIn;
+    nSnapshotSize = nSnapshotSizeIn;
+    nSize = nValidSize;
+    fDirty = false;
+
+    LogPrint("masternode", "Replayed %d records from %s  %dms\n", nRecords, strFilename, GetTimeMillis() - nStart);
+    return true;
+}
+
+void CCacheJournal::AppendRecord(const CDataStream& ssPayload)
+{
+    LOCK(cs);
+    if (!file) return;
+
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    ssRecord << (uint32_t)ssPayload.size();
+    ssRecord.write(&ssPayload[0], ssPayload.size());
+    ssRecord << Hash(ssPayload.begin(), ssPayload.end());
+
+    if (fwrite(&ssRecord[0], 1, ssRecord.size(), file) != ssRecord.size()) {
+        // stop journaling, the next compaction writes a full snapshot and starts over
+        error("%s : Failed to append to %s", __func__, GetPath().string());
+        fclose(file);
+        file = NULL;
+        return;
+    }
+
+    nSize += ssRecord.size();
+    fDirty = true;
+}
+
+void CCacheJournal::Commit()
+{
+    LOCK(cs);
+    if (!file || !fDirty) return;
+
+    FileCommit(file);
+    fDirty = false;
+}
+
+void CCacheJournal::Close()
+{
+    LOCK(cs);
+    if (!file) return;
+
+    FileCommit(file);
+    fclose(file);
+    file = NULL;
+    fDirty = false;
+}
+
+bool CCacheJournal::IsOpen() const
+{
+    LOCK(cs);
+    return file != NULL;
+}
+
+int64_t CCacheJournal::GetSize() const
+{
+    LOCK(cs);
+    return nSize;
+}
+
+bool CCacheJournal::NeedsCompaction() const
+{
+    LOCK(cs);
+    return nSize > std::max(nSnapshotSize, CACHE_JOURNAL_MIN_COMPACT_SIZE);
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CACHEJOURNAL_H
+#define BITCOIN_CACHEJOURNAL_H
+
+#include "clientversion.h"
+#include "serialize.h"
+#include "streams.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <stdio.h>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
+
+/** Journals are not compacted before they reach this size */
+static const int64_t CACHE_JOURNAL_MIN_COMPACT_SIZE = 1024 * 1024;
+
+/**
+ * Append-only change journal kept next to one of the flat-file masternode caches
+ * (mncache.dat, donayments.dat, budget.dat).
+ *
+ * The file starts with the cache's magic message, the network magic and the checksum
+ * of the snapshot it extends. Every record after that is
+ * [uint32 payload size][payload][double-SHA256 of payload], the payload starting with
+ * a one byte record type defined by the owning manager. A journal whose header does not
+ * match the snapshot that was just loaded is stale and gets discarded; a torn or corrupt
+ * record (crash while appending) ends the replay and is truncated away.
+ *
+ * Appends are buffered and only reach the disk on Commit(), which the masternode
+ * maintenance thread calls once a second. Compaction is done by the owner: write a new
+ * snapshot, then Reset() the journal against it.
+ */
+class CCacheJournal
+{
+public:
+    typedef boost::function<bool(unsigned char, CDataStream&)> ApplyFn;
+
+    CCacheJournal(const std::string& strFilenameIn, const std::string& strMagicMessageIn);
+    ~CCacheJournal();
+
+    /** Apply every intact record written against hashSnapshotIn, then keep the journal open for appending */
+    bool Replay(const uint256& hashSnapshotIn, int64_t nSnapshotSizeIn, const ApplyFn& fnApply);
+    /** Start an empty journal against a freshly written snapshot */
+    bool Reset(const uint256& hashSnapshotIn, int64_t nSnapshotSizeIn);
+    /** Flush buffered records and sync them to disk */
+    void Commit();
+    void Close();
+
+    template <typename T>
+    void Append(unsigned char nType, const T& obj)
+    {
+        CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+        ssPayload << nType;
+        ssPayload << obj;
+        AppendRecord(ssPayload);
+    }
+
+    bool IsOpen() const;
+    int64_t GetSize() const;
+    /** Whether the journal has outgrown its snapshot and should be compacted */
+    bool NeedsCompaction() const;
+
+private:
+    mutable CCriticalSection cs;
+    std::string strFilename;
+    std::string strMagicMessage;
+    FILE* file;
+    uint256 hashSnapshot;
+    int64_t nSnapshotSize;
+    int64_t nSize;
+    bool fDirty;
+
+    boost::filesystem::path GetPath() const;
+    void AppendRecord(const CDataStream& ssPayload);
+    bool WriteHeader();
+
+    CCacheJournal(const CCacheJournal&);
+    CCacheJournal& operator=(const CCacheJournal&);
+};
+
+#endif // BITCOIN_CACHEJOURNAL_H
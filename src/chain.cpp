@@ -5,8 +5,45 @@
 
 #include "chain.h"
 
+#include <new>
+
 using namespace std;
 
+void* CBlockIndexArena::Allocate()
+{
+    if (nUsed == CHUNK_ENTRIES) {
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * CHUNK_ENTRIES)));
+        nUsed = 0;
+    }
+    return vChunks.back() + nUsed;
+}
+
+CBlockIndex* CBlockIndexArena::New()
+{
+    CBlockIndex* pindex = new (Allocate()) CBlockIndex();
+    nUsed++;
+    return pindex;
+}
+
+CBlockIndex* CBlockIndexArena::New(const CBlock& block)
+{
+    CBlockIndex* pindex = new (Allocate()) CBlockIndex(block);
+    nUsed++;
+    return pindex;
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t nChunk = 0; nChunk < vChunks.size(); nChunk++) {
+        size_t nEntries = nChunk + 1 == vChunks.size() ? nUsed : CHUNK_ENTRIES;
+        for (size_t i = 0; i < nEntries; i++)
+            vChunks[nChunk][i].~CBlockIndex();
+        ::operator delete(vChunks[nChunk]);
+    }
+    vChunks.clear();
+    nUsed = CHUNK_ENTRIES;
+}
+
 /**
  * CChain implementation
  */
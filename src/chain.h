@@ -15,6 +15,7 @@
 #include "util.h"
 #include "libzerocoin/Denominations.h"
 
+#include <stdexcept>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -62,6 +63,172 @@ struct CDiskBlockPos {
     bool IsNull() const { return (nFile == -1); }
 };
 
+//! Position of a denomination in zerocoinDenomList, -1 for ZQ_ERROR and unknown values
+inline int GetZerocoinDenominationIndex(libzerocoin::CoinDenomination denom)
+{
+    switch (denom) {
+    case libzerocoin::ZQ_ONE: return 0;
+    case libzerocoin::ZQ_FIVE: return 1;
+    case libzerocoin::ZQ_TEN: return 2;
+    case libzerocoin::ZQ_FIFTY: return 3;
+    case libzerocoin::ZQ_ONE_HUNDRED: return 4;
+    case libzerocoin::ZQ_FIVE_HUNDRED: return 5;
+    case libzerocoin::ZQ_ONE_THOUSAND: return 6;
+    case libzerocoin::ZQ_FIVE_THOUSAND: return 7;
+    default: return -1;
+    }
+}
+
+static const int ZEROCOIN_DENOMINATIONS = 8;
+
+/**
+ * Zerocoin supply of every denomination, kept in a fixed array inside the block index entry.
+ * Serialized like the std::map<CoinDenomination, int64_t> it replaces, so the block index on
+ * disk is unchanged.
+ */
+class CZerocoinSupply
+{
+private:
+    int64_t nSupply[ZEROCOIN_DENOMINATIONS];
+
+public:
+    CZerocoinSupply() { SetNull(); }
+
+    void SetNull()
+    {
+        for (int i = 0; i < ZEROCOIN_DENOMINATIONS; i++)
+            nSupply[i] = 0;
+    }
+
+    //! Like std::map::at, throws std::out_of_range for an invalid denomination
+    int64_t& at(libzerocoin::CoinDenomination denom)
+    {
+        int i = GetZerocoinDenominationIndex(denom);
+        if (i < 0)
+            throw std::out_of_range("CZerocoinSupply::at : invalid denomination");
+        return nSupply[i];
+    }
+
+    const int64_t& at(libzerocoin::CoinDenomination denom) const
+    {
+        return const_cast<CZerocoinSupply*>(this)->at(denom);
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, ZEROCOIN_DENOMINATIONS);
+        for (int i = 0; i < ZEROCOIN_DENOMINATIONS; i++) {
+            ::Serialize(s, libzerocoin::zerocoinDenomList[i], nType, nVersion);
+            ::Serialize(s, nSupply[i], nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        SetNull();
+        uint64_t nSize = ReadCompactSize(s);
+        for (uint64_t n = 0; n < nSize; n++) {
+            libzerocoin::CoinDenomination denom;
+            int64_t nValue;
+            ::Unserialize(s, denom, nType, nVersion);
+            ::Unserialize(s, nValue, nType, nVersion);
+            int i = GetZerocoinDenominationIndex(denom);
+            if (i >= 0)
+                nSupply[i] = nValue;
+        }
+    }
+};
+
+/**
+ * Number of zerocoins of every denomination minted in a block. Serialized like the
+ * std::vector<CoinDenomination> it replaces, one entry per mint in denomination order.
+ * A block cannot hold anywhere near 65535 mints of one denomination.
+ */
+class CZerocoinMintCounts
+{
+private:
+    uint16_t nCount[ZEROCOIN_DENOMINATIONS];
+
+public:
+    CZerocoinMintCounts() { SetNull(); }
+
+    void SetNull()
+    {
+        for (int i = 0; i < ZEROCOIN_DENOMINATIONS; i++)
+            nCount[i] = 0;
+    }
+
+    bool IsNull() const
+    {
+        for (int i = 0; i < ZEROCOIN_DENOMINATIONS; i++)
+            if (nCount[i])
+                return false;
+        return true;
+    }
+
+    //! Count a mint; invalid denominations are not part of any supply and are left out
+    void Add(libzerocoin::CoinDenomination denom)
+    {
+        int i = GetZerocoinDenominationIndex(denom);
+        if (i >= 0)
+            nCount[i]++;
+    }
+
+    int Count(libzerocoin::CoinDenomination denom) const
+    {
+        int i = GetZerocoinDenominationIndex(denom);
+        return i < 0 ? 0 : nCount[i];
+    }
+
+    friend bool operator==(const CZerocoinMintCounts& a, const CZerocoinMintCounts& b)
+    {
+        for (int i = 0; i < ZEROCOIN_DENOMINATIONS; i++)
+            if (a.nCount[i] != b.nCount[i])
+                return false;
+        return true;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        uint64_t nTotal = 0;
+        for (int i = 0; i < ZEROCOIN_DENOMINATIONS; i++)
+            nTotal += nCount[i];
+        WriteCompactSize(s, nTotal);
+        for (int i = 0; i < ZEROCOIN_DENOMINATIONS; i++)
+            for (int n = 0; n < nCount[i]; n++)
+                ::Serialize(s, libzerocoin::zerocoinDenomList[i], nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        SetNull();
+        uint64_t nSize = ReadCompactSize(s);
+        for (uint64_t n = 0; n < nSize; n++) {
+            libzerocoin::CoinDenomination denom;
+            ::Unserialize(s, denom, nType, nVersion);
+            Add(denom);
+        }
+    }
+};
+
 enum BlockStatus {
     //! Unused.
     BLOCK_VALID_UNKNOWN = 0,
@@ -121,9 +288,6 @@ public:
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -180,8 +344,8 @@ public:
     uint32_t nSequenceId;
     
     //! zerocoin specific fields
-    std::map<libzerocoin::CoinDenomination, int64_t> mapZerocoinSupply;
-    std::vector<libzerocoin::CoinDenomination> vMintDenominationsInBlock;
+    CZerocoinSupply zerocoinSupply;
+    CZerocoinMintCounts mintDenominationsInBlock;
     
     void SetNull()
     {
@@ -213,10 +377,8 @@ public:
         nNonce = 0;
         nAccumulatorCheckpoint = 0;
         // Start supply of each denomination with 0s
-        for (auto& denom : libzerocoin::zerocoinDenomList) {
-            mapZerocoinSupply.insert(make_pair(denom, 0));
-        }
-        vMintDenominationsInBlock.clear();
+        zerocoinSupply.SetNull();
+        mintDenominationsInBlock.SetNull();
     }
 
     CBlockIndex()
@@ -237,7 +399,6 @@ public:
             nAccumulatorCheckpoint = block.nAccumulatorCheckpoint;
 
         //Proof of Stake
-        bnChainTrust = uint256();
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -294,14 +455,14 @@ public:
     {
         int64_t nTotal = 0;
         for (auto& denom : libzerocoin::zerocoinDenomList) {
-            nTotal += libzerocoin::ZerocoinDenominationToAmount(denom) * mapZerocoinSupply.at(denom);
+            nTotal += libzerocoin::ZerocoinDenominationToAmount(denom) * zerocoinSupply.at(denom);
         }
         return nTotal;
     }
 
     bool MintedDenomination(libzerocoin::CoinDenomination denom) const
     {
-        return std::find(vMintDenominationsInBlock.begin(), vMintDenominationsInBlock.end(), denom) != vMintDenominationsInBlock.end();
+        return mintDenominationsInBlock.Count(denom) > 0;
     }
 
     uint256 GetBlockHash() const
@@ -480,8 +641,8 @@ public:
         READWRITE(nNonce);
         if(this->nVersion > 3) {
             READWRITE(nAccumulatorCheckpoint);
-            READWRITE(mapZerocoinSupply);
-            READWRITE(vMintDenominationsInBlock);
+            READWRITE(zerocoinSupply);
+            READWRITE(mintDenominationsInBlock);
         }
 
     }
@@ -511,6 +672,35 @@ public:
     }
 };
 
+/**
+ * Allocates block index entries from chunks of contiguous memory instead of one heap block
+ * each. Entries live as long as the arena: they are only destroyed all together by Clear().
+ */
+class CBlockIndexArena
+{
+public:
+    CBlockIndexArena() : nUsed(CHUNK_ENTRIES) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* New();
+    CBlockIndex* New(const CBlock& block);
+    //! Destroy all entries and release the memory
+    void Clear();
+    //! Number of entries allocated
+    size_t size() const { return vChunks.empty() ? 0 : (vChunks.size() - 1) * CHUNK_ENTRIES + nUsed; }
+
+private:
+    static const size_t CHUNK_ENTRIES = 4096;
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsed; // entries taken from the last chunk
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+
+    //! Memory for the next entry, counted as used once it is constructed
+    void* Allocate();
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain
 {
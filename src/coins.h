@@ -7,6 +7,7 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "memusage.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -283,6 +284,15 @@ public:
                 return false;
         return true;
     }
+
+    //! Heap memory held by the outputs and their scripts
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout)
+            ret += memusage::DynamicUsage(out.scriptPubKey);
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -304,8 +314,34 @@ public:
     }
 };
 
+/**
+ * What the parent view had for a cache entry when it was fetched: which outputs were unspent
+ * and the metadata that goes with them. The coin database stores one record per output, so
+ * comparing against this lets it write the outputs that were created and erase the ones that
+ * were spent instead of the whole transaction. Outputs never change once created, an output
+ * unspent on both sides only needs writing again if the metadata changed (a reorganization
+ * confirming the transaction at another height).
+ */
+struct CCoinsOrigin {
+    std::vector<bool> vAvail;
+    int nHeight;
+    int nVersion;
+    bool fCoinBase;
+    bool fCoinStake;
+
+    CCoinsOrigin() : nHeight(0), nVersion(0), fCoinBase(false), fCoinStake(false) {}
+
+    void FromCoins(const CCoins& coins);
+    bool IsAvailable(unsigned int nPos) const { return nPos < vAvail.size() && vAvail[nPos]; }
+    bool SameMetadata(const CCoins& coins) const
+    {
+        return nHeight == coins.nHeight && nVersion == coins.nVersion && fCoinBase == coins.fCoinBase && fCoinStake == coins.fCoinStake;
+    }
+};
+
 struct CCoinsCacheEntry {
     CCoins coins; // The actual cached data.
+    CCoinsOrigin origin; // What the parent view had, empty for FRESH entries.
     unsigned char flags;
 
     enum Flags {
@@ -314,6 +350,8 @@ struct CCoinsCacheEntry {
     };
 
     CCoinsCacheEntry() : coins(), flags(0) {}
+
+    size_t DynamicMemoryUsage() const { return coins.DynamicMemoryUsage() + memusage::DynamicUsage(origin.vAvail); }
 };
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
@@ -398,7 +436,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Memory of the entry before the modification, already counted by the cache
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -421,6 +460,9 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
@@ -456,6 +498,9 @@ public:
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of donate coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
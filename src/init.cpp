@@ -36,6 +36,7 @@
 #include "util.h"
 #include "utilmoneystr.h"
 #include "validationinterface.h"
+#include "writebehind.h"
 #ifdef ENABLE_WALLET
 #include "db.h"
 #include "wallet.h"
@@ -214,6 +215,8 @@ void PrepareShutdown()
         }
         delete pcoinsTip;
         pcoinsTip = NULL;
+        delete pcoinsWriteBehind;
+        pcoinsWriteBehind = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
         delete pcoinsdbview;
@@ -323,11 +326,13 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-daemon", _("Run in the background as a daemon and accept commands"));
 #endif
     }
+    strUsage += HelpMessageOpt("-blockcache=<n>", strprintf(_("Keep recently read or connected blocks in memory, up to <n> megabytes (0 to disable, default: %d)"), DEFAULT_BLOCK_CACHE_SIZE));
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxreorg=<n>", strprintf(_("Set the Maximum reorg depth (default: %u)"), Params(CBaseChainParams::MAIN).MaxReorganizationDepth()));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-mnmsgthreads=<n>", strprintf(_("Set the number of threads handling masternode, winner and budget messages (0 to %d, 0 = message handler thread, default: %d)"), MAX_MASTERNODE_MESSAGE_THREADS, DEFAULT_MASTERNODE_MESSAGE_THREADS));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "donated.pid"));
@@ -360,7 +365,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Socket events mode, which must be one of: %s (default: %s)"), GetSupportedSocketEventsModes(), GetDefaultSocketEventsMode()));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
+    strUsage += HelpMessageOpt("-compactblocks", strprintf(_("Exchange new blocks as short transaction ids with peers that support it (default: %u)"), DEFAULT_COMPACT_BLOCKS));
+    strUsage += HelpMessageOpt("-earlyblockrelay=<n>", strprintf(_("Forward new blocks to up to <n> peers asking for it once header and proof of stake are checked, before connecting them (0-%d, default: %d)"), MAX_EARLY_BLOCK_RELAY_PEERS, DEFAULT_EARLY_BLOCK_RELAY_PEERS));
     strUsage += HelpMessageOpt("-peerbloomfilters", strprintf(_("Support filtering of blocks and transaction with bloom filters (default: %u)"), DEFAULT_PEERBLOOMFILTERS));
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), 39811, 39813));
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
@@ -789,10 +797,18 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    std::string strSocketEvents = GetArg("-socketevents", GetDefaultSocketEventsMode());
+    if (!SetSocketEventsMode(strSocketEvents))
+        return InitError(strprintf(_("Invalid -socketevents ('%s') specified. Only these modes are supported: %s"), strSocketEvents, GetSupportedSocketEventsModes()));
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    // select() is limited to FD_SETSIZE; epoll mode has already fallen back to it if epoll is unusable
+    if (GetSocketEventsMode() == SOCKETEVENTS_SELECT)
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    else
+        nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -918,6 +934,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices |= NODE_BLOOM;
 
+    if (GetBoolArg("-compactblocks", DEFAULT_COMPACT_BLOCKS))
+        nLocalServices |= NODE_COMPACT_BLOCKS;
+
+    if (GetArg("-earlyblockrelay", DEFAULT_EARLY_BLOCK_RELAY_PEERS) > 0)
+        nLocalServices |= NODE_EARLY_BLOCKS;
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     // Sanity check
@@ -965,6 +987,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    int nMasternodeMessageThreads = std::max(0, std::min((int)GetArg("-mnmsgthreads", DEFAULT_MASTERNODE_MESSAGE_THREADS), MAX_MASTERNODE_MESSAGE_THREADS));
+    LogPrintf("Using %u threads for masternode messages\n", nMasternodeMessageThreads);
+    InitMasternodeMessageLanes(nMasternodeMessageThreads);
+    for (int i = 0; i < nMasternodeMessageThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadMasternodeMessages, i));
+
     if (mapArgs.count("-sporkkey")) // spork priv key
     {
         if (!sporkManager.SetPrivKey(GetArg("-sporkkey", "")))
@@ -1303,7 +1331,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest goes to the in-memory coins cache
+    blockCache.SetMaxUsage(std::max((int64_t)0, GetArg("-blockcache", DEFAULT_BLOCK_CACHE_SIZE)) << 20);
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1317,6 +1346,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinsWriteBehind;
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
@@ -1329,8 +1359,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                if (!pcoinsdbview->CheckVersion()) {
+                    strLoadError = _("The chainstate database was written by an incompatible version, you need to rebuild it using -reindex");
+                    break;
+                }
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
-                pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                pcoinsWriteBehind = new CCoinsViewWriteBehind(pcoinscatcher, pblocktree);
+                pcoinsTip = new CCoinsViewCache(pcoinsWriteBehind);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -1364,16 +1403,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
-                // Populate list of invalid/fraudulent outpoints that are banned from the chain
-                PopulateInvalidOutPointMap();
+                // Load list of invalid/fraudulent outpoints that are banned from the chain
+                InitInvalidOutPointMap();
 
                 // Recalculate money supply for blocks that are impacted by accounting issue after zerocoin activation
-                if (GetBoolArg("-reindexmoneysupply", false)) {
-                    if (chainActive.Height() > Params().Zerocoin_StartHeight()) {
-                        RecalculateZDONMinted();
-                        RecalculateZDONSpent();
-                    }
-                    RecalculateDONSupply(1);
+                if (GetBoolArg("-reindexmoneysupply", false) && !RecalculateMoneySupply(1)) {
+                    strLoadError = _("Error recalculating the money supply");
+                    break;
                 }
 
                 // Force recalculation of accumulators.
@@ -1598,6 +1634,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         BOOST_FOREACH (string strFile, mapMultiArgs["-loadblock"])
             vImportFiles.push_back(strFile);
     }
+    // Chainstate flushed from now on is written behind validation
+    threadGroup.create_thread(boost::bind(&CCoinsViewWriteBehind::ThreadFlush, pcoinsWriteBehind));
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
     if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
@@ -1620,6 +1658,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    // without a snapshot there is no journal to append to yet
+    if (!mnodemanJournal.IsOpen()) DumpMasternodes();
 
     uiInterface.InitMessage(_("Loading budget cache..."));
 
@@ -1635,6 +1675,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    if (!budgetJournal.IsOpen()) DumpBudgets();
 
     //flag our cached items so we send them to our peers
     budget.ResetSync();
@@ -1655,6 +1696,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    if (!masternodePaymentsJournal.IsOpen()) DumpMasternodePayments();
+
+    // assets that finished syncing shortly before we went down only need a top-up
+    masternodeSync.ReadState();
 
     fMasterNode = GetBoolArg("-masternode", false);
 
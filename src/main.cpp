@@ -10,6 +10,8 @@
 #include "accumulators.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
+#include "blockimport.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -31,13 +33,16 @@
 #include "util.h"
 #include "utilmoneystr.h"
 #include "validationinterface.h"
+#include "writebehind.h"
 
 #include "primitives/zerocoin.h"
 #include "libzerocoin/Denominations.h"
 
+#include <deque>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
@@ -62,6 +67,8 @@ using namespace libzerocoin;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+//! Memory of the mapBlockIndex entries, freed at shutdown
+static CBlockIndexArena blockIndexArena;
 map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<unsigned int, unsigned int> mapHashedBlocks;
@@ -77,7 +84,7 @@ bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -160,8 +167,10 @@ uint32_t nBlockSequenceId = 1;
 /**
      * Sources of received blocks, to be able to send them reject messages or ban
      * them, if processing happens afterwards. Protected by cs_main.
+     * The flag is false for blocks forwarded by early relay, whose sender did not
+     * connect them before passing them on and must not be punished if they fail.
      */
-map<uint256, NodeId> mapBlockSource;
+map<uint256, std::pair<NodeId, bool> > mapBlockSource;
 
 /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_main. */
 struct QueuedBlock {
@@ -179,6 +188,68 @@ int nQueuedValidatedHeaders = 0;
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
+/**
+ * Headers-first sync: the best header chain a peer sent us beyond our active chain, used to schedule
+ * block downloads from all peers at once. Its headers never enter mapBlockIndex, because the
+ * proof-of-stake fields of an index entry (kernel hash, stake modifier) can only be computed from the
+ * full block; index entries are still created by AcceptBlock as the blocks arrive. Protected by cs_main.
+ */
+struct CHeaderChain {
+    //! Active chain block the header chain builds on.
+    uint256 hashFork;
+    //! Height of vHashes.front().
+    int nStartHeight;
+    std::deque<uint256> vHashes;
+    //! nTime and nBits of each header in vHashes, the context the headers after it are checked in.
+    std::deque<std::pair<unsigned int, unsigned int> > vTimeBits;
+    std::map<uint256, int> mapHeights;
+    //! Peer whose headers make up the chain.
+    NodeId nodeSource;
+    //! Last time the chain was extended or the active chain advanced along it.
+    int64_t nLastProgress;
+
+    CHeaderChain() { SetNull(); }
+
+    void SetNull()
+    {
+        hashFork = 0;
+        nStartHeight = 0;
+        vHashes.clear();
+        vTimeBits.clear();
+        mapHeights.clear();
+        nodeSource = -1;
+        nLastProgress = 0;
+    }
+
+    bool IsNull() const { return vHashes.empty(); }
+    int Height() const { return nStartHeight + (int)vHashes.size() - 1; }
+    //! Hash at nHeight, which must be in [nStartHeight - 1, Height()].
+    const uint256& At(int nHeight) const { return nHeight < nStartHeight ? hashFork : vHashes[nHeight - nStartHeight]; }
+};
+CHeaderChain headerChain;
+
+/** A header chain block that arrived before its parent. */
+struct CHeaderChainBlock {
+    NodeId nodeid;
+    int nHeight;
+    size_t nSize;
+    CBlock block;
+};
+
+/** Header chain blocks that arrived before their parent, keyed by the parent's hash, and their total
+ *  serialized size, which stays under MAX_HEADER_CHAIN_BLOCKS_SIZE. Protected by cs_main. */
+map<uint256, CHeaderChainBlock> mapHeaderChainBlocks;
+size_t nHeaderChainBlocksSize = 0;
+
+/** A block asked for as "getcmpct", rebuilt once the compact block (and any missing transactions) arrive. */
+struct CompactBlockInFlight {
+    NodeId nodeid;
+    int64_t nTime;
+    PartiallyDownloadedBlock partialBlock;
+};
+/** Compact blocks requested, by block hash. Protected by cs_main. */
+map<uint256, CompactBlockInFlight> mapCompactBlocksInFlight;
+
 /** Dirty block index entries. */
 set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -232,6 +303,14 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Headers-first: highest header chain block this peer is known to have.
+    int nHeaderChainHeight;
+    //! Headers-first: since when (in seconds) our getheaders to this peer is outstanding, or 0.
+    int64_t nHeadersRequestTime;
+    //! Headers-first: whether the peer may have more headers for us.
+    bool fHeadersMore;
+    //! Headers-first: the peer did not answer getheaders, sync with it using getblocks.
+    bool fHeadersFailed;
 
     CNodeState()
     {
@@ -245,6 +324,10 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        nHeaderChainHeight = 0;
+        nHeadersRequestTime = 0;
+        fHeadersMore = false;
+        fHeadersFailed = false;
     }
 };
 
@@ -260,6 +343,37 @@ CNodeState* State(NodeId pnode)
     return &it->second;
 }
 
+/** Misbehavior reported without cs_main (masternode message lanes), applied to CNodeState by SendMessages.
+ *  Holds an entry for every node between InitializeNode and FinalizeNode, scores for other ids are dropped. */
+CCriticalSection cs_pendingMisbehavior;
+map<NodeId, int> mapPendingMisbehavior;
+
+// Requires cs_main.
+void ApplyPendingMisbehavior(NodeId nodeid)
+{
+    int howmuch = 0;
+    {
+        LOCK(cs_pendingMisbehavior);
+        map<NodeId, int>::iterator it = mapPendingMisbehavior.find(nodeid);
+        if (it == mapPendingMisbehavior.end())
+            return;
+        howmuch = it->second;
+        it->second = 0;
+    }
+
+    CNodeState* state = State(nodeid);
+    if (state == NULL || howmuch == 0)
+        return;
+
+    state->nMisbehavior += howmuch;
+    int banscore = GetArg("-banscore", 100);
+    if (state->nMisbehavior >= banscore && state->nMisbehavior - howmuch < banscore) {
+        LogPrintf("Misbehaving: %s (%d -> %d) BAN THRESHOLD EXCEEDED\n", state->name, state->nMisbehavior - howmuch, state->nMisbehavior);
+        state->fShouldBan = true;
+    } else
+        LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name, state->nMisbehavior - howmuch, state->nMisbehavior);
+}
+
 int GetHeight()
 {
     while (true) {
@@ -288,11 +402,20 @@ void InitializeNode(NodeId nodeid, const CNode* pnode)
     CNodeState& state = mapNodeState.insert(std::make_pair(nodeid, CNodeState())).first->second;
     state.name = pnode->addrName;
     state.address = pnode->addr;
+    {
+        LOCK(cs_pendingMisbehavior);
+        mapPendingMisbehavior[nodeid] = 0;
+    }
 }
 
 void FinalizeNode(NodeId nodeid)
 {
     LOCK(cs_main);
+    ApplyPendingMisbehavior(nodeid);
+    {
+        LOCK(cs_pendingMisbehavior);
+        mapPendingMisbehavior.erase(nodeid);
+    }
     CNodeState* state = State(nodeid);
 
     if (state->fSyncStarted)
@@ -304,6 +427,12 @@ void FinalizeNode(NodeId nodeid)
 
     BOOST_FOREACH (const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
+    for (map<uint256, CompactBlockInFlight>::iterator it = mapCompactBlocksInFlight.begin(); it != mapCompactBlocksInFlight.end();) {
+        if (it->second.nodeid == nodeid)
+            mapCompactBlocksInFlight.erase(it++);
+        else
+            ++it;
+    }
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
@@ -479,6 +608,385 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     }
 }
 
+/** Drop the header chain together with the blocks stashed for it. Requires cs_main. */
+void ResetHeaderChain()
+{
+    headerChain.SetNull();
+    mapHeaderChainBlocks.clear();
+    nHeaderChainBlocksSize = 0;
+}
+
+/** Drop the header chain and hold its source responsible: it stops being asked for headers and is
+ *  penalized by nDoS. Requires cs_main. */
+void FailHeaderChain(int nDoS)
+{
+    NodeId nodeSource = headerChain.nodeSource;
+    ResetHeaderChain();
+
+    CNodeState* state = State(nodeSource);
+    if (state == NULL)
+        return;
+    state->fHeadersFailed = true;
+    if (nDoS > 0)
+        Misbehaving(nodeSource, nDoS);
+}
+
+/** Move the start of the header chain along with the active chain. The chain is dropped once it is
+ *  fully connected, when the active chain leaves it, or when nobody delivers its blocks anymore.
+ *  Requires cs_main. */
+void TrimHeaderChain()
+{
+    if (headerChain.IsNull())
+        return;
+
+    CBlockIndex* pindexFork = chainActive[headerChain.nStartHeight - 1];
+    if (pindexFork == NULL || pindexFork->GetBlockHash() != headerChain.hashFork) {
+        LogPrint("net", "Active chain left the header chain at height %d, dropping it\n", headerChain.nStartHeight - 1);
+        ResetHeaderChain();
+        return;
+    }
+
+    while (!headerChain.IsNull() && chainActive.Height() >= headerChain.nStartHeight) {
+        uint256 hash = headerChain.vHashes.front();
+        if (chainActive[headerChain.nStartHeight]->GetBlockHash() != hash) {
+            LogPrint("net", "Active chain left the header chain at height %d, dropping it\n", headerChain.nStartHeight);
+            ResetHeaderChain();
+            return;
+        }
+        headerChain.mapHeights.erase(hash);
+        headerChain.vHashes.pop_front();
+        headerChain.vTimeBits.pop_front();
+        headerChain.hashFork = hash;
+        headerChain.nStartHeight++;
+        headerChain.nLastProgress = GetTime();
+    }
+
+    if (headerChain.IsNull()) {
+        LogPrint("net", "Header chain downloaded up to height %d\n", chainActive.Height());
+        ResetHeaderChain();
+    } else if (headerChain.nLastProgress < GetTime() - HEADER_CHAIN_STALL_TIMEOUT) {
+        // The source can serve the blocks of its own headers, a chain nobody delivers was most likely made up
+        LogPrintf("No block of the header chain from peer=%d arrived for %d seconds, dropping it\n", headerChain.nodeSource, HEADER_CHAIN_STALL_TIMEOUT);
+        FailHeaderChain(50);
+    }
+}
+
+/** Append an index entry standing in for a header chain header to vContext and return it. */
+static CBlockIndex* PushHeaderContext(std::deque<CBlockIndex>& vContext, CBlockIndex* pprev, int nHeight, const uint256* phash,
+    unsigned int nTime, unsigned int nBits)
+{
+    vContext.push_back(CBlockIndex());
+    CBlockIndex* pindex = &vContext.back();
+    pindex->phashBlock = phash;
+    pindex->pprev = pprev;
+    pindex->nHeight = nHeight;
+    pindex->nTime = nTime;
+    pindex->nBits = nBits;
+    return pindex;
+}
+
+/**
+ * Index entries standing in for the header chain up to nHeight, in [nStartHeight, Height()], so that
+ * GetNextWorkRequired and GetMedianTimePast can look back from there. Only the last
+ * HEADER_CONTEXT_DEPTH headers are made entries, which is all either looks at; the oldest builds on
+ * the fork block when the header chain is shorter. Returns the entry at nHeight. Requires cs_main.
+ */
+static CBlockIndex* GetHeaderChainContext(int nHeight, std::deque<CBlockIndex>& vContext)
+{
+    int nFrom = std::max(headerChain.nStartHeight, nHeight - HEADER_CONTEXT_DEPTH + 1);
+    CBlockIndex* pindexPrev = nFrom == headerChain.nStartHeight ? mapBlockIndex[headerChain.hashFork] : NULL;
+    for (int nPos = nFrom - headerChain.nStartHeight; nPos <= nHeight - headerChain.nStartHeight; nPos++)
+        pindexPrev = PushHeaderContext(vContext, pindexPrev, headerChain.nStartHeight + nPos, &headerChain.vHashes[nPos],
+            headerChain.vTimeBits[nPos].first, headerChain.vTimeBits[nPos].second);
+    return pindexPrev;
+}
+
+/**
+ * The checks of ContextualCheckBlockHeader and CheckWork that need the headers before it and not the
+ * block body: the timestamp against their median, and the difficulty wherever CheckWork wants it to
+ * match exactly, which includes every proof-of-stake block.
+ */
+static bool ContextualCheckHeaderChainHeader(const CBlockHeader& header, int nHeight, const CBlockIndex* pindexPrev, CValidationState& state)
+{
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("%s : header's timestamp is too early at %d", __func__, nHeight),
+            REJECT_INVALID, "time-too-old");
+
+    bool fProofOfWork = nHeight <= Params().LAST_POW_BLOCK();
+    if ((!fProofOfWork || nHeight > DGW_TOLERANT_WORK_HEIGHT) && header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return state.DoS(100, error("%s : incorrect difficulty at %d", __func__, nHeight),
+            REJECT_INVALID, "bad-diffbits");
+
+    return true;
+}
+
+/**
+ * Check headers received from a peer and extend (or replace) the header chain with them. Only the
+ * checks possible without the block body are done here: continuity, proof of work up to the last PoW
+ * block, block version, checkpoints, the future drift and median time of the timestamp, and the
+ * difficulty. Everything else, including the stake kernel, is checked by AcceptBlock once the block
+ * itself arrives. Requires cs_main.
+ */
+bool AcceptHeaderChain(NodeId nodeid, const std::vector<CBlockHeader>& headers, CValidationState& state, int& nNew)
+{
+    nNew = 0;
+
+    std::vector<uint256> vHash(headers.size());
+    for (unsigned int i = 0; i < headers.size(); i++) {
+        vHash[i] = headers[i].GetHash();
+        if (i > 0 && headers[i].hashPrevBlock != vHash[i - 1])
+            return state.DoS(20, error("%s : non-continuous headers sequence", __func__));
+    }
+
+    // Skip the blocks we already have on the active chain
+    unsigned int nFirst = 0;
+    while (nFirst < headers.size()) {
+        BlockMap::iterator mi = mapBlockIndex.find(vHash[nFirst]);
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            break;
+        nFirst++;
+    }
+    if (nFirst == headers.size())
+        return true;
+
+    const uint256 hashPrev = headers[nFirst].hashPrevBlock;
+    bool fInHeaderChain = !headerChain.IsNull() && (hashPrev == headerChain.hashFork || headerChain.mapHeights.count(hashPrev));
+    int nHeight;
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrev);
+    bool fOnActiveChain = mi != mapBlockIndex.end() && chainActive.Contains(mi->second);
+    if (fOnActiveChain) {
+        nHeight = mi->second->nHeight + 1;
+    } else if (fInHeaderChain) {
+        nHeight = (hashPrev == headerChain.hashFork ? headerChain.nStartHeight - 1 : headerChain.mapHeights[hashPrev]) + 1;
+    } else {
+        // Builds on neither chain: a fork we leave to block relay, or the answer to an outdated locator.
+        LogPrint("net", "Unconnected headers from peer=%d, ignoring\n", nodeid);
+        return true;
+    }
+
+    int nLastHeight = nHeight + (int)(headers.size() - nFirst) - 1;
+    if (nLastHeight <= std::max(chainActive.Height(), headerChain.IsNull() ? 0 : headerChain.Height()))
+        return true;
+
+    std::deque<CBlockIndex> vContext;
+    CBlockIndex* pindexPrev = fOnActiveChain ? mi->second :
+                              hashPrev == headerChain.hashFork ? mapBlockIndex[hashPrev] : GetHeaderChainContext(nHeight - 1, vContext);
+    for (unsigned int i = nFirst; i < headers.size(); i++) {
+        const CBlockHeader& header = headers[i];
+        int nHeaderHeight = nHeight + (int)(i - nFirst);
+        bool fProofOfWork = nHeaderHeight <= Params().LAST_POW_BLOCK();
+
+        if (!CheckBlockHeader(header, state, fProofOfWork))
+            return false;
+
+        if (!Checkpoints::CheckBlock(nHeaderHeight, vHash[i]))
+            return state.DoS(100, error("%s : rejected by checkpoint lock-in at %d", __func__, nHeaderHeight),
+                REJECT_CHECKPOINT, "checkpoint mismatch");
+
+        if (header.GetBlockTime() > GetAdjustedTime() + (fProofOfWork ? 7200 : 180))
+            return state.Invalid(error("%s : block timestamp too far in the future", __func__),
+                REJECT_INVALID, "time-too-new");
+
+        if (!ContextualCheckHeaderChainHeader(header, nHeaderHeight, pindexPrev, state))
+            return false;
+        pindexPrev = PushHeaderContext(vContext, pindexPrev, nHeaderHeight, &vHash[i], header.nTime, header.nBits);
+    }
+
+    if (fInHeaderChain) {
+        // Drop whatever the new headers replace
+        while (headerChain.Height() >= nHeight) {
+            headerChain.mapHeights.erase(headerChain.vHashes.back());
+            headerChain.vHashes.pop_back();
+            headerChain.vTimeBits.pop_back();
+        }
+    } else {
+        ResetHeaderChain();
+        headerChain.hashFork = hashPrev;
+        headerChain.nStartHeight = nHeight;
+    }
+
+    // Unsolicited headers cannot make us track an arbitrarily long chain
+    int nMaxHeight = chainActive.Height() + MAX_HEADER_CHAIN_AHEAD + (int)MAX_HEADERS_RESULTS;
+    for (unsigned int i = nFirst; i < headers.size() && nHeight <= nMaxHeight; i++, nHeight++) {
+        headerChain.vHashes.push_back(vHash[i]);
+        headerChain.vTimeBits.push_back(std::make_pair(headers[i].nTime, headers[i].nBits));
+        headerChain.mapHeights[vHash[i]] = nHeight;
+        nNew++;
+    }
+    headerChain.nodeSource = nodeid;
+    headerChain.nLastProgress = GetTime();
+
+    CNodeState* nodestate = State(nodeid);
+    nodestate->nHeaderChainHeight = std::max(nodestate->nHeaderChainHeight, headerChain.Height());
+    return true;
+}
+
+/** Locator starting at the tip of the header chain, so getheaders continues where it ended. Requires cs_main. */
+CBlockLocator GetHeaderChainLocator()
+{
+    if (headerChain.IsNull())
+        return chainActive.GetLocator();
+
+    std::vector<uint256> vHave;
+    int nStep = 1;
+    for (int nHeight = headerChain.Height(); nHeight >= headerChain.nStartHeight; nHeight -= nStep) {
+        vHave.push_back(headerChain.At(nHeight));
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+
+    CBlockLocator locator = chainActive.GetLocator(chainActive[headerChain.nStartHeight - 1]);
+    locator.vHave.insert(locator.vHave.begin(), vHave.begin(), vHave.end());
+    return locator;
+}
+
+/** Whether block download with this peer is driven by getheaders. Requires cs_main. */
+bool IsHeadersFirstPeer(const CNode* pnode, const CNodeState& state)
+{
+    return Params().HeadersFirstSyncingActive() && pnode->nVersion >= HEADERS_FIRST_VERSION && !state.fHeadersFailed;
+}
+
+// Requires cs_main.
+void PushGetHeaders(CNode* pto, CNodeState& state)
+{
+    state.nHeadersRequestTime = GetTime();
+    state.fHeadersMore = false;
+    LogPrint("net", "getheaders (%d) to peer=%d (startheight:%d)\n", headerChain.IsNull() ? chainActive.Height() : headerChain.Height(),
+        pto->id, pto->nStartingHeight);
+    pto->PushMessage("getheaders", GetHeaderChainLocator(), uint256(0));
+}
+
+/** Add not-in-flight blocks of the header chain that the peer has to vHashes, until it has at most count
+ *  entries. Only blocks inside the download window are fetched; nodeStaller is set like in
+ *  FindNextBlocksToDownload. Requires cs_main. */
+void FindNextHeaderChainBlocksToDownload(NodeId nodeid, int nPeerHeight, unsigned int count, std::vector<uint256>& vHashes, NodeId& nodeStaller)
+{
+    if (count == 0 || headerChain.IsNull())
+        return;
+
+    int nWindowEnd = chainActive.Height() + BLOCK_DOWNLOAD_WINDOW;
+    int nMaxHeight = std::min(std::min(headerChain.Height(), nPeerHeight), nWindowEnd + 1);
+    NodeId waitingfor = -1;
+    for (int nHeight = std::max(headerChain.nStartHeight, chainActive.Height() + 1); nHeight <= nMaxHeight; nHeight++) {
+        const uint256& hash = headerChain.At(nHeight);
+        if (mapBlockIndex.count(hash) || mapHeaderChainBlocks.count(headerChain.At(nHeight - 1)))
+            continue; // already downloaded
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+        if (itInFlight != mapBlocksInFlight.end()) {
+            if (waitingfor == -1)
+                waitingfor = itInFlight->second.first;
+            continue;
+        }
+
+        if (nHeight > nWindowEnd) {
+            // We reached the end of the window.
+            if (vHashes.size() == 0 && waitingfor != nodeid)
+                nodeStaller = waitingfor;
+            return;
+        }
+        vHashes.push_back(hash);
+        if (vHashes.size() == count)
+            return;
+    }
+}
+
+/** Keep a header chain block whose parent has not arrived yet. Returns false if the block is not part of
+ *  the header chain. Blocks that do not fit the window or MAX_HEADER_CHAIN_BLOCKS_SIZE are dropped, to
+ *  be downloaded again later. Requires cs_main. */
+bool StashHeaderChainBlock(NodeId nodeid, const CBlock& block)
+{
+    const uint256 hash = block.GetHash();
+    map<uint256, int>::const_iterator it = headerChain.mapHeights.find(hash);
+    if (it == headerChain.mapHeights.end() || headerChain.At(it->second - 1) != block.hashPrevBlock)
+        return false;
+
+    MarkBlockAsReceived(hash);
+    int nHeight = it->second;
+    if (nHeight > chainActive.Height() + (int)BLOCK_DOWNLOAD_WINDOW || mapHeaderChainBlocks.count(block.hashPrevBlock))
+        return true;
+
+    // Blocks further up the chain are needed later than this one, so they make room for it
+    size_t nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    while (nHeaderChainBlocksSize + nSize > MAX_HEADER_CHAIN_BLOCKS_SIZE) {
+        map<uint256, CHeaderChainBlock>::iterator itHighest = mapHeaderChainBlocks.end();
+        for (map<uint256, CHeaderChainBlock>::iterator itStashed = mapHeaderChainBlocks.begin(); itStashed != mapHeaderChainBlocks.end(); ++itStashed) {
+            if (itHighest == mapHeaderChainBlocks.end() || itStashed->second.nHeight > itHighest->second.nHeight)
+                itHighest = itStashed;
+        }
+        if (itHighest == mapHeaderChainBlocks.end() || itHighest->second.nHeight < nHeight)
+            return true;
+        nHeaderChainBlocksSize -= itHighest->second.nSize;
+        mapHeaderChainBlocks.erase(itHighest);
+    }
+
+    CHeaderChainBlock& stashed = mapHeaderChainBlocks[block.hashPrevBlock];
+    stashed.nodeid = nodeid;
+    stashed.nHeight = nHeight;
+    stashed.nSize = nSize;
+    stashed.block = block;
+    nHeaderChainBlocksSize += nSize;
+    return true;
+}
+
+/** Process the stashed header chain blocks that build on hashParent, in chain order. */
+void ProcessHeaderChainBlocks(uint256 hashParent)
+{
+    while (true) {
+        NodeId nodeid;
+        CBlock block;
+        {
+            LOCK(cs_main);
+            map<uint256, CHeaderChainBlock>::iterator it = mapHeaderChainBlocks.find(hashParent);
+            if (it == mapHeaderChainBlocks.end())
+                return;
+            nodeid = it->second.nodeid;
+            std::swap(block, it->second.block);
+            nHeaderChainBlocksSize -= it->second.nSize;
+            mapHeaderChainBlocks.erase(it);
+        }
+
+        CValidationState state;
+        ProcessNewBlock(state, NULL, &block);
+        hashParent = block.GetHash();
+
+        LOCK(cs_main);
+        int nDoS;
+        if (state.IsInvalid(nDoS) && nDoS > 0)
+            Misbehaving(nodeid, nDoS);
+        if (!mapBlockIndex.count(hashParent)) {
+            // The rest of the header chain builds on a block we could not accept
+            FailHeaderChain(state.IsInvalid() && !state.CorruptionPossible() ? 100 : 0);
+            return;
+        }
+    }
+}
+
+/** Whether a new block announced by pnode should be fetched as a compact block. Requires cs_main. */
+bool CanRequestCompactBlock(CNode* pnode, const uint256& hash)
+{
+    if (!(nLocalServices & NODE_COMPACT_BLOCKS) || !(pnode->nServices & NODE_COMPACT_BLOCKS) || IsInitialBlockDownload())
+        return false;
+
+    map<uint256, CompactBlockInFlight>::iterator it = mapCompactBlocksInFlight.find(hash);
+    if (it == mapCompactBlocksInFlight.end())
+        return true;
+    if (GetTime() - it->second.nTime > COMPACT_BLOCK_TIMEOUT) {
+        // the first peer did not deliver, fetch the full block from this one
+        LogPrint("net", "compact block %s from peer=%d timed out\n", hash.ToString(), it->second.nodeid);
+        mapCompactBlocksInFlight.erase(it);
+    }
+    return false;
+}
+
+/** Give up on a compact block and ask the peer for the full one. Requires cs_main. */
+void RequestFullBlock(CNode* pnode, const uint256& hash)
+{
+    mapCompactBlocksInFlight.erase(hash);
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pnode->PushMessage("getdata", vGetData);
+}
+
 } // anon namespace
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
@@ -491,8 +999,13 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
     BOOST_FOREACH (const QueuedBlock& queue, state->vBlocksInFlight) {
-        if (queue.pindex)
+        if (queue.pindex) {
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
+        } else {
+            map<uint256, int>::const_iterator it = headerChain.mapHeights.find(queue.hash);
+            if (it != headerChain.mapHeights.end())
+                stats.vHeightInFlight.push_back(it->second);
+        }
     }
     return true;
 }
@@ -530,8 +1043,10 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewWriteBehind* pcoinsWriteBehind = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CZerocoinDB* zerocoinDB = NULL;
+CBlockCache blockCache(DEFAULT_BLOCK_CACHE_SIZE << 20);
 CSporkDB* pSporkDB = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -999,7 +1514,7 @@ void FindMints(vector<CZerocoinMint> vMintsToFind, vector<CZerocoinMint>& vMints
             if(i % 1000 == 0)
                 LogPrintf("%s : scanned %d blocks\n", __func__, i - nZerocoinStartHeight);
 
-            if(chainActive[i]->vMintDenominationsInBlock.empty())
+            if(chainActive[i]->mintDenominationsInBlock.IsNull())
                 continue;
 
             CBlock block;
@@ -1570,14 +2085,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
     // ----------- swiftTX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLockTx;
+    if (FindConflictingLock(tx, hashLockTx)) {
+        return state.DoS(0,
+            error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", hashLockTx.ToString()),
+            REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -1797,14 +2309,11 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
     // ----------- swiftTX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLockTx;
+    if (FindConflictingLock(tx, hashLockTx)) {
+        return state.DoS(0,
+            error("AcceptableInputs : conflicts with existing transaction lock: %s", hashLockTx.ToString()),
+            REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -2016,9 +2525,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
     }
 
     if (pindexSlow) {
-        CBlock block;
-        if (ReadBlockFromDisk(block, pindexSlow)) {
-            BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        CBlockRef pblock;
+        if (ReadBlockFromDisk(pblock, pindexSlow)) {
+            BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
@@ -2083,7 +2592,7 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+static bool ReadIndexedBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
         return false;
@@ -2094,6 +2603,34 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+{
+    // The caller gets a copy it may modify, so a block read from disk here is not cached
+    CBlockRef pblock = blockCache.Get(pindex->GetBlockHash());
+    if (pblock) {
+        block = *pblock;
+        return true;
+    }
+    return ReadIndexedBlockFromDisk(block, pindex);
+}
+
+bool ReadBlockFromDisk(CBlockRef& pblock, const CBlockIndex* pindex, bool fCacheRead)
+{
+    pblock = blockCache.Get(pindex->GetBlockHash());
+    if (pblock)
+        return true;
+
+    CBlock* pblockNew = new CBlock();
+    pblock.reset(pblockNew);
+    if (!ReadIndexedBlockFromDisk(*pblockNew, pindex)) {
+        pblock.reset();
+        return false;
+    }
+    if (fCacheRead)
+        blockCache.Insert(pindex->GetBlockHash(), pblock);
+    return true;
+}
+
 
 double ConvertBitsToDouble(unsigned int nBits)
 {
@@ -2260,23 +2797,16 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
+// Does not require cs_main: the score is applied by SendMessages (see ApplyPendingMisbehavior).
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
-    CNodeState* state = State(pnode);
-    if (state == NULL)
-        return;
-
-    state->nMisbehavior += howmuch;
-    int banscore = GetArg("-banscore", 100);
-    if (state->nMisbehavior >= banscore && state->nMisbehavior - howmuch < banscore) {
-        LogPrintf("Misbehaving: %s (%d -> %d) BAN THRESHOLD EXCEEDED\n", state->name, state->nMisbehavior - howmuch, state->nMisbehavior);
-        state->fShouldBan = true;
-    } else
-        LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name, state->nMisbehavior - howmuch, state->nMisbehavior);
+    LOCK(cs_pendingMisbehavior);
+    map<NodeId, int>::iterator it = mapPendingMisbehavior.find(pnode);
+    if (it != mapPendingMisbehavior.end())
+        it->second += howmuch;
 }
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
@@ -2298,12 +2828,12 @@ void static InvalidBlockFound(CBlockIndex* pindex, const CValidationState& state
 {
     int nDoS = 0;
     if (state.IsInvalid(nDoS)) {
-        std::map<uint256, NodeId>::iterator it = mapBlockSource.find(pindex->GetBlockHash());
-        if (it != mapBlockSource.end() && State(it->second)) {
+        std::map<uint256, std::pair<NodeId, bool> >::iterator it = mapBlockSource.find(pindex->GetBlockHash());
+        if (it != mapBlockSource.end() && State(it->second.first)) {
             CBlockReject reject = {state.GetRejectCode(), state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), pindex->GetBlockHash()};
-            State(it->second)->rejects.push_back(reject);
-            if (nDoS > 0)
-                Misbehaving(it->second, nDoS);
+            State(it->second.first)->rejects.push_back(reject);
+            if (nDoS > 0 && it->second.second)
+                Misbehaving(it->second.first, nDoS);
         }
     }
     if (!state.CorruptionPossible()) {
@@ -2344,7 +2874,7 @@ CBitcoinAddress addressExp2("DTQYdnNqKuEHXyNeeYhPQGGGdqHbXYwjpj");
 
 map<COutPoint, COutPoint> mapInvalidOutPoints;
 map<CBigNum, CAmount> mapInvalidSerials;
-void AddInvalidSpendsToMap(const CBlock& block)
+static void AddInvalidSpendsToMap(const CBlock& block, map<COutPoint, COutPoint>& mapOutPoints, map<CBigNum, CAmount>& mapSerials)
 {
     for (const CTransaction tx : block.vtx) {
         if (!tx.ContainsZerocoins())
@@ -2357,14 +2887,14 @@ void AddInvalidSpendsToMap(const CBlock& block)
 
                 //If serial is not valid, mark all outputs as bad
                 if (!spend.HasValidSerial(Params().Zerocoin_Params())) {
-                    mapInvalidSerials[spend.getCoinSerialNumber()] = spend.getDenomination() * COIN;
+                    mapSerials[spend.getCoinSerialNumber()] = spend.getDenomination() * COIN;
 
                     // Derive the actual valid serial from the invalid serial if possible
                     CBigNum bnActualSerial = spend.CalculateValidSerial(Params().Zerocoin_Params());
                     uint256 txHash;
 
                     if (zerocoinDB->ReadCoinSpend(bnActualSerial, txHash)) {
-                        mapInvalidSerials[bnActualSerial] = spend.getDenomination() * COIN;
+                        mapSerials[bnActualSerial] = spend.getDenomination() * COIN;
 
                         CTransaction txPrev;
                         uint256 hashBlock;
@@ -2374,14 +2904,14 @@ void AddInvalidSpendsToMap(const CBlock& block)
                         //Record all txouts from txPrev as invalid
                         for (unsigned int i = 0; i < txPrev.vout.size(); i++) {
                             //map to an empty outpoint to represent that this is the first in the chain of bad outs
-                            mapInvalidOutPoints[COutPoint(txPrev.GetHash(), i)] = COutPoint();
+                            mapOutPoints[COutPoint(txPrev.GetHash(), i)] = COutPoint();
                         }
                     }
 
                     //Record all txouts from this invalid zerocoin spend tx as invalid
                     for (unsigned int i = 0; i < tx.vout.size(); i++) {
                         //map to an empty outpoint to represent that this is the first in the chain of bad outs
-                        mapInvalidOutPoints[COutPoint(tx.GetHash(), i)] = COutPoint();
+                        mapOutPoints[COutPoint(tx.GetHash(), i)] = COutPoint();
                     }
                 }
             }
@@ -2389,32 +2919,30 @@ void AddInvalidSpendsToMap(const CBlock& block)
     }
 }
 
-// Populate global map (mapInvalidOutPoints) of invalid/fraudulent OutPoints that are banned from being used on the chain.
-CAmount nFilteredThroughBittrex = 0;
-bool fListPopulatedAfterLock = false;
-void PopulateInvalidOutPointMap()
+void AddInvalidSpendsToMap(const CBlock& block)
 {
-    if (fListPopulatedAfterLock)
-        return;
-    nFilteredThroughBittrex = 0;
-
-    //Calculate over the entire period between the first bad tx and the tip of the chain - or the point at which this becomes enforced
-    int nHeightLast = min(Params().Zerocoin_Block_RecalculateAccumulators() + 1, chainActive.Height());
+    AddInvalidSpendsToMap(block, mapInvalidOutPoints, mapInvalidSerials);
+}
 
-    map<COutPoint, int> mapValidMixed;
+// Record the invalid/fraudulent outpoints of the blocks before nHeightLast in the fraudulent range; false if a block could not be read
+static bool ScanInvalidOutPoints(int nHeightLast, map<COutPoint, COutPoint>& mapOutPoints, map<CBigNum, CAmount>& mapSerials, CAmount& nFiltered)
+{
+    bool fComplete = true;
     for (int i = Params().Zerocoin_Block_FirstFraudulent(); i < nHeightLast; i++) {
         CBlockIndex* pindex = chainActive[i];
         CBlock block;
-        if (!ReadBlockFromDisk(block, pindex))
+        if (!ReadBlockFromDisk(block, pindex)) {
+            fComplete = false;
             continue;
+        }
 
         //Find all the invalid spends for this block and record them
-        AddInvalidSpendsToMap(block);
+        AddInvalidSpendsToMap(block, mapOutPoints, mapSerials);
 
         //Any tx's that use a bad TxOut as an input is marked as invalid
         for (CTransaction tx : block.vtx) {
             for (CTxIn txIn : tx.vin) {
-                if (mapInvalidOutPoints.count(txIn.prevout)) {
+                if (mapOutPoints.count(txIn.prevout)) {
 
                     //If this is a stake transaction, masternode payments should not be considered fraudulent
                     std::list<COutPoint> listOutPoints;
@@ -2437,7 +2965,7 @@ void PopulateInvalidOutPointMap()
 
                                 //Anything past these two addresses is only guilty by association/washed funds
                                 if (addressOut == addressExp1 || addressOut == addressExp2) {
-                                    nFilteredThroughBittrex += tx.vout[j].nValue;
+                                    nFiltered += tx.vout[j].nValue;
                                     continue;
                                 }
 
@@ -2460,7 +2988,7 @@ void PopulateInvalidOutPointMap()
 
                                 CBitcoinAddress address(dest);
                                 if (address == addressExp1 || address == addressExp2) {
-                                    nFilteredThroughBittrex += tx.vout[p.n].nValue;
+                                    nFiltered += tx.vout[p.n].nValue;
                                     continue;
                                 }
                                 //record this outpoint as invalid
@@ -2471,19 +2999,92 @@ void PopulateInvalidOutPointMap()
 
                     //Record each fraudulent outpoint and its cause.
                     for (COutPoint o : listOutPoints)
-                        mapInvalidOutPoints[o] = txIn.prevout;
+                        mapOutPoints[o] = txIn.prevout;
 
                     //The entire tx set of outpoints are added, break here
                     break;
                 }
             }
         }
+    }
+    return fComplete;
+}
 
-        if (pindex->nHeight > Params().Zerocoin_Block_RecalculateAccumulators())
-            fListPopulatedAfterLock = true;
+//Calculate over the entire period between the first bad tx and the tip of the chain - or the point at which this becomes enforced
+static int GetInvalidOutPointScanEnd()
+{
+    return min(Params().Zerocoin_Block_RecalculateAccumulators() + 1, chainActive.Height());
+}
+
+// Populate global map (mapInvalidOutPoints) of invalid/fraudulent OutPoints that are banned from being used on the chain.
+CAmount nFilteredThroughBittrex = 0;
+bool fListPopulatedAfterLock = false;
+void PopulateInvalidOutPointMap()
+{
+    if (fListPopulatedAfterLock)
+        return;
+    nFilteredThroughBittrex = 0;
+
+    int nHeightLast = GetInvalidOutPointScanEnd();
+    bool fComplete = ScanInvalidOutPoints(nHeightLast, mapInvalidOutPoints, mapInvalidSerials, nFilteredThroughBittrex);
+    if (fComplete && nHeightLast - 1 >= Params().Zerocoin_Block_RecalculateAccumulators())
+        fListPopulatedAfterLock = true;
+}
+
+uint256 CInvalidOutPointSet::GetChecksum() const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << nHeight << hashBlock << mapOutPoints << mapSerials << nFilteredThroughBittrex;
+    return ss.GetHash();
+}
+
+bool ComputeInvalidOutPoints(CInvalidOutPointSet& set)
+{
+    set.SetNull();
+    int nHeightLast = GetInvalidOutPointScanEnd();
+    bool fComplete = ScanInvalidOutPoints(nHeightLast, set.mapOutPoints, set.mapSerials, set.nFilteredThroughBittrex);
+    set.nHeight = nHeightLast - 1;
+    if (set.nHeight >= 0)
+        set.hashBlock = chainActive[set.nHeight]->GetBlockHash();
+    set.hashChecksum = set.GetChecksum();
+    return fComplete && set.nHeight == Params().Zerocoin_Block_RecalculateAccumulators();
+}
+
+void InitInvalidOutPointMap()
+{
+    CInvalidOutPointSet set;
+    if (pblocktree->ReadInvalidOutPoints(set)) {
+        if (set.hashChecksum != set.GetChecksum()) {
+            LogPrintf("%s : stored invalid outpoints fail their checksum, recomputing\n", __func__);
+        } else if (set.nHeight < 0 || set.nHeight > chainActive.Height() || chainActive[set.nHeight]->GetBlockHash() != set.hashBlock) {
+            LogPrintf("%s : stored invalid outpoints are not from the active chain, recomputing\n", __func__);
+        } else {
+            mapInvalidOutPoints.insert(set.mapOutPoints.begin(), set.mapOutPoints.end());
+            mapInvalidSerials.insert(set.mapSerials.begin(), set.mapSerials.end());
+            nFilteredThroughBittrex = set.nFilteredThroughBittrex;
+            // A set covering the whole range spares PopulateInvalidOutPointMap the rescan
+            fListPopulatedAfterLock = set.nHeight >= Params().Zerocoin_Block_RecalculateAccumulators();
+            LogPrintf("%s : loaded %u invalid outpoints and %u invalid serials up to height %d\n", __func__,
+                set.mapOutPoints.size(), set.mapSerials.size(), set.nHeight);
+            return;
+        }
     }
+
+    int64_t nStart = GetTimeMillis();
+    bool fComplete = ComputeInvalidOutPoints(set);
+    mapInvalidOutPoints.insert(set.mapOutPoints.begin(), set.mapOutPoints.end());
+    mapInvalidSerials.insert(set.mapSerials.begin(), set.mapSerials.end());
+    nFilteredThroughBittrex = set.nFilteredThroughBittrex;
+    fListPopulatedAfterLock = fComplete;
+    LogPrintf("%s : computed %u invalid outpoints and %u invalid serials up to height %d in %dms\n", __func__,
+        set.mapOutPoints.size(), set.mapSerials.size(), set.nHeight, GetTimeMillis() - nStart);
+
+    // Only the whole range is stored, a chain still syncing through it computes it again next time
+    if (fComplete && !pblocktree->WriteInvalidOutPoints(set))
+        LogPrintf("%s : failed to store the invalid outpoints\n", __func__);
 }
 
+
 bool ValidOutPoint(const COutPoint out, int nHeight)
 {
     bool isInvalid = nHeight >= Params().Block_Enforce_Invalid() && mapInvalidOutPoints.count(out);
@@ -2608,12 +3209,37 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+/** Collects the zerocoin database changes of the block being connected or disconnected, dropped unless committed */
+class CZerocoinDBBatchScope
 {
-    if (pindex->GetBlockHash() != view.GetBestBlock())
-        LogPrintf("%s : pindex=%s view=%s\n", __func__, pindex->GetBlockHash().GetHex(), view.GetBestBlock().GetHex());
-    assert(pindex->GetBlockHash() == view.GetBestBlock());
-
+public:
+    CZerocoinDBBatchScope() : fOwner(zerocoinDB && !zerocoinDB->IsBatching())
+    {
+        if (fOwner)
+            zerocoinDB->StartBatch();
+    }
+
+    ~CZerocoinDBBatchScope()
+    {
+        if (fOwner && zerocoinDB->IsBatching())
+            zerocoinDB->AbortBatch();
+    }
+
+    // Changes collected inside an enclosing scope are left for it to commit
+    bool Commit() { return !fOwner || zerocoinDB->CommitBatch(); }
+
+private:
+    bool fOwner;
+};
+
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+{
+    CZerocoinDBBatchScope zerocoinBatch;
+
+    if (pindex->GetBlockHash() != view.GetBestBlock())
+        LogPrintf("%s : pindex=%s view=%s\n", __func__, pindex->GetBlockHash().GetHex(), view.GetBestBlock().GetHex());
+    assert(pindex->GetBlockHash() == view.GetBestBlock());
+
     if (pfClean)
         *pfClean = false;
 
@@ -2730,6 +3356,9 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         }
     }
 
+    if (!zerocoinBatch.Commit())
+        return state.Abort("Failed to write to zerocoin database");
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
@@ -2738,6 +3367,8 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     }
 }
 
+static void UnmapDiskFiles(int nFile);
+
 void static FlushBlockFile(bool fFinalize = false)
 {
     LOCK(cs_LastBlockFile);
@@ -2759,6 +3390,10 @@ void static FlushBlockFile(bool fFinalize = false)
         FileCommit(fileOld);
         fclose(fileOld);
     }
+
+    // Mappings taken before the truncation would reach past the end of the files
+    if (fFinalize)
+        UnmapDiskFiles(nLastBlockFile);
 }
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
@@ -2771,137 +3406,183 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
-void RecalculateZDONMinted()
-{
-    CBlockIndex *pindex = chainActive[Params().Zerocoin_StartHeight()];
-    int nHeightEnd = chainActive.Height();
-    while (true) {
-        if (pindex->nHeight % 1000 == 0)
-            LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
+// Blocks decoded in parallel before their results are folded into the index in order
+static const int SUPPLY_RECALC_WINDOW = 1000;
+static const int MAX_SUPPLY_RECALC_THREADS = 8;
 
-        //overwrite possibly wrong vMintsInBlock data
-        CBlock block;
-        assert(ReadBlockFromDisk(block, pindex));
+/** What the money supply rebuild takes from one block */
+struct CSupplyBlockDelta {
+    CAmount nValueIn;
+    CAmount nValueOut;
+    CZerocoinMintCounts mints;
+    std::list<libzerocoin::CoinDenomination> listSpends;
+    bool fUndo;      // whether nValueIn includes the spent outputs, taken from the undo data
+    CBlock block;    // kept without undo data, the spent outputs are then looked up by transaction
+    std::string strError;
 
-        std::list<CZerocoinMint> listMints;
-        BlockToZerocoinMintList(block, listMints, true);
-
-        vector<libzerocoin::CoinDenomination> vDenomsBefore = pindex->vMintDenominationsInBlock;
-        pindex->vMintDenominationsInBlock.clear();
-        for (auto mint : listMints)
-            pindex->vMintDenominationsInBlock.emplace_back(mint.GetDenomination());
-
-        if (pindex->nHeight < nHeightEnd)
-            pindex = chainActive.Next(pindex);
-        else
-            break;
-    }
-}
+    CSupplyBlockDelta() : nValueIn(0), nValueOut(0), fUndo(false) {}
+};
 
-void RecalculateZDONSpent()
+static void DecodeSupplyBlock(const CBlockIndex* pindex, CSupplyBlockDelta& delta)
 {
-    CBlockIndex* pindex = chainActive[Params().Zerocoin_StartHeight()];
-    while (true) {
-        if (pindex->nHeight % 1000 == 0)
-            LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
-
-        //Rewrite zDON supply
-        CBlock block;
-        assert(ReadBlockFromDisk(block, pindex));
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex)) {
+        delta.strError = strprintf("failed to read block %d", pindex->nHeight);
+        return;
+    }
 
-        list<libzerocoin::CoinDenomination> listDenomsSpent = ZerocoinSpendListFromBlock(block, true);
+    // One undo entry per transaction after the coinbase, holding the outputs spent by its non-zerocoin inputs
+    CBlockUndo blockundo;
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    delta.fUndo = pindex->pprev && !pos.IsNull() && blockundo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()) &&
+                  blockundo.vtxundo.size() + 1 == block.vtx.size();
+
+    CAmount nValueSpent = 0;
+    for (unsigned int t = 0; t < block.vtx.size(); t++) {
+        const CTransaction& tx = block.vtx[t];
+        if (!tx.IsCoinBase()) {
+            unsigned int nUndo = 0;
+            for (unsigned int i = 0; i < tx.vin.size(); i++) {
+                if (tx.vin[i].scriptSig.IsZerocoinSpend()) {
+                    delta.nValueIn += tx.vin[i].nSequence * COIN;
+                    continue;
+                }
+                if (!delta.fUndo)
+                    continue;
+                const std::vector<CTxInUndo>& vprevout = blockundo.vtxundo[t - 1].vprevout;
+                if (nUndo < vprevout.size())
+                    nValueSpent += vprevout[nUndo++].txout.nValue;
+                else
+                    delta.fUndo = false;
+            }
+            if (delta.fUndo && nUndo != blockundo.vtxundo[t - 1].vprevout.size())
+                delta.fUndo = false;
+        }
 
-        //Reset the supply to previous block
-        pindex->mapZerocoinSupply = pindex->pprev->mapZerocoinSupply;
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            if (i == 0 && tx.IsCoinStake())
+                continue;
 
-        //Add mints to zDON supply
-        for (auto denom : libzerocoin::zerocoinDenomList) {
-            long nDenomAdded = count(pindex->vMintDenominationsInBlock.begin(), pindex->vMintDenominationsInBlock.end(), denom);
-            pindex->mapZerocoinSupply.at(denom) += nDenomAdded;
+            delta.nValueOut += tx.vout[i].nValue;
         }
+    }
 
-        //Remove spends from zDON supply
-        for (auto denom : listDenomsSpent)
-            pindex->mapZerocoinSupply.at(denom)--;
-
-        //Rewrite money supply
-        assert(pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)));
+    if (delta.fUndo)
+        delta.nValueIn += nValueSpent;
+    else
+        delta.block = block;
 
-        if (pindex->nHeight < chainActive.Height())
-            pindex = chainActive.Next(pindex);
-        else
-            break;
+    if (pindex->nHeight >= Params().Zerocoin_StartHeight()) {
+        std::list<CZerocoinMint> listMints;
+        BlockToZerocoinMintList(block, listMints, true);
+        for (auto mint : listMints)
+            delta.mints.Add(mint.GetDenomination());
+        delta.listSpends = ZerocoinSpendListFromBlock(block, true);
     }
 }
 
-bool RecalculateDONSupply(int nHeightStart)
+// Body of the threads decoding a window, each taking every nStep-th block from nFirst
+static void DecodeSupplyBlocks(const std::vector<CBlockIndex*>* pvIndex, std::vector<CSupplyBlockDelta>* pvDelta, size_t nFirst, size_t nStep)
 {
-    if (nHeightStart > chainActive.Height())
-        return false;
-
-    CBlockIndex* pindex = chainActive[nHeightStart];
-    CAmount nSupplyPrev = pindex->pprev->nMoneySupply;
-//    if (nHeightStart == Params().Zerocoin_StartHeight())
-//        nSupplyPrev = CAmount(5449796547496199);
-
-    while (true) {
-        if (pindex->nHeight % 1000 == 0)
-            LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
-
-        CBlock block;
-        assert(ReadBlockFromDisk(block, pindex));
+    for (size_t i = nFirst; i < pvIndex->size(); i += nStep)
+        DecodeSupplyBlock((*pvIndex)[i], (*pvDelta)[i]);
+}
 
-        CAmount nValueIn = 0;
-        CAmount nValueOut = 0;
-        for (const CTransaction tx : block.vtx) {
-            for (unsigned int i = 0; i < tx.vin.size(); i++) {
-                if (tx.IsCoinBase())
-                    break;
+// Value of the outputs spent by the non-zerocoin inputs of block, looked up by transaction
+static bool GetSpentValue(const CBlock& block, CAmount& nValue)
+{
+    for (const CTransaction& tx : block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        for (const CTxIn& txin : tx.vin) {
+            if (txin.scriptSig.IsZerocoinSpend())
+                continue;
+            CTransaction txPrev;
+            uint256 hashBlock;
+            if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
+                return error("%s : transaction %s not found", __func__, txin.prevout.hash.GetHex());
+            nValue += txPrev.vout[txin.prevout.n].nValue;
+        }
+    }
+    return true;
+}
 
-                if (tx.vin[i].scriptSig.IsZerocoinSpend()) {
-                    nValueIn += tx.vin[i].nSequence * COIN;
-                    continue;
-                }
+bool RecalculateMoneySupply(int nHeightStart)
+{
+    int nHeightEnd = chainActive.Height();
+    if (nHeightStart > nHeightEnd)
+        return true;
 
-                COutPoint prevout = tx.vin[i].prevout;
-                CTransaction txPrev;
-                uint256 hashBlock;
-                assert(GetTransaction(prevout.hash, txPrev, hashBlock, true));
-                nValueIn += txPrev.vout[prevout.n].nValue;
+    int64_t nTimeStart = GetTimeMillis();
+    unsigned int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_SUPPLY_RECALC_THREADS));
+    CAmount nSupplyPrev = chainActive[nHeightStart]->pprev->nMoneySupply;
+
+    for (int nHeightWindow = nHeightStart; nHeightWindow <= nHeightEnd; nHeightWindow += SUPPLY_RECALC_WINDOW) {
+        std::vector<CBlockIndex*> vIndex;
+        for (int nHeight = nHeightWindow; nHeight <= nHeightEnd && nHeight < nHeightWindow + SUPPLY_RECALC_WINDOW; nHeight++)
+            vIndex.push_back(chainActive[nHeight]);
+
+        std::vector<CSupplyBlockDelta> vDelta(vIndex.size());
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&DecodeSupplyBlocks, &vIndex, &vDelta, i, nThreads));
+        threads.join_all();
+
+        // Every block builds on the totals of the one before, so the results are applied in chain order
+        std::vector<CDiskBlockIndex> vBlockIndex;
+        for (size_t i = 0; i < vIndex.size(); i++) {
+            CBlockIndex* pindex = vIndex[i];
+            CSupplyBlockDelta& delta = vDelta[i];
+            if (!delta.strError.empty())
+                return error("%s : %s", __func__, delta.strError);
+            if (pindex->nHeight % 1000 == 0)
+                LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
+
+            if (!delta.fUndo && !GetSpentValue(delta.block, delta.nValueIn))
+                return error("%s : failed to get the inputs of block %d", __func__, pindex->nHeight);
+
+            if (pindex->nHeight >= Params().Zerocoin_StartHeight()) {
+                //overwrite possibly wrong vMintsInBlock data
+                pindex->mintDenominationsInBlock = delta.mints;
+
+                //Reset the supply to previous block
+                pindex->zerocoinSupply = pindex->pprev->zerocoinSupply;
+
+                //Add mints to zDON supply
+                for (auto denom : libzerocoin::zerocoinDenomList)
+                    pindex->zerocoinSupply.at(denom) += delta.mints.Count(denom);
+
+                //Remove spends from zDON supply
+                for (auto denom : delta.listSpends)
+                    pindex->zerocoinSupply.at(denom)--;
             }
 
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                if (i == 0 && tx.IsCoinStake())
-                    continue;
-
-                nValueOut += tx.vout[i].nValue;
-            }
-        }
+            // Rewrite money supply
+            pindex->nMoneySupply = nSupplyPrev + delta.nValueOut - delta.nValueIn;
+            nSupplyPrev = pindex->nMoneySupply;
 
-        // Rewrite money supply
-        pindex->nMoneySupply = nSupplyPrev + nValueOut - nValueIn;
-        nSupplyPrev = pindex->nMoneySupply;
+            // Add fraudulent funds to the supply and remove any recovered funds.
+            if (pindex->nHeight == Params().Zerocoin_Block_RecalculateAccumulators()) {
+                PopulateInvalidOutPointMap();
+                LogPrintf("%s : Original money supply=%s\n", __func__, FormatMoney(pindex->nMoneySupply));
 
-        // Add fraudulent funds to the supply and remove any recovered funds.
-        if (pindex->nHeight == Params().Zerocoin_Block_RecalculateAccumulators()) {
-            PopulateInvalidOutPointMap();
-            LogPrintf("%s : Original money supply=%s\n", __func__, FormatMoney(pindex->nMoneySupply));
+                pindex->nMoneySupply += nFilteredThroughBittrex;
+                LogPrintf("%s : Adding bittrex filtered funds to supply + %s : supply=%s\n", __func__, FormatMoney(nFilteredThroughBittrex), FormatMoney(pindex->nMoneySupply));
 
-            pindex->nMoneySupply += nFilteredThroughBittrex;
-            LogPrintf("%s : Adding bittrex filtered funds to supply + %s : supply=%s\n", __func__, FormatMoney(nFilteredThroughBittrex), FormatMoney(pindex->nMoneySupply));
+                CAmount nLocked = GetInvalidUTXOValue();
+                pindex->nMoneySupply -= nLocked;
+                LogPrintf("%s : Removing locked from supply - %s : supply=%s\n", __func__, FormatMoney(nLocked), FormatMoney(pindex->nMoneySupply));
+            }
 
-            CAmount nLocked = GetInvalidUTXOValue();
-            pindex->nMoneySupply -= nLocked;
-            LogPrintf("%s : Removing locked from supply - %s : supply=%s\n", __func__, FormatMoney(nLocked), FormatMoney(pindex->nMoneySupply));
+            vBlockIndex.push_back(CDiskBlockIndex(pindex));
         }
 
-        assert(pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)));
-
-        if (pindex->nHeight < chainActive.Height())
-            pindex = chainActive.Next(pindex);
-        else
-            break;
+        if (!pblocktree->WriteBatchSync(std::vector<std::pair<int, CBlockFileInfo> >(), -1, vBlockIndex))
+            return error("%s : failed to write to block index", __func__);
+        boost::this_thread::interruption_point();
     }
+
+    LogPrintf("%s : recalculated %d blocks with %u threads in %dms\n", __func__, nHeightEnd - nHeightStart + 1, nThreads, GetTimeMillis() - nTimeStart);
     return true;
 }
 
@@ -2967,6 +3648,7 @@ static int64_t nTimeTotal = 0;
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked)
 {
     AssertLockHeld(cs_main);
+    CZerocoinDBBatchScope zerocoinBatch;
     // Check it again in case a previous version let a bad block in
     if (!fAlreadyChecked && !CheckBlock(block, state, !fJustCheck, !fJustCheck))
         return false;
@@ -3149,40 +3831,39 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::list<libzerocoin::CoinDenomination> listSpends = ZerocoinSpendListFromBlock(block, fFilterInvalid);
 
     if (pindex->nHeight == Params().Zerocoin_Block_RecalculateAccumulators() + 1) {
-        RecalculateZDONMinted();
-        RecalculateZDONSpent();
-        RecalculateDONSupply(Params().Zerocoin_StartHeight());
+        if (!RecalculateMoneySupply(Params().Zerocoin_StartHeight()))
+            return state.Abort("Failed to recalculate the money supply");
     }
 
     // Initialize zerocoin supply to the supply from previous block
     if (pindex->pprev && pindex->pprev->GetBlockHeader().nVersion > 3) {
         for (auto& denom : zerocoinDenomList) {
-            pindex->mapZerocoinSupply.at(denom) = pindex->pprev->mapZerocoinSupply.at(denom);
+            pindex->zerocoinSupply.at(denom) = pindex->pprev->zerocoinSupply.at(denom);
         }
     }
 
     // Track zerocoin money supply
     CAmount nAmountZerocoinSpent = 0;
-    pindex->vMintDenominationsInBlock.clear();
+    pindex->mintDenominationsInBlock.SetNull();
     if (pindex->pprev) {
         for (auto& m : listMints) {
             libzerocoin::CoinDenomination denom = m.GetDenomination();
-            pindex->vMintDenominationsInBlock.push_back(m.GetDenomination());
-            pindex->mapZerocoinSupply.at(denom)++;
+            pindex->mintDenominationsInBlock.Add(m.GetDenomination());
+            pindex->zerocoinSupply.at(denom)++;
         }
 
         for (auto& denom : listSpends) {
-            pindex->mapZerocoinSupply.at(denom)--;
+            pindex->zerocoinSupply.at(denom)--;
             nAmountZerocoinSpent += libzerocoin::ZerocoinDenominationToAmount(denom);
 
             // zerocoin failsafe
-            if (pindex->mapZerocoinSupply.at(denom) < 0)
+            if (pindex->zerocoinSupply.at(denom) < 0)
                 return state.DoS(100, error("Block contains zerocoins that spend more than are in the available supply to spend"));
         }
     }
 
     for (auto& denom : zerocoinDenomList) {
-        LogPrint("zero" "%s coins for denomination %d pubcoin %s\n", __func__, denom, pindex->mapZerocoinSupply.at(denom));
+        LogPrint("zero" "%s coins for denomination %d pubcoin %s\n", __func__, denom, pindex->zerocoinSupply.at(denom));
     }
 
     // track money supply and mint amount info
@@ -3285,6 +3966,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    if (!zerocoinBatch.Commit())
+        return state.Abort("Failed to write to zerocoin database");
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -3325,7 +4009,7 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
     static int64_t nLastWrite = 0;
     try {
         if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
@@ -3336,32 +4020,29 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
                 return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
             FlushBlockFile();
-            // Then update all block file information (which may refer to block and undo files).
-            bool fileschanged = false;
-            for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end();) {
-                if (!pblocktree->WriteBlockFileInfo(*it, vinfoBlockFile[*it])) {
-                    return state.Abort("Failed to write to block index");
-                }
-                fileschanged = true;
-                setDirtyFileInfo.erase(it++);
-            }
-            if (fileschanged && !pblocktree->WriteLastBlockFile(nLastBlockFile)) {
-                return state.Abort("Failed to write to block index");
-            }
-            for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end();) {
-                if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(*it))) {
-                    return state.Abort("Failed to write to block index");
-                }
-                setDirtyBlockIndex.erase(it++);
-            }
-            pblocktree->Sync();
-            // Finally flush the chainstate (which may refer to block index entries).
+            // Then freeze the block file information (which may refer to block and undo files) and the
+            // dirty block index entries. The flush thread writes them in one batch, ahead of the chainstate.
+            CBlockTreeChanges changes;
+            for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); it++)
+                changes.vFileInfo.push_back(make_pair(*it, vinfoBlockFile[*it]));
+            if (!setDirtyFileInfo.empty())
+                changes.nLastBlockFile = nLastBlockFile;
+            setDirtyFileInfo.clear();
+            changes.vBlockIndex.reserve(setDirtyBlockIndex.size());
+            BOOST_FOREACH (CBlockIndex* pindex, setDirtyBlockIndex)
+                changes.vBlockIndex.push_back(CDiskBlockIndex(pindex));
+            setDirtyBlockIndex.clear();
+            // Update best block in wallet (so we can detect restored wallets), once all of it is written.
+            if (mode != FLUSH_STATE_IF_NEEDED)
+                changes.locator = chainActive.GetLocator();
+            pcoinsWriteBehind->SetBlockTreeChanges(changes);
+            // Finally hand over the chainstate (which may refer to block index entries); validation goes
+            // on with an empty cache while it is written.
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
-            // Update best block in wallet (so we can detect restored wallets).
-            if (mode != FLUSH_STATE_IF_NEEDED) {
-                GetMainSignals().SetBestChain(chainActive.GetLocator());
-            }
+            // Shutdown and readers of the databases themselves need everything on disk
+            if (mode == FLUSH_STATE_ALWAYS && !pcoinsWriteBehind->Sync())
+                return state.Abort("Failed to write to coin database");
             nLastWrite = GetTimeMicros();
         }
     } catch (const std::runtime_error& e) {
@@ -3380,6 +4061,7 @@ void FlushStateToDisk()
 void static UpdateTip(CBlockIndex* pindexNew)
 {
     chainActive.SetTip(pindexNew);
+    masternodeBlockHashes.SetTip(pindexNew);
 
     // If turned on AutoZeromint will automatically convert DON to zDON
     if (pwalletMain->isZeromintEnabled ())
@@ -3389,10 +4071,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -3536,6 +4218,10 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
         SyncWithWallets(tx, pblock);
     }
 
+    // Blocks just connected are the ones read next, by staking, accumulators and notifications
+    if (blockCache.GetStats().nMaxUsage > 0)
+        blockCache.Insert(pindexNew->GetBlockHash(), CBlockRef(new CBlock(*pblock)));
+
     int64_t nTime6 = GetTimeMicros();
     nTimePostConnect += nTime6 - nTime5;
     nTimeTotal += nTime6 - nTime1;
@@ -3911,8 +4597,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.New(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3933,9 +4618,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
         // ppcoin: compute stake entropy bit for stake modifier
         if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
@@ -4186,15 +4868,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
-                BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                            mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
-                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString(), tx.GetHash().ToString());
-                            return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
-                                REJECT_INVALID, "conflicting-tx-ix");
-                        }
-                    }
+                uint256 hashLockTx;
+                if (FindConflictingLock(tx, hashLockTx)) {
+                    mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
+                    LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", hashLockTx.ToString(), tx.GetHash().ToString());
+                    return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
+                        REJECT_INVALID, "conflicting-tx-ix");
                 }
             }
         }
@@ -4273,7 +4952,7 @@ bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
 
     unsigned int nBitsRequired = GetNextWorkRequired(pindexPrev, &block);
 
-    if (block.IsProofOfWork() && (pindexPrev == NULL || pindexPrev->nHeight + 1 <= 68589)) {
+    if (block.IsProofOfWork() && (pindexPrev == NULL || pindexPrev->nHeight + 1 <= DGW_TOLERANT_WORK_HEIGHT)) {
         double n1 = ConvertBitsToDouble(block.nBits);
         double n2 = ConvertBitsToDouble(nBitsRequired);
 
@@ -4590,11 +5269,52 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
+/**
+ * Forward a block that passed AcceptBlock to up to -earlyblockrelay peers asking for early blocks,
+ * outbound peers first, before it is connected. Peers get it as "earlyblock" and will not hold it
+ * against us if it fails to connect; the regular announcement follows once it becomes our tip.
+ */
+void static RelayBlockEarly(const CBlock& block, CNode* pfrom)
+{
+    int nPeers = std::min((int)GetArg("-earlyblockrelay", DEFAULT_EARLY_BLOCK_RELAY_PEERS), MAX_EARLY_BLOCK_RELAY_PEERS);
+    if (nPeers <= 0)
+        return;
+
+    CInv inv(MSG_BLOCK, block.GetHash());
+    vector<CNode*> vRelayTo;
+    {
+        LOCK(cs_vNodes);
+        for (int nPass = 0; nPass < 2; nPass++) {
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if ((int)vRelayTo.size() >= nPeers)
+                    break;
+                if (pnode->fInbound != (nPass == 1) || pnode == pfrom || pnode->fDisconnect ||
+                    !pnode->fSuccessfullyConnected || !(pnode->nServices & NODE_EARLY_BLOCKS))
+                    continue;
+                {
+                    LOCK(pnode->cs_inventory);
+                    if (pnode->filterInventoryKnown.contains(inv.GetKey()))
+                        continue;
+                }
+                pnode->AddRef();
+                vRelayTo.push_back(pnode);
+            }
+        }
+    }
+
+    BOOST_FOREACH (CNode* pnode, vRelayTo) {
+        LogPrint("net", "early relay of block %s to peer=%d\n", inv.hash.ToString(), pnode->id);
+        pnode->AddInventoryKnown(inv);
+        pnode->PushMessage("earlyblock", block);
+        pnode->Release();
+    }
+}
+
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp, bool fMayBan, bool fPrechecked)
 {
     // Preliminary checks
     int64_t nStartTime = GetTimeMillis();
-    bool checked = CheckBlock(*pblock, state);
+    bool checked = CheckBlock(*pblock, state, true, !fPrechecked);
 
     int nMints = 0;
     int nSpends = 0;
@@ -4620,7 +5340,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     //    return error("ProcessNewBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, pblock->GetHash().ToString().c_str());
 
     // NovaCoin: check proof-of-stake block signature
-    if (!pblock->CheckBlockSignature())
+    if (!fPrechecked && !pblock->CheckBlockSignature())
         return error("ProcessNewBlock() : bad proof-of-stake block signature");
 
     if (pblock->GetHash() != Params().HashGenesisBlock() && pfrom != NULL) {
@@ -4632,6 +5352,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         }
     }
 
+    bool fEarlyRelay = false;
     {
         LOCK(cs_main);   // Replaces the former TRY_LOCK loop because busy waiting wastes too much resources
 
@@ -4644,13 +5365,21 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         CBlockIndex* pindex = NULL;
         bool ret = AcceptBlock (*pblock, state, &pindex, dbp, checked);
         if (pindex && pfrom) {
-            mapBlockSource[pindex->GetBlockHash ()] = pfrom->GetId ();
+            mapBlockSource[pindex->GetBlockHash ()] = std::make_pair(pfrom->GetId (), fMayBan);
         }
         CheckBlockIndex ();
         if (!ret)
             return error ("%s : AcceptBlock FAILED", __func__);
+
+        // Header, block signature and proof of stake are good; only a block on top of our fully
+        // validated tip is passed on, so an invalid block can never drag a chain of others along
+        fEarlyRelay = pindex && dbp == NULL && pindex->pprev == chainActive.Tip() &&
+                      !(pindex->nStatus & BLOCK_FAILED_MASK) && !IsInitialBlockDownload();
     }
 
+    if (fEarlyRelay)
+        RelayBlockEarly(*pblock, pfrom);
+
     if (!ActivateBestChain(state, pblock, checked))
         return error("%s : ActivateBestChain failed", __func__);
 
@@ -4763,6 +5492,122 @@ boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char
     return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
 }
 
+// Mappings of block and undo files by prefix and file number, with the last time they were used.
+// A file is mapped again when a read goes past its mapping, as happens while it is appended to.
+struct CMappedDiskFile {
+    boost::shared_ptr<CMappedFile> file;
+    int64_t nLastUsed;
+};
+static CCriticalSection cs_mappedFiles;
+static std::map<std::pair<std::string, int>, CMappedDiskFile> mapMappedFiles;
+static int64_t nMappedFilesUsed = 0;
+// Block files take up to MAX_BLOCKFILE_SIZE of address space each, which 32-bit systems are short of
+static const size_t MAX_MAPPED_FILES = sizeof(void*) == 4 ? 4 : 64;
+// A header with the accumulator checkpoint of version 4 and later
+static const size_t MAX_BLOCK_HEADER_SIZE = 112;
+
+/** Mapping of the file of pos covering at least its first nEnd bytes, null if there is none */
+static boost::shared_ptr<CMappedFile> GetMappedFile(const CDiskBlockPos& pos, const char* prefix, uint64_t nEnd)
+{
+    LOCK(cs_mappedFiles);
+    std::pair<std::string, int> key(prefix, pos.nFile);
+    std::map<std::pair<std::string, int>, CMappedDiskFile>::iterator it = mapMappedFiles.find(key);
+    if (it == mapMappedFiles.end() || it->second.file->size() < nEnd) {
+        boost::shared_ptr<CMappedFile> file(new CMappedFile(GetBlockPosFilename(pos, prefix)));
+        if (file->IsNull() || file->size() < nEnd) {
+            if (it != mapMappedFiles.end())
+                mapMappedFiles.erase(it);
+            return boost::shared_ptr<CMappedFile>();
+        }
+
+        if (it == mapMappedFiles.end()) {
+            // Drop the least recently used mapping; views still using it keep it alive
+            if (mapMappedFiles.size() >= MAX_MAPPED_FILES) {
+                std::map<std::pair<std::string, int>, CMappedDiskFile>::iterator itOldest = mapMappedFiles.begin();
+                for (std::map<std::pair<std::string, int>, CMappedDiskFile>::iterator itMapped = mapMappedFiles.begin(); itMapped != mapMappedFiles.end(); ++itMapped)
+                    if (itMapped->second.nLastUsed < itOldest->second.nLastUsed)
+                        itOldest = itMapped;
+                mapMappedFiles.erase(itOldest);
+            }
+            it = mapMappedFiles.insert(std::make_pair(key, CMappedDiskFile())).first;
+        }
+        it->second.file = file;
+    }
+    it->second.nLastUsed = ++nMappedFilesUsed;
+    return it->second.file;
+}
+
+/** Forget the mappings of file nFile, for when it is truncated */
+static void UnmapDiskFiles(int nFile)
+{
+    LOCK(cs_mappedFiles);
+    mapMappedFiles.erase(std::make_pair(std::string("blk"), nFile));
+    mapMappedFiles.erase(std::make_pair(std::string("rev"), nFile));
+}
+
+/**
+ * View the record at pos of a block or undo file: the size written in front of it tells its length,
+ * nExtra more bytes following it (the checksum of undo data) are included. The bytes are viewed in
+ * the mapped file, or read into the view where the file cannot be mapped.
+ */
+static bool ReadDiskData(CDiskDataView& view, const CDiskBlockPos& pos, const char* prefix, unsigned int nExtra)
+{
+    view.SetNull();
+    if (pos.IsNull() || pos.nPos < sizeof(unsigned int))
+        return error("%s : invalid position %d:%u in %s files", __func__, pos.nFile, pos.nPos, prefix);
+
+    boost::shared_ptr<CMappedFile> file = GetMappedFile(pos, prefix, pos.nPos);
+    if (file) {
+        unsigned int nSize;
+        memcpy(&nSize, file->data() + pos.nPos - sizeof(nSize), sizeof(nSize));
+        uint64_t nEnd = (uint64_t)pos.nPos + nSize + nExtra;
+        if (nEnd > file->size())
+            file = GetMappedFile(pos, prefix, nEnd);
+        if (!file)
+            return error("%s : record of %u bytes at %s%05u.dat:%u is past the end of the file", __func__, nSize, prefix, pos.nFile, pos.nPos);
+        view.SetMapped(file, file->data() + pos.nPos, nSize + nExtra);
+        return true;
+    }
+
+    CAutoFile filein(OpenDiskFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(unsigned int)), prefix, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenDiskFile failed", __func__);
+    try {
+        unsigned int nSize;
+        filein >> nSize;
+        if (nSize > MAX_BLOCKFILE_SIZE)
+            return error("%s : invalid record size %u at %s%05u.dat:%u", __func__, nSize, prefix, pos.nFile, pos.nPos);
+        std::vector<char> vData(nSize + nExtra);
+        if (!vData.empty())
+            filein.read(&vData[0], vData.size());
+        view.SetBuffer(vData);
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CDiskDataView& view, const CBlockIndex* pindex)
+{
+    if (!ReadDiskData(view, pindex->GetBlockPos(), "blk", 0))
+        return error("ReadRawBlockFromDisk : reading block %s failed", pindex->GetBlockHash().ToString());
+
+    // Only the header is deserialized, to be sure the bytes are the block of the index
+    CBlockHeader header;
+    try {
+        CDataStream ssHeader(view.begin(), view.begin() + std::min(view.size(), MAX_BLOCK_HEADER_SIZE), SER_DISK, CLIENT_VERSION);
+        ssHeader >> header;
+    } catch (std::exception& e) {
+        view.SetNull();
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    if (header.GetHash() != pindex->GetBlockHash()) {
+        view.SetNull();
+        return error("ReadRawBlockFromDisk : GetHash() doesn't match index for %s", pindex->GetBlockHash().ToString());
+    }
+    return true;
+}
+
 CBlockIndex* InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -4774,9 +5619,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.New();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
     //mark as PoS seen
@@ -4790,8 +5633,10 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
 
 bool static LoadBlockIndexDB(string& strError)
 {
+    int64_t nStart = GetTimeMillis();
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
+    LogPrintf("%s : loaded %u block index entries of %u bytes in %dms\n", __func__, mapBlockIndex.size(), sizeof(CBlockIndex), GetTimeMillis() - nStart);
 
     boost::this_thread::interruption_point();
 
@@ -4949,6 +5794,7 @@ bool static LoadBlockIndexDB(string& strError)
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    masternodeBlockHashes.SetTip(it->second);
 
     PruneBlockIndexCandidates();
 
@@ -5010,7 +5856,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -5052,6 +5898,7 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    masternodeBlockHashes.SetTip(NULL);
     pindexBestInvalid = NULL;
 }
 
@@ -5111,43 +5958,30 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+    {
+        // This takes over fileIn and calls fclose() on it when it goes out of scope. Blocks are read,
+        // decoded and their merkle root and signature verified ahead in other threads; they are
+        // checked and connected here in file order.
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_IMPORT_CHECK_THREADS));
+        CBlockImportPipeline pipeline(fileIn, nThreads);
+        boost::shared_ptr<CImportedBlock> pimport;
+        while (pipeline.Next(pimport)) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+            if (dbp)
+                dbp->nPos = pimport->nPos;
+            if (!pimport->fDecoded) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, pimport->strError);
+                // scan again from one byte into the header, in case it was not a block
+                pipeline.Rewind(pimport->nPos - MESSAGE_START_SIZE - sizeof(unsigned int) + 1);
+                continue;
             }
+            // scanning goes on right after the block, not where its header said it ends
+            if (pimport->nDecodedSize != pimport->nSize)
+                pipeline.Rewind(pimport->nPos + pimport->nDecodedSize);
+
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                CBlock& block = pimport->block;
 
                 // detect out of order blocks, and store them for later
                 uint256 hash = block.GetHash();
@@ -5162,7 +5996,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                 // process in case the block isn't known yet
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
                     CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
+                    if (ProcessNewBlock(state, NULL, &block, dbp, true, pimport->fPrechecked))
                         nLoaded++;
                     if (state.IsError())
                         break;
@@ -5196,8 +6030,10 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
-    } catch (std::runtime_error& e) {
-        AbortNode(std::string("System error: ") + e.what());
+
+        std::string strError = pipeline.GetError();
+        if (!strError.empty())
+            AbortNode(std::string("System error: ") + strError);
     }
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
@@ -5425,44 +6261,36 @@ bool static AlreadyHave(const CInv& inv)
         return mapTxLockVote.count(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
-    case MSG_MASTERNODE_WINNER:
-        if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
+    // The masternode maps belong to the masternode message lanes, which may hold their locks while
+    // waiting for cs_main. If a lane has them, the item is asked for again and the lane sorts it out.
+    case MSG_MASTERNODE_WINNER: {
+        TRY_LOCK(cs_mapMasternodePayeeVotes, lockVotes);
+        if (lockVotes && masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
             masternodeSync.AddedMasternodeWinner(inv.hash);
             return true;
         }
         return false;
+    }
     case MSG_BUDGET_VOTE:
-        if (budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) {
-            masternodeSync.AddedBudgetItem(inv.hash);
-            return true;
-        }
-        return false;
     case MSG_BUDGET_PROPOSAL:
-        if (budget.mapSeenMasternodeBudgetProposals.count(inv.hash)) {
-            masternodeSync.AddedBudgetItem(inv.hash);
-            return true;
-        }
-        return false;
     case MSG_BUDGET_FINALIZED_VOTE:
-        if (budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) {
-            masternodeSync.AddedBudgetItem(inv.hash);
-            return true;
-        }
-        return false;
-    case MSG_BUDGET_FINALIZED:
-        if (budget.mapSeenFinalizedBudgets.count(inv.hash)) {
+    case MSG_BUDGET_FINALIZED: {
+        TRY_LOCK(cs_budget, lockBudget);
+        if (!lockBudget)
+            return false;
+        if ((inv.type == MSG_BUDGET_VOTE && budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) ||
+            (inv.type == MSG_BUDGET_PROPOSAL && budget.mapSeenMasternodeBudgetProposals.count(inv.hash)) ||
+            (inv.type == MSG_BUDGET_FINALIZED_VOTE && budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) ||
+            (inv.type == MSG_BUDGET_FINALIZED && budget.mapSeenFinalizedBudgets.count(inv.hash))) {
             masternodeSync.AddedBudgetItem(inv.hash);
             return true;
         }
         return false;
+    }
     case MSG_MASTERNODE_ANNOUNCE:
-        if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
-            masternodeSync.AddedMasternodeList(inv.hash);
-            return true;
-        }
-        return false;
+        return mnodeman.AlreadyHaveBroadcast(inv.hash);
     case MSG_MASTERNODE_PING:
-        return mnodeman.mapSeenMasternodePing.count(inv.hash);
+        return mnodeman.AlreadyHavePing(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -5506,14 +6334,18 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    if (inv.type == MSG_BLOCK) {
+                        // Send the block as stored on disk, it serializes the same for the network
+                        CDiskDataView view;
+                        if (!ReadRawBlockFromDisk(view, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage("block", CFlatData(const_cast<char*>(view.begin()), const_cast<char*>(view.end())));
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -5524,10 +6356,11 @@ void static ProcessGetData(CNode* pfrom)
                             // they must either disconnect and retry or request the full block.
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
+                            // They go out on the merkleblock's queue, so they cannot fall behind the next merkleblock
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                                if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second).GetKey()))
+                                    pfrom->PushMessageWithPriority(GetSendPriority("merkleblock"), "tx", block.vtx[pair.first]);
                         }
                         // else
                         // no response
@@ -5702,6 +6535,55 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
+/** Validate a block whose parent we know, received in full or rebuilt from a compact block. */
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block, bool fMayBan = true)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    if (!mapBlockIndex.count(hashBlock)) {
+        ProcessNewBlock(state, pfrom, &block, NULL, fMayBan);
+        int nDoS;
+        if(state.IsInvalid(nDoS)) {
+            pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+            if(nDoS > 0) {
+                TRY_LOCK(cs_main, lockMain);
+                // An early block that got stored passed the checks its sender made, it failed while connecting
+                BlockMap::iterator mi = lockMain ? mapBlockIndex.find(hashBlock) : mapBlockIndex.end();
+                bool fStored = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                if(lockMain && (fMayBan || !fStored)) Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+        {
+            // A header chain through a block we could not accept will not get any further
+            LOCK(cs_main);
+            if (!mapBlockIndex.count(hashBlock) && headerChain.mapHeights.count(hashBlock))
+                FailHeaderChain(state.IsInvalid() && !state.CorruptionPossible() ? 100 : 0);
+            mapCompactBlocksInFlight.erase(hashBlock);
+        }
+        ProcessHeaderChainBlocks(hashBlock);
+        //disconnect this node if its old protocol version
+        pfrom->DisconnectOldProtocol(ActiveProtocol(), "block");
+    } else {
+        LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, hashBlock.GetHex());
+    }
+}
+
+/** Hand a message to the masternode, budget, spork and SwiftX extensions. */
+void static ProcessMasternodeMessage(CNode* pfrom, string& strCommand, CDataStream& vRecv)
+{
+    obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
+    mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+    budget.ProcessMessage(pfrom, strCommand, vRecv);
+    masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
+    ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
+    ProcessSpork(pfrom, strCommand, vRecv);
+    masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -5880,7 +6762,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the filterAddrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -5943,9 +6825,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    // Headers-first sync in progress: blocks of the header chain are scheduled by SendMessages.
+                    // Anything else is fetched as usual, so a header chain nobody delivers cannot hold up block relay.
+                    map<uint256, int>::const_iterator it = headerChain.mapHeights.find(inv.hash);
+                    if (!headerChain.IsNull() && it == headerChain.mapHeights.end())
+                        State(pfrom->GetId())->fHeadersMore = true;
+                    if (it != headerChain.mapHeights.end()) {
+                        CNodeState* nodestate = State(pfrom->GetId());
+                        nodestate->nHeaderChainHeight = std::max(nodestate->nHeaderChainHeight, it->second);
+                    } else if (CanRequestCompactBlock(pfrom, inv.hash)) {
+                        CompactBlockInFlight& inFlight = mapCompactBlocksInFlight[inv.hash];
+                        inFlight.nodeid = pfrom->GetId();
+                        inFlight.nTime = GetTime();
+                        pfrom->PushMessage("getcmpct", inv.hash);
+                        LogPrint("net", "getcmpct %s to peer=%d\n", inv.hash.ToString(), pfrom->id);
+                    } else if (!mapCompactBlocksInFlight.count(inv.hash)) {
+                        // Add this to the list of blocks to request
+                        vToFetch.push_back(inv);
+                        LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
                 }
             }
 
@@ -5984,7 +6882,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks" || (strCommand == "getheaders" && pfrom->nVersion < HEADERS_FIRST_VERSION)) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -6016,7 +6914,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -6212,7 +7110,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
+    else if (strCommand == "headers" && !fImporting && !fReindex) // Ignore headers received while importing
     {
         std::vector<CBlockHeader> headers;
 
@@ -6231,45 +7129,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
+        CNodeState* nodestate = State(pfrom->GetId());
+        if (nodestate->nHeadersRequestTime == 0) {
+            // Only the peers we asked may shape the header chain
+            LogPrint("net", "Unrequested headers from peer=%d, ignoring\n", pfrom->id);
+            return true;
+        }
+        nodestate->nHeadersRequestTime = 0;
+
         if (nCount == 0) {
             // Nothing interesting. Stop asking this peers for more headers.
             return true;
         }
-        CBlockIndex* pindexLast = NULL;
-        BOOST_FOREACH (const CBlockHeader& header, headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                Misbehaving(pfrom->GetId(), 20);
-                LogPrintf("%s: misbehaving peer: non-continuous headers sequence", __func__);
-                return error("non-continuous headers sequence");
-            }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
-                int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
-                    return error(strError.c_str());
-                }
-            }
+        CValidationState state;
+        int nNew = 0;
+        if (!AcceptHeaderChain(pfrom->GetId(), headers, state, nNew)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+            return error("invalid headers received from peer=%d", pfrom->id);
         }
 
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
-
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
-        }
+        if (nNew > 0)
+            LogPrint("net", "Header chain extended by %d to height %d by peer=%d\n", nNew, headerChain.Height(), pfrom->id);
 
-        CheckBlockIndex();
+        // Headers message had its maximum size; the peer may have more headers. SendMessages asks for them
+        // as long as the header chain is not too far ahead of the blocks.
+        nodestate->fHeadersMore = (nCount == MAX_HEADERS_RESULTS && nNew > 0);
     }
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
@@ -6280,8 +7167,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_BLOCK, hashBlock);
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
-        //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
+        bool fHeaderChainBlock = false;
         if (!mapBlockIndex.count(block.hashPrevBlock)) {
+            // Header chain blocks downloaded out of order are kept until their parent arrives
+            LOCK(cs_main);
+            fHeaderChainBlock = !headerChain.IsNull() && StashHeaderChainBlock(pfrom->GetId(), block);
+            if (!fHeaderChainBlock)
+                MarkBlockAsReceived(hashBlock);
+        }
+
+        if (fHeaderChainBlock) {
+            pfrom->AddInventoryKnown(inv);
+        } else if (!mapBlockIndex.count(block.hashPrevBlock)) {
+            //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
             if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
@@ -6292,26 +7190,172 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->vBlockRequested.push_back(hashBlock);
             }
         } else {
-            pfrom->AddInventoryKnown(inv);
+            ProcessReceivedBlock(pfrom, block);
+        }
+    }
 
-            CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
-                int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+
+    else if (strCommand == "earlyblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        // The lenient treatment of early blocks is only for peers that both sides agreed to get them from
+        if (!(nLocalServices & NODE_EARLY_BLOCKS) || !(pfrom->nServices & NODE_EARLY_BLOCKS)) {
+            LogPrint("net", "unrequested early block from peer=%d\n", pfrom->id);
+            Misbehaving(pfrom->GetId(), 20);
+            return false;
+        }
+
+        CBlock block;
+        vRecv >> block;
+        uint256 hashBlock = block.GetHash();
+        LogPrint("net", "received early block %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        // Only useful on top of what we have; anything else arrives through the regular announcement
+        bool fConnects;
+        {
+            LOCK(cs_main);
+            fConnects = mapBlockIndex.count(block.hashPrevBlock) && headerChain.IsNull();
+        }
+        if (fConnects)
+            ProcessReceivedBlock(pfrom, block, false);
+    }
+
+
+    else if (strCommand == "getcmpct") {
+        uint256 hashBlock;
+        vRecv >> hashBlock;
+
+        CBlock block;
+        bool fCompact = false;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA) || !ReadBlockFromDisk(block, mi->second)) {
+                LogPrint("net", "getcmpct for unknown block %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+                pfrom->PushMessage("notfound", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+                return true;
+            }
+            // Old blocks are not in anybody's mempool any more
+            fCompact = chainActive.Height() - mi->second->nHeight <= MAX_CMPCTBLOCK_DEPTH;
+        }
+
+        if (fCompact)
+            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block, GetRand(std::numeric_limits<uint64_t>::max())));
+        else
+            pfrom->PushMessage("block", block);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA) || !ReadBlockFromDisk(block, mi->second)) {
+                LogPrint("net", "getblocktxn for unknown block %s peer=%d\n", req.blockhash.ToString(), pfrom->id);
+                return true;
+            }
+        }
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("%s : getblocktxn with out-of-bounds index %u from peer=%d", __func__, req.indexes[i], pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+        LogPrint("net", "received compact block %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            map<uint256, CompactBlockInFlight>::iterator it = mapCompactBlocksInFlight.find(hashBlock);
+            if (it == mapCompactBlocksInFlight.end() || it->second.nodeid != pfrom->GetId()) {
+                LogPrint("net", "%s : Unrequested compact block %s, ignoring\n", __func__, hashBlock.GetHex());
+                return true;
+            }
+            if (mapBlockIndex.count(hashBlock)) {
+                mapCompactBlocksInFlight.erase(it);
+                return true;
+            }
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // Let the full block take the usual way of asking for its ancestors
+                RequestFullBlock(pfrom, hashBlock);
+                return true;
+            }
+
+            ReadStatus status = it->second.partialBlock.InitData(cmpctblock, mempool);
+            if (status == READ_STATUS_INVALID) {
+                mapCompactBlocksInFlight.erase(it);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("%s : invalid compact block %s from peer=%d", __func__, hashBlock.GetHex(), pfrom->id);
+            }
+            if (status == READ_STATUS_FAILED) {
+                RequestFullBlock(pfrom, hashBlock);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            req.blockhash = hashBlock;
+            req.indexes = it->second.partialBlock.GetMissingIndexes();
+            if (!req.indexes.empty()) {
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            status = it->second.partialBlock.FillBlock(block, vector<CTransaction>());
+            if (status != READ_STATUS_OK) {
+                RequestFullBlock(pfrom, hashBlock);
+                return true;
             }
+            mapCompactBlocksInFlight.erase(it);
         }
+
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            map<uint256, CompactBlockInFlight>::iterator it = mapCompactBlocksInFlight.find(resp.blockhash);
+            if (it == mapCompactBlocksInFlight.end() || it->second.nodeid != pfrom->GetId() || it->second.partialBlock.header.IsNull()) {
+                LogPrint("net", "%s : Unrequested block transactions for %s, ignoring\n", __func__, resp.blockhash.GetHex());
+                return true;
+            }
+
+            ReadStatus status = it->second.partialBlock.FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                mapCompactBlocksInFlight.erase(it);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("%s : peer=%d sent the wrong number of transactions for block %s", __func__, pfrom->id, resp.blockhash.GetHex());
+            }
+            if (status == READ_STATUS_FAILED) {
+                RequestFullBlock(pfrom, resp.blockhash);
+                return true;
+            }
+            mapCompactBlocksInFlight.erase(it);
+        }
+
+        ProcessReceivedBlock(pfrom, block);
     }
 
 
@@ -6533,13 +7577,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
     } else {
         //probably one the extensions
-        obfuScationPool.ProcessMessageObfuscation(pfrom, strCommand, vRecv);
-        mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
-        budget.ProcessMessage(pfrom, strCommand, vRecv);
-        masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
-        ProcessSpork(pfrom, strCommand, vRecv);
-        masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
+        ProcessMasternodeMessage(pfrom, strCommand, vRecv);
     }
 
 
@@ -6560,6 +7598,176 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT;
 }
 
+/** Run one message through its handler, turning parse errors into reject messages. */
+bool static HandleMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, bool fMasternodeLane)
+{
+    unsigned int nMessageSize = vRecv.size();
+    int64_t nTimeStart = GetTimeMicros();
+    bool fRet = false;
+    try {
+        if (fMasternodeLane) {
+            ProcessMasternodeMessage(pfrom, strCommand, vRecv);
+            fRet = true;
+        } else
+            fRet = ProcessMessage(pfrom, strCommand, vRecv, nTimeReceived);
+        boost::this_thread::interruption_point();
+    } catch (std::ios_base::failure& e) {
+        pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
+        if (strstr(e.what(), "end of data")) {
+            // Allow exceptions from under-length message on vRecv
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
+        } else if (strstr(e.what(), "size too large")) {
+            // Allow exceptions from over-long size
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
+        } else {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+    } catch (boost::thread_interrupted) {
+        throw;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+
+    pfrom->RecordMessageRecv(strCommand, nMessageSize + CMessageHeader::HEADER_SIZE, GetTimeMicros() - nTimeStart);
+
+    if (!fRet)
+        LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
+
+    return fRet;
+}
+
+/**
+ * Masternode-layer messages (list, pings, winners, budget votes) are expensive to check
+ * for their signatures. They are handed to a small pool of lanes so the message handler
+ * thread can keep up with blocks and transactions. A peer always maps to the same lane,
+ * which keeps its messages in order.
+ *
+ * Lanes run concurrently with ConnectTip, so whatever a lane reads of the coins or the
+ * chain it reads under TRY_LOCK(cs_main), as the mnb and dsee collateral checks do.
+ * Budget proposals and finalized budgets check their collateral with cs_main taken while
+ * the budget locks are held, the reverse of the order block connection takes them in, so
+ * they stay on the message handler thread together with sporks, SwiftX and obfuscation.
+ */
+static const char* pszMasternodeLaneCommands[] = {"mnb", "don", "dseg", "dsee", "dseep", "mnget", "mnw",
+    "mnvs", "mvote", "fbvote", "ssc"};
+static const set<string> setMasternodeLaneCommands(pszMasternodeLaneCommands,
+    pszMasternodeLaneCommands + ARRAYLEN(pszMasternodeLaneCommands));
+
+struct CLaneMessage {
+    CNode* pnode;
+    string strCommand;
+    CDataStream vRecv;
+    int64_t nTimeReceived;
+    unsigned int nSize;
+
+    CLaneMessage() : pnode(NULL), vRecv(SER_NETWORK, PROTOCOL_VERSION), nTimeReceived(0), nSize(0) {}
+};
+
+struct CMessageLane {
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CLaneMessage> queue;
+    map<NodeId, size_t> mapQueuedBytes;
+    //! Peers whose message handling waits for this lane (CNode::fLaneBlocked set)
+    set<NodeId> setBlocked;
+};
+
+static std::vector<CMessageLane*> vMasternodeLanes;
+
+void InitMasternodeMessageLanes(int nLanes)
+{
+    assert(vMasternodeLanes.empty());
+    for (int i = 0; i < nLanes; i++)
+        vMasternodeLanes.push_back(new CMessageLane());
+}
+
+/** Queue a message on the peer's lane. Returns false, and marks the peer, when its lane is full. */
+bool static QueueMasternodeMessage(CNode* pfrom, const string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CMessageLane* lane = vMasternodeLanes[pfrom->GetId() % vMasternodeLanes.size()];
+    {
+        boost::unique_lock<boost::mutex> lock(lane->mutex);
+        size_t& nQueuedBytes = lane->mapQueuedBytes[pfrom->GetId()];
+        if (nQueuedBytes >= ReceiveFloodSize()) {
+            lane->setBlocked.insert(pfrom->GetId());
+            pfrom->fLaneBlocked = true; // caller holds cs_vRecvMsg
+            return false;
+        }
+        nQueuedBytes += vRecv.size();
+
+        lane->queue.push_back(CLaneMessage());
+        CLaneMessage& msg = lane->queue.back();
+        msg.pnode = pfrom;
+        msg.strCommand = strCommand;
+        std::swap(msg.vRecv, vRecv);
+        msg.vRecv.SetVersion(pfrom->nVersion);
+        msg.nTimeReceived = nTimeReceived;
+        msg.nSize = msg.vRecv.size();
+    }
+    {
+        // released by the lane thread once the message is handled
+        LOCK(cs_vNodes);
+        pfrom->AddRef();
+    }
+    lane->cond.notify_one();
+    return true;
+}
+
+void ThreadMasternodeMessages(int nLane)
+{
+    RenameThread(strprintf("donate-mnmsg%d", nLane).c_str());
+    CMessageLane* lane = vMasternodeLanes[nLane];
+
+    while (true) {
+        CLaneMessage msg;
+        {
+            boost::unique_lock<boost::mutex> lock(lane->mutex);
+            while (lane->queue.empty())
+                lane->cond.wait(lock);
+            std::swap(msg.pnode, lane->queue.front().pnode);
+            msg.strCommand.swap(lane->queue.front().strCommand);
+            std::swap(msg.vRecv, lane->queue.front().vRecv);
+            msg.nTimeReceived = lane->queue.front().nTimeReceived;
+            msg.nSize = lane->queue.front().nSize;
+            lane->queue.pop_front();
+        }
+
+        CNode* pfrom = msg.pnode;
+        if (!pfrom->fDisconnect) {
+            if (fDebug)
+                LogPrintf("received: %s (%u bytes) peer=%d lane=%d\n", SanitizeString(msg.strCommand), msg.nSize, pfrom->id, nLane);
+            HandleMessage(pfrom, msg.strCommand, msg.vRecv, msg.nTimeReceived, true);
+        }
+        ReleaseRecvBuffer(msg.vRecv);
+
+        bool fWasBlocked = false;
+        {
+            boost::unique_lock<boost::mutex> lock(lane->mutex);
+            map<NodeId, size_t>::iterator it = lane->mapQueuedBytes.find(pfrom->GetId());
+            if (it != lane->mapQueuedBytes.end()) {
+                it->second -= std::min(it->second, (size_t)msg.nSize);
+                if (it->second == 0)
+                    lane->mapQueuedBytes.erase(it);
+            }
+            fWasBlocked = lane->setBlocked.erase(pfrom->GetId()) > 0;
+        }
+        if (fWasBlocked) {
+            {
+                LOCK(pfrom->cs_vRecvMsg);
+                pfrom->fLaneBlocked = false;
+            }
+            messageHandlerCondition.notify_one();
+        }
+
+        {
+            LOCK(cs_vNodes);
+            pfrom->Release();
+        }
+    }
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -6623,7 +7831,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        const uint256& hash = msg.GetMessageHash();
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum) {
@@ -6632,39 +7840,28 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Process message
-        bool fRet = false;
-        try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
-            boost::this_thread::interruption_point();
-        } catch (std::ios_base::failure& e) {
-            pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
-            if (strstr(e.what(), "end of data")) {
-                // Allow exceptions from under-length message on vRecv
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
-            } else if (strstr(e.what(), "size too large")) {
-                // Allow exceptions from over-long size
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
-            } else {
-                PrintExceptionContinue(&e, "ProcessMessages()");
+        // Masternode-layer messages go to their lane, the handler thread moves on to the next message
+        if (!vMasternodeLanes.empty() && pfrom->nVersion != 0 && setMasternodeLaneCommands.count(strCommand)) {
+            if (!QueueMasternodeMessage(pfrom, strCommand, vRecv, msg.nTime)) {
+                // lane full: leave the message where it is until the lane drained
+                it--;
+                break;
             }
-        } catch (boost::thread_interrupted) {
-            throw;
-        } catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
+            continue;
         }
 
-        if (!fRet)
-            LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
+        // Process message
+        HandleMessage(pfrom, strCommand, vRecv, msg.nTime, false);
 
         break;
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; ++itDone)
+            ReleaseRecvBuffer(itDone->vRecv);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -6710,14 +7907,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!lockMain)
             return true;
 
+        ApplyPendingMisbehavior(pto->GetId());
+
         // Address refresh broadcast
         static int64_t nLastRebroadcast;
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear filterAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->filterAddrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6733,8 +7932,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->filterAddrKnown.contains(addr.GetKey())) {
+                    pto->filterAddrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -6770,16 +7969,33 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pindexBestHeader == NULL)
             pindexBestHeader = chainActive.Tip();
+        TrimHeaderChain();
         bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
         if (!state.fSyncStarted && !pto->fClient && fFetch /*&& !fImporting*/ && !fReindex) {
             // Only actively request headers from a single peer, unless we're close to end of initial download.
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (IsHeadersFirstPeer(pto, state))
+                    PushGetHeaders(pto, state);
+                else
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+            }
+        }
+
+        // Headers-first: keep the header chain ahead of the block download window
+        if (state.fSyncStarted && IsHeadersFirstPeer(pto, state)) {
+            if (state.nHeadersRequestTime != 0) {
+                if (state.nHeadersRequestTime < GetTime() - HEADERS_DOWNLOAD_TIMEOUT) {
+                    // Let another peer take over the sync
+                    LogPrintf("Timeout downloading headers from peer=%d, syncing with getblocks\n", pto->id);
+                    state.nHeadersRequestTime = 0;
+                    state.fHeadersFailed = true;
+                    state.fSyncStarted = false;
+                    nSyncStarted--;
+                }
+            } else if (state.fHeadersMore && (headerChain.IsNull() || headerChain.Height() - chainActive.Height() < MAX_HEADER_CHAIN_AHEAD)) {
+                PushGetHeaders(pto, state);
             }
         }
 
@@ -6800,7 +8016,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.GetKey()))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -6819,13 +8035,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000) {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                pto->filterInventoryKnown.insert(inv.GetKey());
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000) {
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -6866,6 +8080,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 LogPrintf("Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
+            // Headers-first: fetch the header chain from every peer that has its blocks
+            vector<uint256> vHeaderChainToDownload;
+            // the starting height in version is only taken from peers we chose, others have to announce their blocks
+            FindNextHeaderChainBlocksToDownload(pto->GetId(), std::max(state.fPreferredDownload ? pto->nStartingHeight : -1, state.nHeaderChainHeight),
+                MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vHeaderChainToDownload, staller);
+            BOOST_FOREACH (const uint256& hash, vHeaderChainToDownload) {
+                vGetData.push_back(CInv(MSG_BLOCK, hash));
+                MarkBlockAsInFlight(pto->GetId(), hash);
+                LogPrint("net", "Requesting block %s (%d) peer=%d\n", hash.ToString(), headerChain.mapHeights[hash], pto->id);
+            }
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
@@ -6926,24 +8150,26 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+    // View the undo data and the checksum after it in the history file
+    CDiskDataView view;
+    if (!ReadDiskData(view, pos, "rev", sizeof(uint256)))
+        return error("CBlockUndo::ReadFromDisk : reading undo data failed");
+    const char* pchChecksum = view.end() - sizeof(uint256);
 
-    // Read block
+    // Read undo data
     uint256 hashChecksum;
+    memcpy(hashChecksum.begin(), pchChecksum, sizeof(uint256));
     try {
-        filein >> *this;
-        filein >> hashChecksum;
+        CDataStream ssUndo(view.begin(), pchChecksum, SER_DISK, CLIENT_VERSION);
+        ssUndo >> *this;
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
 
-    // Verify checksum
+    // Verify checksum over the bytes as stored, which is what serializing the undo data again gives
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
-    hasher << *this;
+    hasher.write(view.begin(), pchChecksum - view.begin());
     if (hashChecksum != hasher.GetHash())
         return error("CBlockUndo::ReadFromDisk : Checksum mismatch");
 
@@ -6963,10 +8189,8 @@ public:
     ~CMainCleanup()
     {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
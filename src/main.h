@@ -13,9 +13,11 @@
 #endif
 
 #include "amount.h"
+#include "blockcache.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
+#include "mappedfile.h"
 #include "net.h"
 #include "pow.h"
 #include "primitives/block.h"
@@ -45,6 +47,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewWriteBehind;
 class CZerocoinDB;
 class CSporkDB;
 class CBloomFilter;
@@ -90,6 +93,10 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of masternode message threads allowed */
+static const int MAX_MASTERNODE_MESSAGE_THREADS = 8;
+/** -mnmsgthreads default (number of threads handling masternode-layer messages, 0 = message handler thread) */
+static const int DEFAULT_MASTERNODE_MESSAGE_THREADS = 1;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -102,6 +109,18 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** How far (in blocks) the headers-first header chain may run ahead of the active chain before we stop asking for more. */
+static const int MAX_HEADER_CHAIN_AHEAD = 16000;
+/** Timeout in seconds for a peer to answer getheaders before we fall back to getblocks with it. */
+static const int64_t HEADERS_DOWNLOAD_TIMEOUT = 60;
+/** Timeout in seconds after which a header chain whose blocks nobody delivers is dropped. */
+static const int64_t HEADER_CHAIN_STALL_TIMEOUT = 10 * 60;
+/** Maximum serialized size of the header chain blocks kept while their parent is still missing. */
+static const size_t MAX_HEADER_CHAIN_BLOCKS_SIZE = 32 * 1024 * 1024;
+/** Headers of the header chain looked back on to check the next one: the 24 of DarkGravity and one more. */
+static const int HEADER_CONTEXT_DEPTH = 25;
+/** Last height up to which proof-of-work blocks only need a difficulty close to the required one. */
+static const int DGW_TOLERANT_WORK_HEIGHT = 68589;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -109,6 +128,16 @@ static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 
 /** Enable bloom filter */
  static const bool DEFAULT_PEERBLOOMFILTERS = true;
+/** Default for -compactblocks, relay blocks as short transaction ids to peers that support it */
+static const bool DEFAULT_COMPACT_BLOCKS = true;
+/** Seconds a compact block request may stay unanswered before another peer announcing the block is asked */
+static const int64_t COMPACT_BLOCK_TIMEOUT = 10;
+/** Blocks deeper than this below the tip are served in full even when asked for as a compact block */
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+/** Default for -earlyblockrelay, number of peers a new block is forwarded to before it is fully validated */
+static const int DEFAULT_EARLY_BLOCK_RELAY_PEERS = 0;
+/** Upper bound for -earlyblockrelay */
+static const int MAX_EARLY_BLOCK_RELAY_PEERS = 8;
 
 /** "reject" message codes */
 static const unsigned char REJECT_MALFORMED = 0x01;
@@ -141,7 +170,7 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
@@ -158,6 +187,7 @@ extern std::map<uint256, int64_t> mapRejectedBlocks;
 extern std::map<unsigned int, unsigned int> mapHashedBlocks;
 extern std::map<COutPoint, COutPoint> mapInvalidOutPoints;
 extern std::map<CBigNum, CAmount> mapInvalidSerials;
+extern CAmount nFilteredThroughBittrex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
@@ -189,9 +219,11 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @param[in]   pfrom   The node which we are receiving the block from; it is added to mapBlockSource and may be penalised if the block is invalid.
  * @param[in]   pblock  The block we want to process.
  * @param[out]  dbp     If pblock is stored to disk (or already there), this will be set to its location.
+ * @param[in]   fMayBan Whether pfrom may be penalised when pblock fails validation after its header and proof of stake checked out (false for blocks forwarded by early relay).
+ * @param[in]   fPrechecked Whether the merkle root and block signature of pblock were verified already (blocks read ahead on import).
  * @return True if state.IsValid()
  */
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL);
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL, bool fMayBan = true, bool fPrechecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -221,6 +253,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Create nLanes masternode message lanes, to be run by ThreadMasternodeMessages */
+void InitMasternodeMessageLanes(int nLanes);
+/** Run a masternode message lane */
+void ThreadMasternodeMessages(int nLane);
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -370,10 +406,11 @@ int GetZerocoinStartHeight();
 bool IsTransactionInChain(uint256 txId, int& nHeightTx);
 bool IsBlockHashInChain(const uint256& hashBlock);
 void PopulateInvalidOutPointMap();
+/** Load the invalid outpoints stored in the block tree database, computing and storing them if they are missing or stale */
+void InitInvalidOutPointMap();
 bool ValidOutPoint(const COutPoint out, int nHeight);
-void RecalculateZDONSpent();
-void RecalculateZDONMinted();
-bool RecalculateDONSupply(int nHeightStart);
+/** Rebuild the money supply from nHeightStart and the zerocoin supply of the blocks after the zerocoin start, and rewrite their index entries */
+bool RecalculateMoneySupply(int nHeightStart);
 bool ReindexAccumulators(list<uint256>& listMissingCheckpoints, string& strError);
 
 
@@ -411,6 +448,53 @@ public:
     bool ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock);
 };
 
+/**
+ * Invalid outpoints and serials found in the blocks between Zerocoin_Block_FirstFraudulent and
+ * Zerocoin_Block_RecalculateAccumulators. That range is settled history, so the set is computed
+ * once and kept in the block tree database together with the last block it covers.
+ */
+class CInvalidOutPointSet
+{
+public:
+    int nHeight;       // last block scanned
+    uint256 hashBlock; // its hash; the set only applies to a chain containing it
+    std::map<COutPoint, COutPoint> mapOutPoints;
+    std::map<CBigNum, CAmount> mapSerials;
+    CAmount nFilteredThroughBittrex;
+    uint256 hashChecksum; // GetChecksum() when it was written
+
+    CInvalidOutPointSet() { SetNull(); }
+
+    void SetNull()
+    {
+        nHeight = -1;
+        hashBlock = 0;
+        mapOutPoints.clear();
+        mapSerials.clear();
+        nFilteredThroughBittrex = 0;
+        hashChecksum = 0;
+    }
+
+    /** Hash of everything but the checksum */
+    uint256 GetChecksum() const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nHeight);
+        READWRITE(hashBlock);
+        READWRITE(mapOutPoints);
+        READWRITE(mapSerials);
+        READWRITE(nFilteredThroughBittrex);
+        READWRITE(hashChecksum);
+    }
+};
+
+/** Scan the fraudulent range of the active chain into set; false if the chain does not cover it yet or blocks could not be read */
+bool ComputeInvalidOutPoints(CInvalidOutPointSet& set);
+
 
 /** 
  * Closure representing one script verification
@@ -451,6 +535,10 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Get the block of pindex shared with other readers, from the block cache when it is there; scans over old blocks pass fCacheRead=false so they do not push recent ones out */
+bool ReadBlockFromDisk(CBlockRef& pblock, const CBlockIndex* pindex, bool fCacheRead = true);
+/** View the block of pindex as serialized on disk, in place in the memory-mapped block file where possible; only its header is checked against the index */
+bool ReadRawBlockFromDisk(CDiskDataView& view, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -639,12 +727,18 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** The view below pcoinsTip that writes flushed chainstate from the flush thread */
+extern CCoinsViewWriteBehind* pcoinsWriteBehind;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
 /** Global variable that points to the zerocoin database (protected by cs_main) */
 extern CZerocoinDB* zerocoinDB;
 
+/** Recently read or connected blocks */
+extern CBlockCache blockCache;
+
 /** Global variable that points to the spork database (protected by cs_main) */
 extern CSporkDB* pSporkDB;
 
@@ -0,0 +1,64 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::CMappedFile(const boost::filesystem::path& path) : pdata(NULL), nSize(0)
+{
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            pdata = (const char*)p;
+            nSize = (size_t)st.st_size;
+        }
+    }
+    // The mapping stays valid without the descriptor
+    close(fd);
+#endif
+}
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    if (pdata)
+        munmap((void*)pdata, nSize);
+#endif
+}
+
+void CDiskDataView::SetMapped(const boost::shared_ptr<CMappedFile>& fileIn, const char* pbeginIn, size_t nSizeIn)
+{
+    file = fileIn;
+    std::vector<char>().swap(vBuffer);
+    pbegin = pbeginIn;
+    nSize = nSizeIn;
+}
+
+void CDiskDataView::SetBuffer(std::vector<char>& vData)
+{
+    file.reset();
+    vBuffer.swap(vData);
+    // Never null, so an empty buffer still counts as read
+    pbegin = vBuffer.empty() ? "" : &vBuffer[0];
+    nSize = vBuffer.size();
+}
+
+void CDiskDataView::SetNull()
+{
+    file.reset();
+    std::vector<char>().swap(vBuffer);
+    pbegin = NULL;
+    nSize = 0;
+}
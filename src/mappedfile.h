@@ -0,0 +1,64 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include <stddef.h>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+/**
+ * Read-only memory mapping of a whole file, as long as it was when it got mapped.
+ * Bytes the file gains afterwards are not part of the mapping; map it again to see them.
+ * Only supported on POSIX systems, elsewhere (and for empty files) the mapping stays null
+ * and callers read the file instead.
+ */
+class CMappedFile : private boost::noncopyable
+{
+public:
+    explicit CMappedFile(const boost::filesystem::path& path);
+    ~CMappedFile();
+
+    bool IsNull() const { return pdata == NULL; }
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+
+private:
+    const char* pdata;
+    size_t nSize;
+};
+
+/**
+ * Bytes of a file, either viewed in place in a mapping, which the view keeps alive,
+ * or read into a buffer owned by the view.
+ */
+class CDiskDataView : private boost::noncopyable
+{
+public:
+    CDiskDataView() : pbegin(NULL), nSize(0) {}
+
+    /** View nSizeIn bytes at pbeginIn in the mapping file */
+    void SetMapped(const boost::shared_ptr<CMappedFile>& fileIn, const char* pbeginIn, size_t nSizeIn);
+    /** Take over the bytes in vData */
+    void SetBuffer(std::vector<char>& vData);
+    void SetNull();
+
+    bool IsNull() const { return pbegin == NULL; }
+    bool IsMapped() const { return file.get() != NULL; }
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+
+private:
+    boost::shared_ptr<CMappedFile> file;
+    std::vector<char> vBuffer;
+    const char* pbegin;
+    size_t nSize;
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
@@ -13,11 +13,14 @@
 #include "masternodeman.h"
 #include "obfuscation.h"
 #include "util.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
 CBudgetManager budget;
 CCriticalSection cs_budget;
+/** Changes to budget since budget.dat was last written */
+CCacheJournal budgetJournal("budget.journal", "MasternodeBudget");
 
 std::map<uint256, int64_t> askedForSourceProposalOrBudget;
 std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
@@ -36,6 +39,9 @@ int GetBudgetPaymentCycleBlocks()
 
 bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, std::string& strError, int64_t& nTime, int& nConf)
 {
+    // GetTransaction takes cs_main anyway; holding it throughout covers the block index lookup too
+    LOCK(cs_main);
+
     CTransaction txCollateral;
     uint256 nBlockHash;
     if (!GetTransaction(nTxCollateralHash, txCollateral, nBlockHash, true)) {
@@ -249,6 +255,8 @@ CBudgetDB::CBudgetDB()
 {
     pathDB = GetDataDir() / "budget.dat";
     strMagicMessage = "MasternodeBudget";
+    hashSnapshot = 0;
+    nSnapshotSize = 0;
 }
 
 bool CBudgetDB::Write(const CBudgetManager& objToSave)
@@ -265,11 +273,12 @@ bool CBudgetDB::Write(const CBudgetManager& objToSave)
     uint256 hash = Hash(ssObj.begin(), ssObj.end());
     ssObj << hash;
 
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
+    // write to a temporary file and rename it into place, so a crash can't leave a torn snapshot behind
+    boost::filesystem::path pathTmp(pathDB.string() + ".new");
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -277,7 +286,13 @@ bool CBudgetDB::Write(const CBudgetManager& objToSave)
     } catch (std::exception& e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
+    FileCommit(fileout.Get());
     fileout.fclose();
+    if (!RenameOver(pathTmp, pathDB))
+        return error("%s : Failed to rename %s into place", __func__, pathTmp.string());
+
+    hashSnapshot = hash;
+    nSnapshotSize = ssObj.size();
 
     LogPrint("masternode","Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
 
@@ -325,6 +340,8 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
         error("%s : Checksum mismatch, data corrupted", __func__);
         return IncorrectHash;
     }
+    hashSnapshot = hashIn;
+    nSnapshotSize = fileSize;
 
 
     unsigned char pchMsgTmp[4];
@@ -360,6 +377,8 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
     LogPrint("masternode","Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", objToLoad.ToString());
     if (!fDryRun) {
+        LogPrint("masternode","Budget manager - replaying journal....\n");
+        budgetJournal.Replay(hashIn, fileSize, boost::bind(&CBudgetManager::ApplyJournalRecord, &objToLoad, _1, _2));
         LogPrint("masternode","Budget manager - cleaning....\n");
         objToLoad.CheckAndRemove();
         LogPrint("masternode","Budget manager - result:\n");
@@ -373,6 +392,13 @@ void DumpBudgets()
 {
     int64_t nStart = GetTimeMillis();
 
+    // as long as the journal is small, it already holds everything since the last snapshot
+    if (budgetJournal.IsOpen() && !budgetJournal.NeedsCompaction()) {
+        budgetJournal.Commit();
+        LogPrint("masternode","Budget journal flushed  %dms\n", GetTimeMillis() - nStart);
+        return;
+    }
+
     CBudgetDB budgetdb;
     CBudgetManager tempBudget;
 
@@ -391,13 +417,14 @@ void DumpBudgets()
         }
     }
     LogPrint("masternode","Writting info to budget.dat...\n");
-    budgetdb.Write(budget);
+    budget.WriteSnapshot(budgetdb);
 
     LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
 bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
 {
+    LOCK(cs);
     std::string strError = "";
     if (!finalizedBudget.IsValid(strError)) return false;
 
@@ -406,6 +433,8 @@ bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
     }
 
     mapFinalizedBudgets.insert(make_pair(finalizedBudget.GetHash(), finalizedBudget));
+    fFinalizedBudgetsRankDirty = true;
+    budgetJournal.Append(BUDGET_JOURNAL_FINALIZED, finalizedBudget);
     return true;
 }
 
@@ -423,6 +452,8 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
     }
 
     mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+    fProposalsRankDirty = true;
+    budgetJournal.Append(BUDGET_JOURNAL_PROPOSAL, budgetProposal);
     LogPrint("masternode","CBudgetManager::AddProposal - proposal %s added\n", budgetProposal.GetName ().c_str ());
     return true;
 }
@@ -500,14 +531,19 @@ void CBudgetManager::FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, b
 
     // ------- Grab The Highest Count
 
-    std::map<uint256, CFinalizedBudget>::iterator it = mapFinalizedBudgets.begin();
-    while (it != mapFinalizedBudgets.end()) {
-        CFinalizedBudget* pfinalizedBudget = &((*it).second);
-        if (pfinalizedBudget->GetVoteCount() > nHighestCount &&
-            pindexPrev->nHeight + 1 >= pfinalizedBudget->GetBlockStart() &&
+    // ranked by vote count, so the first budget that pays this height is the highest voted one
+    RankFinalizedBudgets();
+
+    std::vector<CFinalizedBudget*>::iterator it = vecFinalizedBudgetsRanked.begin();
+    while (it != vecFinalizedBudgetsRanked.end()) {
+        CFinalizedBudget* pfinalizedBudget = *it;
+        if (pfinalizedBudget->GetVoteCount() <= nHighestCount) break;
+
+        if (pindexPrev->nHeight + 1 >= pfinalizedBudget->GetBlockStart() &&
             pindexPrev->nHeight + 1 <= pfinalizedBudget->GetBlockEnd() &&
             pfinalizedBudget->GetPayeeAndAmount(pindexPrev->nHeight + 1, payee, nAmount)) {
             nHighestCount = pfinalizedBudget->GetVoteCount();
+            break;
         }
 
         ++it;
@@ -591,20 +627,13 @@ CBudgetProposal* CBudgetManager::FindProposal(uint256 nHash)
 
 bool CBudgetManager::IsBudgetPaymentBlock(int nBlockHeight)
 {
+    LOCK(cs);
+
     int nHighestCount = -1;
     int nFivePercent = mnodeman.CountEnabled(ActiveProtocol()) / 20;
 
-    std::map<uint256, CFinalizedBudget>::iterator it = mapFinalizedBudgets.begin();
-    while (it != mapFinalizedBudgets.end()) {
-        CFinalizedBudget* pfinalizedBudget = &((*it).second);
-        if (pfinalizedBudget->GetVoteCount() > nHighestCount &&
-            nBlockHeight >= pfinalizedBudget->GetBlockStart() &&
-            nBlockHeight <= pfinalizedBudget->GetBlockEnd()) {
-            nHighestCount = pfinalizedBudget->GetVoteCount();
-        }
-
-        ++it;
-    }
+    CFinalizedBudget* pfinalizedBudget = GetHighestVotedFinalizedBudget(nBlockHeight);
+    if (pfinalizedBudget) nHighestCount = pfinalizedBudget->GetVoteCount();
 
     LogPrint("masternode","CBudgetManager::IsBudgetPaymentBlock() - nHighestCount: %lli, 5%% of Masternodes: %lli. Number of budgets: %lli\n", 
               nHighestCount, nFivePercent, mapFinalizedBudgets.size());
@@ -620,22 +649,14 @@ bool CBudgetManager::IsTransactionValid(const CTransaction& txNew, int nBlockHei
     LOCK(cs);
 
     int nHighestCount = 0;
-    int nFivePercent = mnodeman.CountEnabled(ActiveProtocol()) / 20;
-    std::vector<CFinalizedBudget*> ret;
+    int nCountEnabled = mnodeman.CountEnabled(ActiveProtocol());
+    int nFivePercent = nCountEnabled / 20;
 
     // ------- Grab The Highest Count
 
-    std::map<uint256, CFinalizedBudget>::iterator it = mapFinalizedBudgets.begin();
-    while (it != mapFinalizedBudgets.end()) {
-        CFinalizedBudget* pfinalizedBudget = &((*it).second);
-        if (pfinalizedBudget->GetVoteCount() > nHighestCount &&
-            nBlockHeight >= pfinalizedBudget->GetBlockStart() &&
-            nBlockHeight <= pfinalizedBudget->GetBlockEnd()) {
-            nHighestCount = pfinalizedBudget->GetVoteCount();
-        }
-
-        ++it;
-    }
+    CFinalizedBudget* pHighestBudget = GetHighestVotedFinalizedBudget(nBlockHeight);
+    if (pHighestBudget && pHighestBudget->GetVoteCount() > nHighestCount)
+        nHighestCount = pHighestBudget->GetVoteCount();
 
     LogPrint("masternode","CBudgetManager::IsTransactionValid() - nHighestCount: %lli, 5%% of Masternodes: %lli mapFinalizedBudgets.size(): %ld\n", 
               nHighestCount, nFivePercent, mapFinalizedBudgets.size());
@@ -646,15 +667,16 @@ bool CBudgetManager::IsTransactionValid(const CTransaction& txNew, int nBlockHei
 
     // check the highest finalized budgets (+/- 10% to assist in consensus)
 
-    it = mapFinalizedBudgets.begin();
-    while (it != mapFinalizedBudgets.end()) {
-        CFinalizedBudget* pfinalizedBudget = &((*it).second);
+    // ranked by vote count, so we can stop at the first budget below the threshold
+    std::vector<CFinalizedBudget*>::iterator it = vecFinalizedBudgetsRanked.begin();
+    while (it != vecFinalizedBudgetsRanked.end()) {
+        CFinalizedBudget* pfinalizedBudget = *it;
 
-        if (pfinalizedBudget->GetVoteCount() > nHighestCount - mnodeman.CountEnabled(ActiveProtocol()) / 10) {
-            if (nBlockHeight >= pfinalizedBudget->GetBlockStart() && nBlockHeight <= pfinalizedBudget->GetBlockEnd()) {
-                if (pfinalizedBudget->IsTransactionValid(txNew, nBlockHeight)) {
-                    return true;
-                }
+        if (pfinalizedBudget->GetVoteCount() <= nHighestCount - nCountEnabled / 10) break;
+
+        if (nBlockHeight >= pfinalizedBudget->GetBlockStart() && nBlockHeight <= pfinalizedBudget->GetBlockEnd()) {
+            if (pfinalizedBudget->IsTransactionValid(txNew, nBlockHeight)) {
+                return true;
             }
         }
 
@@ -673,7 +695,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetAllProposals()
 
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
-        (*it).second.CleanAndRemove(false);
+        if ((*it).second.CleanAndRemove(false)) fProposalsRankDirty = true;
 
         CBudgetProposal* pbudgetProposal = &((*it).second);
         vBudgetProposalRet.push_back(pbudgetProposal);
@@ -696,25 +718,38 @@ struct sortProposalsByVotes {
     }
 };
 
-//Need to review this function
-std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
+void CBudgetManager::RankProposals()
 {
-    LOCK(cs);
+    AssertLockHeld(cs);
 
-    // ------- Sort budgets by Yes Count
+    if (!fProposalsRankDirty) return;
 
     std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
+    vBudgetPorposalsSort.reserve(mapProposals.size());
 
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
-        (*it).second.CleanAndRemove(false);
         vBudgetPorposalsSort.push_back(make_pair(&((*it).second), (*it).second.GetYeas() - (*it).second.GetNays()));
         ++it;
     }
 
     std::sort(vBudgetPorposalsSort.begin(), vBudgetPorposalsSort.end(), sortProposalsByVotes());
 
-    // ------- Grab The Budgets In Order
+    vecProposalsRanked.clear();
+    vecProposalsRanked.reserve(vBudgetPorposalsSort.size());
+    std::vector<std::pair<CBudgetProposal*, int> >::iterator it2 = vBudgetPorposalsSort.begin();
+    while (it2 != vBudgetPorposalsSort.end()) {
+        vecProposalsRanked.push_back((*it2).first);
+        ++it2;
+    }
+
+    fProposalsRankDirty = false;
+}
+
+//Need to review this function
+std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
+{
+    LOCK(cs);
 
     std::vector<CBudgetProposal*> vBudgetProposalsRet;
 
@@ -722,25 +757,43 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (pindexPrev == NULL) return vBudgetProposalsRet;
 
+    // ------- Drop votes of masternodes we no longer know about, once per block
+
+    if (nVotesCleanedHeight != pindexPrev->nHeight) {
+        std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
+        while (it != mapProposals.end()) {
+            if ((*it).second.CleanAndRemove(false)) fProposalsRankDirty = true;
+            ++it;
+        }
+        nVotesCleanedHeight = pindexPrev->nHeight;
+    }
+
+    // ------- Sort budgets by Yes Count
+
+    RankProposals();
+
+    // ------- Grab The Budgets In Order
+
     int nBlockStart = pindexPrev->nHeight - pindexPrev->nHeight % GetBudgetPaymentCycleBlocks() + GetBudgetPaymentCycleBlocks();
     int nBlockEnd = nBlockStart + GetBudgetPaymentCycleBlocks() - 1;
     CAmount nTotalBudget = GetTotalBudget(nBlockStart);
+    int nTenPercent = mnodeman.CountEnabled(ActiveProtocol()) / 10;
 
 
-    std::vector<std::pair<CBudgetProposal*, int> >::iterator it2 = vBudgetPorposalsSort.begin();
-    while (it2 != vBudgetPorposalsSort.end()) {
-        CBudgetProposal* pbudgetProposal = (*it2).first;
+    std::vector<CBudgetProposal*>::iterator it2 = vecProposalsRanked.begin();
+    while (it2 != vecProposalsRanked.end()) {
+        CBudgetProposal* pbudgetProposal = *it2;
 
         LogPrint("masternode","CBudgetManager::GetBudget() - Processing Budget %s\n", pbudgetProposal->strProposalName.c_str());
         //prop start/end should be inside this period
         if (pbudgetProposal->fValid && pbudgetProposal->nBlockStart <= nBlockStart &&
             pbudgetProposal->nBlockEnd >= nBlockEnd &&
-            pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > mnodeman.CountEnabled(ActiveProtocol()) / 10 &&
+            pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > nTenPercent &&
             pbudgetProposal->IsEstablished()) {
 
             LogPrint("masternode","CBudgetManager::GetBudget() -   Check 1 passed: valid=%d | %ld <= %ld | %ld >= %ld | Yeas=%d Nays=%d Count=%d | established=%d\n",
                       pbudgetProposal->fValid, pbudgetProposal->nBlockStart, nBlockStart, pbudgetProposal->nBlockEnd,
-                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), mnodeman.CountEnabled(ActiveProtocol()) / 10,
+                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), nTenPercent,
                       pbudgetProposal->IsEstablished());
 
             if (pbudgetProposal->GetAmount() + nBudgetAllocated <= nTotalBudget) {
@@ -756,7 +809,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
         else {
             LogPrint("masternode","CBudgetManager::GetBudget() -   Check 1 failed: valid=%d | %ld <= %ld | %ld >= %ld | Yeas=%d Nays=%d Count=%d | established=%d\n",
                       pbudgetProposal->fValid, pbudgetProposal->nBlockStart, nBlockStart, pbudgetProposal->nBlockEnd,
-                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), mnodeman.CountEnabled(ActiveProtocol()) / 10,
+                      nBlockEnd, pbudgetProposal->GetYeas(), pbudgetProposal->GetNays(), nTenPercent,
                       pbudgetProposal->IsEstablished());
         }
 
@@ -773,14 +826,14 @@ struct sortFinalizedBudgetsByVotes {
     }
 };
 
-std::vector<CFinalizedBudget*> CBudgetManager::GetFinalizedBudgets()
+void CBudgetManager::RankFinalizedBudgets()
 {
-    LOCK(cs);
+    AssertLockHeld(cs);
 
-    std::vector<CFinalizedBudget*> vFinalizedBudgetsRet;
-    std::vector<std::pair<CFinalizedBudget*, int> > vFinalizedBudgetsSort;
+    if (!fFinalizedBudgetsRankDirty) return;
 
-    // ------- Grab The Budgets In Order
+    std::vector<std::pair<CFinalizedBudget*, int> > vFinalizedBudgetsSort;
+    vFinalizedBudgetsSort.reserve(mapFinalizedBudgets.size());
 
     std::map<uint256, CFinalizedBudget>::iterator it = mapFinalizedBudgets.begin();
     while (it != mapFinalizedBudgets.end()) {
@@ -789,15 +842,46 @@ std::vector<CFinalizedBudget*> CBudgetManager::GetFinalizedBudgets()
         vFinalizedBudgetsSort.push_back(make_pair(pfinalizedBudget, pfinalizedBudget->GetVoteCount()));
         ++it;
     }
-    std::sort(vFinalizedBudgetsSort.begin(), vFinalizedBudgetsSort.end(), sortFinalizedBudgetsByVotes());
+    // stable, so ties keep map (hash) order -- the highest voted budget is the same one a linear scan would pick
+    std::stable_sort(vFinalizedBudgetsSort.begin(), vFinalizedBudgetsSort.end(), sortFinalizedBudgetsByVotes());
 
+    vecFinalizedBudgetsRanked.clear();
+    vecFinalizedBudgetsRanked.reserve(vFinalizedBudgetsSort.size());
     std::vector<std::pair<CFinalizedBudget*, int> >::iterator it2 = vFinalizedBudgetsSort.begin();
     while (it2 != vFinalizedBudgetsSort.end()) {
-        vFinalizedBudgetsRet.push_back((*it2).first);
+        vecFinalizedBudgetsRanked.push_back((*it2).first);
         ++it2;
     }
 
-    return vFinalizedBudgetsRet;
+    fFinalizedBudgetsRankDirty = false;
+}
+
+CFinalizedBudget* CBudgetManager::GetHighestVotedFinalizedBudget(int nBlockHeight)
+{
+    AssertLockHeld(cs);
+
+    RankFinalizedBudgets();
+
+    std::vector<CFinalizedBudget*>::iterator it = vecFinalizedBudgetsRanked.begin();
+    while (it != vecFinalizedBudgetsRanked.end()) {
+        CFinalizedBudget* pfinalizedBudget = *it;
+        if (nBlockHeight >= pfinalizedBudget->GetBlockStart() && nBlockHeight <= pfinalizedBudget->GetBlockEnd())
+            return pfinalizedBudget;
+        ++it;
+    }
+
+    return NULL;
+}
+
+std::vector<CFinalizedBudget*> CBudgetManager::GetFinalizedBudgets()
+{
+    LOCK(cs);
+
+    // ------- Grab The Budgets In Order
+
+    RankFinalizedBudgets();
+
+    return vecFinalizedBudgetsRanked;
 }
 
 std::string CBudgetManager::GetRequiredPaymentsString(int nBlockHeight)
@@ -922,7 +1006,7 @@ void CBudgetManager::NewBlock()
     LogPrint("masternode","CBudgetManager::NewBlock - mapProposals cleanup - size: %d\n", mapProposals.size());
     std::map<uint256, CBudgetProposal>::iterator it2 = mapProposals.begin();
     while (it2 != mapProposals.end()) {
-        (*it2).second.CleanAndRemove(false);
+        if ((*it2).second.CleanAndRemove(false)) fProposalsRankDirty = true;
         ++it2;
     }
 
@@ -1335,7 +1419,11 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
     }
 
 
-    return mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError);
+    if (!mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError)) return false;
+
+    fProposalsRankDirty = true;
+    budgetJournal.Append(BUDGET_JOURNAL_VOTE, vote);
+    return true;
 }
 
 bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pfrom, std::string& strError)
@@ -1361,7 +1449,66 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
         return false;
     }
     LogPrint("masternode","CBudgetManager::UpdateFinalizedBudget - Finalized Proposal %s added\n", vote.nBudgetHash.ToString());
-    return mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError);
+    if (!mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError)) return false;
+
+    fFinalizedBudgetsRankDirty = true;
+    budgetJournal.Append(BUDGET_JOURNAL_FINALIZED_VOTE, vote);
+    return true;
+}
+
+bool CBudgetManager::ApplyJournalRecord(unsigned char nType, CDataStream& ssRecord)
+{
+    LOCK(cs);
+
+    std::string strError = "";
+
+    if (nType == BUDGET_JOURNAL_PROPOSAL) {
+        CBudgetProposal budgetProposal;
+        ssRecord >> budgetProposal;
+        if (!mapProposals.count(budgetProposal.GetHash())) {
+            mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+            fProposalsRankDirty = true;
+        }
+        return true;
+    }
+
+    if (nType == BUDGET_JOURNAL_VOTE) {
+        CBudgetVote vote;
+        ssRecord >> vote;
+        if (mapProposals.count(vote.nProposalHash) && mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError))
+            fProposalsRankDirty = true;
+        return true;
+    }
+
+    if (nType == BUDGET_JOURNAL_FINALIZED) {
+        CFinalizedBudget finalizedBudget;
+        ssRecord >> finalizedBudget;
+        if (!mapFinalizedBudgets.count(finalizedBudget.GetHash())) {
+            mapFinalizedBudgets.insert(make_pair(finalizedBudget.GetHash(), finalizedBudget));
+            fFinalizedBudgetsRankDirty = true;
+        }
+        return true;
+    }
+
+    if (nType == BUDGET_JOURNAL_FINALIZED_VOTE) {
+        CFinalizedBudgetVote vote;
+        ssRecord >> vote;
+        if (mapFinalizedBudgets.count(vote.nBudgetHash) && mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError))
+            fFinalizedBudgetsRankDirty = true;
+        return true;
+    }
+
+    return false;
+}
+
+bool CBudgetManager::WriteSnapshot(CBudgetDB& budgetdb)
+{
+    // hold the lock so nothing changes between the snapshot and the fresh journal
+    LOCK(cs);
+
+    if (!budgetdb.Write(*this)) return false;
+
+    return budgetJournal.Reset(budgetdb.GetSnapshotHash(), budgetdb.GetSnapshotSize());
 }
 
 CBudgetProposal::CBudgetProposal()
@@ -1372,6 +1519,7 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    RecalculateTallies();
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1384,6 +1532,7 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    RecalculateTallies();
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1398,6 +1547,7 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
     fValid = true;
+    RecalculateTallies();
 }
 
 bool CBudgetProposal::IsValid(std::string& strError, bool fCheckCollateral)
@@ -1504,78 +1654,86 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
-    mapVotes[hash] = vote;
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if (it != mapVotes.end()) {
+        TallyVote((*it).second, -1);
+        (*it).second = vote;
+    } else {
+        it = mapVotes.insert(make_pair(hash, vote)).first;
+    }
+    TallyVote((*it).second, 1);
     LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s %s\n", strAction.c_str(), vote.GetHash().ToString().c_str());
 
     return true;
 }
 
-// If masternode voted for a proposal, but is now invalid -- remove the vote
-void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
+void CBudgetProposal::TallyVote(const CBudgetVote& vote, int nWeight)
 {
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
+    if (vote.nVote == VOTE_YES) nRatioYeas += nWeight;
+    if (vote.nVote == VOTE_NO) nRatioNays += nWeight;
 
-    while (it != mapVotes.end()) {
-        (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
-        ++it;
-    }
+    if (!vote.fValid) return;
+
+    if (vote.nVote == VOTE_YES) nYeas += nWeight;
+    if (vote.nVote == VOTE_NO) nNays += nWeight;
+    if (vote.nVote == VOTE_ABSTAIN) nAbstains += nWeight;
 }
 
-double CBudgetProposal::GetRatio()
+void CBudgetProposal::RecalculateTallies()
 {
-    int yeas = 0;
-    int nays = 0;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
+    nRatioYeas = 0;
+    nRatioNays = 0;
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES) yeas++;
-        if ((*it).second.nVote == VOTE_NO) nays++;
+        TallyVote((*it).second, 1);
         ++it;
     }
-
-    if (yeas + nays == 0) return 0.0f;
-
-    return ((double)(yeas) / (double)(yeas + nays));
 }
 
-int CBudgetProposal::GetYeas()
+// If masternode voted for a proposal, but is now invalid -- remove the vote
+bool CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
 {
-    int ret = 0;
-
+    bool fChanged = false;
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
+
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
+        bool fVoteValid = (*it).second.SignatureValid(fSignatureCheck);
+        if (fVoteValid != (*it).second.fValid) {
+            TallyVote((*it).second, -1);
+            (*it).second.fValid = fVoteValid;
+            TallyVote((*it).second, 1);
+            fChanged = true;
+        }
         ++it;
     }
 
-    return ret;
+    return fChanged;
 }
 
-int CBudgetProposal::GetNays()
+double CBudgetProposal::GetRatio()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
-        ++it;
-    }
+    if (nRatioYeas + nRatioNays == 0) return 0.0f;
 
-    return ret;
+    return ((double)(nRatioYeas) / (double)(nRatioYeas + nRatioNays));
 }
 
-int CBudgetProposal::GetAbstains()
+int CBudgetProposal::GetYeas()
 {
-    int ret = 0;
+    return nYeas;
+}
 
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
+int CBudgetProposal::GetNays()
+{
+    return nNays;
+}
 
-    return ret;
+int CBudgetProposal::GetAbstains()
+{
+    return nAbstains;
 }
 
 int CBudgetProposal::GetBlockStartCycle()
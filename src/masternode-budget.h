@@ -7,6 +7,7 @@
 #define MASTERNODE_BUDGET_H
 
 #include "base58.h"
+#include "cachejournal.h"
 #include "init.h"
 #include "key.h"
 #include "main.h"
@@ -21,6 +22,7 @@ using namespace std;
 extern CCriticalSection cs_budget;
 
 class CBudgetManager;
+class CBudgetDB;
 class CFinalizedBudgetBroadcast;
 class CFinalizedBudget;
 class CBudgetProposal;
@@ -39,8 +41,17 @@ extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 extern std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
 
 extern CBudgetManager budget;
+extern CCacheJournal budgetJournal;
 void DumpBudgets();
 
+/** Record types in the budget.dat journal */
+enum BudgetJournalRecord {
+    BUDGET_JOURNAL_PROPOSAL = 1,
+    BUDGET_JOURNAL_VOTE = 2,
+    BUDGET_JOURNAL_FINALIZED = 3,
+    BUDGET_JOURNAL_FINALIZED_VOTE = 4
+};
+
 // Define amount of blocks in budget payment cycle
 int GetBudgetPaymentCycleBlocks();
 
@@ -149,6 +160,8 @@ class CBudgetDB
 private:
     boost::filesystem::path pathDB;
     std::string strMagicMessage;
+    uint256 hashSnapshot;
+    int64_t nSnapshotSize;
 
 public:
     enum ReadResult {
@@ -164,6 +177,10 @@ public:
     CBudgetDB();
     bool Write(const CBudgetManager& objToSave);
     ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
+
+    /// Checksum and size of the snapshot last read or written, the journal is tied to it
+    uint256 GetSnapshotHash() const { return hashSnapshot; }
+    int64_t GetSnapshotSize() const { return nSnapshotSize; }
 };
 
 
@@ -177,6 +194,18 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // cached orderings (by net yes votes / vote count), rebuilt lazily under cs when marked dirty
+    std::vector<CBudgetProposal*> vecProposalsRanked;
+    std::vector<CFinalizedBudget*> vecFinalizedBudgetsRanked;
+    bool fProposalsRankDirty;
+    bool fFinalizedBudgetsRankDirty;
+    // height at which proposal votes were last re-checked against the masternode list
+    int nVotesCleanedHeight;
+
+    void RankProposals();
+    void RankFinalizedBudgets();
+    CFinalizedBudget* GetHighestVotedFinalizedBudget(int nBlockHeight);
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -196,6 +225,9 @@ public:
     {
         mapProposals.clear();
         mapFinalizedBudgets.clear();
+        fProposalsRankDirty = true;
+        fFinalizedBudgetsRankDirty = true;
+        nVotesCleanedHeight = -1;
     }
 
     void ClearSeen()
@@ -251,10 +283,18 @@ public:
         mapSeenFinalizedBudgetVotes.clear();
         mapOrphanMasternodeBudgetVotes.clear();
         mapOrphanFinalizedBudgetVotes.clear();
+        vecProposalsRanked.clear();
+        vecFinalizedBudgetsRanked.clear();
+        fProposalsRankDirty = true;
+        fFinalizedBudgetsRankDirty = true;
+        nVotesCleanedHeight = -1;
     }
     void CheckAndRemove();
     std::string ToString() const;
 
+    bool ApplyJournalRecord(unsigned char nType, CDataStream& ssRecord);
+    bool WriteSnapshot(CBudgetDB& budgetdb);
+
 
     ADD_SERIALIZE_METHODS;
 
@@ -270,6 +310,12 @@ public:
 
         READWRITE(mapProposals);
         READWRITE(mapFinalizedBudgets);
+
+        if (ser_action.ForRead()) {
+            fProposalsRankDirty = true;
+            fFinalizedBudgetsRankDirty = true;
+            nVotesCleanedHeight = -1;
+        }
     }
 };
 
@@ -456,6 +502,18 @@ private:
     mutable CCriticalSection cs;
     CAmount nAlloted;
 
+protected:
+    // running tallies of mapVotes, updated as votes are added, replaced or change validity
+    int nYeas;
+    int nNays;
+    int nAbstains;
+    // yes/no votes regardless of validity, as used by GetRatio()
+    int nRatioYeas;
+    int nRatioNays;
+
+    void TallyVote(const CBudgetVote& vote, int nWeight);
+    void RecalculateTallies();
+
 public:
     bool fValid;
     std::string strProposalName;
@@ -513,7 +571,8 @@ public:
     void SetAllotted(CAmount nAllotedIn) { nAlloted = nAllotedIn; }
     CAmount GetAllotted() { return nAlloted; }
 
-    void CleanAndRemove(bool fSignatureCheck);
+    // returns true if the validity of any vote (and so the tallies) changed
+    bool CleanAndRemove(bool fSignatureCheck);
 
     uint256 GetHash()
     {
@@ -547,6 +606,9 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+
+        if (ser_action.ForRead())
+            RecalculateTallies();
     }
 };
 
@@ -575,6 +637,8 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        first.RecalculateTallies();
+        second.RecalculateTallies();
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
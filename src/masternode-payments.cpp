@@ -13,11 +13,14 @@
 #include "sync.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
 /** Object for who's going to get paid on which blocks */
 CMasternodePayments masternodePayments;
+/** Changes to masternodePayments since donayments.dat was last written */
+CCacheJournal masternodePaymentsJournal("donayments.journal", "MasternodePayments");
 
 CCriticalSection cs_vecPayments;
 CCriticalSection cs_mapMasternodeBlocks;
@@ -31,6 +34,8 @@ CMasternodePaymentDB::CMasternodePaymentDB()
 {
     pathDB = GetDataDir() / "donayments.dat";
     strMagicMessage = "MasternodePayments";
+    hashSnapshot = 0;
+    nSnapshotSize = 0;
 }
 
 bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
@@ -45,11 +50,12 @@ bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
     uint256 hash = Hash(ssObj.begin(), ssObj.end());
     ssObj << hash;
 
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
+    // write to a temporary file and rename it into place, so a crash can't leave a torn snapshot behind
+    boost::filesystem::path pathTmp(pathDB.string() + ".new");
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -57,7 +63,13 @@ bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
     } catch (std::exception& e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
+    FileCommit(fileout.Get());
     fileout.fclose();
+    if (!RenameOver(pathTmp, pathDB))
+        return error("%s : Failed to rename %s into place", __func__, pathTmp.string());
+
+    hashSnapshot = hash;
+    nSnapshotSize = ssObj.size();
 
     LogPrint("masternode","Written info to donayments.dat  %dms\n", GetTimeMillis() - nStart);
 
@@ -103,6 +115,8 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
         error("%s : Checksum mismatch, data corrupted", __func__);
         return IncorrectHash;
     }
+    hashSnapshot = hashIn;
+    nSnapshotSize = fileSize;
 
     unsigned char pchMsgTmp[4];
     std::string strMagicMessageTmp;
@@ -137,6 +151,8 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
     LogPrint("masternode","Loaded info from donayments.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", objToLoad.ToString());
     if (!fDryRun) {
+        LogPrint("masternode","Masternode payments manager - replaying journal....\n");
+        masternodePaymentsJournal.Replay(hashIn, fileSize, boost::bind(&CMasternodePayments::ApplyJournalRecord, &objToLoad, _1, _2));
         LogPrint("masternode","Masternode payments manager - cleaning....\n");
         objToLoad.CleanPaymentList();
         LogPrint("masternode","Masternode payments manager - result:\n");
@@ -150,6 +166,13 @@ void DumpMasternodePayments()
 {
     int64_t nStart = GetTimeMillis();
 
+    // as long as the journal is small, it already holds everything since the last snapshot
+    if (masternodePaymentsJournal.IsOpen() && !masternodePaymentsJournal.NeedsCompaction()) {
+        masternodePaymentsJournal.Commit();
+        LogPrint("masternode","Masternode payments journal flushed  %dms\n", GetTimeMillis() - nStart);
+        return;
+    }
+
     CMasternodePaymentDB paymentdb;
     CMasternodePayments tempPayments;
 
@@ -168,7 +191,7 @@ void DumpMasternodePayments()
         }
     }
     LogPrint("masternode","Writting info to donayments.dat...\n");
-    paymentdb.Write(masternodePayments);
+    masternodePayments.WriteSnapshot(paymentdb);
 
     LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
@@ -508,6 +531,8 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
+
+        masternodePaymentsJournal.Append(MNPAYMENTS_JOURNAL_WINNER, winnerIn);
     }
 
     mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
@@ -633,6 +658,7 @@ void CMasternodePayments::CleanPaymentList()
 
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size() * 1.25), 1000);
+    bool fRemoved = false;
 
     std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
     while (it != mapMasternodePayeeVotes.end()) {
@@ -640,13 +666,66 @@ void CMasternodePayments::CleanPaymentList()
 
         if (nHeight - winner.nBlockHeight > nLimit) {
             LogPrint("donayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
+            masternodeSync.EraseSeenSyncMNW((*it).first);
             mapMasternodePayeeVotes.erase(it++);
             mapMasternodeBlocks.erase(winner.nBlockHeight);
+            fRemoved = true;
         } else {
             ++it;
         }
     }
+
+    // one record covers the whole cleanup: everything below this height is gone
+    if (fRemoved)
+        masternodePaymentsJournal.Append(MNPAYMENTS_JOURNAL_PRUNE, nHeight - nLimit);
+}
+
+bool CMasternodePayments::ApplyJournalRecord(unsigned char nType, CDataStream& ssRecord)
+{
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+
+    if (nType == MNPAYMENTS_JOURNAL_WINNER) {
+        CMasternodePaymentWinner winner;
+        ssRecord >> winner;
+
+        if (mapMasternodePayeeVotes.count(winner.GetHash())) return true;
+
+        mapMasternodePayeeVotes[winner.GetHash()] = winner;
+        if (!mapMasternodeBlocks.count(winner.nBlockHeight)) {
+            CMasternodeBlockPayees blockPayees(winner.nBlockHeight);
+            mapMasternodeBlocks[winner.nBlockHeight] = blockPayees;
+        }
+        mapMasternodeBlocks[winner.nBlockHeight].AddPayee(winner.payee, 1);
+        return true;
+    }
+
+    if (nType == MNPAYMENTS_JOURNAL_PRUNE) {
+        int nPruneHeight;
+        ssRecord >> nPruneHeight;
+
+        std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
+        while (it != mapMasternodePayeeVotes.end()) {
+            if ((*it).second.nBlockHeight < nPruneHeight) {
+                mapMasternodeBlocks.erase((*it).second.nBlockHeight);
+                mapMasternodePayeeVotes.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        return true;
+    }
+
+    return false;
+}
+
+bool CMasternodePayments::WriteSnapshot(CMasternodePaymentDB& paymentdb)
+{
+    // hold the locks so nothing changes between the snapshot and the fresh journal
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+
+    if (!paymentdb.Write(*this)) return false;
+
+    return masternodePaymentsJournal.Reset(paymentdb.GetSnapshotHash(), paymentdb.GetSnapshotSize());
 }
 
 bool CMasternodePaymentWinner::IsValid(CNode* pnode, std::string& strError)
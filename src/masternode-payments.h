@@ -6,6 +6,7 @@
 #ifndef MASTERNODE_PAYMENTS_H
 #define MASTERNODE_PAYMENTS_H
 
+#include "cachejournal.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
@@ -18,10 +19,18 @@ extern CCriticalSection cs_mapMasternodeBlocks;
 extern CCriticalSection cs_mapMasternodePayeeVotes;
 
 class CMasternodePayments;
+class CMasternodePaymentDB;
 class CMasternodePaymentWinner;
 class CMasternodeBlockPayees;
 
 extern CMasternodePayments masternodePayments;
+extern CCacheJournal masternodePaymentsJournal;
+
+/** Record types in the donayments.dat journal */
+enum MasternodePaymentsJournalRecord {
+    MNPAYMENTS_JOURNAL_WINNER = 1,
+    MNPAYMENTS_JOURNAL_PRUNE = 2
+};
 
 #define DONAYMENTS_SIGNATURES_REQUIRED 6
 #define DONAYMENTS_SIGNATURES_TOTAL 10
@@ -41,6 +50,8 @@ class CMasternodePaymentDB
 private:
     boost::filesystem::path pathDB;
     std::string strMagicMessage;
+    uint256 hashSnapshot;
+    int64_t nSnapshotSize;
 
 public:
     enum ReadResult {
@@ -56,6 +67,10 @@ public:
     CMasternodePaymentDB();
     bool Write(const CMasternodePayments& objToSave);
     ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
+
+    /// Checksum and size of the snapshot last read or written, the journal is tied to it
+    uint256 GetSnapshotHash() const { return hashSnapshot; }
+    int64_t GetSnapshotSize() const { return nSnapshotSize; }
 };
 
 class CMasternodePayee
@@ -288,6 +303,9 @@ public:
     int GetOldestBlock();
     int GetNewestBlock();
 
+    bool ApplyJournalRecord(unsigned char nType, CDataStream& ssRecord);
+    bool WriteSnapshot(CMasternodePaymentDB& paymentdb);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
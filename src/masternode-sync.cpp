@@ -19,11 +19,82 @@
 class CMasternodeSync;
 CMasternodeSync masternodeSync;
 
-CMasternodeSync::CMasternodeSync()
+CMasternodeSyncAsset::CMasternodeSyncAsset(int nAssetIn)
 {
+    nAsset = nAssetIn;
     Reset();
 }
 
+void CMasternodeSyncAsset::Reset()
+{
+    mapAsked.clear();
+    mapReported.clear();
+    mapPartialCount.clear();
+    nExpected = 0;
+    nReceived = 0;
+    nStarted = 0;
+    nLastItem = 0;
+    nLastReport = 0;
+    nFinished = 0;
+    fResumed = false;
+}
+
+int CMasternodeSyncAsset::CountOutstanding(int64_t nNow) const
+{
+    int nCount = 0;
+    for (std::map<NodeId, int64_t>::const_iterator it = mapAsked.begin(); it != mapAsked.end(); ++it) {
+        // peers that could not be asked are stored with time 0, peers that stay silent are given up on
+        if ((*it).second == 0 || mapReported.count((*it).first)) continue;
+        if ((*it).second > nNow - MASTERNODE_SYNC_TIMEOUT * 3) nCount++;
+    }
+    return nCount;
+}
+
+int CMasternodeSyncAsset::GetPeersNeeded() const
+{
+    return fResumed ? 1 : MASTERNODE_SYNC_PEERS;
+}
+
+bool CMasternodeSyncAsset::IsComplete(int64_t nNow) const
+{
+    if (mapReported.empty()) return false;
+
+    // wait for the peers still working on our request unless enough of them already answered
+    if ((int)mapReported.size() < GetPeersNeeded() && CountOutstanding(nNow) > 0) return false;
+
+    if (nReceived >= nExpected) return true;
+
+    // some of the announced items were invalid or never sent, give stragglers a moment
+    return std::max(nLastItem, nLastReport) < nNow - MASTERNODE_SYNC_TIMEOUT * 2;
+}
+
+bool CMasternodeSyncAsset::IsTimedOut(int64_t nNow) const
+{
+    return mapReported.empty() && nStarted < nNow - MASTERNODE_SYNC_TIMEOUT * 6;
+}
+
+std::string CMasternodeSyncAsset::GetName() const
+{
+    switch (nAsset) {
+    case MASTERNODE_SYNC_LIST:
+        return "list";
+    case MASTERNODE_SYNC_MNW:
+        return "winners";
+    case MASTERNODE_SYNC_BUDGET:
+        return "budget";
+    }
+    return "unknown";
+}
+
+CMasternodeSync::CMasternodeSync() : assetList(MASTERNODE_SYNC_LIST), assetWinners(MASTERNODE_SYNC_MNW), assetBudget(MASTERNODE_SYNC_BUDGET)
+{
+    nListFinishedBefore = 0;
+    nWinnersFinishedBefore = 0;
+    nBudgetFinishedBefore = 0;
+    // the assets reset themselves, and locking is not safe during static initialization
+    ResetCounters();
+}
+
 bool CMasternodeSync::IsSynced()
 {
     return RequestedMasternodeAssets == MASTERNODE_SYNC_FINISHED;
@@ -60,7 +131,7 @@ bool CMasternodeSync::IsBlockchainSynced()
     return true;
 }
 
-void CMasternodeSync::Reset()
+void CMasternodeSync::ResetCounters()
 {
     lastMasternodeList = 0;
     lastMasternodeWinner = 0;
@@ -83,9 +154,26 @@ void CMasternodeSync::Reset()
     nAssetSyncStarted = GetTime();
 }
 
+void CMasternodeSync::Reset()
+{
+    LOCK(cs);
+    ResetCounters();
+    assetList.Reset();
+    assetWinners.Reset();
+    assetBudget.Reset();
+}
+
+void CMasternodeSync::AddedItem(CMasternodeSyncAsset& asset)
+{
+    LOCK(cs);
+    asset.nLastItem = GetTime();
+}
+
 void CMasternodeSync::AddedMasternodeList(uint256 hash)
 {
-    if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
+    bool fSeen = mnodeman.mapSeenMasternodeBroadcast.count(hash);
+    LOCK(cs);
+    if (fSeen) {
         if (mapSeenSyncMNB[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeList = GetTime();
             mapSeenSyncMNB[hash]++;
@@ -94,11 +182,14 @@ void CMasternodeSync::AddedMasternodeList(uint256 hash)
         lastMasternodeList = GetTime();
         mapSeenSyncMNB.insert(make_pair(hash, 1));
     }
+    AddedItem(assetList);
 }
 
 void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
 {
-    if (masternodePayments.mapMasternodePayeeVotes.count(hash)) {
+    bool fSeen = masternodePayments.mapMasternodePayeeVotes.count(hash);
+    LOCK(cs);
+    if (fSeen) {
         if (mapSeenSyncMNW[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeWinner = GetTime();
             mapSeenSyncMNW[hash]++;
@@ -107,12 +198,15 @@ void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
         lastMasternodeWinner = GetTime();
         mapSeenSyncMNW.insert(make_pair(hash, 1));
     }
+    AddedItem(assetWinners);
 }
 
 void CMasternodeSync::AddedBudgetItem(uint256 hash)
 {
-    if (budget.mapSeenMasternodeBudgetProposals.count(hash) || budget.mapSeenMasternodeBudgetVotes.count(hash) ||
-        budget.mapSeenFinalizedBudgets.count(hash) || budget.mapSeenFinalizedBudgetVotes.count(hash)) {
+    bool fSeen = budget.mapSeenMasternodeBudgetProposals.count(hash) || budget.mapSeenMasternodeBudgetVotes.count(hash) ||
+                 budget.mapSeenFinalizedBudgets.count(hash) || budget.mapSeenFinalizedBudgetVotes.count(hash);
+    LOCK(cs);
+    if (fSeen) {
         if (mapSeenSyncBudget[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastBudgetItem = GetTime();
             mapSeenSyncBudget[hash]++;
@@ -121,6 +215,19 @@ void CMasternodeSync::AddedBudgetItem(uint256 hash)
         lastBudgetItem = GetTime();
         mapSeenSyncBudget.insert(make_pair(hash, 1));
     }
+    AddedItem(assetBudget);
+}
+
+void CMasternodeSync::EraseSeenSyncMNB(const uint256& hash)
+{
+    LOCK(cs);
+    mapSeenSyncMNB.erase(hash);
+}
+
+void CMasternodeSync::EraseSeenSyncMNW(const uint256& hash)
+{
+    LOCK(cs);
+    mapSeenSyncMNW.erase(hash);
 }
 
 bool CMasternodeSync::IsBudgetPropEmpty()
@@ -133,57 +240,99 @@ bool CMasternodeSync::IsBudgetFinEmpty()
     return sumBudgetItemFin == 0 && countBudgetItemFin > 0;
 }
 
-void CMasternodeSync::GetNextAsset()
+void CMasternodeSync::StartAsset(CMasternodeSyncAsset& asset, int64_t nFinishedBefore, bool fCacheLoaded)
+{
+    AssertLockHeld(cs);
+
+    asset.Reset();
+    asset.nStarted = GetTime();
+    // the cache on disk was current shortly before we went down, one peer is enough to top it up
+    asset.fResumed = fCacheLoaded && nFinishedBefore > GetTime() - MASTERNODE_SYNC_RESUME_SECONDS;
+    LogPrint("masternode", "CMasternodeSync::StartAsset - %s%s\n", asset.GetName(), asset.fResumed ? " (resumed)" : "");
+}
+
+void CMasternodeSync::FinishAsset(CMasternodeSyncAsset& asset)
+{
+    AssertLockHeld(cs);
+
+    asset.nFinished = GetTime();
+    LogPrintf("CMasternodeSync::FinishAsset - %s synced, %d items from %d peers in %ds\n", asset.GetName(),
+        asset.nReceived, asset.mapReported.size(), asset.nFinished - asset.nStarted);
+
+    if (&asset == &assetList) {
+        nListFinishedBefore = asset.nFinished;
+        // winners and budgets only depend on the list, not on each other
+        StartAsset(assetWinners, nWinnersFinishedBefore, !masternodePayments.mapMasternodeBlocks.empty());
+        StartAsset(assetBudget, nBudgetFinishedBefore, budget.sizeProposals() > 0 || budget.sizeFinalized() > 0);
+    } else if (&asset == &assetWinners) {
+        nWinnersFinishedBefore = asset.nFinished;
+    } else if (&asset == &assetBudget) {
+        nBudgetFinishedBefore = asset.nFinished;
+    }
+}
+
+void CMasternodeSync::FailAsset(CMasternodeSyncAsset& asset)
+{
+    AssertLockHeld(cs);
+
+    // budgets may legitimately not exist, and a freshly resumed cache is good enough to go on with
+    if (&asset == &assetBudget || asset.fResumed || !IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+        FinishAsset(asset);
+        return;
+    }
+
+    LogPrintf("CMasternodeSync::Process - ERROR - Sync of %s has failed, will retry later\n", asset.GetName());
+    RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
+    RequestedMasternodeAttempt = 0;
+    lastFailure = GetTime();
+    nCountFailures++;
+}
+
+void CMasternodeSync::UpdateRequestedAsset()
 {
+    AssertLockHeld(cs);
+
+    if (RequestedMasternodeAssets < MASTERNODE_SYNC_LIST || RequestedMasternodeAssets >= MASTERNODE_SYNC_FAILED) return;
+
+    CMasternodeSyncAsset* passet = NULL;
+    if (!assetList.IsFinished())
+        passet = &assetList;
+    else if (!assetWinners.IsFinished())
+        passet = &assetWinners;
+    else if (!assetBudget.IsFinished())
+        passet = &assetBudget;
+
+    if (passet == NULL) {
+        LogPrintf("CMasternodeSync::Process - Sync has finished\n");
+        RequestedMasternodeAssets = MASTERNODE_SYNC_FINISHED;
+        RequestedMasternodeAttempt = 0;
+        nAssetSyncStarted = GetTime();
+        return;
+    }
 
+    RequestedMasternodeAssets = passet->nAsset;
+    RequestedMasternodeAttempt = passet->mapAsked.size();
+    nAssetSyncStarted = passet->nStarted;
+}
+
+void CMasternodeSync::GetNextAsset()
+{
     switch (RequestedMasternodeAssets) {
     case (MASTERNODE_SYNC_INITIAL):
     case (MASTERNODE_SYNC_FAILED): // should never be used here actually, use Reset() instead
         ClearFulfilledRequest();
-/*
-// Donate FornaxA - temporarily disable sync sequence
-//        RequestedMasternodeAssets = MASTERNODE_SYNC_SPORKS;
-        RequestedMasternodeAssets = MASTERNODE_SYNC_FINISHED;
-        break;
-    case (MASTERNODE_SYNC_SPORKS):
-        RequestedMasternodeAssets = MASTERNODE_SYNC_LIST;
-        break;
-    case (MASTERNODE_SYNC_LIST):
-        RequestedMasternodeAssets = MASTERNODE_SYNC_MNW;
-        break;
-    case (MASTERNODE_SYNC_MNW):
-        RequestedMasternodeAssets = MASTERNODE_SYNC_BUDGET;
-        break;
-    case (MASTERNODE_SYNC_BUDGET):
-        LogPrintf("CMasternodeSync::GetNextAsset - Sync has finished\n");
-        RequestedMasternodeAssets = MASTERNODE_SYNC_FINISHED;
-        break;
-    }
-    RequestedMasternodeAttempt = 0;
-    nAssetSyncStarted = GetTime();
-*/
-
-    // donateDevs - tor - reenabled
-    // original:
         RequestedMasternodeAssets = MASTERNODE_SYNC_SPORKS;
         break;
-    case (MASTERNODE_SYNC_SPORKS):
+    case (MASTERNODE_SYNC_SPORKS): {
+        bool fCacheLoaded = mnodeman.size() > 0;
+        LOCK(cs);
         RequestedMasternodeAssets = MASTERNODE_SYNC_LIST;
-        break;
-    case (MASTERNODE_SYNC_LIST):
-        RequestedMasternodeAssets = MASTERNODE_SYNC_MNW;
-        break;
-    case (MASTERNODE_SYNC_MNW):
-        RequestedMasternodeAssets = MASTERNODE_SYNC_BUDGET;
-        break;
-    case (MASTERNODE_SYNC_BUDGET):
-        LogPrintf("CMasternodeSync::GetNextAsset - Sync has finished\n");
-        RequestedMasternodeAssets = MASTERNODE_SYNC_FINISHED;
+        StartAsset(assetList, nListFinishedBefore, fCacheLoaded);
         break;
     }
+    }
     RequestedMasternodeAttempt = 0;
     nAssetSyncStarted = GetTime();
-
 }
 
 std::string CMasternodeSync::GetSyncStatus()
@@ -216,31 +365,43 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
 
         if (RequestedMasternodeAssets >= MASTERNODE_SYNC_FINISHED) return;
 
+        LOCK(cs);
+
         //this means we will receive no further communication
+        CMasternodeSyncAsset* passet = NULL;
         switch (nItemID) {
         case (MASTERNODE_SYNC_LIST):
-            if (nItemID != RequestedMasternodeAssets) return;
+            passet = &assetList;
             sumMasternodeList += nCount;
             countMasternodeList++;
             break;
         case (MASTERNODE_SYNC_MNW):
-            if (nItemID != RequestedMasternodeAssets) return;
+            passet = &assetWinners;
             sumMasternodeWinner += nCount;
             countMasternodeWinner++;
             break;
         case (MASTERNODE_SYNC_BUDGET_PROP):
-            if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
+            // the finalized budget count follows, the peer has not finished yet
+            if (assetBudget.mapAsked.count(pfrom->GetId())) assetBudget.mapPartialCount[pfrom->GetId()] += nCount;
             sumBudgetItemProp += nCount;
             countBudgetItemProp++;
             break;
         case (MASTERNODE_SYNC_BUDGET_FIN):
-            if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
+            passet = &assetBudget;
+            nCount += assetBudget.mapPartialCount[pfrom->GetId()];
             sumBudgetItemFin += nCount;
             countBudgetItemFin++;
             break;
         }
 
         LogPrint("masternode", "CMasternodeSync:ProcessMessage - ssc - got inventory count %d %d\n", nItemID, nCount);
+
+        // only answers to our own requests tell us about completeness
+        if (passet == NULL || !passet->IsStarted() || passet->IsFinished() || !passet->mapAsked.count(pfrom->GetId())) return;
+
+        passet->mapReported[pfrom->GetId()] = nCount;
+        passet->nExpected = std::max(passet->nExpected, nCount);
+        passet->nLastReport = GetTime();
     }
 }
 
@@ -257,11 +418,79 @@ void CMasternodeSync::ClearFulfilledRequest()
     }
 }
 
+std::vector<CMasternodeSyncAsset> CMasternodeSync::GetAssets()
+{
+    LOCK(cs);
+    std::vector<CMasternodeSyncAsset> vAssets;
+    vAssets.push_back(assetList);
+    vAssets.push_back(assetWinners);
+    vAssets.push_back(assetBudget);
+    return vAssets;
+}
+
+bool CMasternodeSync::ReadState()
+{
+    boost::filesystem::path pathSync = GetDataDir() / "mnsync.dat";
+    FILE* file = fopen(pathSync.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) return false;
+
+    std::string strMagicMessageTmp;
+    unsigned char pchMsgTmp[4];
+    int64_t nList, nWinners, nBudget;
+    uint256 hashIn;
+    try {
+        filein >> strMagicMessageTmp >> FLATDATA(pchMsgTmp) >> nList >> nWinners >> nBudget >> hashIn;
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    CDataStream ssSync(SER_DISK, CLIENT_VERSION);
+    ssSync << strMagicMessageTmp << FLATDATA(pchMsgTmp) << nList << nWinners << nBudget;
+    if (strMagicMessageTmp != "MasternodeSync" || memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)) ||
+        hashIn != Hash(ssSync.begin(), ssSync.end()))
+        return error("%s : Invalid or corrupted %s", __func__, pathSync.string());
+
+    LOCK(cs);
+    nListFinishedBefore = nList;
+    nWinnersFinishedBefore = nWinners;
+    nBudgetFinishedBefore = nBudget;
+    return true;
+}
+
+bool CMasternodeSync::WriteState()
+{
+    CDataStream ssSync(SER_DISK, CLIENT_VERSION);
+    {
+        LOCK(cs);
+        ssSync << std::string("MasternodeSync");
+        ssSync << FLATDATA(Params().MessageStart());
+        ssSync << nListFinishedBefore << nWinnersFinishedBefore << nBudgetFinishedBefore;
+    }
+    uint256 hash = Hash(ssSync.begin(), ssSync.end());
+    ssSync << hash;
+
+    boost::filesystem::path pathSync = GetDataDir() / "mnsync.dat";
+    FILE* file = fopen(pathSync.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathSync.string());
+
+    try {
+        fileout.write(&ssSync[0], ssSync.size());
+    } catch (std::exception& e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    return true;
+}
+
 void CMasternodeSync::Process()
 {
     static int tick = 0;
 
-    if (tick++ % MASTERNODE_SYNC_TIMEOUT != 0) return;
+    // assets are driven by the answers of our peers, look at them every second
+    tick++;
 
     if (IsSynced()) {
         /* 
@@ -280,8 +509,6 @@ void CMasternodeSync::Process()
         return;
     }
 
-    LogPrint("masternode", "CMasternodeSync::Process() - tick %d RequestedMasternodeAssets %d\n", tick, RequestedMasternodeAssets);
-
     if (RequestedMasternodeAssets == MASTERNODE_SYNC_INITIAL) GetNextAsset();
 
     // sporks synced but blockchain is not, wait until we're almost at a recent block to continue
@@ -291,8 +518,9 @@ void CMasternodeSync::Process()
     TRY_LOCK(cs_vNodes, lockRecv);
     if (!lockRecv) return;
 
-    BOOST_FOREACH (CNode* pnode, vNodes) {
-        if (Params().NetworkID() == CBaseChainParams::REGTEST) {
+    if (Params().NetworkID() == CBaseChainParams::REGTEST) {
+        if (tick % MASTERNODE_SYNC_TIMEOUT != 0) return;
+        BOOST_FOREACH (CNode* pnode, vNodes) {
             if (RequestedMasternodeAttempt <= 2) {
                 pnode->PushMessage("getsporks"); //get current network sporks
             } else if (RequestedMasternodeAttempt < 4) {
@@ -308,124 +536,94 @@ void CMasternodeSync::Process()
             RequestedMasternodeAttempt++;
             return;
         }
+        return;
+    }
 
-        //set to synced
-        if (RequestedMasternodeAssets == MASTERNODE_SYNC_SPORKS) {
+    if (RequestedMasternodeAssets == MASTERNODE_SYNC_SPORKS) {
+        // sporks carry no inventory count, ask a few peers at once and give them a moment to answer
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_PEERS) break;
             if (pnode->HasFulfilledRequest("getspork")) continue;
             pnode->FulfilledRequest("getspork");
 
             pnode->PushMessage("getsporks"); //get current network sporks
-            if (RequestedMasternodeAttempt >= 2) GetNextAsset();
             RequestedMasternodeAttempt++;
-
-            return;
         }
+        if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD && GetTime() - nAssetSyncStarted >= MASTERNODE_SYNC_TIMEOUT) GetNextAsset();
+        return;
+    }
 
-        if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto()) {
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST) {
-                LogPrint("masternode", "CMasternodeSync::Process() - lastMasternodeList %lld (GetTime() - MASTERNODE_SYNC_TIMEOUT) %lld\n", lastMasternodeList, GetTime() - MASTERNODE_SYNC_TIMEOUT);
-                if (lastMasternodeList > 0 && lastMasternodeList < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("mnsync")) continue;
-                pnode->FulfilledRequest("mnsync");
-
-                // timeout
-                if (lastMasternodeList == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-                        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                        RequestedMasternodeAttempt = 0;
-                        lastFailure = GetTime();
-                        nCountFailures++;
-                    } else {
-                        GetNextAsset();
-                    }
-                    return;
-                }
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
+    LogPrint("masternode", "CMasternodeSync::Process() - tick %d RequestedMasternodeAssets %d\n", tick, RequestedMasternodeAssets);
 
-                mnodeman.DsegUpdate(pnode);
-                RequestedMasternodeAttempt++;
-                return;
+    // decide under our lock, but send outside of it: the managers call back into us with their own locks held
+    std::vector<std::pair<CNode*, int> > vRequests;
+    {
+        LOCK(cs);
+        int64_t nNow = GetTime();
+        CMasternodeSyncAsset* vpAssets[] = {&assetList, &assetWinners, &assetBudget};
+        BOOST_FOREACH (CMasternodeSyncAsset* passet, vpAssets) {
+            if (!passet->IsStarted() || passet->IsFinished()) continue;
+
+            if (passet->nAsset == MASTERNODE_SYNC_LIST)
+                passet->nReceived = mapSeenSyncMNB.size();
+            else if (passet->nAsset == MASTERNODE_SYNC_MNW)
+                passet->nReceived = mapSeenSyncMNW.size();
+            else
+                passet->nReceived = mapSeenSyncBudget.size();
+
+            if (passet->IsComplete(nNow)) {
+                FinishAsset(*passet);
+                continue;
+            }
+            if (passet->IsTimedOut(nNow)) {
+                FailAsset(*passet);
+                if (RequestedMasternodeAssets == MASTERNODE_SYNC_FAILED) return;
+                continue;
             }
 
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_MNW) {
-                if (lastMasternodeWinner > 0 && lastMasternodeWinner < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("mnwsync")) continue;
-                pnode->FulfilledRequest("mnwsync");
-
-                // timeout
-                if (lastMasternodeWinner == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-                        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                        RequestedMasternodeAttempt = 0;
-                        lastFailure = GetTime();
-                        nCountFailures++;
-                    } else {
-                        GetNextAsset();
-                    }
-                    return;
-                }
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                CBlockIndex* pindexPrev = chainActive.Tip();
-                if (pindexPrev == NULL) return;
-
-                int nMnCount = mnodeman.CountEnabled();
-                pnode->PushMessage("mnget", nMnCount); //sync payees
-                RequestedMasternodeAttempt++;
-
-                return;
+            // keep enough requests in flight
+            int nMissing = passet->GetPeersNeeded() - passet->mapReported.size() - passet->CountOutstanding(nNow);
+            std::string strRequest = passet->nAsset == MASTERNODE_SYNC_LIST ? "mnsync" : passet->nAsset == MASTERNODE_SYNC_MNW ? "mnwsync" : "busync";
+            int nMinProto = passet->nAsset == MASTERNODE_SYNC_BUDGET ? ActiveProtocol() : masternodePayments.GetMinMasternodePaymentsProto();
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if (nMissing <= 0) break;
+                if (pnode->nVersion < nMinProto || pnode->fDisconnect) continue;
+                if (pnode->HasFulfilledRequest(strRequest)) continue;
+                pnode->FulfilledRequest(strRequest);
+
+                passet->mapAsked[pnode->GetId()] = nNow;
+                vRequests.push_back(std::make_pair(pnode, passet->nAsset));
+                nMissing--;
             }
         }
+        UpdateRequestedAsset();
+    }
 
-        if (pnode->nVersion >= ActiveProtocol()) {
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_BUDGET) {
-                
-                // We'll start rejecting votes if we accidentally get set as synced too soon
-                if (lastBudgetItem > 0 && lastBudgetItem < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { 
-                    
-                    // Hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-
-                    // Try to activate our masternode if possible
-                    activeMasternode.ManageStatus();
-
-                    return;
-                }
-
-                // timeout
-                if (lastBudgetItem == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    // maybe there is no budgets at all, so just finish syncing
-                    GetNextAsset();
-                    activeMasternode.ManageStatus();
-                    return;
+    int nMnCount = vRequests.empty() ? 0 : mnodeman.CountEnabled();
+    for (unsigned int i = 0; i < vRequests.size(); i++) {
+        CNode* pnode = vRequests[i].first;
+        if (vRequests[i].second == MASTERNODE_SYNC_LIST) {
+            if (!mnodeman.DsegUpdate(pnode)) {
+                // we got the list from this peer before the restart, which is as good as an answer if we still hold it
+                bool fCacheLoaded = mnodeman.size() > 0;
+                LOCK(cs);
+                assetList.mapAsked[pnode->GetId()] = 0;
+                if (fCacheLoaded) {
+                    assetList.mapReported[pnode->GetId()] = 0;
+                    assetList.nLastReport = GetTime();
                 }
-
-                if (pnode->HasFulfilledRequest("busync")) continue;
-                pnode->FulfilledRequest("busync");
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                uint256 n = 0;
-                pnode->PushMessage("mnvs", n); //sync masternode votes
-                RequestedMasternodeAttempt++;
-
-                return;
             }
+        } else if (vRequests[i].second == MASTERNODE_SYNC_MNW) {
+            pnode->PushMessage("mnget", nMnCount); //sync payees
+        } else {
+            uint256 n = 0;
+            pnode->PushMessage("mnvs", n); //sync masternode votes
         }
     }
+
+    if (IsSynced()) {
+        WriteState();
+        // Try to activate our masternode if possible
+        activeMasternode.ManageStatus();
+    }
 }
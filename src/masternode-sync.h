@@ -18,21 +18,72 @@
 
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 2
+// number of peers each asset is requested from at the same time
+#define MASTERNODE_SYNC_PEERS 3
+// assets finished less than this long before a restart only need to be topped up from one peer
+#define MASTERNODE_SYNC_RESUME_SECONDS (30 * 60)
+
+#include "net.h"
+#include "sync.h"
+
+#include <map>
+#include <set>
+#include <string>
 
 class CMasternodeSync;
 extern CMasternodeSync masternodeSync;
 
 //
-// CMasternodeSync : Sync masternode assets in stages
+// CMasternodeSyncAsset : Progress of one asset (list, winners or budgets)
+//
+// An asset is requested from up to MASTERNODE_SYNC_PEERS peers at once. Every peer answers
+// with the items it knows about followed by an "ssc" message carrying their number, so the
+// asset is complete once enough peers reported and we have seen at least as many distinct
+// items as the largest inventory reported.
 //
 
-class CMasternodeSync
+class CMasternodeSyncAsset
 {
 public:
-    std::map<uint256, int> mapSeenSyncMNB;
-    std::map<uint256, int> mapSeenSyncMNW;
-    std::map<uint256, int> mapSeenSyncBudget;
+    int nAsset;
+    // peers the asset was requested from, and when
+    std::map<NodeId, int64_t> mapAsked;
+    // inventory size reported by each peer
+    std::map<NodeId, int> mapReported;
+    // budget peers send two counts, the proposal one arrives first
+    std::map<NodeId, int> mapPartialCount;
+    int nExpected;
+    int nReceived;
+    int64_t nStarted;
+    int64_t nLastItem;
+    int64_t nLastReport;
+    int64_t nFinished;
+    // finished recently enough before a restart to only need a top-up
+    bool fResumed;
 
+    CMasternodeSyncAsset(int nAssetIn = MASTERNODE_SYNC_INITIAL);
+
+    void Reset();
+    bool IsStarted() const { return nStarted > 0; }
+    bool IsFinished() const { return nFinished > 0; }
+    int CountOutstanding(int64_t nNow) const;
+    int GetPeersNeeded() const;
+    bool IsComplete(int64_t nNow) const;
+    bool IsTimedOut(int64_t nNow) const;
+    std::string GetName() const;
+};
+
+//
+// CMasternodeSync : Sync masternode assets
+//
+// Sporks are fetched first and the masternode list after them, since winners and budget
+// votes can only be checked against known masternodes. Winners and budgets are independent
+// of each other and are then fetched at the same time.
+//
+
+class CMasternodeSync
+{
+public:
     int64_t lastMasternodeList;
     int64_t lastMasternodeWinner;
     int64_t lastBudgetItem;
@@ -50,8 +101,9 @@ public:
     int countBudgetItemProp;
     int countBudgetItemFin;
 
-    // Count peers we've requested the list from
+    // Lowest asset that is not synced yet
     int RequestedMasternodeAssets;
+    // Count peers we've requested that asset from
     int RequestedMasternodeAttempt;
 
     // Time when current masternode asset sync started
@@ -62,6 +114,9 @@ public:
     void AddedMasternodeList(uint256 hash);
     void AddedMasternodeWinner(uint256 hash);
     void AddedBudgetItem(uint256 hash);
+    /** Forget a broadcast or winner, so it counts again when it is received anew */
+    void EraseSeenSyncMNB(const uint256& hash);
+    void EraseSeenSyncMNW(const uint256& hash);
     void GetNextAsset();
     std::string GetSyncStatus();
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
@@ -74,6 +129,34 @@ public:
     bool IsBlockchainSynced();
     bool IsMasternodeListSynced() { return RequestedMasternodeAssets > MASTERNODE_SYNC_LIST; }
     void ClearFulfilledRequest();
+
+    /** Copy of the progress of each asset, for RPC */
+    std::vector<CMasternodeSyncAsset> GetAssets();
+
+    /** Remember when each asset last finished syncing (mnsync.dat) so a restart can resume */
+    bool ReadState();
+    bool WriteState();
+
+private:
+    CCriticalSection cs;
+    // items received during the sync, protected by cs: they are added from the masternode message lanes
+    std::map<uint256, int> mapSeenSyncMNB;
+    std::map<uint256, int> mapSeenSyncMNW;
+    std::map<uint256, int> mapSeenSyncBudget;
+    CMasternodeSyncAsset assetList;
+    CMasternodeSyncAsset assetWinners;
+    CMasternodeSyncAsset assetBudget;
+    // loaded from mnsync.dat
+    int64_t nListFinishedBefore;
+    int64_t nWinnersFinishedBefore;
+    int64_t nBudgetFinishedBefore;
+
+    void ResetCounters();
+    void StartAsset(CMasternodeSyncAsset& asset, int64_t nFinishedBefore, bool fCacheLoaded);
+    void AddedItem(CMasternodeSyncAsset& asset);
+    void FinishAsset(CMasternodeSyncAsset& asset);
+    void FailAsset(CMasternodeSyncAsset& asset);
+    void UpdateRequestedAsset();
 };
 
 #endif
@@ -13,48 +13,89 @@
 
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
+// hashes of recent blocks for scoring
+CMasternodeBlockHashes masternodeBlockHashes;
 
-//Get the last hash that matches the modulus given. Processed in reverse order
-bool GetBlockHash(uint256& hash, int nBlockHeight)
+CMasternodeBlockHashes::CMasternodeBlockHashes()
 {
-    if (chainActive.Tip() == NULL) return false;
+    vHashes.resize(MASTERNODE_BLOCK_HASH_CACHE_SIZE);
+    vScoreHashes.resize(MASTERNODE_BLOCK_HASH_CACHE_SIZE);
+    pindexTip = NULL;
+}
 
-    if (nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
+void CMasternodeBlockHashes::SetTip(const CBlockIndex* pindexNew)
+{
+    LOCK(cs);
 
-    if (mapCacheBlockHashes.count(nBlockHeight)) {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
+    int nOldHeight = pindexTip ? pindexTip->nHeight : -1;
+    pindexTip = pindexNew;
+
+    // walk back until we meet the chain we already have, at most once around the ring
+    for (const CBlockIndex* pindex = pindexNew; pindex != NULL; pindex = pindex->pprev) {
+        if (pindexNew->nHeight - pindex->nHeight >= MASTERNODE_BLOCK_HASH_CACHE_SIZE) break;
+
+        int nSlot = pindex->nHeight % MASTERNODE_BLOCK_HASH_CACHE_SIZE;
+        uint256 hash = pindex->GetBlockHash();
+        if (pindex->nHeight <= nOldHeight && nOldHeight - pindex->nHeight < MASTERNODE_BLOCK_HASH_CACHE_SIZE && vHashes[nSlot] == hash)
+            break;
+
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << hash;
+        vHashes[nSlot] = hash;
+        vScoreHashes[nSlot] = ss.GetHash();
     }
+}
 
-    const CBlockIndex* BlockLastSolved = chainActive.Tip();
-    const CBlockIndex* BlockReading = chainActive.Tip();
+bool CMasternodeBlockHashes::Get(int nHeight, uint256& hash, uint256& hashScore) const
+{
+    LOCK(cs);
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight + 1 < nBlockHeight) return false;
+    if (pindexTip == NULL || nHeight < 0 || nHeight > pindexTip->nHeight) return false;
 
-    int nBlocksAgo = 0;
-    if (nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight + 1) - nBlockHeight;
-    assert(nBlocksAgo >= 0);
+    if (pindexTip->nHeight - nHeight < MASTERNODE_BLOCK_HASH_CACHE_SIZE) {
+        int nSlot = nHeight % MASTERNODE_BLOCK_HASH_CACHE_SIZE;
+        hash = vHashes[nSlot];
+        hashScore = vScoreHashes[nSlot];
+        return true;
+    }
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nBlocksAgo) {
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
+    // older than the ring, block index entries never change once they are in the chain
+    const CBlockIndex* pindex = pindexTip->GetAncestor(nHeight);
+    if (pindex == NULL) return false;
 
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
+    hash = pindex->GetBlockHash();
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hash;
+    hashScore = ss.GetHash();
+    return true;
+}
+
+bool CMasternodeBlockHashes::GetForScore(int64_t nBlockHeight, uint256& hash, uint256& hashScore) const
+{
+    int nTipHeight;
+    {
+        LOCK(cs);
+        if (pindexTip == NULL) return false;
+        nTipHeight = pindexTip->nHeight;
     }
 
-    return false;
+    if (nBlockHeight == 0)
+        nBlockHeight = nTipHeight;
+
+    if (nTipHeight == 0 || nTipHeight + 1 < nBlockHeight) return false;
+
+    // scores for a height are based on the block before it, the genesis block is never used
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : nTipHeight;
+    if (nHeight <= 0) return false;
+
+    return Get(nHeight, hash, hashScore);
+}
+
+//Get the hash of the block before nBlockHeight (of the one before the tip for 0)
+bool GetBlockHash(uint256& hash, int nBlockHeight)
+{
+    uint256 hashScore;
+    return masternodeBlockHashes.GetForScore(nBlockHeight, hash, hashScore);
 }
 
 CMasternode::CMasternode()
@@ -162,20 +203,15 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
 //
 uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return 0;
-
     uint256 hash = 0;
+    uint256 hash2 = 0;
     uint256 aux = vin.prevout.hash + vin.prevout.n;
 
-    if (!GetBlockHash(hash, nBlockHeight)) {
+    if (!masternodeBlockHashes.GetForScore(nBlockHeight, hash, hash2)) {
         LogPrint("masternode","CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
         return 0;
     }
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    ss << hash;
-    uint256 hash2 = ss.GetHash();
-
     CHashWriter ss2(SER_GETHASH, PROTOCOL_VERSION);
     ss2 << hash;
     ss2 << aux;
@@ -575,12 +611,15 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
     tx.vin.push_back(vin);
     tx.vout.push_back(vout);
 
+    // This runs on a masternode message lane, so the coins and the chain are read under cs_main
+    int nInputAge = 0;
+    CBlockIndex* pConfIndex = NULL;
     {
         TRY_LOCK(cs_main, lockMain);
         if (!lockMain) {
             // not mnb fault, let it to be checked again later
             mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
-            masternodeSync.mapSeenSyncMNB.erase(GetHash());
+            masternodeSync.EraseSeenSyncMNB(GetHash());
             return false;
         }
 
@@ -589,32 +628,35 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
             state.IsInvalid(nDoS);
             return false;
         }
+
+        nInputAge = GetInputAge(vin);
+
+        uint256 hashBlock = 0;
+        CTransaction tx2;
+        GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end() && (*mi).second) {
+            CBlockIndex* pMNIndex = (*mi).second;                                       // block for 1000 DONATE tx -> 1 confirmation
+            pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+        }
     }
 
     LogPrint("masternode", "mnb - Accepted Masternode entry\n");
 
-    if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
+    if (nInputAge < MASTERNODE_MIN_CONFIRMATIONS) {
         LogPrint("masternode","mnb - Input must have at least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
         // maybe we miss few blocks, let this mnb to be checked again later
         mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
-        masternodeSync.mapSeenSyncMNB.erase(GetHash());
+        masternodeSync.EraseSeenSyncMNB(GetHash());
         return false;
     }
 
     // verify that sig time is legit in past
     // should be at least not earlier than block when 1000 DON tx got MASTERNODE_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi != mapBlockIndex.end() && (*mi).second) {
-        CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 1000 DONATE tx -> 1 confirmation
-        CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-        if (pConfIndex->GetBlockTime() > sigTime) {
-            LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
-                sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
-            return false;
-        }
+    if (pConfIndex && pConfIndex->GetBlockTime() > sigTime) {
+        LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
+            sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
+        return false;
     }
 
     LogPrint("masternode","mnb - Got NEW Masternode entry - %s - %lli \n", vin.prevout.hash.ToString(), sigTime);
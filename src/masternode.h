@@ -21,16 +21,47 @@
 #define MASTERNODE_EXPIRATION_SECONDS (120 * 60)
 #define MASTERNODE_REMOVAL_SECONDS (130 * 60)
 #define MASTERNODE_CHECK_SECONDS 5
+// recent block hashes kept for masternode scoring
+#define MASTERNODE_BLOCK_HASH_CACHE_SIZE 4096
 
 using namespace std;
 
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
+class CMasternodeBlockHashes;
+extern CMasternodeBlockHashes masternodeBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
+//
+// Block hashes of the active chain that masternode scores are based on, indexed by height.
+//
+// The most recent MASTERNODE_BLOCK_HASH_CACHE_SIZE blocks are kept in a ring together with the
+// hash of their hash, which every score at that height starts from. The ring is updated from
+// UpdateTip, so it can be read without cs_main and follows reorgs.
+//
+
+class CMasternodeBlockHashes
+{
+private:
+    mutable CCriticalSection cs;
+    // slot nHeight % MASTERNODE_BLOCK_HASH_CACHE_SIZE
+    std::vector<uint256> vHashes;
+    std::vector<uint256> vScoreHashes;
+    const CBlockIndex* pindexTip;
+
+public:
+    CMasternodeBlockHashes();
+
+    /** Follow the active chain, called whenever its tip changes */
+    void SetTip(const CBlockIndex* pindexNew);
+    /** Hash of the block at nHeight and the hash scores at that height start from */
+    bool Get(int nHeight, uint256& hash, uint256& hashScore) const;
+    /** Same, for the block GetBlockHash() picks for nBlockHeight */
+    bool GetForScore(int64_t nBlockHeight, uint256& hash, uint256& hashScore) const;
+};
+
 
 //
 // The Masternode Ping Class : Contains a different serialize method for sending pings from masternodes throughout the network
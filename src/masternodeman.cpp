@@ -10,6 +10,7 @@
 #include "obfuscation.h"
 #include "spork.h"
 #include "util.h"
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -17,6 +18,8 @@
 
 /** Masternode manager */
 CMasternodeMan mnodeman;
+/** Changes to mnodeman since mncache.dat was last written */
+CCacheJournal mnodemanJournal("mncache.journal", "MasternodeCache");
 
 struct CompareLastPaid {
     bool operator()(const pair<int64_t, CTxIn>& t1,
@@ -50,6 +53,8 @@ CMasternodeDB::CMasternodeDB()
 {
     pathMN = GetDataDir() / "mncache.dat";
     strMagicMessage = "MasternodeCache";
+    hashSnapshot = 0;
+    nSnapshotSize = 0;
 }
 
 bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
@@ -64,11 +69,12 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
     ssMasternodes << hash;
 
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
+    // write to a temporary file and rename it into place, so a crash can't leave a torn snapshot behind
+    boost::filesystem::path pathTmp(pathMN.string() + ".new");
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -76,8 +82,13 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     } catch (std::exception& e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
-    //    FileCommit(fileout);
+    FileCommit(fileout.Get());
     fileout.fclose();
+    if (!RenameOver(pathTmp, pathMN))
+        return error("%s : Failed to rename %s into place", __func__, pathTmp.string());
+
+    hashSnapshot = hash;
+    nSnapshotSize = ssMasternodes.size();
 
     LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
@@ -124,6 +135,8 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
         error("%s : Checksum mismatch, data corrupted", __func__);
         return IncorrectHash;
     }
+    hashSnapshot = hashIn;
+    nSnapshotSize = fileSize;
 
     unsigned char pchMsgTmp[4];
     std::string strMagicMessageTmp;
@@ -157,6 +170,9 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
     LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
     if (!fDryRun) {
+        LogPrint("masternode","Masternode manager - replaying journal....\n");
+        mnodemanJournal.Replay(hashIn, fileSize, boost::bind(&CMasternodeMan::ApplyJournalRecord, &mnodemanToLoad, _1, _2));
+        mnodemanToLoad.ResetJournalBaseline();
         LogPrint("masternode","Masternode manager - cleaning....\n");
         mnodemanToLoad.CheckAndRemove(true);
         LogPrint("masternode","Masternode manager - result:\n");
@@ -170,6 +186,14 @@ void DumpMasternodes()
 {
     int64_t nStart = GetTimeMillis();
 
+    // as long as the journal is small, only the changes go to disk
+    mnodeman.JournalChanges();
+    if (mnodemanJournal.IsOpen() && !mnodemanJournal.NeedsCompaction()) {
+        mnodemanJournal.Commit();
+        LogPrint("masternode","Masternode journal flushed  %dms\n", GetTimeMillis() - nStart);
+        return;
+    }
+
     CMasternodeDB mndb;
     CMasternodeMan tempMnodeman;
 
@@ -188,7 +212,7 @@ void DumpMasternodes()
         }
     }
     LogPrint("masternode","Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
+    mnodeman.WriteSnapshot(mndb);
 
     LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
@@ -261,7 +285,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
             while (it3 != mapSeenMasternodeBroadcast.end()) {
                 if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
+                    masternodeSync.EraseSeenSyncMNB((*it3).first);
                     mapSeenMasternodeBroadcast.erase(it3++);
                 } else {
                     ++it3;
@@ -318,8 +342,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
     while (it3 != mapSeenMasternodeBroadcast.end()) {
         if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
+            masternodeSync.EraseSeenSyncMNB((*it3).first);
             mapSeenMasternodeBroadcast.erase(it3++);
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
         } else {
             ++it3;
         }
@@ -414,7 +438,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
     }
 }
 
-void CMasternodeMan::DsegUpdate(CNode* pnode)
+bool CMasternodeMan::DsegUpdate(CNode* pnode)
 {
     LOCK(cs);
 
@@ -424,7 +448,7 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
             if (it != mWeAskedForMasternodeList.end()) {
                 if (GetTime() < (*it).second) {
                     LogPrint("masternode", "dseg - we already asked peer %i for the list; skipping...\n", pnode->GetId());
-                    return;
+                    return false;
                 }
             }
         }
@@ -433,6 +457,7 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
     pnode->PushMessage("dseg", CTxIn());
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
+    return true;
 }
 
 CMasternode* CMasternodeMan::Find(const CScript& payee)
@@ -722,6 +747,23 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
+bool CMasternodeMan::AlreadyHaveBroadcast(const uint256& hash)
+{
+    // the caller holds cs_main, which ProcessMessage may be waiting for
+    TRY_LOCK(cs_process_message, lockProcess);
+    if (!lockProcess || !mapSeenMasternodeBroadcast.count(hash))
+        return false;
+
+    masternodeSync.AddedMasternodeList(hash);
+    return true;
+}
+
+bool CMasternodeMan::AlreadyHavePing(const uint256& hash)
+{
+    TRY_LOCK(cs_process_message, lockProcess);
+    return lockProcess && mapSeenMasternodePing.count(hash);
+}
+
 void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
@@ -990,15 +1032,30 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         tx.vin.push_back(vin);
         tx.vout.push_back(vout);
 
+        // This runs on a masternode message lane, so the coins and the chain are read under cs_main
         bool fAcceptable = false;
+        int nInputAge = 0;
+        CBlockIndex* pConfIndex = NULL;
         {
             TRY_LOCK(cs_main, lockMain);
             if (!lockMain) return;
             fAcceptable = AcceptableInputs(mempool, state, CTransaction(tx), false, NULL);
+            if (fAcceptable) {
+                nInputAge = GetInputAge(vin);
+
+                uint256 hashBlock = 0;
+                CTransaction tx2;
+                GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+                if (mi != mapBlockIndex.end() && (*mi).second) {
+                    CBlockIndex* pMNIndex = (*mi).second;                                       // block for 10000 DON tx -> 1 confirmation
+                    pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+                }
+            }
         }
 
         if (fAcceptable) {
-            if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
+            if (nInputAge < MASTERNODE_MIN_CONFIRMATIONS) {
                 LogPrint("masternode","dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
                 Misbehaving(pfrom->GetId(), 20);
                 return;
@@ -1006,18 +1063,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
             // verify that sig time is legit in past
             // should be at least not earlier than block when 1000 DONATE tx got MASTERNODE_MIN_CONFIRMATIONS
-            uint256 hashBlock = 0;
-            CTransaction tx2;
-            GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 10000 DON tx -> 1 confirmation
-                CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if (pConfIndex->GetBlockTime() > sigTime) {
-                    LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
-                        sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
-                    return;
-                }
+            if (pConfIndex && pConfIndex->GetBlockTime() > sigTime) {
+                LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
+                    sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
+                return;
             }
 
             // use this as a peer
@@ -1165,6 +1214,88 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
     }
 }
 
+void CMasternodeMan::JournalChanges()
+{
+    LOCK(cs);
+
+    if (!mnodemanJournal.IsOpen()) return;
+
+    // pings and state checks update entries in place all over the place, so rather than hooking
+    // every one of them we compare each Masternode against what we journaled last time
+    std::map<COutPoint, uint256> mapCurrent;
+    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        uint256 hash = SerializeHash(mn);
+        mapCurrent[mn.vin.prevout] = hash;
+
+        std::map<COutPoint, uint256>::iterator it = mapJournaledMasternodes.find(mn.vin.prevout);
+        if (it == mapJournaledMasternodes.end() || (*it).second != hash)
+            mnodemanJournal.Append(MN_JOURNAL_UPSERT, mn);
+    }
+
+    std::map<COutPoint, uint256>::iterator it = mapJournaledMasternodes.begin();
+    while (it != mapJournaledMasternodes.end()) {
+        if (!mapCurrent.count((*it).first))
+            mnodemanJournal.Append(MN_JOURNAL_REMOVE, (*it).first);
+        ++it;
+    }
+
+    mapJournaledMasternodes.swap(mapCurrent);
+}
+
+void CMasternodeMan::ResetJournalBaseline()
+{
+    LOCK(cs);
+
+    mapJournaledMasternodes.clear();
+    BOOST_FOREACH (CMasternode& mn, vMasternodes)
+        mapJournaledMasternodes[mn.vin.prevout] = SerializeHash(mn);
+}
+
+bool CMasternodeMan::ApplyJournalRecord(unsigned char nType, CDataStream& ssRecord)
+{
+    LOCK(cs);
+
+    if (nType == MN_JOURNAL_UPSERT) {
+        CMasternode mn;
+        ssRecord >> mn;
+
+        CMasternode* pmn = Find(mn.vin);
+        if (pmn == NULL)
+            vMasternodes.push_back(mn);
+        else
+            *pmn = mn;
+        return true;
+    }
+
+    if (nType == MN_JOURNAL_REMOVE) {
+        COutPoint outpoint;
+        ssRecord >> outpoint;
+
+        vector<CMasternode>::iterator it = vMasternodes.begin();
+        while (it != vMasternodes.end()) {
+            if ((*it).vin.prevout == outpoint) {
+                vMasternodes.erase(it);
+                break;
+            }
+            ++it;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+bool CMasternodeMan::WriteSnapshot(CMasternodeDB& mndb)
+{
+    // hold the lock so nothing changes between the snapshot and the fresh journal
+    LOCK(cs);
+
+    if (!mndb.Write(*this)) return false;
+
+    ResetJournalBaseline();
+    return mnodemanJournal.Reset(mndb.GetSnapshotHash(), mndb.GetSnapshotSize());
+}
+
 std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
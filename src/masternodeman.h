@@ -7,6 +7,7 @@
 #define MASTERNODEMAN_H
 
 #include "base58.h"
+#include "cachejournal.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
@@ -22,8 +23,15 @@ using namespace std;
 class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
+extern CCacheJournal mnodemanJournal;
 void DumpMasternodes();
 
+/** Record types in the mncache.dat journal */
+enum MasternodeJournalRecord {
+    MN_JOURNAL_UPSERT = 1,
+    MN_JOURNAL_REMOVE = 2
+};
+
 /** Access to the MN database (mncache.dat)
  */
 class CMasternodeDB
@@ -31,6 +39,8 @@ class CMasternodeDB
 private:
     boost::filesystem::path pathMN;
     std::string strMagicMessage;
+    uint256 hashSnapshot;
+    int64_t nSnapshotSize;
 
 public:
     enum ReadResult {
@@ -46,6 +56,10 @@ public:
     CMasternodeDB();
     bool Write(const CMasternodeMan& mnodemanToSave);
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+
+    /// Checksum and size of the snapshot last read or written, the journal is tied to it
+    uint256 GetSnapshotHash() const { return hashSnapshot; }
+    int64_t GetSnapshotSize() const { return nSnapshotSize; }
 };
 
 class CMasternodeMan
@@ -65,6 +79,8 @@ private:
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // hash of each Masternode as last written to the journal (not serialized)
+    std::map<COutPoint, uint256> mapJournaledMasternodes;
 
 public:
     // Keep track of all broadcasts I've seen
@@ -113,7 +129,8 @@ public:
 
     void CountNetworks(int protocolVersion, int& ipv4, int& ipv6, int& onion);
 
-    void DsegUpdate(CNode* pnode);
+    /** Ask a peer for its full list, returns false if we already did so recently */
+    bool DsegUpdate(CNode* pnode);
 
     /// Find an entry
     CMasternode* Find(const CScript& payee);
@@ -143,6 +160,10 @@ public:
 
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
+    /// Inventory lookups for the message handler thread, false while a message lane is using the maps
+    bool AlreadyHaveBroadcast(const uint256& hash);
+    bool AlreadyHavePing(const uint256& hash);
+
     /// Return the number of (unique) Masternodes
     int size() { return vMasternodes.size(); }
 
@@ -155,6 +176,15 @@ public:
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
+
+    /// Append Masternodes that changed or disappeared since the last call to the journal
+    void JournalChanges();
+    /// Take the current list as already journaled (after a snapshot or a replay)
+    void ResetJournalBaseline();
+    /// Apply one journal record while loading mncache.dat
+    bool ApplyJournalRecord(unsigned char nType, CDataStream& ssRecord);
+    /// Write mncache.dat and start a new journal against it
+    bool WriteSnapshot(CMasternodeDB& mndb);
 };
 
 #endif
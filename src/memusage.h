@@ -0,0 +1,59 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+/**
+ * Estimates of the heap memory held by containers, for caches that are limited in bytes.
+ * They count what the allocator hands out, not what the container asked for.
+ */
+namespace memusage
+{
+/** Bytes actually taken from the heap by a malloc of alloc bytes (glibc on Linux) */
+static inline size_t MallocUsage(size_t alloc)
+{
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    assert(sizeof(void*) == 4);
+    return ((alloc + 15) >> 3) << 3;
+}
+
+template <typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+static inline size_t DynamicUsage(const std::vector<bool>& v)
+{
+    // stored as machine words of bits
+    return MallocUsage((v.capacity() + 63) / 64 * 8);
+}
+
+// Node layout of boost::unordered_map: the value plus the link to the next node
+template <typename X>
+struct unordered_node : private X {
+private:
+    void* ptr;
+};
+
+template <typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+}
+
+#endif // BITCOIN_MEMUSAGE_H
@@ -34,6 +34,10 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -61,6 +65,10 @@ using namespace std;
 namespace
 {
 const int MAX_OUTBOUND_CONNECTIONS = 16;
+/** Maximum number of socket events handled per epoll_wait */
+const int MAX_SOCKET_EVENTS = 256;
+/** How long ThreadSocketHandler waits for socket events (in milliseconds) */
+const int SOCKET_EVENTS_TIMEOUT = 50;
 
 struct ListenSocket {
     SOCKET socket;
@@ -91,6 +99,7 @@ CCriticalSection cs_vNodes;
 map<CInv, CDataStream> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
+static size_t nRelayMemoryUsage = 0;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -112,6 +121,114 @@ boost::condition_variable messageHandlerCondition;
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+//
+// Socket events
+//
+#ifdef HAVE_SYS_EPOLL_H
+static SocketEventsMode nSocketEventsMode = SOCKETEVENTS_EPOLL;
+static int hEpoll = -1;
+#else
+static SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+#endif
+
+std::string GetSocketEventsModeName(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SOCKETEVENTS_SELECT:
+        return "select";
+    case SOCKETEVENTS_EPOLL:
+        return "epoll";
+    }
+    return "unknown";
+}
+
+std::string GetDefaultSocketEventsMode()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return GetSocketEventsModeName(SOCKETEVENTS_EPOLL);
+#else
+    return GetSocketEventsModeName(SOCKETEVENTS_SELECT);
+#endif
+}
+
+std::string GetSupportedSocketEventsModes()
+{
+    std::string strModes = GetSocketEventsModeName(SOCKETEVENTS_SELECT);
+#ifdef HAVE_SYS_EPOLL_H
+    strModes += ", " + GetSocketEventsModeName(SOCKETEVENTS_EPOLL);
+#endif
+    return strModes;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/** Create the epoll instance if epoll mode is selected, falling back to select if that fails */
+static void CreateEpoll()
+{
+    if (nSocketEventsMode != SOCKETEVENTS_EPOLL || hEpoll != -1)
+        return;
+
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1) {
+        LogPrintf("epoll_create1 failed: %s, using select\n", NetworkErrorString(errno));
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+    }
+}
+#endif
+
+bool SetSocketEventsMode(const std::string& strMode)
+{
+    if (strMode == GetSocketEventsModeName(SOCKETEVENTS_SELECT)) {
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (strMode == GetSocketEventsModeName(SOCKETEVENTS_EPOLL)) {
+        // created right away, so the caller sees a fallback to select before sizing its connection limits
+        nSocketEventsMode = SOCKETEVENTS_EPOLL;
+        CreateEpoll();
+        return true;
+    }
+#endif
+    return false;
+}
+
+SocketEventsMode GetSocketEventsMode()
+{
+    return nSocketEventsMode;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Nodes are registered edge-triggered for reading for as long as their socket is open, with the
+ * CNode itself as event data. Write interest is only added while the send queues hold data the kernel
+ * did not take (see SocketSendData), so idle peers never wake the socket handler.
+ */
+static void EpollControl(CNode* pnode, int nOp)
+{
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET | (pnode->fSendEvents ? (uint32_t)EPOLLOUT : 0);
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, nOp, pnode->hSocket, &event) == SOCKET_ERROR && nOp != EPOLL_CTL_DEL)
+        LogPrintf("socket epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+}
+#endif
+
+/** Only watch for writability while something is waiting to be sent. Requires cs_vSend. */
+static void UpdateSendEvents(CNode* pnode)
+{
+    bool fSendEvents = pnode->nSendSize != 0;
+    if (pnode->fSendEvents == fSendEvents)
+        return;
+    pnode->fSendEvents = fSendEvents;
+#ifdef HAVE_SYS_EPOLL_H
+    EpollControl(pnode, EPOLL_CTL_MOD);
+#endif
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -341,6 +458,20 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_totalMsgCmdStats;
+mapMsgCmdStats_t CNode::mapTotalMsgCmdStats;
+
+const std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
+
+CNetMsgStats& CNetMsgStats::operator+=(const CNetMsgStats& other)
+{
+    nSendMsgs += other.nSendMsgs;
+    nSendBytes += other.nSendBytes;
+    nRecvMsgs += other.nRecvMsgs;
+    nRecvBytes += other.nRecvBytes;
+    nProcessUsec += other.nProcessUsec;
+    return *this;
+}
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -448,6 +579,9 @@ void CNode::CloseSocketDisconnect()
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET) {
         LogPrint("net", "disconnecting peer=%d\n", id);
+#ifdef HAVE_SYS_EPOLL_H
+        EpollControl(this, EPOLL_CTL_DEL);
+#endif
         CloseSocket(hSocket);
     }
 
@@ -488,14 +622,31 @@ void CNode::PushVersion()
 
 
 banmap_t CNode::setBanned;
+CSubNetTrie<int64_t> CNode::trieBanned;
 CCriticalSection CNode::cs_setBanned;
 bool CNode::setBannedIsDirty;
 
+/** Whether a banned-until-time is still in force */
+struct BanActive {
+    int64_t nNow;
+
+    explicit BanActive(int64_t nNowIn) : nNow(nNowIn) {}
+    bool operator()(int64_t nBanUntil) const { return nNow < nBanUntil; }
+};
+
+void CNode::RebuildBannedTrie()
+{
+    trieBanned.clear();
+    for (banmap_t::const_iterator it = setBanned.begin(); it != setBanned.end(); ++it)
+        trieBanned.insert(it->first, it->second.nBanUntil);
+}
+
 void CNode::ClearBanned()
 {
     {
         LOCK(cs_setBanned);
         setBanned.clear();
+        trieBanned.clear();
         setBannedIsDirty = true;
     }
     DumpBanlist(); // store banlist to Disk
@@ -504,19 +655,8 @@ void CNode::ClearBanned()
 
 bool CNode::IsBanned(CNetAddr ip)
 {
-    bool fResult = false;
-    {
-        LOCK(cs_setBanned);
-        for (banmap_t::iterator it = setBanned.begin(); it != setBanned.end(); it++)
-        {
-            CSubNet subNet = (*it).first;
-            CBanEntry banEntry = (*it).second;
-
-            if(subNet.Match(ip) && GetTime() < banEntry.nBanUntil)
-                fResult = true;
-        }
-    }
-    return fResult;
+    LOCK(cs_setBanned);
+    return trieBanned.any_match(ip, BanActive(GetTime()));
 }
 
 bool CNode::IsBanned(CSubNet subnet)
@@ -555,6 +695,7 @@ void CNode::Ban(const CSubNet& subNet, const BanReason &banReason, int64_t banti
         LOCK(cs_setBanned);
         if (setBanned[subNet].nBanUntil < banEntry.nBanUntil) {
             setBanned[subNet] = banEntry;
+            trieBanned.insert(subNet, banEntry.nBanUntil);
             setBannedIsDirty = true;
         }
         else
@@ -584,6 +725,7 @@ bool CNode::Unban(const CSubNet &subNet)
         LOCK(cs_setBanned);
         if (!setBanned.erase(subNet))
             return false;
+        RebuildBannedTrie();
         setBannedIsDirty = true;
     }
     uiInterface.BannedListChanged();
@@ -601,6 +743,7 @@ void CNode::SetBanned(const banmap_t &banMap)
 {
     LOCK(cs_setBanned);
     setBanned = banMap;
+    RebuildBannedTrie();
     setBannedIsDirty = true;
 }
 
@@ -626,6 +769,8 @@ void CNode::SweepBanned()
             else
                 ++it;
         }
+        if (notifyUI)
+            RebuildBannedTrie();
     }
     // update UI
     if(notifyUI) {
@@ -646,23 +791,19 @@ void CNode::SetBannedSetDirty(bool dirty)
 }
 
 
-std::vector<CSubNet> CNode::vWhitelistedRange;
+CSubNetTrie<bool> CNode::trieWhitelistedRange;
 CCriticalSection CNode::cs_vWhitelistedRange;
 
 bool CNode::IsWhitelistedRange(const CNetAddr& addr)
 {
     LOCK(cs_vWhitelistedRange);
-    BOOST_FOREACH (const CSubNet& subnet, vWhitelistedRange) {
-        if (subnet.Match(addr))
-            return true;
-    }
-    return false;
+    return trieWhitelistedRange.match(addr);
 }
 
 void CNode::AddWhitelistedRange(const CSubNet& subnet)
 {
     LOCK(cs_vWhitelistedRange);
-    vWhitelistedRange.push_back(subnet);
+    trieWhitelistedRange.insert(subnet, true);
 }
 
 #undef X
@@ -681,7 +822,13 @@ void CNode::copyStats(CNodeStats& stats)
     X(fInbound);
     X(nStartingHeight);
     X(nSendBytes);
+    for (int i = 0; i < SEND_PRIORITY_COUNT; i++)
+        stats.nSendBytesPerPriority[i] = nSendBytesPerPriority[i];
     X(nRecvBytes);
+    {
+        LOCK(cs_msgCmdStats);
+        X(mapMsgCmdStats);
+    }
     X(fWhitelisted);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -735,6 +882,8 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            // hash here, not on the message handler thread
+            msg.GetMessageHash();
             messageHandlerCondition.notify_one();
         }
     }
@@ -772,41 +921,153 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
     return nCopy;
 }
 
+/** Payload buffers of processed messages, reused so large messages are not reallocated (and wiped on free) every time */
+static CCriticalSection cs_vRecvBufferPool;
+static std::vector<CDataStream> vRecvBufferPool;
+static size_t nRecvBufferPoolSize = 0;
+
+/** Swap the pooled buffer that best fits nSize, without exceeding nMaxSize, into vRecv, which is left empty
+ *  with room for at least nSize bytes */
+static void AcquireRecvBuffer(CDataStream& vRecv, unsigned int nSize, unsigned int nMaxSize)
+{
+    {
+        LOCK(cs_vRecvBufferPool);
+        std::vector<CDataStream>::iterator itBest = vRecvBufferPool.end();
+        for (std::vector<CDataStream>::iterator it = vRecvBufferPool.begin(); it != vRecvBufferPool.end(); ++it) {
+            if (it->capacity() >= nSize && it->capacity() <= nMaxSize && (itBest == vRecvBufferPool.end() || it->capacity() < itBest->capacity()))
+                itBest = it;
+        }
+        if (itBest != vRecvBufferPool.end()) {
+            int nType = vRecv.GetType();
+            int nVersion = vRecv.GetVersion();
+            nRecvBufferPoolSize -= itBest->capacity();
+            std::swap(vRecv, *itBest);
+            std::swap(*itBest, vRecvBufferPool.back());
+            vRecvBufferPool.pop_back();
+            vRecv.SetType(nType);
+            vRecv.SetVersion(nVersion);
+        }
+    }
+    vRecv.clear();
+    vRecv.reserve(nSize);
+}
+
+void ReleaseRecvBuffer(CDataStream& vRecv)
+{
+    size_t nCapacity = vRecv.capacity();
+    if (nCapacity == 0)
+        return;
+
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.size() >= MAX_RECV_BUFFER_POOL_COUNT || nRecvBufferPoolSize + nCapacity > MAX_RECV_BUFFER_POOL_SIZE)
+        return;
+    vRecvBufferPool.push_back(CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    std::swap(vRecvBufferPool.back(), vRecv);
+    vRecvBufferPool.back().clear();
+    nRecvBufferPoolSize += vRecvBufferPool.back().capacity();
+}
+
+const uint256& CNetMessage::GetMessageHash()
+{
+    assert(complete());
+    if (hashData == 0)
+        hasher.Finalize((unsigned char*)&hashData);
+    return hashData;
+}
+
 int CNetMessage::readData(const char* pch, unsigned int nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    // Grow the buffer as the payload arrives rather than trusting the announced size up front,
+    // GetTotalRecvSize counts its capacity toward -maxreceivebuffer.
+    if (nDataPos == 0)
+        AcquireRecvBuffer(vRecv, std::min(hdr.nMessageSize, RECV_BUFFER_GROWTH_SIZE), hdr.nMessageSize);
+    if (vRecv.capacity() < nDataPos + nCopy)
+        vRecv.reserve(std::min(hdr.nMessageSize, nDataPos + nCopy + RECV_BUFFER_GROWTH_SIZE));
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
+    hasher.Write((const unsigned char*)pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
 
+static const char* pszMasternodeSendCommands[] = {"mnb", "don", "dseg", "dsee", "dseep", "mnget", "mnw", "mnvs",
+    "mprop", "mvote", "fbs", "fbvote", "ssc"};
+static const std::set<std::string> setMasternodeSendCommands(pszMasternodeSendCommands,
+    pszMasternodeSendCommands + ARRAYLEN(pszMasternodeSendCommands));
+static const char* pszTxSendCommands[] = {"tx", "ix", "txlvote", "addr"};
+static const std::set<std::string> setTxSendCommands(pszTxSendCommands, pszTxSendCommands + ARRAYLEN(pszTxSendCommands));
+
+SendPriority GetSendPriority(const std::string& strCommand)
+{
+    if (setMasternodeSendCommands.count(strCommand))
+        return SEND_PRIORITY_MASTERNODE;
+    if (setTxSendCommands.count(strCommand))
+        return SEND_PRIORITY_TX;
+    return SEND_PRIORITY_CONSENSUS;
+}
+
+const char* GetSendPriorityName(int nPriority)
+{
+    switch (nPriority) {
+    case SEND_PRIORITY_CONSENSUS:
+        return "consensus";
+    case SEND_PRIORITY_TX:
+        return "txrelay";
+    case SEND_PRIORITY_MASTERNODE:
+        return "masternode";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * Point nSendQueue at the queue the next message should come from. A queue keeps its turn while its
+ * deficit covers its next message; passing the turn grants the next non-empty queue its quantum.
+ * A block queued behind a masternode list sync thus waits for at most one masternode quantum.
+ * Requires cs_vSend, and no message may be partially sent.
+ */
+static bool SelectSendQueue(CNode* pnode)
+{
+    if (pnode->nSendSize == 0)
+        return false;
+
+    while (true) {
+        std::deque<CSerializeData>& queue = pnode->vSendMsg[pnode->nSendQueue];
+        if (queue.empty())
+            pnode->nSendDeficit[pnode->nSendQueue] = 0;
+        else if ((int64_t)queue.front().size() <= pnode->nSendDeficit[pnode->nSendQueue])
+            return true;
+
+        pnode->nSendQueue = (pnode->nSendQueue + 1) % SEND_PRIORITY_COUNT;
+        if (!pnode->vSendMsg[pnode->nSendQueue].empty())
+            pnode->nSendDeficit[pnode->nSendQueue] += SEND_QUEUE_QUANTUM[pnode->nSendQueue];
+    }
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
-
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
+    while (pnode->nSendOffset != 0 || SelectSendQueue(pnode)) {
+        std::deque<CSerializeData>& queue = pnode->vSendMsg[pnode->nSendQueue];
+        const CSerializeData& data = queue.front();
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
+            pnode->nSendBytesPerPriority[pnode->nSendQueue] += nBytes;
             pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
+                pnode->nSendDeficit[pnode->nSendQueue] -= data.size();
+                queue.pop_front();
             } else {
                 // could not send full message; stop sending more
                 break;
@@ -825,18 +1086,344 @@ void SocketSendData(CNode* pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
-        assert(pnode->nSendOffset == 0);
-        assert(pnode->nSendSize == 0);
-    }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    UpdateSendEvents(pnode);
 }
 
 static list<CNode*> vNodesDisconnected;
 
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    } else if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+/** Read once from the node's socket. Returns whether the socket may hold more data. */
+static bool SocketRecvData(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return true;
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        // a short read means the socket buffer is drained
+        return nBytes == (int)sizeof(pchBuf);
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// Implement the following logic:
+// * If there is data to send, wait for sending data. As this only
+//   happens when optimistic write failed, we choose to first drain the
+//   write buffer in this case before receiving more. This avoids
+//   needlessly queueing received data, if the remote peer is not themselves
+//   receiving data. This means properly utilizing TCP flow control signalling.
+// * Otherwise, if there is no (complete) message in the receive buffer,
+//   or there is space left in the buffer, wait for receiving data.
+// * (if neither of the above applies, there is certainly one message
+//   in the receiver buffer ready to be processed).
+// Together, that means that at least one of the following is always possible,
+// so we don't deadlock:
+// * We send some data.
+// * We wait for data to be received (and disconnect after timeout).
+// * We process a message in the buffer (message handler thread).
+static bool WantsToSend(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    return lockSend && pnode->nSendSize != 0;
+}
+
+static bool WantsToReceive(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    return lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                           pnode->GetTotalRecvSize() <= ReceiveFloodSize());
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+static void SocketEventsSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = SOCKET_EVENTS_TIMEOUT * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            if (WantsToSend(pnode))
+                FD_SET(pnode->hSocket, &fdsetSend);
+            else if (WantsToReceive(pnode))
+                FD_SET(pnode->hSocket, &fdsetRecv);
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec / 1000);
+    }
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            AcceptConnection(hListenSocket);
+    }
+
+    //
+    // Service each socket
+    //
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+        boost::this_thread::interruption_point();
+
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            SocketRecvData(pnode);
+
+        //
+        // Send
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                SocketSendData(pnode);
+        }
+
+        //
+        // Inactivity checking
+        //
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Service only the sockets epoll reported. Edge-triggered readiness is remembered in the node
+ * (fHasRecvData/fCanSendData) until it is consumed, as no new edge arrives for a socket we did
+ * not drain. setEventNodes holds the nodes with such leftover readiness; nodes leave it before
+ * they are deleted, and epoll stops reporting a node once its socket is closed.
+ */
+static void SocketEventsEpoll(std::set<CNode*>& setEventNodes, bool& fBusy, int64_t& nLastInactivityCheck)
+{
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_SOCKET_EVENTS, fBusy ? 0 : SOCKET_EVENTS_TIMEOUT);
+    boost::this_thread::interruption_point();
+
+    if (nEvents == SOCKET_ERROR) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+            MilliSleep(SOCKET_EVENTS_TIMEOUT);
+        }
+        nEvents = 0;
+    }
+
+    bool fAccept = false;
+    for (int i = 0; i < nEvents; i++) {
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (pnode == NULL) {
+            // listening sockets are registered without a node
+            fAccept = true;
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            pnode->fHasRecvData = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fCanSendData = true;
+        setEventNodes.insert(pnode);
+    }
+
+    //
+    // Accept new connections
+    //
+    if (fAccept) {
+        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+            if (hListenSocket.socket != INVALID_SOCKET)
+                AcceptConnection(hListenSocket);
+        }
+    }
+
+    //
+    // Service the sockets with pending events
+    //
+    fBusy = false;
+    std::set<CNode*>::iterator it = setEventNodes.begin();
+    while (it != setEventNodes.end()) {
+        CNode* pnode = *it;
+        boost::this_thread::interruption_point();
+
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fCanSendData) {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend) {
+                pnode->fCanSendData = false;
+                SocketSendData(pnode);
+            } else {
+                fBusy = true;
+            }
+        }
+
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fHasRecvData && !WantsToSend(pnode) && WantsToReceive(pnode)) {
+            pnode->fHasRecvData = SocketRecvData(pnode);
+            fBusy |= pnode->fHasRecvData;
+        }
+
+        if (pnode->hSocket == INVALID_SOCKET || (!pnode->fHasRecvData && !pnode->fCanSendData))
+            setEventNodes.erase(it++);
+        else
+            ++it;
+    }
+
+    //
+    // Inactivity checking
+    //
+    int64_t nTime = GetTime();
+    if (nTime != nLastInactivityCheck) {
+        nLastInactivityCheck = nTime;
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            InactivityCheck(pnode);
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    std::set<CNode*> setEventNodes;
+#ifdef HAVE_SYS_EPOLL_H
+    bool fEventsBusy = false;
+    int64_t nLastInactivityCheck = 0;
+#endif
     while (true) {
         //
         // Disconnect nodes
@@ -856,6 +1443,7 @@ void ThreadSocketHandler()
 
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
+                    setEventNodes.erase(pnode);
 
                     // hold in disconnected pool until all refs are released
                     if (pnode->fNetworkNode || pnode->fInbound)
@@ -884,6 +1472,7 @@ void ThreadSocketHandler()
                     }
                     if (fDelete) {
                         vNodesDisconnected.remove(pnode);
+                        setEventNodes.erase(pnode);
                         delete pnode;
                     }
                 }
@@ -899,218 +1488,13 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
-
-        //
-        // Accept new connections
-        //
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
-        }
-
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-            boost::this_thread::interruption_point();
-
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->Release();
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1) {
+            SocketEventsEpoll(setEventNodes, fEventsBusy, nLastInactivityCheck);
+            continue;
         }
+#endif
+        SocketEventsSelect();
     }
 }
 
@@ -1526,7 +1910,7 @@ void ThreadMessageHandler()
                         pnode->CloseSocketDisconnect();
 
                     if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
+                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete() && !pnode->fLaneBlocked)) {
                             fSleep = false;
                         }
                     }
@@ -1739,6 +2123,22 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     Discover(threadGroup);
 
+#ifdef HAVE_SYS_EPOLL_H
+    CreateEpoll();
+    if (hEpoll != -1) {
+        // Listening sockets stay level-triggered and carry no node
+        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) == SOCKET_ERROR)
+                LogPrintf("socket epoll_ctl failed for listening socket: %s\n", NetworkErrorString(errno));
+        }
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", GetSocketEventsModeName(nSocketEventsMode));
+
     //
     // Start threads
     //
@@ -1816,6 +2216,13 @@ public:
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
 
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1) {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
+
 #ifdef WIN32
         // Shutdown Windows Sockets
         WSACleanup();
@@ -1831,6 +2238,12 @@ void CExplicitNetCleanup::callCleanup()
     delete tmp; // Stroustrup's gonna kill me for that
 }
 
+/** Approximate memory held by a mapRelay entry and its expiration record */
+static size_t RelayEntryUsage(const CDataStream& ss)
+{
+    return ss.capacity() + sizeof(std::pair<const CInv, CDataStream>) + sizeof(std::pair<int64_t, CInv>) + 4 * sizeof(void*);
+}
+
 void RelayTransaction(const CTransaction& tx)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
@@ -1844,15 +2257,19 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
     CInv inv(MSG_TX, tx.GetHash());
     {
         LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
+        // Save original serialized message so newer versions are preserved
+        if (mapRelay.insert(std::make_pair(inv, ss)).second) {
+            vRelayExpiration.push_back(std::make_pair(GetTime() + RELAY_EXPIRY, inv));
+            nRelayMemoryUsage += RelayEntryUsage(ss);
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        // Expire old relay messages, and the oldest ones beyond the memory limit
+        while (!vRelayExpiration.empty() && (vRelayExpiration.front().first < GetTime() || nRelayMemoryUsage > MAX_RELAY_MEMORY)) {
+            map<CInv, CDataStream>::iterator it = mapRelay.find(vRelayExpiration.front().second);
+            nRelayMemoryUsage -= RelayEntryUsage(it->second);
+            mapRelay.erase(it);
+            vRelayExpiration.pop_front();
+        }
     }
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
@@ -1915,6 +2332,41 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+void CNode::RecordMessageSent(const std::string& strCommand, uint64_t nBytes)
+{
+    LOCK(cs_msgCmdStats);
+    mapMsgCmdStats_t::iterator it = mapMsgCmdStats.find(strCommand);
+    if (it == mapMsgCmdStats.end())
+        it = mapMsgCmdStats.find(NET_MESSAGE_COMMAND_OTHER);
+    it->second.nSendMsgs++;
+    it->second.nSendBytes += nBytes;
+}
+
+void CNode::RecordMessageRecv(const std::string& strCommand, uint64_t nBytes, int64_t nProcessUsec)
+{
+    LOCK(cs_msgCmdStats);
+    mapMsgCmdStats_t::iterator it = mapMsgCmdStats.find(strCommand);
+    if (it == mapMsgCmdStats.end())
+        it = mapMsgCmdStats.find(NET_MESSAGE_COMMAND_OTHER);
+    it->second.nRecvMsgs++;
+    it->second.nRecvBytes += nBytes;
+    it->second.nProcessUsec += nProcessUsec;
+}
+
+void CNode::GetTotalMsgCmdStats(mapMsgCmdStats_t& mapStats)
+{
+    {
+        LOCK(cs_totalMsgCmdStats);
+        mapStats = mapTotalMsgCmdStats;
+    }
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        LOCK(pnode->cs_msgCmdStats);
+        for (mapMsgCmdStats_t::const_iterator it = pnode->mapMsgCmdStats.begin(); it != pnode->mapMsgCmdStats.end(); ++it)
+            mapStats[it->first] += it->second;
+    }
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -2046,7 +2498,9 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+                                                                                                  filterAddrKnown(ADDR_KNOWN_ELEMENTS, 0.001),
+                                                                                                  filterInventoryKnown(INVENTORY_KNOWN_ELEMENTS, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2071,11 +2525,23 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendQueue = SEND_PRIORITY_CONSENSUS;
+    for (int i = 0; i < SEND_PRIORITY_COUNT; i++) {
+        nSendDeficit[i] = 0;
+        nSendBytesPerPriority[i] = 0;
+    }
+    nSendPriority = SEND_PRIORITY_CONSENSUS;
+    BOOST_FOREACH (const std::string& strCommand, GetAllNetMessageTypes())
+        mapMsgCmdStats[strCommand] = CNetMsgStats();
+    mapMsgCmdStats[NET_MESSAGE_COMMAND_OTHER] = CNetMsgStats();
+    fSendEvents = false;
+    fHasRecvData = false;
+    fCanSendData = false;
+    fLaneBlocked = false;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2093,6 +2559,10 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     else
         LogPrint("net", "Added connection peer=%d\n", id);
 
+#ifdef HAVE_SYS_EPOLL_H
+    EpollControl(this, EPOLL_CTL_ADD);
+#endif
+
     // Be shy and don't send version until we hear
     if (hSocket != INVALID_SOCKET && !fInbound)
         PushVersion();
@@ -2102,11 +2572,21 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
 
 CNode::~CNode()
 {
+#ifdef HAVE_SYS_EPOLL_H
+    EpollControl(this, EPOLL_CTL_DEL);
+#endif
     CloseSocket(hSocket);
 
     if (pfilter)
         delete pfilter;
 
+    {
+        LOCK(cs_totalMsgCmdStats);
+        for (mapMsgCmdStats_t::const_iterator it = mapMsgCmdStats.begin(); it != mapMsgCmdStats.end(); ++it)
+            if (!it->second.IsNull())
+                mapTotalMsgCmdStats[it->first] += it->second;
+    }
+
     GetNodeSignals().FinalizeNode(GetId());
 }
 
@@ -2141,10 +2621,17 @@ void CNode::AskFor(const CInv& inv)
 }
 
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
+{
+    BeginMessage(pszCommand, GetSendPriority(pszCommand));
+}
+
+void CNode::BeginMessage(const char* pszCommand, SendPriority nPriority) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
     ssSend << CMessageHeader(pszCommand, 0);
+    nSendPriority = nPriority;
+    strSendCommand = pszCommand;
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2186,12 +2673,15 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    RecordMessageSent(strSendCommand, ssSend.size());
+
+    std::deque<CSerializeData>& queue = vSendMsg[nSendPriority];
+    queue.push_back(CSerializeData());
+    ssSend.GetAndClear(queue.back());
+    nSendSize += queue.back().size();
 
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    // If write queues empty, attempt "optimistic write"
+    if (nSendSize == queue.back().size())
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
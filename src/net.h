@@ -11,11 +11,11 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
+#include "subnettrie.h"
 #include "sync.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
@@ -51,6 +51,29 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
+/** Send queues of a peer, highest priority first */
+enum SendPriority {
+    SEND_PRIORITY_CONSENSUS,  // blocks, headers, inventory and connection control
+    SEND_PRIORITY_TX,         // transaction and address relay
+    SEND_PRIORITY_MASTERNODE, // masternode list, winner and budget sync
+    SEND_PRIORITY_COUNT
+};
+/** Bytes a send queue may send per round of SocketSendData's deficit round robin, by priority */
+static const int64_t SEND_QUEUE_QUANTUM[SEND_PRIORITY_COUNT] = {2 * MAX_PROTOCOL_MESSAGE_LENGTH, 256 * 1024, 64 * 1024};
+/** Number of recent addresses remembered per peer so they are not sent back to it */
+static const unsigned int ADDR_KNOWN_ELEMENTS = 5000;
+/** Number of recent inventory items remembered per peer so they are not announced to it again */
+static const unsigned int INVENTORY_KNOWN_ELEMENTS = 5000;
+/** Seconds a relayed transaction stays available to getdata from mapRelay */
+static const int64_t RELAY_EXPIRY = 15 * 60;
+/** Maximum memory held by mapRelay, the oldest entries are dropped first beyond it */
+static const size_t MAX_RELAY_MEMORY = 16 * 1024 * 1024;
+/** Maximum number of payload buffers kept for reuse by incoming messages */
+static const unsigned int MAX_RECV_BUFFER_POOL_COUNT = 64;
+/** Maximum total capacity of the payload buffers kept for reuse */
+static const unsigned int MAX_RECV_BUFFER_POOL_SIZE = 4 * MAX_PROTOCOL_MESSAGE_LENGTH;
+/** Payload buffers grow by this much ahead of the received data, never beyond the announced message size */
+static const unsigned int RECV_BUFFER_GROWTH_SIZE = 256 * 1024;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** -upnp default */
@@ -62,6 +85,12 @@ static const bool DEFAULT_UPNP = false;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 
+/** How ThreadSocketHandler waits for socket readiness (-socketevents) */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT = 0,
+    SOCKETEVENTS_EPOLL = 1,
+};
+
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
 
@@ -80,6 +109,14 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+/** Select the socket events backend by name; false if it is unknown or not available in this build */
+bool SetSocketEventsMode(const std::string& strMode);
+SocketEventsMode GetSocketEventsMode();
+std::string GetSocketEventsModeName(SocketEventsMode mode);
+/** Default for -socketevents: epoll where available, select otherwise */
+std::string GetDefaultSocketEventsMode();
+/** Comma separated list of the modes this build supports */
+std::string GetSupportedSocketEventsModes();
 
 typedef int NodeId;
 
@@ -131,6 +168,8 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
+/** Wakes ThreadMessageHandler when a node has new work for it */
+extern boost::condition_variable messageHandlerCondition;
 extern std::map<CInv, CDataStream> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
@@ -150,6 +189,27 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Messages, bytes and handler time of one message command */
+class CNetMsgStats
+{
+public:
+    uint64_t nSendMsgs;
+    uint64_t nSendBytes;
+    uint64_t nRecvMsgs;
+    uint64_t nRecvBytes;
+    int64_t nProcessUsec; // wall time spent handling the received messages
+
+    CNetMsgStats() : nSendMsgs(0), nSendBytes(0), nRecvMsgs(0), nRecvBytes(0), nProcessUsec(0) {}
+
+    bool IsNull() const { return nSendMsgs == 0 && nRecvMsgs == 0; }
+    CNetMsgStats& operator+=(const CNetMsgStats& other);
+};
+
+typedef std::map<std::string, CNetMsgStats> mapMsgCmdStats_t;
+
+/** Commands outside GetAllNetMessageTypes() are counted under this name */
+extern const std::string NET_MESSAGE_COMMAND_OTHER;
+
 class CNodeStats
 {
 public:
@@ -165,7 +225,9 @@ public:
     bool fInbound;
     int nStartingHeight;
     uint64_t nSendBytes;
+    uint64_t nSendBytesPerPriority[SEND_PRIORITY_COUNT];
     uint64_t nRecvBytes;
+    mapMsgCmdStats_t mapMsgCmdStats;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -182,12 +244,15 @@ public:
     CMessageHeader hdr; // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv; // received message data
+    CDataStream vRecv; // received message data, sized to the announced payload once it starts arriving
     unsigned int nDataPos;
 
+    CHash256 hasher;  // running double-SHA256 of the payload received so far
+    uint256 hashData; // payload hash, set once the message is complete
+
     int64_t nTime; // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn), hashData(0)
     {
         hdrbuf.resize(24);
         in_data = false;
@@ -209,10 +274,20 @@ public:
         vRecv.SetVersion(nVersionIn);
     }
 
+    /** Double-SHA256 of the payload, the message must be complete */
+    const uint256& GetMessageHash();
+
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
 };
 
+/** Send queue a message goes to */
+SendPriority GetSendPriority(const std::string& strCommand);
+const char* GetSendPriorityName(int nPriority);
+
+/** Hand the payload buffer of a processed message back for reuse by the next incoming ones */
+void ReleaseRecvBuffer(CDataStream& vRecv);
+
 
 typedef enum BanReason
 {
@@ -285,16 +360,33 @@ public:
     SOCKET hSocket;
     CDataStream ssSend;
     size_t nSendSize;   // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendOffset; // offset inside the first message of vSendMsg[nSendQueue] already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    // One queue per SendPriority, drained by SocketSendData in deficit round robin
+    std::deque<CSerializeData> vSendMsg[SEND_PRIORITY_COUNT];
+    int nSendQueue;
+    int64_t nSendDeficit[SEND_PRIORITY_COUNT];
+    uint64_t nSendBytesPerPriority[SEND_PRIORITY_COUNT];
+    // Queue and command of the message being built in ssSend
+    SendPriority nSendPriority;
+    std::string strSendCommand;
     CCriticalSection cs_vSend;
+    // Whether the socket is watched for writability (epoll), protected by cs_vSend
+    bool fSendEvents;
+    // Edge-triggered readiness not consumed yet (epoll), only used by the socket handler thread
+    bool fHasRecvData;
+    bool fCanSendData;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // The next message waits for this peer's masternode message lane to drain, protected by cs_vRecvMsg
+    bool fLaneBlocked;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    // Per command statistics, holding every known command and NET_MESSAGE_COMMAND_OTHER from the start
+    mapMsgCmdStats_t mapMsgCmdStats;
+    CCriticalSection cs_msgCmdStats;
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -337,14 +429,19 @@ protected:
     // Denial-of-service detection/prevention
     // Key is IP address, value is banned-until-time
     static banmap_t setBanned;
+    // setBanned indexed for address lookups, value is banned-until-time; protected by cs_setBanned
+    static CSubNetTrie<int64_t> trieBanned;
     static CCriticalSection cs_setBanned;
     static bool setBannedIsDirty;
 
+    // requires LOCK(cs_setBanned)
+    static void RebuildBannedTrie();
+
     std::vector<std::string> vecRequestsFulfilled; //keep track of what client has asked for
 
     // Whitelisted ranges. Any node connecting from these is automatically
     // whitelisted (as well as those connecting to whitelisted binds).
-    static std::vector<CSubNet> vWhitelistedRange;
+    static CSubNetTrie<bool> trieWhitelistedRange;
     static CCriticalSection cs_vWhitelistedRange;
 
     // Basic fuzz-testing
@@ -356,12 +453,12 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -386,6 +483,9 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    // Per command statistics of the peers deleted so far
+    static CCriticalSection cs_totalMsgCmdStats;
+    static mapMsgCmdStats_t mapTotalMsgCmdStats;
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -406,8 +506,9 @@ public:
     unsigned int GetTotalRecvSize()
     {
         unsigned int total = 0;
+        // the memory held, a payload buffer may have room for more than it received so far
         BOOST_FOREACH (const CNetMessage& msg, vRecvMsg)
-            total += msg.vRecv.size() + 24;
+            total += msg.vRecv.capacity() + 24;
         return total;
     }
 
@@ -436,7 +537,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        filterAddrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -444,7 +545,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !filterAddrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -458,7 +559,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.GetKey());
         }
     }
 
@@ -466,7 +567,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.GetKey()))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -475,6 +576,8 @@ public:
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
     void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
+    // Same, queueing the message with nPriority instead of the command's own priority
+    void BeginMessage(const char* pszCommand, SendPriority nPriority) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void AbortMessage() UNLOCK_FUNCTION(cs_vSend);
@@ -509,6 +612,20 @@ public:
         }
     }
 
+    /** Push a message that has to stay in order with the messages of another send queue */
+    template <typename T1>
+    void PushMessageWithPriority(SendPriority nPriority, const char* pszCommand, const T1& a1)
+    {
+        try {
+            BeginMessage(pszCommand, nPriority);
+            ssSend << a1;
+            EndMessage();
+        } catch (...) {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template <typename T1, typename T2>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2)
     {
@@ -726,6 +843,11 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    void RecordMessageSent(const std::string& strCommand, uint64_t nBytes);
+    void RecordMessageRecv(const std::string& strCommand, uint64_t nBytes, int64_t nProcessUsec);
+    /** Per command statistics of all peers, connected or not, since startup */
+    static void GetTotalMsgCmdStats(mapMsgCmdStats_t& mapStats);
 };
 
 class CExplicitNetCleanup
@@ -128,6 +128,10 @@ public:
     std::string ToString() const;
     bool IsValid() const;
 
+    const CNetAddr& GetNetwork() const { return network; }
+    /** Number of leading one bits of the 128 bit netmask, or -1 when the netmask is not a prefix */
+    int GetPrefixLength() const;
+
     friend bool operator==(const CSubNet& a, const CSubNet& b);
     friend bool operator!=(const CSubNet& a, const CSubNet& b);
     friend bool operator<(const CSubNet& a, const CSubNet& b);
@@ -7,6 +7,7 @@
 #include "coincontrol.h"
 #include "init.h"
 #include "main.h"
+#include "masternode-budget.h"
 #include "masternodeman.h"
 #include "script/sign.h"
 #include "swifttx.h"
@@ -2309,9 +2310,19 @@ void ThreadCheckObfuScationPool()
                 mnodeman.ProcessMasternodeConnections();
                 masternodePayments.CleanPaymentList();
                 CleanTransactionLocksList();
+                mnodeman.JournalChanges();
             }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+            // journaled cache changes reach the disk every second, full snapshots only once a journal outgrows them
+            mnodemanJournal.Commit();
+            masternodePaymentsJournal.Commit();
+            budgetJournal.Commit();
+
+            if (c % MASTERNODES_DUMP_SECONDS == 0) {
+                DumpMasternodes();
+                DumpBudgets();
+                DumpMasternodePayments();
+            }
 
             obfuScationPool.CheckTimeout();
             obfuScationPool.CheckForCompleteQueue();
@@ -33,6 +33,20 @@ static const char* ppszTypeName[] =
         "mn ping",
         "dstx"};
 
+static const char* ppszNetMessageTypes[] = {
+    "version", "verack", "addr", "getaddr", "inv", "getdata", "notfound", "getblocks", "getheaders",
+    "headers", "block", "earlyblock", "getcmpct", "cmpctblock", "getblocktxn", "blocktxn", "tx",
+    "mempool", "merkleblock", "filterload", "filteradd", "filterclear", "ping", "pong", "alert",
+    "reject", "spork", "getsporks", "ix", "txlvote", "dstx", "mnb", "mnget", "mnw", "mnvs",
+    "dseg", "dsee", "dseep", "don", "mprop", "mvote", "fbs", "fbvote", "ssc", "dsa", "dsc",
+    "dsf", "dsi", "dsq", "dsr", "dss", "dssu"};
+static const std::vector<std::string> vAllNetMessageTypes(ppszNetMessageTypes, ppszNetMessageTypes + ARRAYLEN(ppszNetMessageTypes));
+
+const std::vector<std::string>& GetAllNetMessageTypes()
+{
+    return vAllNetMessageTypes;
+}
+
 CMessageHeader::CMessageHeader()
 {
     memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
@@ -152,3 +166,11 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+std::vector<unsigned char> CInv::GetKey() const
+{
+    std::vector<unsigned char> vKey(sizeof(type) + hash.size());
+    memcpy(&vKey[0], &type, sizeof(type));
+    memcpy(&vKey[sizeof(type)], hash.begin(), hash.size());
+    return vKey;
+}
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -63,6 +64,9 @@ public:
     unsigned int nChecksum;
 };
 
+/** Every message command this node sends or handles, used to keep per command statistics bounded */
+const std::vector<std::string>& GetAllNetMessageTypes();
+
 /** nServices flags */
 enum {
     NODE_NETWORK = (1 << 0),
@@ -77,6 +81,14 @@ enum {
 
 	 NODE_BLOOM_WITHOUT_MN = (1 << 4),
 
+    // NODE_COMPACT_BLOCKS means the node answers "getcmpct" with blocks made of short transaction ids
+    // ("cmpctblock") and serves the transactions the receiver could not find with "getblocktxn"/"blocktxn".
+    NODE_COMPACT_BLOCKS = (1 << 5),
+
+    // NODE_EARLY_BLOCKS means the node wants new blocks pushed to it as "earlyblock" as soon as their header,
+    // block signature and proof of stake are checked, before the sender has connected them.
+    NODE_EARLY_BLOCKS = (1 << 6),
+
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
     // bitcoin-development mailing list. Remember that service bits are just
@@ -145,6 +157,8 @@ public:
     bool IsMasterNodeType() const;
     const char* GetCommand() const;
     std::string ToString() const;
+    /** Type and hash as one key, a SwiftX lock request shares its hash with the transaction */
+    std::vector<unsigned char> GetKey() const;
 
     // TODO: make private (improves encapsulation)
 public:
@@ -306,20 +306,21 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
-    if (!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
-
     if (!fVerbose) {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        // The block as serialized on disk, without deserializing it
+        CDiskDataView view;
+        if (!ReadRawBlockFromDisk(view, pblockindex))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        return HexStr(view.begin(), view.end());
     }
 
-    return blockToJSON(block, pblockindex);
+    CBlockRef pblock;
+    if (!ReadBlockFromDisk(pblock, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    return blockToJSON(*pblock, pblockindex);
 }
 
 UniValue getblockheader(const UniValue& params, bool fHelp)
@@ -518,7 +519,14 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"blockcache\": {          (object) recently read or connected blocks kept in memory\n"
+            "    \"blocks\": xxxx,         (numeric) number of blocks cached\n"
+            "    \"usage\": xxxx,          (numeric) estimated memory they take, in bytes\n"
+            "    \"maxusage\": xxxx,       (numeric) memory limit of the cache, in bytes\n"
+            "    \"hits\": xxxx,           (numeric) block reads answered from the cache\n"
+            "    \"misses\": xxxx          (numeric) block reads that went to disk\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getblockchaininfo", "") + HelpExampleRpc("getblockchaininfo", ""));
@@ -531,6 +539,15 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+
+    CBlockCacheStats stats = blockCache.GetStats();
+    UniValue objCache(UniValue::VOBJ);
+    objCache.push_back(Pair("blocks", (uint64_t)stats.nBlocks));
+    objCache.push_back(Pair("usage", (uint64_t)stats.nUsage));
+    objCache.push_back(Pair("maxusage", (uint64_t)stats.nMaxUsage));
+    objCache.push_back(Pair("hits", stats.nHits));
+    objCache.push_back(Pair("misses", stats.nMisses));
+    obj.push_back(Pair("blockcache", objCache));
     return obj;
 }
 
@@ -931,6 +948,66 @@ UniValue getinvalid (const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue verifyinvalid(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "verifyinvalid ( store )\n"
+                "\nRescan the blocks of the fraudulent zerocoin range and compare the invalid outpoints found\n"
+                "with the set stored in the block index database and the set in use.\n"
+                "\nArguments:\n"
+                "1. store   (boolean, optional, default=false) Replace the stored set with the rescanned one when they differ; used from the next start\n"
+                "\nResult:\n"
+                "{\n"
+                "  \"height\": n,                (numeric) The last block scanned\n"
+                "  \"blockhash\": \"hash\",        (string) Its hash\n"
+                "  \"outpoints\": n,             (numeric) Number of invalid outpoints found\n"
+                "  \"serials\": n,               (numeric) Number of invalid serials found\n"
+                "  \"filtered\": x.xxx,          (numeric) Value filtered through the exchange addresses\n"
+                "  \"checksum\": \"hash\",         (string) Checksum of the rescanned set\n"
+                "  \"complete\": true|false,     (boolean) Whether every block of the range was scanned\n"
+                "  \"stored\": true|false,       (boolean) Whether the stored set matches the rescanned one\n"
+                "  \"loaded\": true|false,       (boolean) Whether the set in use matches the rescanned one\n"
+                "  \"written\": true|false       (boolean) Whether the rescanned set was stored\n"
+                "}\n"
+                "\nExamples:\n" +
+            HelpExampleCli("verifyinvalid", "") + HelpExampleRpc("verifyinvalid", "true"));
+
+    bool fStore = false;
+    if (params.size() == 1)
+        fStore = params[0].get_bool();
+
+    LOCK(cs_main);
+    CInvalidOutPointSet set;
+    bool fComplete = ComputeInvalidOutPoints(set);
+
+    CInvalidOutPointSet setStored;
+    bool fStoredMatch = pblocktree->ReadInvalidOutPoints(setStored) && setStored.hashChecksum == setStored.GetChecksum() &&
+                        setStored.hashChecksum == set.hashChecksum;
+    bool fLoadedMatch = mapInvalidOutPoints == set.mapOutPoints && mapInvalidSerials == set.mapSerials &&
+                        nFilteredThroughBittrex == set.nFilteredThroughBittrex;
+
+    bool fWritten = false;
+    if (fStore && fComplete && !fStoredMatch) {
+        if (!pblocktree->WriteInvalidOutPoints(set))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to write the invalid outpoints");
+        fWritten = true;
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("height", set.nHeight));
+    ret.push_back(Pair("blockhash", set.hashBlock.GetHex()));
+    ret.push_back(Pair("outpoints", (int64_t)set.mapOutPoints.size()));
+    ret.push_back(Pair("serials", (int64_t)set.mapSerials.size()));
+    ret.push_back(Pair("filtered", ValueFromAmount(set.nFilteredThroughBittrex)));
+    ret.push_back(Pair("checksum", set.hashChecksum.GetHex()));
+    ret.push_back(Pair("complete", fComplete));
+    ret.push_back(Pair("stored", fStoredMatch));
+    ret.push_back(Pair("loaded", fLoadedMatch));
+    ret.push_back(Pair("written", fWritten));
+    return ret;
+}
+
 UniValue findserial(const UniValue& params, bool fHelp)
 {
     if(fHelp || params.size() != 1)
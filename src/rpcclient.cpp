@@ -94,6 +94,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"importaddress", 2},
         {"verifychain", 0},
         {"verifychain", 1},
+        {"verifyinvalid", 0},
         {"keypoolrefill", 0},
         {"getrawmempool", 0},
         {"estimatefee", 0},
@@ -102,6 +103,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"prioritisetransaction", 2},
         {"setban", 2},
         {"setban", 3},
+        {"getnetmsgstats", 0},
         {"spork", 1},
         {"mnbudget", 3},
         {"mnbudget", 4},
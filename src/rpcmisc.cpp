@@ -147,6 +147,20 @@ UniValue mnsync(const UniValue& params, bool fHelp)
             "  \"countBudgetItemFin\": n,       (numeric) Number of MN budget finalization messages (local)\n"
             "  \"RequestedMasternodeAssets\": n, (numeric) Status code of last sync phase\n"
             "  \"RequestedMasternodeAttempt\": n, (numeric) Status code of last sync attempt\n"
+            "  \"assets\": [                   (array) Progress of each masternode asset\n"
+            "    {\n"
+            "      \"name\": \"xxxx\",           (string) Asset name (list, winners, budget)\n"
+            "      \"status\": \"xxxx\",         (string) 'pending', 'syncing' or 'finished'\n"
+            "      \"resumed\": true|false,     (boolean) Whether the asset only tops up a recent cache\n"
+            "      \"peersAsked\": n,           (numeric) Peers the asset was requested from\n"
+            "      \"peersReported\": n,        (numeric) Peers that sent their inventory count\n"
+            "      \"expected\": n,             (numeric) Largest inventory count reported by a peer\n"
+            "      \"received\": n,             (numeric) Distinct items received\n"
+            "      \"started\": ttt,            (numeric) Time the asset sync started\n"
+            "      \"finished\": ttt            (numeric) Time the asset sync finished\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
             "}\n"
 
             "\nResult ('reset' mode):\n"
@@ -175,6 +189,22 @@ UniValue mnsync(const UniValue& params, bool fHelp)
         obj.push_back(Pair("RequestedMasternodeAssets", masternodeSync.RequestedMasternodeAssets));
         obj.push_back(Pair("RequestedMasternodeAttempt", masternodeSync.RequestedMasternodeAttempt));
 
+        UniValue assets(UniValue::VARR);
+        BOOST_FOREACH (const CMasternodeSyncAsset& asset, masternodeSync.GetAssets()) {
+            UniValue assetObj(UniValue::VOBJ);
+            assetObj.push_back(Pair("name", asset.GetName()));
+            assetObj.push_back(Pair("status", asset.IsFinished() ? "finished" : asset.IsStarted() ? "syncing" : "pending"));
+            assetObj.push_back(Pair("resumed", asset.fResumed));
+            assetObj.push_back(Pair("peersAsked", (int)asset.mapAsked.size()));
+            assetObj.push_back(Pair("peersReported", (int)asset.mapReported.size()));
+            assetObj.push_back(Pair("expected", asset.nExpected));
+            assetObj.push_back(Pair("received", asset.nReceived));
+            assetObj.push_back(Pair("started", asset.nStarted));
+            assetObj.push_back(Pair("finished", asset.nFinished));
+            assets.push_back(assetObj);
+        }
+        obj.push_back(Pair("assets", assets));
+
         return obj;
     }
 
@@ -23,6 +23,24 @@
 
 using namespace std;
 
+/** Per command statistics as a json object, leaving out commands that were never seen */
+static UniValue MsgCmdStatsToJSON(const mapMsgCmdStats_t& mapStats)
+{
+    UniValue obj(UniValue::VOBJ);
+    for (mapMsgCmdStats_t::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        if (it->second.IsNull())
+            continue;
+        UniValue cmd(UniValue::VOBJ);
+        cmd.push_back(Pair("sentmsgs", it->second.nSendMsgs));
+        cmd.push_back(Pair("sentbytes", it->second.nSendBytes));
+        cmd.push_back(Pair("recvmsgs", it->second.nRecvMsgs));
+        cmd.push_back(Pair("recvbytes", it->second.nRecvBytes));
+        cmd.push_back(Pair("processtime", it->second.nProcessUsec * 0.000001));
+        obj.push_back(Pair(it->first, cmd));
+    }
+    return obj;
+}
+
 UniValue getconnectioncount(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -87,7 +105,13 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"lastsend\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last send\n"
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
+            "    \"bytessent_per_class\": {    (json object) The bytes sent from each send queue\n"
+            "       \"consensus\": n,          (numeric) Blocks, headers, inventory and connection control\n"
+            "       \"txrelay\": n,            (numeric) Transactions and addresses\n"
+            "       \"masternode\": n          (numeric) Masternode list, winner and budget sync\n"
+            "    },\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"msgstats\": {...},         (json object) Traffic and handler time per message command, as in getnetmsgstats\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"pingtime\": n,             (numeric) ping time\n"
             "    \"pingwait\": n,             (numeric) ping wait\n"
@@ -125,7 +149,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         obj.push_back(Pair("lastsend", stats.nLastSend));
         obj.push_back(Pair("lastrecv", stats.nLastRecv));
         obj.push_back(Pair("bytessent", stats.nSendBytes));
+        UniValue sentPerClass(UniValue::VOBJ);
+        for (int i = 0; i < SEND_PRIORITY_COUNT; i++)
+            sentPerClass.push_back(Pair(GetSendPriorityName(i), stats.nSendBytesPerPriority[i]));
+        obj.push_back(Pair("bytessent_per_class", sentPerClass));
         obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
+        obj.push_back(Pair("msgstats", MsgCmdStatsToJSON(stats.mapMsgCmdStats)));
         obj.push_back(Pair("conntime", stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
         obj.push_back(Pair("pingtime", stats.dPingTime));
@@ -336,18 +365,68 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"msgstats\": {...}      (json object) Traffic and handler time per message command, as in getnetmsgstats\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
 
+    mapMsgCmdStats_t mapStats;
+    CNode::GetTotalMsgCmdStats(mapStats);
+
     UniValue obj(UniValue::VOBJ);
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+    obj.push_back(Pair("msgstats", MsgCmdStatsToJSON(mapStats)));
     return obj;
 }
 
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getnetmsgstats ( nodeid )\n"
+            "\nReturns messages, bytes and handler time per message command, for all peers since startup\n"
+            "or for one connected peer. Commands never seen are left out, unknown ones are counted as \"*other*\".\n"
+            "\nArguments:\n"
+            "1. nodeid        (numeric, optional) The peer id as shown by getpeerinfo\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {\n"
+            "    \"sentmsgs\": n,      (numeric) Messages sent, including the ones still queued\n"
+            "    \"sentbytes\": n,     (numeric) Bytes sent, headers included\n"
+            "    \"recvmsgs\": n,      (numeric) Messages received and handled\n"
+            "    \"recvbytes\": n,     (numeric) Bytes received, headers included\n"
+            "    \"processtime\": x.x  (numeric) Seconds spent handling the received messages\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getnetmsgstats", "") + HelpExampleCli("getnetmsgstats", "3") + HelpExampleRpc("getnetmsgstats", "3"));
+
+    mapMsgCmdStats_t mapStats;
+    if (params.size() == 0)
+        CNode::GetTotalMsgCmdStats(mapStats);
+    else {
+        NodeId nodeid = params[0].get_int();
+        bool fFound = false;
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeid) {
+                LOCK(pnode->cs_msgCmdStats);
+                mapStats = pnode->mapMsgCmdStats;
+                fFound = true;
+                break;
+            }
+        }
+        if (!fFound)
+            throw JSONRPCError(RPC_CLIENT_NODE_NOT_CONNECTED, "Error: Node is not connected");
+    }
+
+    return MsgCmdStatsToJSON(mapStats);
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
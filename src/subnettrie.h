@@ -0,0 +1,125 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUBNETTRIE_H
+#define BITCOIN_SUBNETTRIE_H
+
+#include "netbase.h"
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Binary trie over the 128 bits of CNetAddr (IPv4 is stored mapped, onion addresses with their
+ * OnionCat prefix), mapping subnets to values. A lookup walks at most 128 nodes from the root
+ * and sees every stored subnet containing the address, however many subnets are stored.
+ * Subnets whose netmask is not a prefix (a.b.c.d/255.0.255.0) cannot live in the trie and are
+ * kept in a side list that is scanned on every lookup.
+ */
+template <typename T>
+class CSubNetTrie
+{
+public:
+    CSubNetTrie() { clear(); }
+
+    void clear()
+    {
+        vNodes.assign(1, Node());
+        vValues.clear();
+        vIrregular.clear();
+    }
+
+    /** Number of subnets stored */
+    size_t size() const { return vValues.size() + vIrregular.size(); }
+    bool empty() const { return size() == 0; }
+
+    /** Store value for subnet, replacing the value it had */
+    void insert(const CSubNet& subnet, const T& value)
+    {
+        if (!subnet.IsValid())
+            return;
+        int nPrefix = subnet.GetPrefixLength();
+        if (nPrefix < 0) {
+            for (size_t i = 0; i < vIrregular.size(); i++) {
+                if (vIrregular[i].first == subnet) {
+                    vIrregular[i].second = value;
+                    return;
+                }
+            }
+            vIrregular.push_back(std::make_pair(subnet, value));
+            return;
+        }
+
+        const CNetAddr& network = subnet.GetNetwork();
+        uint32_t nNode = 0;
+        for (int nBit = 0; nBit < nPrefix; nBit++) {
+            int nSide = GetBit(network, nBit);
+            if (vNodes[nNode].nChild[nSide] == 0) {
+                vNodes[nNode].nChild[nSide] = vNodes.size();
+                vNodes.push_back(Node());
+            }
+            nNode = vNodes[nNode].nChild[nSide];
+        }
+        if (vNodes[nNode].nValue == NO_VALUE) {
+            vNodes[nNode].nValue = vValues.size();
+            vValues.push_back(value);
+        } else
+            vValues[vNodes[nNode].nValue] = value;
+    }
+
+    /** Whether pred holds for the value of any stored subnet containing addr */
+    template <typename Pred>
+    bool any_match(const CNetAddr& addr, Pred pred) const
+    {
+        if (!addr.IsValid())
+            return false;
+        uint32_t nNode = 0;
+        for (int nBit = 0;; nBit++) {
+            if (vNodes[nNode].nValue != NO_VALUE && pred(vValues[vNodes[nNode].nValue]))
+                return true;
+            if (nBit == 128)
+                break;
+            nNode = vNodes[nNode].nChild[GetBit(addr, nBit)];
+            if (nNode == 0)
+                break;
+        }
+        for (size_t i = 0; i < vIrregular.size(); i++) {
+            if (vIrregular[i].first.Match(addr) && pred(vIrregular[i].second))
+                return true;
+        }
+        return false;
+    }
+
+    /** Whether any stored subnet contains addr */
+    bool match(const CNetAddr& addr) const
+    {
+        return any_match(addr, AlwaysTrue);
+    }
+
+private:
+    static const uint32_t NO_VALUE = 0xffffffff;
+
+    // Children are indexes into vNodes, 0 (the root, which is nobody's child) meaning none
+    struct Node {
+        uint32_t nChild[2];
+        uint32_t nValue;
+
+        Node() : nValue(NO_VALUE) { nChild[0] = nChild[1] = 0; }
+    };
+
+    std::vector<Node> vNodes;
+    std::vector<T> vValues;
+    std::vector<std::pair<CSubNet, T> > vIrregular;
+
+    static int GetBit(const CNetAddr& addr, int nBit)
+    {
+        // GetByte counts from the last byte of the address
+        return (addr.GetByte(15 - (nBit >> 3)) >> (7 - (nBit & 7))) & 1;
+    }
+
+    static bool AlwaysTrue(const T&) { return true; }
+};
+
+#endif // BITCOIN_SUBNETTRIE_H
@@ -21,6 +21,8 @@
 
 #include <boost/lexical_cast.hpp>
 
+#include <queue>
+
 using namespace std;
 using namespace boost;
 
@@ -30,8 +32,30 @@ std::map<uint256, CConsensusVote> mapTxLockVote;
 std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
+int64_t nUnknownVotesTimeTotal = 0;
 int nCompleteTXLocks;
 
+// locks ordered by expiration time, stale entries are skipped when they come up
+typedef std::pair<int64_t, uint256> LockExpiry;
+std::priority_queue<LockExpiry, std::vector<LockExpiry>, std::greater<LockExpiry> > heapLockExpiry;
+
+static void ScheduleLockExpiry(const CTransactionLock& lock)
+{
+    heapLockExpiry.push(std::make_pair((int64_t)lock.nExpiration, lock.txHash));
+}
+
+static void SetUnknownVoteTime(const uint256& hash, int64_t nTime)
+{
+    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.find(hash);
+    if (it != mapUnknownVotes.end()) {
+        nUnknownVotesTimeTotal += nTime - it->second;
+        it->second = nTime;
+    } else {
+        nUnknownVotesTimeTotal += nTime;
+        mapUnknownVotes.insert(make_pair(hash, nTime));
+    }
+}
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -154,7 +178,7 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
             */
             if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
                 if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
+                    SetUnknownVoteTime(ctx.vinMasternode.prevout.hash, GetTime() + (60 * 10));
                 }
 
                 if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
@@ -164,7 +188,7 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
                               ctx.txHash.ToString().c_str());
                     return;
                 } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
+                    SetUnknownVoteTime(ctx.vinMasternode.prevout.hash, GetTime() + (60 * 10));
                 }
             }
             RelayInv(inv);
@@ -253,6 +277,7 @@ int64_t CreateNewLock(CTransaction tx)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = tx.GetHash();
         mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
+        ScheduleLockExpiry(newLock);
     } else {
         mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
         LogPrint("swiftx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
@@ -288,14 +313,11 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
     ctx.vinMasternode = activeMasternode.vin;
     ctx.txHash = tx.GetHash();
     ctx.nBlockHeight = nBlockHeight;
+    // Sign() verifies the signature against our key already
     if (!ctx.Sign()) {
         LogPrintf("SwiftX::DoConsensusVote - Failed to sign consensus vote\n");
         return;
     }
-    if (!ctx.SignatureValid()) {
-        LogPrintf("SwiftX::DoConsensusVote - Signature invalid\n");
-        return;
-    }
 
     mapTxLockVote[ctx.GetHash()] = ctx;
 
@@ -340,6 +362,7 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = ctx.txHash;
         mapTxLocks.insert(make_pair(ctx.txHash, newLock));
+        ScheduleLockExpiry(newLock);
     } else
         LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
 
@@ -356,12 +379,16 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         }
 #endif
 
-        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
+        int nSignatures = (*i).second.CountSignatures();
+        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", nSignatures, ctx.GetHash().ToString().c_str());
 
-        if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
+        if (nSignatures >= SWIFTTX_SIGNATURES_REQUIRED) {
             LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
+            // votes can arrive before the request, don't create an empty one for them
+            std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(ctx.txHash);
+            CTransaction txEmpty;
+            CTransaction& tx = itReq != mapTxLockReq.end() ? itReq->second : txEmpty;
             if (!CheckForConflictingLocks(tx)) {
 #ifdef ENABLE_WALLET
                 if (pwalletMain) {
@@ -371,7 +398,7 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
                 }
 #endif
 
-                if (mapTxLockReq.count(ctx.txHash)) {
+                if (itReq != mapTxLockReq.end()) {
                     BOOST_FOREACH (const CTxIn& in, tx.vin) {
                                     if (!mapLockedInputs.count(in.prevout)) {
                                         mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
@@ -404,62 +431,73 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
+    uint256 hashLockTx;
+    if (FindConflictingLock(tx, hashLockTx)) {
+        LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), hashLockTx.ToString().c_str());
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(tx.GetHash());
+        if (it != mapTxLocks.end()) {
+            it->second.nExpiration = GetTime();
+            ScheduleLockExpiry(it->second);
+        }
+        it = mapTxLocks.find(hashLockTx);
+        if (it != mapTxLocks.end()) {
+            it->second.nExpiration = GetTime();
+            ScheduleLockExpiry(it->second);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+bool FindConflictingLock(const CTransaction& tx, uint256& hashLockTx)
+{
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                            LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                            if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                            if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                            return true;
-                        }
-                    }
-                }
+        std::map<COutPoint, uint256>::const_iterator it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && it->second != tx.GetHash()) {
+            hashLockTx = it->second;
+            return true;
+        }
+    }
 
     return false;
 }
 
 int64_t GetAverageVoteTime()
 {
-    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
-    int64_t total = 0;
-    int64_t count = 0;
-
-    while (it != mapUnknownVotes.end()) {
-        total += it->second;
-        count++;
-        it++;
-    }
+    if (mapUnknownVotes.empty()) return 0;
 
-    return total / count;
+    return nUnknownVotesTimeTotal / (int64_t)mapUnknownVotes.size();
 }
 
 void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
-
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    int64_t nNow = GetTime();
+    while (!heapLockExpiry.empty() && heapLockExpiry.top().first < nNow) { //keep them for an hour
+        uint256 txHash = heapLockExpiry.top().second;
+        heapLockExpiry.pop();
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+        // the lock may be gone already, or have been scheduled again
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+        if (it == mapTxLocks.end() || nNow <= it->second.nExpiration) continue;
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                                mapLockedInputs.erase(in.prevout);
+        LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+        std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(txHash);
+        if (itReq != mapTxLockReq.end()) {
+            BOOST_FOREACH (const CTxIn& in, itReq->second.vin)
+                            mapLockedInputs.erase(in.prevout);
 
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                                mapTxLockVote.erase(v.GetHash());
-            }
+            mapTxLockReq.erase(itReq);
+            mapTxLockReqRejected.erase(txHash);
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
+                            mapTxLockVote.erase(v.GetHash());
         }
+
+        mapTxLocks.erase(it);
     }
 }
 
@@ -530,36 +568,13 @@ bool CConsensusVote::Sign()
 }
 
 
-bool CTransactionLock::SignaturesValid()
-{
-    BOOST_FOREACH (CConsensusVote vote, vecConsensusVotes) {
-                    int n = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
-
-                    if (n == -1) {
-                        LogPrintf("CTransactionLock::SignaturesValid() - Unknown Masternode\n");
-                        return false;
-                    }
-
-                    if (n > SWIFTTX_SIGNATURES_TOTAL) {
-                        LogPrintf("CTransactionLock::SignaturesValid() - Masternode not in the top %s\n", SWIFTTX_SIGNATURES_TOTAL);
-                        return false;
-                    }
-
-                    if (!vote.SignatureValid()) {
-                        LogPrintf("CTransactionLock::SignaturesValid() - Signature not valid\n");
-                        return false;
-                    }
-                }
-
-    return true;
-}
-
-void CTransactionLock::AddSignature(CConsensusVote& cv)
+void CTransactionLock::AddSignature(const CConsensusVote& cv)
 {
     vecConsensusVotes.push_back(cv);
+    mapHeightVotes[cv.nBlockHeight]++;
 }
 
-int CTransactionLock::CountSignatures()
+int CTransactionLock::CountSignatures() const
 {
     /*
         Only count signatures where the BlockHeight matches the transaction's blockheight.
@@ -568,11 +583,6 @@ int CTransactionLock::CountSignatures()
 
     if (nBlockHeight == 0) return -1;
 
-    int n = 0;
-    BOOST_FOREACH (CConsensusVote v, vecConsensusVotes) {
-                    if (v.nBlockHeight == nBlockHeight) {
-                        n++;
-                    }
-                }
-    return n;
+    std::map<int, int>::const_iterator it = mapHeightVotes.find(nBlockHeight);
+    return it != mapHeightVotes.end() ? it->second : 0;
 }
@@ -51,6 +51,9 @@ bool IsIXTXValid(const CTransaction& txCollateral);
 // if two conflicting locks are approved by the network, they will cancel out
 bool CheckForConflictingLocks(CTransaction& tx);
 
+// find an input of tx that is locked by another transaction
+bool FindConflictingLock(const CTransaction& tx, uint256& hashLockTx);
+
 void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
 //check if we need to vote on this transaction
@@ -97,18 +100,24 @@ class CTransactionLock
 public:
     int nBlockHeight;
     uint256 txHash;
+    // votes are only added after their rank and signature were checked
     std::vector<CConsensusVote> vecConsensusVotes;
     int nExpiration;
     int nTimeout;
 
-    bool SignaturesValid();
-    int CountSignatures();
-    void AddSignature(CConsensusVote& cv);
+    CTransactionLock() : nBlockHeight(0), txHash(0), nExpiration(0), nTimeout(0) {}
+
+    int CountSignatures() const;
+    void AddSignature(const CConsensusVote& cv);
 
-    uint256 GetHash()
+    uint256 GetHash() const
     {
         return txHash;
     }
+
+private:
+    // number of votes for each block height, only the lock's own height counts
+    std::map<int, int> mapHeightVotes;
 };
 
 
@@ -0,0 +1,83 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "test/test_donate.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockcache_tests)
+
+static CBlockRef BuildBlock(unsigned int nNonce, unsigned int nTx)
+{
+    return CBlockRef(new CBlock(BuildTestBlock(nNonce, nTx)));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    std::vector<CBlockRef> vBlocks;
+    for (unsigned int i = 0; i < 4; i++)
+        vBlocks.push_back(BuildBlock(i, 10));
+
+    // Room for three of the blocks
+    CBlockCache cache(1 << 20);
+    cache.Insert(vBlocks[0]->GetHash(), vBlocks[0]);
+    size_t nBlockUsage = cache.GetStats().nUsage;
+    BOOST_CHECK(nBlockUsage > BlockDynamicUsage(*vBlocks[0]));
+    cache.SetMaxUsage(nBlockUsage * 3);
+
+    cache.Insert(vBlocks[1]->GetHash(), vBlocks[1]);
+    cache.Insert(vBlocks[2]->GetHash(), vBlocks[2]);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 3U);
+
+    // Readers share the cached instance
+    BOOST_CHECK(cache.Get(vBlocks[0]->GetHash()) == vBlocks[0]);
+
+    // Block 1 is now the least recently used one
+    cache.Insert(vBlocks[3]->GetHash(), vBlocks[3]);
+    CBlockCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBlocks, 3U);
+    BOOST_CHECK_EQUAL(stats.nUsage, nBlockUsage * 3);
+    BOOST_CHECK(!cache.Get(vBlocks[1]->GetHash()));
+    BOOST_CHECK(cache.Get(vBlocks[0]->GetHash()));
+    BOOST_CHECK(cache.Get(vBlocks[2]->GetHash()));
+    BOOST_CHECK(cache.Get(vBlocks[3]->GetHash()));
+
+    stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nHits, 4U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+
+    cache.Erase(vBlocks[0]->GetHash());
+    BOOST_CHECK_EQUAL(cache.GetStats().nUsage, nBlockUsage * 2);
+
+    // A disabled cache keeps nothing
+    cache.SetMaxUsage(0);
+    stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nBlocks, 0U);
+    BOOST_CHECK_EQUAL(stats.nUsage, 0U);
+    cache.Insert(vBlocks[1]->GetHash(), vBlocks[1]);
+    BOOST_CHECK(!cache.Get(vBlocks[1]->GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_usage)
+{
+    // Bigger blocks are accounted as bigger
+    CBlockRef pblockSmall = BuildBlock(0, 1);
+    CBlockRef pblockBig = BuildBlock(1, 100);
+    BOOST_CHECK(BlockDynamicUsage(*pblockBig) > 10 * BlockDynamicUsage(*pblockSmall));
+
+    // A block over the limit on its own is not cached
+    CBlockCache cache(BlockDynamicUsage(*pblockBig) / 2);
+    cache.Insert(pblockBig->GetHash(), pblockBig);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 0U);
+    cache.Insert(pblockSmall->GetHash(), pblockSmall);
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 1U);
+
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.GetStats().nBlocks, 0U);
+    BOOST_CHECK_EQUAL(cache.GetStats().nUsage, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,105 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "main.h"
+#include "streams.h"
+#include "txmempool.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11 << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(4);
+    block.vtx[0] = tx; // coinbase: null prevout
+    for (int i = 1; i < 4; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = i;
+        block.vtx[i] = tx;
+    }
+    block.nVersion = 1;
+    block.nTime = 1500000000;
+    block.nBits = 0x207fffff;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_roundtrip)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block = BuildBlockTestCase();
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 0, 0, 0.0, 1));
+    pool.addUnchecked(block.vtx[3].GetHash(), CTxMemPoolEntry(block.vtx[3], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block, 0x1234);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.shorttxids.size(), 3U);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblockRead;
+    stream >> cmpctblockRead;
+    BOOST_CHECK(cmpctblockRead.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblockRead.shorttxids == cmpctblock.shorttxids);
+    BOOST_CHECK_EQUAL(cmpctblockRead.GetShortID(block.vtx[2].GetHash()), cmpctblock.GetShortID(block.vtx[2].GetHash()));
+
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblockRead, pool) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(partialBlock.IsTxAvailable(3));
+
+    std::vector<uint16_t> vMissing = partialBlock.GetMissingIndexes();
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK_EQUAL(vMissing[0], 2);
+
+    // getblocktxn / blocktxn round trip
+    BlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.indexes = vMissing;
+    CDataStream streamReq(SER_NETWORK, PROTOCOL_VERSION);
+    streamReq << req;
+    BlockTransactionsRequest reqRead;
+    streamReq >> reqRead;
+    BOOST_CHECK(reqRead.indexes == req.indexes);
+
+    BlockTransactions resp(reqRead);
+    resp.txn[0] = block.vtx[2];
+
+    CBlock blockWrong;
+    std::vector<CTransaction> vtxWrong(1, block.vtx[1]);
+    BOOST_CHECK(partialBlock.FillBlock(blockWrong, vtxWrong) == READ_STATUS_FAILED);
+    BOOST_CHECK(partialBlock.FillBlock(blockWrong, std::vector<CTransaction>()) == READ_STATUS_INVALID);
+
+    CBlock blockFilled;
+    BOOST_CHECK(partialBlock.FillBlock(blockFilled, resp.txn) == READ_STATUS_OK);
+    BOOST_CHECK(blockFilled.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockFilled.vtx.size(), block.vtx.size());
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(blockFilled.vtx[i].GetHash() == block.vtx[i].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_bad_prefilled)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block = BuildBlockTestCase();
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block, 0);
+    cmpctblock.prefilledtxn[0].index = 4; // past the end of the block
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
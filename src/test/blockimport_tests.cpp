@@ -0,0 +1,125 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "random.h"
+#include "util.h"
+#include "test/test_donate.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+static void WriteHeader(CDataStream& ss, unsigned int nSize)
+{
+    ss << FLATDATA(Params().MessageStart()) << nSize;
+}
+
+static void WriteBlock(CDataStream& ss, const CBlock& block)
+{
+    WriteHeader(ss, ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+    ss << block;
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_order_and_rewind)
+{
+    std::vector<CBlock> vBlocks;
+    for (unsigned int i = 0; i < 5; i++)
+        vBlocks.push_back(BuildTestBlock(i));
+    unsigned int nBlockSize = ::GetSerializeSize(vBlocks[0], SER_DISK, CLIENT_VERSION);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    WriteBlock(ss, vBlocks[0]);
+    ss << std::string("junk between blocks");
+    WriteBlock(ss, vBlocks[1]);
+
+    // A header whose bytes do not decode, claiming the block after it as well
+    CDataStream ssNext(SER_DISK, CLIENT_VERSION);
+    WriteBlock(ssNext, vBlocks[2]);
+    WriteHeader(ss, 100 + ssNext.size());
+    ss << std::vector<unsigned char>(99, 0xff);
+    ss.write(&ssNext[0], ssNext.size());
+
+    // A header claiming more bytes than its block takes
+    WriteHeader(ss, nBlockSize + 10);
+    ss << vBlocks[3];
+    ss.write(std::string(10, '\0').data(), 10);
+    WriteBlock(ss, vBlocks[4]);
+
+    boost::filesystem::path path = GetTempPath() / strprintf("test_blockimport_%i", (int)GetRand(100000));
+    FILE* file = fopen(path.string().c_str(), "wb+");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+    rewind(file);
+
+    std::vector<uint256> vHashes;
+    int nBad = 0;
+    {
+        // Handled the way LoadExternalBlockFile does
+        CBlockImportPipeline pipeline(file, 3);
+        boost::shared_ptr<CImportedBlock> pimport;
+        while (pipeline.Next(pimport)) {
+            BOOST_CHECK(pimport->fDone);
+            if (!pimport->fDecoded) {
+                nBad++;
+                pipeline.Rewind(pimport->nPos - MESSAGE_START_SIZE - sizeof(unsigned int) + 1);
+                continue;
+            }
+            if (pimport->nDecodedSize != pimport->nSize) {
+                BOOST_CHECK_EQUAL(pimport->nDecodedSize, nBlockSize);
+                pipeline.Rewind(pimport->nPos + pimport->nDecodedSize);
+            }
+            vHashes.push_back(pimport->block.GetHash());
+        }
+        BOOST_CHECK(pipeline.GetError().empty());
+    }
+    boost::filesystem::remove(path);
+
+    BOOST_CHECK_EQUAL(nBad, 1);
+    BOOST_REQUIRE_EQUAL(vHashes.size(), vBlocks.size());
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+        BOOST_CHECK(vHashes[i] == vBlocks[i].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_stop)
+{
+    // More blocks than are taken out
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    std::vector<uint256> vExpected;
+    for (unsigned int i = 0; i < 200; i++) {
+        CBlock block = BuildTestBlock(i);
+        WriteBlock(ss, block);
+        vExpected.push_back(block.GetHash());
+    }
+
+    boost::filesystem::path path = GetTempPath() / strprintf("test_blockimport_%i", (int)GetRand(100000));
+    FILE* file = fopen(path.string().c_str(), "wb+");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+    rewind(file);
+
+    std::vector<uint256> vHashes;
+    {
+        CBlockImportPipeline pipeline(file, 4);
+        boost::shared_ptr<CImportedBlock> pimport;
+        while (pipeline.Next(pimport)) {
+            BOOST_CHECK(pimport->fDecoded);
+            vHashes.push_back(pimport->block.GetHash());
+            // Stopping part way is fine, the pipeline is torn down with its threads
+            if (vHashes.size() == 150)
+                break;
+        }
+    }
+    boost::filesystem::remove(path);
+
+    BOOST_REQUIRE_EQUAL(vHashes.size(), 150U);
+    for (unsigned int i = 0; i < vHashes.size(); i++)
+        BOOST_CHECK(vHashes[i] == vExpected[i]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
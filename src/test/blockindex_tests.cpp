@@ -0,0 +1,166 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "clientversion.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txdb.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace libzerocoin;
+
+BOOST_AUTO_TEST_SUITE(blockindex_tests)
+
+BOOST_AUTO_TEST_CASE(zerocoin_supply_serialization)
+{
+    std::map<CoinDenomination, int64_t> mapSupply;
+    CZerocoinSupply supply;
+    for (unsigned int i = 0; i < zerocoinDenomList.size(); i++) {
+        mapSupply[zerocoinDenomList[i]] = 1000 * i + 7;
+        supply.at(zerocoinDenomList[i]) = 1000 * i + 7;
+    }
+    BOOST_CHECK_THROW(supply.at(ZQ_ERROR), std::out_of_range);
+
+    // Same bytes as the map it replaces in the block index
+    CDataStream ssMap(SER_DISK, CLIENT_VERSION);
+    ssMap << mapSupply;
+    CDataStream ssSupply(SER_DISK, CLIENT_VERSION);
+    ssSupply << supply;
+    BOOST_CHECK(ssMap.str() == ssSupply.str());
+
+    CZerocoinSupply supplyRead;
+    ssMap >> supplyRead;
+    for (unsigned int i = 0; i < zerocoinDenomList.size(); i++)
+        BOOST_CHECK_EQUAL(supplyRead.at(zerocoinDenomList[i]), mapSupply[zerocoinDenomList[i]]);
+}
+
+BOOST_AUTO_TEST_CASE(zerocoin_mint_counts_serialization)
+{
+    // Written in block order by earlier versions
+    std::vector<CoinDenomination> vMints;
+    vMints.push_back(ZQ_FIFTY);
+    vMints.push_back(ZQ_ONE);
+    vMints.push_back(ZQ_FIFTY);
+    vMints.push_back(ZQ_FIVE_THOUSAND);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << vMints;
+
+    CZerocoinMintCounts counts;
+    ss >> counts;
+    BOOST_CHECK(!counts.IsNull());
+    BOOST_CHECK_EQUAL(counts.Count(ZQ_FIFTY), 2);
+    BOOST_CHECK_EQUAL(counts.Count(ZQ_ONE), 1);
+    BOOST_CHECK_EQUAL(counts.Count(ZQ_FIVE_THOUSAND), 1);
+    BOOST_CHECK_EQUAL(counts.Count(ZQ_TEN), 0);
+
+    // Written back in denomination order
+    std::vector<CoinDenomination> vSorted;
+    ss << counts;
+    ss >> vSorted;
+    BOOST_CHECK_EQUAL(vSorted.size(), 4U);
+    BOOST_CHECK(vSorted[0] == ZQ_ONE && vSorted[1] == ZQ_FIFTY && vSorted[2] == ZQ_FIFTY && vSorted[3] == ZQ_FIVE_THOUSAND);
+
+    counts.SetNull();
+    BOOST_CHECK(counts.IsNull());
+    counts.Add(ZQ_ERROR);
+    BOOST_CHECK(counts.IsNull());
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_arena)
+{
+    CBlockIndexArena arena;
+    std::set<CBlockIndex*> setIndex;
+    for (int i = 0; i < 10000; i++) {
+        CBlockIndex* pindex = arena.New();
+        BOOST_CHECK(pindex->pprev == NULL && pindex->mintDenominationsInBlock.IsNull());
+        pindex->nHeight = i;
+        setIndex.insert(pindex);
+    }
+    BOOST_CHECK_EQUAL(arena.size(), 10000U);
+    BOOST_CHECK_EQUAL(setIndex.size(), 10000U);
+
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+    BOOST_CHECK(arena.New() != NULL);
+    BOOST_CHECK_EQUAL(arena.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_load)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    std::vector<uint256> vHash;
+    uint256 hashPrev = GetRandHash();
+    for (int i = 0; i < 500; i++) {
+        CBlockIndex index;
+        index.nHeight = 1000000 + i;
+        index.nVersion = 4;
+        index.hashMerkleRoot = GetRandHash();
+        index.nTime = 1500000000 + i;
+        index.nBits = 0x207fffff;
+        index.zerocoinSupply.at(ZQ_TEN) = i;
+        CDiskBlockIndex diskindex(&index);
+        diskindex.hashPrev = hashPrev;
+        BOOST_CHECK(blocktree.WriteBlockIndex(diskindex));
+        hashPrev = diskindex.GetBlockHash();
+        vHash.push_back(hashPrev);
+    }
+
+    BOOST_CHECK(blocktree.LoadBlockIndexGuts());
+    for (int i = 0; i < 500; i++) {
+        BOOST_REQUIRE(mapBlockIndex.count(vHash[i]));
+        CBlockIndex* pindex = mapBlockIndex[vHash[i]];
+        BOOST_CHECK(pindex->GetBlockHash() == vHash[i]);
+        BOOST_CHECK_EQUAL(pindex->nHeight, 1000000 + i);
+        BOOST_CHECK_EQUAL(pindex->zerocoinSupply.at(ZQ_TEN), i);
+        BOOST_REQUIRE(pindex->pprev != NULL);
+        if (i > 0)
+            BOOST_CHECK(pindex->pprev == mapBlockIndex[vHash[i - 1]]);
+    }
+
+    // Leave the index as the other tests expect it
+    mapBlockIndex.erase(mapBlockIndex[vHash[0]]->pprev->GetBlockHash());
+    for (int i = 0; i < 500; i++)
+        mapBlockIndex.erase(vHash[i]);
+}
+
+BOOST_AUTO_TEST_CASE(invalid_outpoints_store)
+{
+    CInvalidOutPointSet set;
+    set.nHeight = 891737;
+    set.hashBlock = GetRandHash();
+    COutPoint outFirst(GetRandHash(), 0);
+    set.mapOutPoints[outFirst] = COutPoint();
+    set.mapOutPoints[COutPoint(GetRandHash(), 2)] = outFirst;
+    set.mapSerials[CBigNum(123456789)] = 100 * COIN;
+    set.nFilteredThroughBittrex = 5 * COIN;
+    set.hashChecksum = set.GetChecksum();
+
+    CBlockTreeDB blocktree(1 << 20, true);
+    CInvalidOutPointSet setRead;
+    BOOST_CHECK(!blocktree.ReadInvalidOutPoints(setRead));
+    BOOST_CHECK(blocktree.WriteInvalidOutPoints(set));
+    BOOST_CHECK(blocktree.ReadInvalidOutPoints(setRead));
+    BOOST_CHECK_EQUAL(setRead.nHeight, set.nHeight);
+    BOOST_CHECK(setRead.hashBlock == set.hashBlock);
+    BOOST_CHECK(setRead.mapOutPoints == set.mapOutPoints);
+    BOOST_CHECK(setRead.mapSerials == set.mapSerials);
+    BOOST_CHECK_EQUAL(setRead.nFilteredThroughBittrex, set.nFilteredThroughBittrex);
+    BOOST_CHECK(setRead.hashChecksum == setRead.GetChecksum());
+
+    // Any change to the content shows in the checksum
+    setRead.mapOutPoints.erase(outFirst);
+    BOOST_CHECK(setRead.hashChecksum != setRead.GetChecksum());
+    setRead = set;
+    setRead.nHeight++;
+    BOOST_CHECK(setRead.hashChecksum != setRead.GetChecksum());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
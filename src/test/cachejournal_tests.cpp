@@ -0,0 +1,176 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cachejournal.h"
+#include "random.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+static const unsigned char JOURNAL_RECORD_VALUE = 1;
+
+/** Collects replayed values, refusing record types it does not know */
+struct JournalCollector {
+    std::vector<int>* pvValues;
+
+    JournalCollector(std::vector<int>& vValues) : pvValues(&vValues) {}
+
+    bool operator()(unsigned char nType, CDataStream& ssPayload)
+    {
+        if (nType != JOURNAL_RECORD_VALUE) return false;
+        int nValue;
+        ssPayload >> nValue;
+        pvValues->push_back(nValue);
+        return true;
+    }
+};
+
+// header: magic message, network magic, snapshot hash; record: size, type + int, hash
+static const int64_t JOURNAL_RECORD_SIZE = 4 + 1 + 4 + 32;
+
+static void WriteJournal(const std::string& strFilename, const uint256& hashSnapshot, int nRecords)
+{
+    CCacheJournal journal(strFilename, "TestJournal");
+    BOOST_CHECK(journal.Reset(hashSnapshot, 0));
+    for (int i = 0; i < nRecords; i++)
+        journal.Append(JOURNAL_RECORD_VALUE, i);
+    journal.Commit();
+    journal.Close();
+}
+
+static int64_t JournalFileSize(const std::string& strFilename)
+{
+    return boost::filesystem::file_size(GetDataDir() / strFilename);
+}
+
+BOOST_AUTO_TEST_SUITE(cachejournal_tests)
+
+BOOST_AUTO_TEST_CASE(cachejournal_replay)
+{
+    uint256 hashSnapshot = GetRandHash();
+    WriteJournal("journal_replay.dat", hashSnapshot, 5);
+
+    std::vector<int> vValues;
+    CCacheJournal journal("journal_replay.dat", "TestJournal");
+    BOOST_CHECK(journal.Replay(hashSnapshot, 0, JournalCollector(vValues)));
+    BOOST_CHECK(journal.IsOpen());
+    BOOST_CHECK_EQUAL(vValues.size(), 5U);
+    for (int i = 0; i < (int)vValues.size(); i++)
+        BOOST_CHECK_EQUAL(vValues[i], i);
+    BOOST_CHECK_EQUAL(journal.GetSize(), JournalFileSize("journal_replay.dat"));
+
+    // New records follow the replayed ones
+    journal.Append(JOURNAL_RECORD_VALUE, 5);
+    journal.Close();
+
+    vValues.clear();
+    BOOST_CHECK(journal.Replay(hashSnapshot, 0, JournalCollector(vValues)));
+    BOOST_CHECK_EQUAL(vValues.size(), 6U);
+    BOOST_CHECK_EQUAL(vValues.back(), 5);
+    journal.Close();
+}
+
+BOOST_AUTO_TEST_CASE(cachejournal_stale_header)
+{
+    uint256 hashSnapshot = GetRandHash();
+    WriteJournal("journal_stale.dat", hashSnapshot, 3);
+    int64_t nHeaderSize = JournalFileSize("journal_stale.dat") - 3 * JOURNAL_RECORD_SIZE;
+
+    // Written against another snapshot: nothing is applied and the journal starts over
+    std::vector<int> vValues;
+    CCacheJournal journal("journal_stale.dat", "TestJournal");
+    BOOST_CHECK(journal.Replay(GetRandHash(), 0, JournalCollector(vValues)));
+    BOOST_CHECK(vValues.empty());
+    BOOST_CHECK(journal.IsOpen());
+    BOOST_CHECK_EQUAL(journal.GetSize(), nHeaderSize);
+    journal.Close();
+    BOOST_CHECK_EQUAL(JournalFileSize("journal_stale.dat"), nHeaderSize);
+
+    // Same for a journal kept by another cache
+    WriteJournal("journal_stale.dat", hashSnapshot, 3);
+    CCacheJournal journalOther("journal_stale.dat", "OtherJournal");
+    BOOST_CHECK(journalOther.Replay(hashSnapshot, 0, JournalCollector(vValues)));
+    BOOST_CHECK(vValues.empty());
+    journalOther.Close();
+}
+
+BOOST_AUTO_TEST_CASE(cachejournal_truncated_tail)
+{
+    uint256 hashSnapshot = GetRandHash();
+    WriteJournal("journal_truncated.dat", hashSnapshot, 4);
+    int64_t nFullSize = JournalFileSize("journal_truncated.dat");
+
+    // Crash halfway through appending the last record
+    boost::filesystem::resize_file(GetDataDir() / "journal_truncated.dat", nFullSize - 10);
+
+    std::vector<int> vValues;
+    CCacheJournal journal("journal_truncated.dat", "TestJournal");
+    BOOST_CHECK(journal.Replay(hashSnapshot, 0, JournalCollector(vValues)));
+    BOOST_CHECK_EQUAL(vValues.size(), 3U);
+    BOOST_CHECK_EQUAL(journal.GetSize(), nFullSize - JOURNAL_RECORD_SIZE);
+
+    // The torn tail is cut off, so an append lands right after the last good record
+    journal.Append(JOURNAL_RECORD_VALUE, 7);
+    journal.Close();
+    BOOST_CHECK_EQUAL(JournalFileSize("journal_truncated.dat"), nFullSize);
+
+    vValues.clear();
+    BOOST_CHECK(journal.Replay(hashSnapshot, 0, JournalCollector(vValues)));
+    BOOST_CHECK_EQUAL(vValues.size(), 4U);
+    BOOST_CHECK_EQUAL(vValues.back(), 7);
+    journal.Close();
+}
+
+BOOST_AUTO_TEST_CASE(cachejournal_corrupt_record)
+{
+    uint256 hashSnapshot = GetRandHash();
+    WriteJournal("journal_corrupt.dat", hashSnapshot, 4);
+    int64_t nFullSize = JournalFileSize("journal_corrupt.dat");
+    int64_t nHeaderSize = nFullSize - 4 * JOURNAL_RECORD_SIZE;
+
+    // Flip a payload byte of the third record
+    FILE* file = fopen((GetDataDir() / "journal_corrupt.dat").string().c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    long nPos = nHeaderSize + 2 * JOURNAL_RECORD_SIZE + 4 + 2;
+    fseek(file, nPos, SEEK_SET);
+    int ch = fgetc(file);
+    fseek(file, nPos, SEEK_SET);
+    fputc(ch ^ 0xff, file);
+    fclose(file);
+
+    // Replay stops at the bad checksum and drops everything after it
+    std::vector<int> vValues;
+    CCacheJournal journal("journal_corrupt.dat", "TestJournal");
+    BOOST_CHECK(journal.Replay(hashSnapshot, 0, JournalCollector(vValues)));
+    BOOST_CHECK_EQUAL(vValues.size(), 2U);
+    journal.Close();
+    BOOST_CHECK_EQUAL(JournalFileSize("journal_corrupt.dat"), nHeaderSize + 2 * JOURNAL_RECORD_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(cachejournal_unknown_record)
+{
+    uint256 hashSnapshot = GetRandHash();
+    {
+        CCacheJournal journal("journal_unknown.dat", "TestJournal");
+        BOOST_CHECK(journal.Reset(hashSnapshot, 0));
+        journal.Append(JOURNAL_RECORD_VALUE, 1);
+        journal.Append(JOURNAL_RECORD_VALUE + 1, 2);
+        journal.Append(JOURNAL_RECORD_VALUE, 3);
+        journal.Close();
+    }
+
+    // A record the owner refuses ends the replay like a corrupt one
+    std::vector<int> vValues;
+    CCacheJournal journal("journal_unknown.dat", "TestJournal");
+    BOOST_CHECK(journal.Replay(hashSnapshot, 0, JournalCollector(vValues)));
+    BOOST_CHECK_EQUAL(vValues.size(), 1U);
+    BOOST_CHECK_EQUAL(vValues[0], 1);
+    journal.Close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
 
 #include <vector>
@@ -175,4 +176,125 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+namespace
+{
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+    CLevelDBWrapper& GetDB() { return db; }
+};
+
+CCoins CoinsTestCase(unsigned int nOutputs, int nHeight)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = nHeight;
+    coins.fCoinStake = true;
+    coins.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = 1000 + i;
+        coins.vout[i].scriptPubKey = CScript() << OP_DUP << std::vector<unsigned char>(20, i) << OP_EQUAL;
+    }
+    return coins;
+}
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_memory_usage)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache cache(&base);
+    size_t nEmpty = cache.DynamicMemoryUsage();
+
+    uint256 txid = GetRandHash();
+    *cache.ModifyCoins(txid) = CoinsTestCase(10, 1);
+    size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > nEmpty + 10 * sizeof(CTxOut));
+
+    // Spending shrinks it, a flush empties it
+    cache.ModifyCoins(txid)->Spend(9);
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nUsage);
+    {
+        CCoinsViewCache child(&cache);
+        child.ModifyCoins(txid)->Spend(0);
+        BOOST_CHECK(child.Flush());
+        BOOST_CHECK_EQUAL(child.DynamicMemoryUsage(), memusage::DynamicUsage(CCoinsMap()));
+    }
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), memusage::DynamicUsage(CCoinsMap()));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_per_output)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coins = CoinsTestCase(3, 100);
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = coins;
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoins read;
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK(!db.HaveCoins(GetRandHash()));
+
+    // Spending one output touches its record only
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txid)->Spend(1);
+        BOOST_CHECK(cache.Flush());
+    }
+    coins.Spend(1);
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK(read.vout[1].IsNull());
+
+    // Confirmed again at another height: the remaining outputs go with the new metadata
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txid)->nHeight = 105;
+        BOOST_CHECK(cache.Flush());
+    }
+    coins.nHeight = 105;
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+
+    // Spending the rest removes the transaction
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txid)->Clear();
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(!db.GetCoins(txid, read));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest db;
+    std::vector<uint256> vTxid;
+    std::vector<CCoins> vCoins;
+    for (int i = 0; i < 20; i++) {
+        vTxid.push_back(GetRandHash());
+        vCoins.push_back(CoinsTestCase(1 + i % 4, i));
+        vCoins.back().fCoinBase = i % 2;
+        vCoins.back().fCoinStake = false;
+        if (vCoins.back().vout.size() > 1)
+            vCoins.back().Spend(0);
+        BOOST_CHECK(db.GetDB().Write(std::make_pair('c', vTxid.back()), vCoins.back()));
+    }
+    BOOST_CHECK(!db.HaveCoins(vTxid[0]));
+
+    BOOST_CHECK(db.Upgrade());
+    for (int i = 0; i < 20; i++) {
+        CCoins read;
+        BOOST_CHECK(db.GetCoins(vTxid[i], read));
+        BOOST_CHECK(read == vCoins[i]);
+        BOOST_CHECK(!db.GetDB().Exists(std::make_pair('c', vTxid[i])));
+    }
+    // Nothing left to do the second time
+    BOOST_CHECK(db.Upgrade());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,517 @@
+namespace json_tests{
+static unsigned const char base58_keys_invalid[] = {
+0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x22, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 
+0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x22, 0x78, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x44, 0x4d, 0x71, 0x78, 
+0x6d, 0x58, 0x66, 0x48, 0x41, 0x76, 0x4e, 0x4d, 
+0x58, 0x31, 0x50, 0x35, 0x4c, 0x61, 0x64, 0x41, 
+0x63, 0x75, 0x50, 0x42, 0x45, 0x4b, 0x4b, 0x35, 
+0x70, 0x50, 0x53, 0x53, 0x50, 0x74, 0x22, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x32, 
+0x4a, 0x59, 0x53, 0x79, 0x73, 0x75, 0x44, 0x6e, 
+0x32, 0x79, 0x76, 0x6f, 0x47, 0x31, 0x61, 0x73, 
+0x33, 0x6a, 0x79, 0x4a, 0x70, 0x77, 0x6e, 0x36, 
+0x71, 0x39, 0x32, 0x6b, 0x78, 0x67, 0x57, 0x4b, 
+0x55, 0x56, 0x70, 0x56, 0x4e, 0x31, 0x32, 0x73, 
+0x6e, 0x54, 0x73, 0x59, 0x66, 0x54, 0x6f, 0x56, 
+0x66, 0x41, 0x36, 0x56, 0x73, 0x54, 0x63, 0x66, 
+0x76, 0x66, 0x38, 0x65, 0x71, 0x73, 0x78, 0x76, 
+0x31, 0x4b, 0x64, 0x46, 0x63, 0x43, 0x65, 0x71, 
+0x75, 0x41, 0x47, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x59, 0x54, 0x47, 0x70, 
+0x79, 0x34, 0x6b, 0x41, 0x34, 0x4c, 0x6b, 0x66, 
+0x75, 0x45, 0x79, 0x45, 0x51, 0x37, 0x58, 0x4b, 
+0x36, 0x55, 0x6f, 0x39, 0x42, 0x42, 0x56, 0x68, 
+0x53, 0x4a, 0x64, 0x62, 0x35, 0x65, 0x59, 0x4d, 
+0x78, 0x34, 0x56, 0x6d, 0x43, 0x58, 0x45, 0x71, 
+0x6e, 0x76, 0x52, 0x38, 0x54, 0x51, 0x58, 0x66, 
+0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 
+0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x22, 0x42, 0x74, 0x35, 0x71, 0x59, 0x5a, 0x41, 
+0x48, 0x67, 0x4e, 0x39, 0x54, 0x6b, 0x58, 0x46, 
+0x35, 0x7a, 0x75, 0x4a, 0x35, 0x59, 0x72, 0x31, 
+0x35, 0x42, 0x69, 0x46, 0x31, 0x73, 0x79, 0x44, 
+0x44, 0x70, 0x45, 0x55, 0x73, 0x64, 0x45, 0x31, 
+0x68, 0x52, 0x5a, 0x5a, 0x6b, 0x55, 0x47, 0x6d, 
+0x50, 0x59, 0x50, 0x39, 0x48, 0x54, 0x6b, 0x50, 
+0x62, 0x76, 0x52, 0x36, 0x59, 0x69, 0x4a, 0x41, 
+0x42, 0x55, 0x48, 0x6a, 0x71, 0x75, 0x79, 0x37, 
+0x70, 0x51, 0x43, 0x77, 0x22, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x22, 0x32, 0x55, 0x39, 
+0x35, 0x37, 0x77, 0x59, 0x72, 0x47, 0x4a, 0x54, 
+0x75, 0x4d, 0x65, 0x4b, 0x54, 0x36, 0x5a, 0x66, 
+0x63, 0x59, 0x54, 0x73, 0x5a, 0x42, 0x65, 0x75, 
+0x78, 0x35, 0x56, 0x78, 0x73, 0x61, 0x72, 0x39, 
+0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 
+0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x22, 0x54, 0x78, 0x51, 0x4a, 0x43, 0x78, 0x37, 
+0x58, 0x6a, 0x56, 0x36, 0x76, 0x4e, 0x70, 0x57, 
+0x45, 0x55, 0x69, 0x34, 0x72, 0x47, 0x37, 0x44, 
+0x64, 0x64, 0x71, 0x6a, 0x73, 0x48, 0x54, 0x43, 
+0x38, 0x74, 0x4c, 0x74, 0x55, 0x78, 0x58, 0x61, 
+0x53, 0x58, 0x74, 0x61, 0x36, 0x59, 0x74, 0x32, 
+0x5a, 0x78, 0x61, 0x34, 0x58, 0x44, 0x47, 0x34, 
+0x54, 0x64, 0x50, 0x47, 0x6b, 0x72, 0x73, 0x34, 
+0x63, 0x52, 0x68, 0x7a, 0x77, 0x74, 0x61, 0x73, 
+0x78, 0x37, 0x64, 0x38, 0x22, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x22, 0x32, 0x55, 0x36, 
+0x6f, 0x6d, 0x42, 0x5a, 0x55, 0x32, 0x31, 0x41, 
+0x6e, 0x46, 0x78, 0x35, 0x45, 0x41, 0x50, 0x32, 
+0x37, 0x47, 0x63, 0x55, 0x75, 0x62, 0x48, 0x44, 
+0x58, 0x66, 0x70, 0x72, 0x36, 0x65, 0x32, 0x4d, 
+0x61, 0x5a, 0x66, 0x69, 0x43, 0x76, 0x38, 0x34, 
+0x6e, 0x61, 0x55, 0x79, 0x39, 0x68, 0x42, 0x6b, 
+0x74, 0x33, 0x6d, 0x6f, 0x48, 0x33, 0x43, 0x75, 
+0x33, 0x74, 0x34, 0x59, 0x36, 0x76, 0x7a, 0x51, 
+0x6a, 0x34, 0x59, 0x4b, 0x6b, 0x75, 0x45, 0x74, 
+0x7a, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 
+0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x22, 0x63, 0x55, 0x7a, 0x38, 0x65, 0x73, 
+0x4e, 0x35, 0x34, 0x59, 0x63, 0x31, 0x35, 0x44, 
+0x39, 0x65, 0x4d, 0x75, 0x41, 0x58, 0x36, 0x57, 
+0x48, 0x42, 0x67, 0x41, 0x72, 0x68, 0x50, 0x6e, 
+0x55, 0x62, 0x69, 0x62, 0x61, 0x75, 0x47, 0x4c, 
+0x32, 0x5a, 0x32, 0x42, 0x66, 0x72, 0x63, 0x53, 
+0x59, 0x77, 0x4d, 0x67, 0x44, 0x73, 0x67, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x37, 0x55, 0x6a, 0x56, 0x6f, 0x68, 0x61, 0x41, 
+0x77, 0x74, 0x36, 0x75, 0x58, 0x79, 0x51, 0x32, 
+0x6e, 0x72, 0x65, 0x4b, 0x57, 0x7a, 0x32, 0x5a, 
+0x6b, 0x67, 0x65, 0x64, 0x6f, 0x4c, 0x62, 0x68, 
+0x34, 0x34, 0x37, 0x52, 0x51, 0x56, 0x45, 0x39, 
+0x6f, 0x46, 0x54, 0x4c, 0x33, 0x44, 0x31, 0x6d, 
+0x55, 0x67, 0x33, 0x43, 0x76, 0x31, 0x77, 0x72, 
+0x4e, 0x57, 0x34, 0x6a, 0x46, 0x4a, 0x70, 0x65, 
+0x31, 0x39, 0x38, 0x68, 0x58, 0x61, 0x51, 0x37, 
+0x78, 0x77, 0x52, 0x4e, 0x39, 0x22, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x42, 0x78, 
+0x71, 0x68, 0x41, 0x6f, 0x43, 0x41, 0x76, 0x71, 
+0x31, 0x55, 0x6e, 0x45, 0x50, 0x37, 0x59, 0x42, 
+0x75, 0x64, 0x6b, 0x72, 0x72, 0x6e, 0x6a, 0x79, 
+0x31, 0x45, 0x56, 0x51, 0x64, 0x35, 0x67, 0x51, 
+0x33, 0x38, 0x4b, 0x73, 0x73, 0x4e, 0x6e, 0x68, 
+0x61, 0x42, 0x73, 0x64, 0x6a, 0x5a, 0x36, 0x55, 
+0x4d, 0x59, 0x6b, 0x4e, 0x64, 0x78, 0x6e, 0x53, 
+0x62, 0x35, 0x71, 0x56, 0x69, 0x57, 0x5a, 0x6d, 
+0x6f, 0x54, 0x6f, 0x35, 0x73, 0x47, 0x56, 0x33, 
+0x41, 0x71, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x22, 0x7a, 0x41, 0x37, 0x45, 0x37, 
+0x6a, 0x78, 0x68, 0x59, 0x79, 0x57, 0x6f, 0x34, 
+0x77, 0x4c, 0x4a, 0x43, 0x68, 0x52, 0x68, 0x70, 
+0x46, 0x46, 0x47, 0x53, 0x73, 0x42, 0x41, 0x5a, 
+0x77, 0x43, 0x77, 0x47, 0x57, 0x22, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x36, 0x6d, 
+0x37, 0x4b, 0x4c, 0x42, 0x4a, 0x58, 0x34, 0x64, 
+0x43, 0x36, 0x6b, 0x43, 0x75, 0x66, 0x76, 0x4a, 
+0x76, 0x37, 0x67, 0x59, 0x52, 0x45, 0x4b, 0x53, 
+0x45, 0x58, 0x62, 0x4c, 0x7a, 0x63, 0x77, 0x75, 
+0x4a, 0x4d, 0x41, 0x6f, 0x6e, 0x44, 0x50, 0x79, 
+0x72, 0x55, 0x35, 0x4d, 0x72, 0x63, 0x51, 0x34, 
+0x67, 0x63, 0x52, 0x4d, 0x38, 0x68, 0x4a, 0x32, 
+0x37, 0x51, 0x6a, 0x37, 0x6e, 0x69, 0x74, 0x4c, 
+0x4b, 0x31, 0x75, 0x69, 0x58, 0x31, 0x68, 0x56, 
+0x64, 0x35, 0x71, 0x79, 0x22, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x22, 0x4e, 0x48, 0x68, 
+0x34, 0x7a, 0x67, 0x62, 0x35, 0x53, 0x4b, 0x50, 
+0x36, 0x55, 0x6e, 0x48, 0x32, 0x4c, 0x6e, 0x43, 
+0x61, 0x75, 0x66, 0x79, 0x5a, 0x36, 0x39, 0x41, 
+0x4e, 0x43, 0x57, 0x78, 0x45, 0x79, 0x37, 0x31, 
+0x79, 0x6d, 0x51, 0x43, 0x6b, 0x65, 0x71, 0x43, 
+0x43, 0x4e, 0x52, 0x35, 0x46, 0x4d, 0x35, 0x56, 
+0x78, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 
+0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x22, 0x35, 0x66, 0x44, 0x72, 0x73, 0x42, 
+0x59, 0x65, 0x6b, 0x71, 0x71, 0x6f, 0x52, 0x6a, 
+0x37, 0x37, 0x66, 0x78, 0x33, 0x43, 0x34, 0x6f, 
+0x38, 0x4d, 0x36, 0x75, 0x66, 0x71, 0x78, 0x54, 
+0x79, 0x5a, 0x45, 0x53, 0x58, 0x4b, 0x78, 0x53, 
+0x72, 0x43, 0x76, 0x35, 0x59, 0x6a, 0x77, 0x56, 
+0x43, 0x35, 0x72, 0x41, 0x6d, 0x48, 0x4b, 0x5a, 
+0x37, 0x69, 0x32, 0x58, 0x45, 0x61, 0x74, 0x42, 
+0x64, 0x6a, 0x34, 0x4d, 0x64, 0x54, 0x6d, 0x73, 
+0x54, 0x45, 0x31, 0x57, 0x59, 0x22, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x32, 0x36, 
+0x59, 0x4d, 0x68, 0x43, 0x51, 0x74, 0x70, 0x33, 
+0x64, 0x47, 0x41, 0x64, 0x71, 0x65, 0x37, 0x65, 
+0x71, 0x6f, 0x7a, 0x6d, 0x44, 0x77, 0x79, 0x75, 
+0x75, 0x38, 0x42, 0x4b, 0x68, 0x64, 0x46, 0x57, 
+0x67, 0x57, 0x54, 0x64, 0x61, 0x43, 0x69, 0x36, 
+0x59, 0x38, 0x56, 0x39, 0x33, 0x5a, 0x50, 0x71, 
+0x31, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 
+0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x22, 0x59, 0x56, 0x6a, 0x59, 0x5a, 0x35, 
+0x48, 0x7a, 0x4a, 0x41, 0x6f, 0x56, 0x73, 0x66, 
+0x33, 0x75, 0x50, 0x52, 0x33, 0x50, 0x59, 0x63, 
+0x4a, 0x38, 0x72, 0x64, 0x48, 0x6e, 0x46, 0x74, 
+0x39, 0x6b, 0x69, 0x33, 0x46, 0x76, 0x50, 0x79, 
+0x69, 0x4a, 0x68, 0x72, 0x4a, 0x56, 0x4c, 0x70, 
+0x4e, 0x51, 0x43, 0x4e, 0x64, 0x4a, 0x79, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x32, 0x45, 0x4c, 0x66, 0x41, 0x47, 0x7a, 0x46, 
+0x35, 0x64, 0x44, 0x61, 0x47, 0x6b, 0x6e, 0x48, 
+0x43, 0x50, 0x57, 0x56, 0x6f, 0x4c, 0x72, 0x52, 
+0x74, 0x41, 0x41, 0x34, 0x69, 0x58, 0x59, 0x5a, 
+0x6d, 0x55, 0x7a, 0x42, 0x61, 0x66, 0x73, 0x6b, 
+0x50, 0x74, 0x77, 0x46, 0x6b, 0x38, 0x64, 0x38, 
+0x54, 0x48, 0x35, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x35, 0x6a, 0x55, 0x50, 
+0x41, 0x32, 0x36, 0x6d, 0x55, 0x4e, 0x62, 0x70, 
+0x69, 0x68, 0x31, 0x4c, 0x37, 0x78, 0x43, 0x67, 
+0x6d, 0x54, 0x37, 0x52, 0x73, 0x62, 0x61, 0x75, 
+0x79, 0x48, 0x76, 0x43, 0x71, 0x6f, 0x6e, 0x67, 
+0x4e, 0x43, 0x4d, 0x75, 0x72, 0x6f, 0x39, 0x4c, 
+0x42, 0x52, 0x55, 0x50, 0x75, 0x55, 0x52, 0x37, 
+0x63, 0x4d, 0x44, 0x7a, 0x39, 0x73, 0x6d, 0x70, 
+0x6f, 0x69, 0x64, 0x4a, 0x34, 0x34, 0x48, 0x59, 
+0x63, 0x7a, 0x66, 0x33, 0x42, 0x69, 0x57, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x34, 0x31, 0x78, 0x73, 0x65, 0x59, 0x33, 0x71, 
+0x57, 0x33, 0x51, 0x48, 0x75, 0x4e, 0x66, 0x32, 
+0x34, 0x77, 0x36, 0x65, 0x38, 0x6b, 0x6b, 0x55, 
+0x69, 0x4b, 0x78, 0x7a, 0x48, 0x65, 0x66, 0x46, 
+0x70, 0x52, 0x42, 0x65, 0x38, 0x4e, 0x43, 0x74, 
+0x6f, 0x58, 0x31, 0x63, 0x58, 0x6f, 0x6d, 0x37, 
+0x31, 0x54, 0x70, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x72, 0x61, 0x45, 0x35, 
+0x4e, 0x4d, 0x6e, 0x43, 0x4a, 0x44, 0x6d, 0x57, 
+0x4d, 0x35, 0x55, 0x72, 0x42, 0x6d, 0x59, 0x6a, 
+0x4e, 0x76, 0x6a, 0x6b, 0x4e, 0x46, 0x77, 0x34, 
+0x6a, 0x32, 0x64, 0x42, 0x79, 0x68, 0x64, 0x78, 
+0x54, 0x6f, 0x67, 0x56, 0x47, 0x4d, 0x63, 0x6e, 
+0x58, 0x50, 0x4b, 0x56, 0x42, 0x46, 0x51, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x35, 0x37, 0x37, 0x73, 0x5a, 0x6b, 0x39, 0x78, 
+0x4d, 0x33, 0x4d, 0x46, 0x34, 0x46, 0x37, 0x33, 
+0x6b, 0x73, 0x73, 0x72, 0x36, 0x39, 0x46, 0x48, 
+0x75, 0x33, 0x55, 0x6b, 0x6d, 0x74, 0x54, 0x51, 
+0x66, 0x52, 0x33, 0x70, 0x52, 0x54, 0x63, 0x74, 
+0x63, 0x62, 0x51, 0x63, 0x36, 0x4a, 0x4e, 0x52, 
+0x59, 0x70, 0x74, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x32, 0x4e, 0x6a, 0x64, 
+0x44, 0x5a, 0x38, 0x7a, 0x44, 0x78, 0x75, 0x63, 
+0x34, 0x36, 0x43, 0x73, 0x4c, 0x6f, 0x32, 0x71, 
+0x4b, 0x50, 0x7a, 0x52, 0x41, 0x46, 0x42, 0x5a, 
+0x71, 0x6b, 0x46, 0x54, 0x39, 0x59, 0x48, 0x71, 
+0x4b, 0x47, 0x66, 0x58, 0x4d, 0x6e, 0x50, 0x36, 
+0x58, 0x46, 0x41, 0x4e, 0x75, 0x67, 0x76, 0x62, 
+0x73, 0x39, 0x43, 0x53, 0x47, 0x41, 0x77, 0x46, 
+0x51, 0x4b, 0x51, 0x48, 0x33, 0x44, 0x75, 0x59, 
+0x34, 0x51, 0x4b, 0x53, 0x33, 0x31, 0x74, 0x35, 
+0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 
+0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x22, 0x37, 0x56, 0x4e, 0x61, 0x66, 0x31, 0x4d, 
+0x7a, 0x5a, 0x42, 0x4c, 0x39, 0x57, 0x73, 0x51, 
+0x33, 0x6f, 0x33, 0x38, 0x6f, 0x42, 0x69, 0x68, 
+0x77, 0x7a, 0x6a, 0x59, 0x69, 0x79, 0x47, 0x4b, 
+0x7a, 0x74, 0x43, 0x32, 0x4b, 0x44, 0x44, 0x31, 
+0x62, 0x41, 0x45, 0x68, 0x7a, 0x62, 0x72, 0x57, 
+0x55, 0x52, 0x57, 0x41, 0x56, 0x47, 0x5a, 0x62, 
+0x64, 0x63, 0x43, 0x79, 0x73, 0x48, 0x6a, 0x47, 
+0x69, 0x73, 0x38, 0x41, 0x4d, 0x36, 0x63, 0x37, 
+0x37, 0x32, 0x39, 0x68, 0x79, 0x32, 0x22, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x46, 
+0x77, 0x72, 0x6b, 0x34, 0x37, 0x33, 0x4b, 0x78, 
+0x44, 0x50, 0x50, 0x41, 0x7a, 0x33, 0x44, 0x42, 
+0x39, 0x72, 0x43, 0x5a, 0x69, 0x35, 0x76, 0x66, 
+0x4a, 0x37, 0x61, 0x4c, 0x67, 0x6b, 0x79, 0x47, 
+0x41, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 
+0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x22, 0x36, 0x6b, 0x45, 0x64, 0x38, 0x63, 
+0x4c, 0x77, 0x36, 0x6b, 0x36, 0x68, 0x6d, 0x45, 
+0x50, 0x38, 0x6a, 0x68, 0x4a, 0x6e, 0x46, 0x43, 
+0x56, 0x66, 0x6b, 0x6b, 0x59, 0x6f, 0x48, 0x4a, 
+0x43, 0x74, 0x45, 0x45, 0x71, 0x37, 0x33, 0x64, 
+0x48, 0x35, 0x61, 0x38, 0x39, 0x53, 0x41, 0x37, 
+0x36, 0x43, 0x63, 0x37, 0x72, 0x41, 0x4d, 0x67, 
+0x69, 0x58, 0x57, 0x46, 0x74, 0x76, 0x37, 0x65, 
+0x66, 0x6d, 0x79, 0x4c, 0x54, 0x57, 0x35, 0x38, 
+0x4a, 0x6f, 0x48, 0x65, 0x4c, 0x37, 0x6e, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x32, 0x42, 0x50, 0x41, 0x48, 0x53, 0x41, 0x72, 
+0x62, 0x6b, 0x42, 0x46, 0x6f, 0x56, 0x75, 0x71, 
+0x31, 0x66, 0x52, 0x52, 0x44, 0x74, 0x70, 0x4c, 
+0x33, 0x45, 0x59, 0x61, 0x75, 0x50, 0x4d, 0x42, 
+0x65, 0x76, 0x4c, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x35, 0x77, 0x4a, 0x31, 
+0x65, 0x68, 0x50, 0x38, 0x65, 0x4e, 0x66, 0x4c, 
+0x32, 0x45, 0x69, 0x34, 0x57, 0x68, 0x79, 0x58, 
+0x76, 0x7a, 0x77, 0x43, 0x6f, 0x38, 0x4d, 0x63, 
+0x71, 0x4e, 0x4b, 0x72, 0x75, 0x64, 0x69, 0x72, 
+0x76, 0x57, 0x74, 0x63, 0x5a, 0x6e, 0x65, 0x75, 
+0x45, 0x4b, 0x66, 0x64, 0x4e, 0x62, 0x74, 0x35, 
+0x64, 0x42, 0x53, 0x73, 0x47, 0x59, 0x72, 0x32, 
+0x6d, 0x4c, 0x55, 0x68, 0x78, 0x37, 0x4c, 0x56, 
+0x7a, 0x65, 0x7a, 0x6f, 0x52, 0x51, 0x4a, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x32, 0x38, 0x4d, 0x43, 0x4d, 0x6e, 0x4b, 0x77, 
+0x39, 0x78, 0x58, 0x31, 0x51, 0x52, 0x58, 0x4a, 
+0x45, 0x75, 0x56, 0x32, 0x67, 0x52, 0x35, 0x7a, 
+0x67, 0x76, 0x42, 0x6d, 0x68, 0x39, 0x67, 0x32, 
+0x77, 0x44, 0x76, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x38, 0x37, 0x65, 0x77, 
+0x57, 0x41, 0x70, 0x66, 0x67, 0x65, 0x45, 0x35, 
+0x47, 0x43, 0x55, 0x37, 0x4a, 0x33, 0x51, 0x42, 
+0x6f, 0x70, 0x33, 0x4d, 0x39, 0x50, 0x57, 0x44, 
+0x44, 0x4c, 0x59, 0x4d, 0x31, 0x73, 0x67, 0x74, 
+0x54, 0x78, 0x32, 0x57, 0x55, 0x41, 0x74, 0x53, 
+0x73, 0x41, 0x6b, 0x6a, 0x44, 0x4e, 0x72, 0x58, 
+0x70, 0x59, 0x43, 0x67, 0x46, 0x56, 0x44, 0x37, 
+0x66, 0x51, 0x76, 0x46, 0x53, 0x6e, 0x37, 0x52, 
+0x75, 0x4b, 0x37, 0x39, 0x34, 0x33, 0x64, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x37, 0x56, 0x51, 0x65, 0x45, 0x6e, 0x48, 0x41, 
+0x6a, 0x69, 0x67, 0x6a, 0x68, 0x48, 0x31, 0x56, 
+0x43, 0x6e, 0x62, 0x70, 0x35, 0x32, 0x6b, 0x6a, 
+0x76, 0x44, 0x68, 0x77, 0x43, 0x39, 0x62, 0x69, 
+0x34, 0x61, 0x73, 0x50, 0x46, 0x77, 0x64, 0x6d, 
+0x76, 0x70, 0x52, 0x71, 0x6b, 0x57, 0x42, 0x53, 
+0x4d, 0x54, 0x48, 0x54, 0x68, 0x70, 0x36, 0x31, 
+0x44, 0x34, 0x6f, 0x72, 0x67, 0x75, 0x37, 0x63, 
+0x6f, 0x67, 0x4c, 0x41, 0x68, 0x4b, 0x79, 0x4d, 
+0x55, 0x73, 0x43, 0x74, 0x47, 0x22, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x36, 0x54, 
+0x72, 0x76, 0x39, 0x70, 0x61, 0x68, 0x52, 0x4a, 
+0x70, 0x6a, 0x79, 0x48, 0x33, 0x4e, 0x7a, 0x53, 
+0x31, 0x75, 0x47, 0x4a, 0x7a, 0x4e, 0x75, 0x50, 
+0x70, 0x46, 0x63, 0x71, 0x44, 0x6d, 0x34, 0x76, 
+0x59, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 
+0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x22, 0x32, 0x4a, 0x61, 0x31, 0x31, 0x33, 
+0x6d, 0x71, 0x76, 0x71, 0x74, 0x6b, 0x41, 0x73, 
+0x74, 0x59, 0x55, 0x50, 0x75, 0x63, 0x59, 0x52, 
+0x66, 0x70, 0x75, 0x50, 0x69, 0x61, 0x58, 0x51, 
+0x57, 0x73, 0x32, 0x6e, 0x41, 0x33, 0x37, 0x6b, 
+0x4b, 0x58, 0x4d, 0x32, 0x35, 0x65, 0x71, 0x38, 
+0x77, 0x47, 0x62, 0x58, 0x55, 0x34, 0x72, 0x44, 
+0x57, 0x6a, 0x46, 0x34, 0x50, 0x58, 0x42, 0x7a, 
+0x6e, 0x56, 0x43, 0x4b, 0x50, 0x34, 0x52, 0x55, 
+0x50, 0x7a, 0x37, 0x4e, 0x6a, 0x79, 0x22, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x48, 
+0x77, 0x36, 0x38, 0x77, 0x31, 0x7a, 0x67, 0x52, 
+0x43, 0x32, 0x54, 0x71, 0x6b, 0x34, 0x42, 0x37, 
+0x61, 0x50, 0x31, 0x36, 0x59, 0x35, 0x31, 0x32, 
+0x58, 0x39, 0x43, 0x4e, 0x68, 0x57, 0x65, 0x58, 
+0x71, 0x67, 0x51, 0x6d, 0x61, 0x59, 0x6b, 0x38, 
+0x69, 0x61, 0x47, 0x47, 0x38, 0x77, 0x5a, 0x65, 
+0x67, 0x4c, 0x55, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x46, 0x69, 0x61, 0x45, 
+0x41, 0x41, 0x52, 0x47, 0x35, 0x45, 0x65, 0x6e, 
+0x38, 0x31, 0x65, 0x4c, 0x36, 0x45, 0x43, 0x4a, 
+0x41, 0x34, 0x7a, 0x65, 0x31, 0x6b, 0x78, 0x54, 
+0x69, 0x44, 0x64, 0x33, 0x57, 0x42, 0x22, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x35, 
+0x6f, 0x71, 0x6e, 0x55, 0x44, 0x62, 0x42, 0x46, 
+0x4a, 0x6e, 0x79, 0x62, 0x78, 0x6b, 0x58, 0x46, 
+0x57, 0x4e, 0x72, 0x39, 0x6a, 0x62, 0x63, 0x45, 
+0x62, 0x58, 0x70, 0x62, 0x44, 0x44, 0x4d, 0x6b, 
+0x62, 0x75, 0x33, 0x51, 0x71, 0x45, 0x34, 0x58, 
+0x53, 0x36, 0x41, 0x76, 0x44, 0x4d, 0x34, 0x6b, 
+0x77, 0x4c, 0x39, 0x48, 0x45, 0x74, 0x57, 0x6b, 
+0x53, 0x36, 0x64, 0x59, 0x31, 0x53, 0x4b, 0x72, 
+0x33, 0x54, 0x51, 0x68, 0x70, 0x6b, 0x73, 0x5a, 
+0x73, 0x42, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x22, 0x32, 0x4a, 0x6e, 0x5a, 0x53, 
+0x51, 0x34, 0x77, 0x4d, 0x70, 0x67, 0x33, 0x48, 
+0x6e, 0x70, 0x70, 0x5a, 0x67, 0x43, 0x32, 0x74, 
+0x7a, 0x69, 0x4c, 0x37, 0x6f, 0x43, 0x72, 0x4a, 
+0x52, 0x6f, 0x6a, 0x35, 0x47, 0x72, 0x76, 0x69, 
+0x75, 0x68, 0x48, 0x4a, 0x37, 0x33, 0x77, 0x56, 
+0x43, 0x52, 0x59, 0x65, 0x4e, 0x47, 0x36, 0x41, 
+0x4a, 0x77, 0x4c, 0x38, 0x33, 0x43, 0x51, 0x71, 
+0x55, 0x47, 0x46, 0x64, 0x67, 0x35, 0x4c, 0x43, 
+0x78, 0x4c, 0x62, 0x58, 0x6e, 0x6a, 0x55, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x37, 0x70, 0x42, 0x5a, 0x39, 0x6f, 0x45, 0x6d, 
+0x57, 0x5a, 0x6e, 0x43, 0x4c, 0x56, 0x6f, 0x58, 
+0x44, 0x38, 0x65, 0x70, 0x78, 0x75, 0x57, 0x5a, 
+0x58, 0x55, 0x62, 0x50, 0x52, 0x71, 0x73, 0x53, 
+0x6b, 0x45, 0x4c, 0x51, 0x68, 0x38, 0x46, 0x63, 
+0x39, 0x37, 0x43, 0x41, 0x4b, 0x6f, 0x64, 0x48, 
+0x50, 0x7a, 0x4d, 0x59, 0x54, 0x46, 0x63, 0x79, 
+0x73, 0x33, 0x6a, 0x46, 0x34, 0x51, 0x53, 0x43, 
+0x43, 0x66, 0x54, 0x77, 0x53, 0x68, 0x33, 0x50, 
+0x5a, 0x63, 0x71, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x22, 0x33, 0x66, 0x65, 0x31, 
+0x4b, 0x32, 0x4c, 0x59, 0x6b, 0x7a, 0x53, 0x67, 
+0x6f, 0x36, 0x6d, 0x50, 0x58, 0x58, 0x56, 0x5a, 
+0x63, 0x71, 0x78, 0x53, 0x51, 0x71, 0x77, 0x38, 
+0x6a, 0x43, 0x6b, 0x36, 0x73, 0x54, 0x47, 0x55, 
+0x75, 0x6a, 0x46, 0x76, 0x38, 0x35, 0x6f, 0x53, 
+0x34, 0x6a, 0x46, 0x35, 0x69, 0x57, 0x74, 0x22, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 
+0x4b, 0x4a, 0x32, 0x38, 0x36, 0x62, 0x69, 0x39, 
+0x32, 0x59, 0x53, 0x42, 0x68, 0x59, 0x6b, 0x45, 
+0x54, 0x68, 0x76, 0x39, 0x59, 0x70, 0x45, 0x4a, 
+0x32, 0x76, 0x66, 0x78, 0x4d, 0x75, 0x51, 0x35, 
+0x4e, 0x54, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x22, 0x35, 0x6a, 0x44, 0x77, 0x73, 
+0x33, 0x76, 0x57, 0x35, 0x43, 0x36, 0x74, 0x4b, 
+0x42, 0x4a, 0x51, 0x37, 0x66, 0x64, 0x51, 0x39, 
+0x6e, 0x42, 0x72, 0x54, 0x5a, 0x71, 0x79, 0x75, 
+0x6f, 0x75, 0x56, 0x43, 0x6d, 0x44, 0x47, 0x43, 
+0x31, 0x59, 0x50, 0x71, 0x69, 0x31, 0x63, 0x79, 
+0x58, 0x45, 0x69, 0x7a, 0x74, 0x43, 0x45, 0x52, 
+0x56, 0x64, 0x51, 0x6e, 0x4a, 0x56, 0x78, 0x7a, 
+0x42, 0x67, 0x4c, 0x42, 0x61, 0x46, 0x45, 0x61, 
+0x65, 0x4c, 0x61, 0x31, 0x31, 0x76, 0x22, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x79, 
+0x31, 0x79, 0x4e, 0x59, 0x7a, 0x31, 0x38, 0x34, 
+0x76, 0x35, 0x32, 0x63, 0x7a, 0x74, 0x77, 0x4e, 
+0x31, 0x72, 0x5a, 0x69, 0x55, 0x57, 0x42, 0x48, 
+0x37, 0x74, 0x50, 0x44, 0x64, 0x59, 0x46, 0x78, 
+0x64, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 
+0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 
+0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x22, 0x38, 0x72, 0x56, 0x76, 0x33, 0x55, 
+0x66, 0x6b, 0x33, 0x4a, 0x57, 0x34, 0x34, 0x74, 
+0x6f, 0x74, 0x34, 0x56, 0x63, 0x7a, 0x68, 0x43, 
+0x37, 0x50, 0x68, 0x68, 0x38, 0x74, 0x6b, 0x6b, 
+0x43, 0x69, 0x47, 0x66, 0x37, 0x22, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x32, 0x4a, 
+0x6a, 0x6f, 0x65, 0x51, 0x61, 0x61, 0x41, 0x35, 
+0x64, 0x54, 0x68, 0x70, 0x35, 0x46, 0x6d, 0x6d, 
+0x74, 0x67, 0x47, 0x4a, 0x35, 0x70, 0x4b, 0x4d, 
+0x41, 0x61, 0x62, 0x47, 0x79, 0x6f, 0x6a, 0x34, 
+0x44, 0x32, 0x64, 0x32, 0x62, 0x32, 0x4d, 0x33, 
+0x78, 0x73, 0x53, 0x4a, 0x53, 0x4a, 0x54, 0x42, 
+0x39, 0x71, 0x66, 0x6e, 0x79, 0x34, 0x61, 0x5a, 
+0x31, 0x61, 0x35, 0x6f, 0x59, 0x79, 0x36, 0x77, 
+0x4d, 0x77, 0x4e, 0x62, 0x70, 0x43, 0x53, 0x35, 
+0x36, 0x39, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x22, 0x32, 0x58, 0x66, 0x63, 0x66, 
+0x62, 0x79, 0x5a, 0x36, 0x76, 0x41, 0x6f, 0x65, 
+0x41, 0x4a, 0x45, 0x53, 0x42, 0x65, 0x73, 0x4d, 
+0x46, 0x42, 0x50, 0x78, 0x33, 0x36, 0x76, 0x31, 
+0x70, 0x73, 0x72, 0x66, 0x77, 0x58, 0x61, 0x4b, 
+0x6d, 0x36, 0x32, 0x61, 0x68, 0x70, 0x6f, 0x65, 
+0x50, 0x43, 0x55, 0x75, 0x38, 0x32, 0x42, 0x4d, 
+0x6e, 0x6e, 0x69, 0x34, 0x5a, 0x7a, 0x34, 0x70, 
+0x72, 0x41, 0x67, 0x50, 0x68, 0x48, 0x44, 0x32, 
+0x46, 0x4a, 0x31, 0x63, 0x54, 0x34, 0x65, 0x50, 
+0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 
+0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x22, 0x32, 0x56, 0x73, 0x72, 0x59, 0x35, 0x39, 
+0x73, 0x50, 0x75, 0x35, 0x76, 0x35, 0x4c, 0x43, 
+0x62, 0x53, 0x71, 0x4c, 0x77, 0x73, 0x59, 0x74, 
+0x78, 0x33, 0x73, 0x39, 0x6d, 0x56, 0x74, 0x41, 
+0x67, 0x68, 0x6d, 0x76, 0x4e, 0x57, 0x46, 0x36, 
+0x6e, 0x6f, 0x57, 0x7a, 0x57, 0x47, 0x38, 0x5a, 
+0x67, 0x39, 0x51, 0x68, 0x42, 0x53, 0x79, 0x34, 
+0x46, 0x41, 0x57, 0x50, 0x77, 0x4e, 0x6a, 0x45, 
+0x59, 0x36, 0x51, 0x43, 0x36, 0x5a, 0x6b, 0x70, 
+0x76, 0x77, 0x36, 0x6d, 0x50, 0x22, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5d, 0x2c, 0x20, 0x0a, 0x20, 
+0x20, 0x20, 0x20, 0x5b, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x22, 0x38, 0x38, 
+0x77, 0x73, 0x65, 0x6a, 0x46, 0x67, 0x55, 0x35, 
+0x79, 0x61, 0x71, 0x34, 0x48, 0x4b, 0x53, 0x45, 
+0x4a, 0x41, 0x6d, 0x52, 0x76, 0x76, 0x42, 0x74, 
+0x53, 0x4d, 0x5a, 0x7a, 0x70, 0x4c, 0x48, 0x46, 
+0x37, 0x34, 0x72, 0x78, 0x64, 0x38, 0x39, 0x6b, 
+0x66, 0x55, 0x59, 0x4c, 0x54, 0x7a, 0x56, 0x6a, 
+0x41, 0x58, 0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5d, 0x2c, 0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+0x5b, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x20, 0x20, 0x22, 0x37, 0x56, 0x6a, 0x47, 0x78, 
+0x5a, 0x74, 0x31, 0x36, 0x61, 0x4c, 0x58, 0x4a, 
+0x51, 0x46, 0x76, 0x68, 0x78, 0x33, 0x44, 0x73, 
+0x64, 0x6f, 0x4d, 0x31, 0x4c, 0x55, 0x32, 0x61, 
+0x4c, 0x58, 0x51, 0x51, 0x66, 0x56, 0x54, 0x46, 
+0x65, 0x54, 0x69, 0x47, 0x4a, 0x67, 0x51, 0x76, 
+0x61, 0x33, 0x52, 0x5a, 0x65, 0x76, 0x38, 0x5a, 
+0x69, 0x53, 0x43, 0x38, 0x6e, 0x6f, 0x53, 0x65, 
+0x57, 0x78, 0x45, 0x58, 0x67, 0x64, 0x53, 0x37, 
+0x79, 0x7a, 0x67, 0x73, 0x51, 0x6a, 0x44, 0x31, 
+0x22, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5d, 0x2c, 
+0x20, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x5b, 0x0a, 
+0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+0x22, 0x44, 0x47, 0x64, 0x41, 0x59, 0x32, 0x78, 
+0x75, 0x4b, 0x73, 0x58, 0x4a, 0x57, 0x71, 0x4d, 
+0x72, 0x48, 0x64, 0x71, 0x6e, 0x4d, 0x34, 0x41, 
+0x77, 0x74, 0x42, 0x73, 0x51, 0x52, 0x73, 0x6b, 
+0x66, 0x79, 0x57, 0x22, 0x0a, 0x20, 0x20, 0x20, 
+0x20, 0x5d, 0x0a, 0x5d, 0x0a, 
+};};
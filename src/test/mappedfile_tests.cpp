@@ -0,0 +1,113 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#include "main.h"
+#include "util.h"
+#include "test/test_donate.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mappedfile_tests)
+
+// Not used by the blocks of the test chain
+static const int TEST_BLOCK_FILE = 99;
+
+BOOST_AUTO_TEST_CASE(mappedfile_view)
+{
+    boost::filesystem::path path = GetDataDir() / "mappedfile_test";
+    {
+        boost::filesystem::ofstream file(path, std::ios::binary);
+        file << "mapped bytes";
+    }
+
+    CDiskDataView view;
+    BOOST_CHECK(view.IsNull());
+    {
+        boost::shared_ptr<CMappedFile> file(new CMappedFile(path));
+        BOOST_CHECK(!file->IsNull());
+        BOOST_CHECK_EQUAL(file->size(), 12U);
+        view.SetMapped(file, file->data() + 7, 5);
+    }
+    // The view keeps the mapping alive
+    BOOST_CHECK(view.IsMapped());
+    BOOST_CHECK_EQUAL(std::string(view.begin(), view.end()), "bytes");
+
+    std::vector<char> vData(3, 'x');
+    view.SetBuffer(vData);
+    BOOST_CHECK(!view.IsMapped());
+    BOOST_CHECK_EQUAL(std::string(view.begin(), view.end()), "xxx");
+
+    // Missing and empty files are not mapped
+    BOOST_CHECK(CMappedFile(GetDataDir() / "mappedfile_missing").IsNull());
+    {
+        boost::filesystem::ofstream file(path, std::ios::trunc);
+    }
+    BOOST_CHECK(CMappedFile(path).IsNull());
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_raw_block)
+{
+    CBlock block1 = BuildTestBlock(1);
+    CBlock block2 = BuildTestBlock(2);
+    uint256 hash1 = block1.GetHash();
+    uint256 hash2 = block2.GetHash();
+
+    CDiskBlockPos pos1(TEST_BLOCK_FILE, 0);
+    BOOST_CHECK(WriteBlockToDisk(block1, pos1));
+    CBlockIndex index1;
+    index1.phashBlock = &hash1;
+    index1.nFile = pos1.nFile;
+    index1.nDataPos = pos1.nPos;
+    index1.nStatus = BLOCK_HAVE_DATA;
+
+    CDataStream ss1(SER_NETWORK, PROTOCOL_VERSION);
+    ss1 << block1;
+    CDiskDataView view;
+    BOOST_CHECK(ReadRawBlockFromDisk(view, &index1));
+    BOOST_CHECK_EQUAL(HexStr(view.begin(), view.end()), HexStr(ss1.begin(), ss1.end()));
+
+    // A block appended after the file was mapped is found by mapping it again
+    CDiskBlockPos pos2(TEST_BLOCK_FILE, pos1.nPos + ss1.size());
+    BOOST_CHECK(WriteBlockToDisk(block2, pos2));
+    CBlockIndex index2;
+    index2.phashBlock = &hash2;
+    index2.nFile = pos2.nFile;
+    index2.nDataPos = pos2.nPos;
+    index2.nStatus = BLOCK_HAVE_DATA;
+
+    CDataStream ss2(SER_NETWORK, PROTOCOL_VERSION);
+    ss2 << block2;
+    CDiskDataView view2;
+    BOOST_CHECK(ReadRawBlockFromDisk(view2, &index2));
+    BOOST_CHECK_EQUAL(HexStr(view2.begin(), view2.end()), HexStr(ss2.begin(), ss2.end()));
+    // The earlier view is unaffected
+    BOOST_CHECK_EQUAL(HexStr(view.begin(), view.end()), HexStr(ss1.begin(), ss1.end()));
+
+    // Bytes that are not the block of the index are refused
+    index2.phashBlock = &hash1;
+    BOOST_CHECK(!ReadRawBlockFromDisk(view2, &index2));
+    BOOST_CHECK(view2.IsNull());
+
+    // Undo data reads through the mapping too, checked against its checksum
+    CBlockUndo undo;
+    undo.vtxundo.resize(1);
+    undo.vtxundo[0].vprevout.push_back(CTxInUndo(block1.vtx[0].vout[0], true, false, 10, 1));
+    CDiskBlockPos posUndo(TEST_BLOCK_FILE, 0);
+    BOOST_CHECK(undo.WriteToDisk(posUndo, hash1));
+    CBlockUndo undoRead;
+    BOOST_CHECK(undoRead.ReadFromDisk(posUndo, hash1));
+    BOOST_CHECK_EQUAL(undoRead.vtxundo.size(), 1U);
+    BOOST_CHECK(undoRead.vtxundo[0].vprevout[0].txout == block1.vtx[0].vout[0]);
+    BOOST_CHECK(!undoRead.ReadFromDisk(posUndo, hash2));
+
+    boost::filesystem::remove(GetBlockPosFilename(pos1, "blk"));
+    boost::filesystem::remove(GetBlockPosFilename(posUndo, "rev"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
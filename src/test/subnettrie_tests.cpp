@@ -0,0 +1,71 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "subnettrie.h"
+
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(subnettrie_tests)
+
+static bool Greater(int n)
+{
+    return n > 10;
+}
+
+BOOST_AUTO_TEST_CASE(subnettrie_match)
+{
+    CSubNetTrie<int> trie;
+    BOOST_CHECK(!trie.match(CNetAddr("1.2.3.4")));
+
+    trie.insert(CSubNet("1.2.0.0/16"), 5);
+    trie.insert(CSubNet("1.2.3.4"), 20);
+    trie.insert(CSubNet("2001:470::/32"), 1);
+    trie.insert(CSubNet("FD87:D87E:EB43:edb1:8e4:3588:e546:35ca"), 1);
+    BOOST_CHECK_EQUAL(trie.size(), 4U);
+
+    BOOST_CHECK(trie.match(CNetAddr("1.2.3.4")));
+    BOOST_CHECK(trie.match(CNetAddr("1.2.200.1")));
+    BOOST_CHECK(!trie.match(CNetAddr("1.3.0.1")));
+    BOOST_CHECK(trie.match(CNetAddr("2001:470::1")));
+    BOOST_CHECK(!trie.match(CNetAddr("2001:471::1")));
+    BOOST_CHECK(trie.match(CNetAddr("FD87:D87E:EB43:edb1:8e4:3588:e546:35ca")));
+    BOOST_CHECK(!trie.match(CNetAddr("FD87:D87E:EB43:edb1:8e4:3588:e546:35cb")));
+    // IPv4 subnets do not cover the IPv6 addresses sharing their low bits
+    BOOST_CHECK(!trie.match(CNetAddr("::1.2.3.4")));
+    BOOST_CHECK(!trie.match(CNetAddr()));
+
+    // Every containing subnet is seen, not only the longest one
+    BOOST_CHECK(trie.any_match(CNetAddr("1.2.3.4"), Greater));
+    BOOST_CHECK(!trie.any_match(CNetAddr("1.2.3.5"), Greater));
+    trie.insert(CSubNet("1.2.3.4"), 3);
+    BOOST_CHECK_EQUAL(trie.size(), 4U);
+    BOOST_CHECK(!trie.any_match(CNetAddr("1.2.3.4"), Greater));
+    trie.insert(CSubNet("0.0.0.0/0"), 11);
+    BOOST_CHECK(trie.any_match(CNetAddr("1.2.3.5"), Greater));
+    BOOST_CHECK(trie.any_match(CNetAddr("9.9.9.9"), Greater));
+    BOOST_CHECK(!trie.any_match(CNetAddr("2001:470::1"), Greater));
+
+    trie.clear();
+    BOOST_CHECK(trie.empty());
+    BOOST_CHECK(!trie.match(CNetAddr("1.2.3.4")));
+}
+
+BOOST_AUTO_TEST_CASE(subnettrie_irregular_netmask)
+{
+    CSubNetTrie<bool> trie;
+    CSubNet subnet("1.2.3.4/255.0.255.0");
+    BOOST_CHECK_EQUAL(subnet.GetPrefixLength(), -1);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4/24").GetPrefixLength(), 120);
+    BOOST_CHECK_EQUAL(CSubNet("::/0").GetPrefixLength(), 0);
+
+    trie.insert(subnet, true);
+    trie.insert(CSubNet("1.2.3.4/255.0.255.0/"), true); // invalid, ignored
+    BOOST_CHECK_EQUAL(trie.size(), 1U);
+    BOOST_CHECK(trie.match(CNetAddr("1.9.3.9")));
+    BOOST_CHECK(!trie.match(CNetAddr("1.2.4.4")));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
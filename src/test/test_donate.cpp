@@ -4,11 +4,14 @@
 
 #define BOOST_TEST_MODULE Donate Test Suite
 
+#include "test/test_donate.h"
+
 #include "main.h"
 #include "random.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
+#include "writebehind.h"
 #ifdef ENABLE_WALLET
 #include "db.h"
 #include "wallet.h"
@@ -43,7 +46,8 @@ struct TestingSetup {
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        pcoinsWriteBehind = new CCoinsViewWriteBehind(pcoinsdbview, pblocktree);
+        pcoinsTip = new CCoinsViewCache(pcoinsWriteBehind);
         InitBlockIndex();
 #ifdef ENABLE_WALLET
         bool fFirstRun;
@@ -66,6 +70,7 @@ struct TestingSetup {
         pwalletMain = NULL;
 #endif
         delete pcoinsTip;
+        delete pcoinsWriteBehind;
         delete pcoinsdbview;
         delete pblocktree;
 #ifdef ENABLE_WALLET
@@ -77,6 +82,22 @@ struct TestingSetup {
 
 BOOST_GLOBAL_FIXTURE(TestingSetup);
 
+CBlock BuildTestBlock(unsigned int nNonce, unsigned int nTx)
+{
+    CBlock block;
+    block.nNonce = nNonce;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    for (unsigned int i = 0; i < nTx; i++) {
+        tx.vout[0].nValue = nNonce + i;
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
 void Shutdown(void* parg)
 {
   exit(0);
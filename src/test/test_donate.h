@@ -0,0 +1,13 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TEST_TEST_DONATE_H
+#define BITCOIN_TEST_TEST_DONATE_H
+
+#include "primitives/block.h"
+
+/** A block of nTx anyone-can-spend transactions, told apart by nNonce; it is not valid on any chain */
+CBlock BuildTestBlock(unsigned int nNonce, unsigned int nTx = 1);
+
+#endif // BITCOIN_TEST_TEST_DONATE_H
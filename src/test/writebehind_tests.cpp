@@ -0,0 +1,60 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "random.h"
+#include "txdb.h"
+#include "writebehind.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(writebehind_tests)
+
+BOOST_AUTO_TEST_CASE(writebehind_snapshot)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    CCoinsViewDB coinsdb(1 << 20, true);
+    CCoinsViewWriteBehind writebehind(&coinsdb, &blocktree);
+    CCoinsViewCache cache(&writebehind);
+
+    uint256 txid = GetRandHash();
+    uint256 hashBlock = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txid);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 42;
+        coins->vout[0].scriptPubKey = CScript() << OP_TRUE;
+    }
+    cache.SetBestBlock(hashBlock);
+
+    CBlockTreeChanges changes;
+    changes.nLastBlockFile = 3;
+    writebehind.SetBlockTreeChanges(changes);
+    BOOST_CHECK(cache.Flush());
+
+    // Handed over but not written: answered from the snapshot
+    BOOST_CHECK(writebehind.IsPending());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK(!coinsdb.HaveCoins(txid));
+    BOOST_CHECK(writebehind.HaveCoins(txid));
+    BOOST_CHECK(writebehind.GetBestBlock() == hashBlock);
+    BOOST_CHECK(cache.HaveCoins(txid));
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txid)->vout[0].nValue, 42);
+
+    BOOST_CHECK(writebehind.Sync());
+    BOOST_CHECK(!writebehind.IsPending());
+    BOOST_CHECK(coinsdb.HaveCoins(txid));
+    BOOST_CHECK(coinsdb.GetBestBlock() == hashBlock);
+    int nLastBlockFile = -1;
+    BOOST_CHECK(blocktree.ReadLastBlockFile(nLastBlockFile));
+    BOOST_CHECK_EQUAL(nLastBlockFile, 3);
+
+    // Spending it goes through the same way
+    cache.ModifyCoins(txid)->Clear();
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!writebehind.HaveCoins(txid));
+    BOOST_CHECK(writebehind.Sync());
+    BOOST_CHECK(!coinsdb.HaveCoins(txid));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
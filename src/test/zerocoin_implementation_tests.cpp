@@ -349,4 +349,40 @@ BOOST_AUTO_TEST_CASE(checksum_tests)
 }
 
 
+BOOST_AUTO_TEST_CASE(zerocoin_db_batch)
+{
+    CZerocoinDB db(1 << 20, true);
+    CBigNum bnSerial(1234567);
+    uint256 txHash = uint256("0x3b94ea0b9e0b6f7ab4da0b8fa0f1fa2c1c0e1f3f52cd6a0f7b7f0ccdb5f6e8a1");
+    BOOST_CHECK(db.WriteCoinSpend(bnSerial, txHash));
+
+    // Reads see the changes of the batch, the database only once it is committed
+    db.StartBatch();
+    BOOST_CHECK(db.IsBatching());
+    BOOST_CHECK(db.EraseCoinSpend(bnSerial));
+    BOOST_CHECK(db.WriteAccumulatorValue(7, CBigNum(99)));
+    uint256 txHashRead;
+    CBigNum bnValue;
+    BOOST_CHECK(!db.ReadCoinSpend(bnSerial, txHashRead));
+    BOOST_CHECK(db.ReadAccumulatorValue(7, bnValue) && bnValue == CBigNum(99));
+    db.AbortBatch();
+    BOOST_CHECK(!db.IsBatching());
+    BOOST_CHECK(db.ReadCoinSpend(bnSerial, txHashRead) && txHashRead == txHash);
+    BOOST_CHECK(!db.ReadAccumulatorValue(7, bnValue));
+
+    db.StartBatch();
+    BOOST_CHECK(db.EraseCoinSpend(bnSerial));
+    BOOST_CHECK(db.WriteAccumulatorValue(7, CBigNum(99)));
+    BOOST_CHECK(db.CommitBatch());
+    BOOST_CHECK(!db.IsBatching());
+    BOOST_CHECK(!db.ReadCoinSpend(bnSerial, txHashRead));
+    BOOST_CHECK(db.ReadAccumulatorValue(7, bnValue) && bnValue == CBigNum(99));
+
+    db.StartBatch();
+    BOOST_CHECK(db.EraseAccumulatorValue(7));
+    BOOST_CHECK(!db.ReadAccumulatorValue(7, bnValue));
+    BOOST_CHECK(db.CommitBatch());
+    BOOST_CHECK(!db.ReadAccumulatorValue(7, bnValue));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -11,44 +11,219 @@
 #include "uint256.h"
 #include "accumulators.h"
 
+#include <set>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 using namespace libzerocoin;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+/**
+ * The coin database holds one record per unspent output, keyed 'C' txid VARINT(n), a 'T' txid
+ * marker for every transaction with unspent outputs, its version under 'V' and the best block
+ * under 'H'. The marker lets a lookup of a missing transaction be answered by a point read,
+ * which LevelDB's bloom filters usually settle without touching a table, instead of a seek.
+ *
+ * Versions before it kept one 'c' txid record per transaction and the best block under 'B',
+ * converted by CCoinsViewDB::Upgrade, as are the missing markers of version 1. An older binary
+ * finds no best block in it and rebuilds its own records, which CheckVersion detects.
+ */
+static const int COINS_DB_VERSION = 2;
+
+/** Key of the marker of a transaction with unspent outputs */
+static std::pair<char, uint256> CoinsTxKey(const uint256& txid)
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+    return std::make_pair('T', txid);
+}
+
+struct CCoinsOutKey {
+    char chType;
+    uint256 txid;
+    uint32_t n;
+
+    CCoinsOutKey() : chType('C'), txid(0), n(0) {}
+    CCoinsOutKey(const uint256& txidIn, uint32_t nIn) : chType('C'), txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * An unspent output with the metadata of its transaction:
+ * - VARINT(nVersion)
+ * - VARINT(nCode), nHeight * 4 + 2 if coinstake + 1 if coinbase
+ * - the output (via CTxOutCompressor)
+ */
+struct CCoinsOutRecord {
+    int nVersion;
+    int nHeight;
+    bool fCoinBase;
+    bool fCoinStake;
+    CTxOut out;
+
+    CCoinsOutRecord() : nVersion(0), nHeight(0), fCoinBase(false), fCoinStake(false) {}
+    CCoinsOutRecord(const CCoins& coins, unsigned int n) : nVersion(coins.nVersion), nHeight(coins.nHeight), fCoinBase(coins.fCoinBase),
+                                                            fCoinStake(coins.fCoinStake), out(coins.vout[n]) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned int nCode = nHeight * 4 + (fCoinStake ? 2 : 0) + (fCoinBase ? 1 : 0);
+        ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
+        ::Serialize(s, VARINT(nCode), nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(out)), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nCode = 0;
+        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        nHeight = nCode / 4;
+        fCoinStake = (nCode & 2) != 0;
+        fCoinBase = (nCode & 1) != 0;
+        ::Unserialize(s, REF(CTxOutCompressor(out)), nType, nVersion);
+    }
+
+    void AddTo(CCoins& coins, unsigned int n) const
+    {
+        coins.nVersion = nVersion;
+        coins.nHeight = nHeight;
+        coins.fCoinBase = fCoinBase;
+        coins.fCoinStake = fCoinStake;
+        if (coins.vout.size() <= n)
+            coins.vout.resize(n + 1);
+        coins.vout[n] = out;
+    }
+};
+
+/** Write the outputs the cache entry created and erase the ones it spent, relative to what was fetched from us */
+void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoinsCacheEntry& entry, size_t& nWritten, size_t& nErased)
+{
+    const CCoins& coins = entry.coins;
+    const CCoinsOrigin& origin = entry.origin;
+    // Outputs that stayed unspent are on disk already, unless they now belong to another confirmation
+    bool fRewrite = !origin.SameMetadata(coins);
+    unsigned int nOutputs = std::max(coins.vout.size(), origin.vAvail.size());
+    bool fAnyAvail = false;
+    bool fAnyAvailBefore = false;
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        bool fAvail = i < coins.vout.size() && !coins.vout[i].IsNull();
+        if (fAvail && (fRewrite || !origin.IsAvailable(i))) {
+            batch.Write(CCoinsOutKey(hash, i), CCoinsOutRecord(coins, i));
+            nWritten++;
+        } else if (!fAvail && origin.IsAvailable(i)) {
+            batch.Erase(CCoinsOutKey(hash, i));
+            nErased++;
+        }
+        fAnyAvail |= fAvail;
+        fAnyAvailBefore |= origin.IsAvailable(i);
+    }
+    if (fAnyAvail && !fAnyAvailBefore)
+        batch.Write(CoinsTxKey(hash), '1');
+    else if (!fAnyAvail && fAnyAvailBefore)
+        batch.Erase(CoinsTxKey(hash));
+}
+
+/**
+ * Read the records of txid from the cursor on, leaving it on the first record of another
+ * transaction. Returns whether any was found; nSize gets the bytes they take.
+ */
+bool static ReadCoinsRecords(leveldb::Iterator* pcursor, const uint256& txid, CCoins& coins, uint64_t& nSize)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << 'C' << txid;
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+
+    coins.Clear();
+    bool fFound = false;
+    for (; pcursor->Valid() && pcursor->key().starts_with(slPrefix); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutKey key;
+        ssKey >> key;
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutRecord record;
+        ssValue >> record;
+        record.AddTo(coins, key.n);
+        nSize += slKey.size() + slValue.size();
+        fFound = true;
+    }
+    HandleError(pcursor->status());
+    return fFound;
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 {
-    batch.Write('B', hash);
+    batch.Write('H', hash);
 }
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
 {
 }
 
+leveldb::Iterator* CCoinsViewDB::GetLookupCursor() const
+{
+    AssertLockHeld(cs_lookup);
+    if (!pLookupCursor)
+        pLookupCursor.reset(db.NewLookupIterator());
+    return pLookupCursor.get();
+}
+
+void CCoinsViewDB::ResetLookupCursor()
+{
+    LOCK(cs_lookup);
+    pLookupCursor.reset();
+}
+
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    if (!db.Exists(CoinsTxKey(txid))) {
+        coins.Clear();
+        return false;
+    }
+
+    LOCK(cs_lookup);
+    leveldb::Iterator* pcursor = GetLookupCursor();
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << CCoinsOutKey(txid, 0);
+    pcursor->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+
+    uint64_t nSize = 0;
+    try {
+        return ReadCoinsRecords(pcursor, txid, coins, nSize);
+    } catch (const std::ios_base::failure& e) {
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    return db.Exists(CoinsTxKey(txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
 {
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read('H', hashBestChain))
         return uint256(0);
     return hashBestChain;
 }
@@ -58,20 +233,140 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    size_t written = 0;
+    size_t erased = 0;
+    // mapCoins is only read: CCoinsViewWriteBehind keeps serving lookups from it while it is written
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            BatchWriteCoins(batch, it->first, it->second, written, erased);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transactions (out of %u), %u new and %u spent outputs, to coin database...\n",
+        (unsigned int)changed, (unsigned int)count, (unsigned int)written, (unsigned int)erased);
+    bool ret = db.WriteBatch(batch);
+    // The lookup cursor reads from the snapshot it was created at, so take a new one from here on
+    ResetLookupCursor();
+    return ret;
+}
+
+bool CCoinsViewDB::CheckVersion() const
+{
+    int nVersion = 0;
+    if (!db.Read('V', nVersion))
+        return true;
+    if (nVersion > COINS_DB_VERSION)
+        return error("%s : coin database version %d is newer than supported %d", __func__, nVersion, COINS_DB_VERSION);
+    // Only versions before the record per output write the best block under 'B'
+    if (db.Exists('B'))
+        return error("%s : coin database was written by an older version since it was upgraded", __func__);
+    return true;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    int nVersion = 0;
+    if (db.Read('V', nVersion) && nVersion >= COINS_DB_VERSION)
+        return true;
+
+    CLevelDBBatch batch;
+    size_t nBatch = 0;
+    size_t nTransactions = 0;
+    size_t nOutputs = 0;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssStart(SER_DISK, CLIENT_VERSION);
+    ssStart << 'c';
+    pcursor->Seek(leveldb::Slice(&ssStart[0], ssStart.size()));
+    bool fConvert = pcursor->Valid() && pcursor->key()[0] == 'c';
+    // Per-output records without markers: version 1, or written before versions were recorded
+    bool fMark = nVersion == 1 || !fConvert;
+    if (fConvert)
+        LogPrintf("Upgrading coin database to one record per output...\n");
+    // Every batch converts a run of transactions and erases their old records, so an interrupted
+    // upgrade carries on where it stopped at the next start
+    try {
+        for (; pcursor->Valid() && pcursor->key()[0] == 'c'; pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            uint256 txid;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+
+            bool fAnyAvail = false;
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                if (!coins.vout[i].IsNull()) {
+                    batch.Write(CCoinsOutKey(txid, i), CCoinsOutRecord(coins, i));
+                    nOutputs++;
+                    fAnyAvail = true;
+                }
+            }
+            if (fAnyAvail)
+                batch.Write(CoinsTxKey(txid), '1');
+            batch.Erase(make_pair('c', txid));
+            nTransactions++;
+
+            if (++nBatch == 10000) {
+                if (!db.WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                nBatch = 0;
+                LogPrint("coindb", "%s : %u transactions converted\n", __func__, (unsigned int)nTransactions);
+            }
+        }
+        HandleError(pcursor->status());
+
+        if (fMark) {
+            CDataStream ssOutputs(SER_DISK, CLIENT_VERSION);
+            ssOutputs << 'C';
+            pcursor->Seek(leveldb::Slice(&ssOutputs[0], ssOutputs.size()));
+            uint256 txidLast = 0;
+            for (; pcursor->Valid() && pcursor->key()[0] == 'C'; pcursor->Next()) {
+                boost::this_thread::interruption_point();
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                CCoinsOutKey key;
+                ssKey >> key;
+                if (key.txid == txidLast)
+                    continue;
+                txidLast = key.txid;
+                batch.Write(CoinsTxKey(key.txid), '1');
+                if (++nBatch == 10000) {
+                    if (!db.WriteBatch(batch))
+                        return false;
+                    batch.Clear();
+                    nBatch = 0;
+                }
+            }
+            HandleError(pcursor->status());
+        }
+    } catch (const std::ios_base::failure& e) {
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
+    pcursor.reset();
+
+    // The version and the moved best block go with the last converted records
+    uint256 hashBestChain;
+    if (db.Read('B', hashBestChain)) {
+        BatchWriteHashBestChain(batch, hashBestChain);
+        batch.Erase('B');
+    }
+    batch.Write('V', COINS_DB_VERSION);
+    if (!db.WriteBatch(batch, true))
+        return false;
+    ResetLookupCursor();
+
+    if (fConvert)
+        LogPrintf("Upgraded coin database: %u transactions, %u unspent outputs\n", (unsigned int)nTransactions, (unsigned int)nOutputs);
+    return true;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
@@ -98,6 +393,18 @@ bool CBlockTreeDB::WriteLastBlockFile(int nFile)
     return Write('l', nFile);
 }
 
+bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, CBlockFileInfo> >& vFileInfo, int nLastFile, const std::vector<CDiskBlockIndex>& vBlockIndex)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<int, CBlockFileInfo> >::const_iterator it = vFileInfo.begin(); it != vFileInfo.end(); it++)
+        batch.Write(make_pair('f', it->first), it->second);
+    if (nLastFile >= 0)
+        batch.Write('l', nLastFile);
+    for (std::vector<CDiskBlockIndex>::const_iterator it = vBlockIndex.begin(); it != vBlockIndex.end(); it++)
+        batch.Write(make_pair('b', it->GetBlockHash()), *it);
+    return WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::WriteReindexing(bool fReindexing)
 {
     if (fReindexing)
@@ -123,44 +430,39 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    CDataStream ssStart(SER_DISK, CLIENT_VERSION);
+    ssStart << 'C';
+    pcursor->Seek(leveldb::Slice(&ssStart[0], ssStart.size()));
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
+    // The records of a transaction are adjacent; the hash covers them per transaction as before
+    while (pcursor->Valid() && pcursor->key()[0] == 'C') {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+            CCoinsOutKey key;
+            ssKey >> key;
+            CCoins coins;
+            ReadCoinsRecords(pcursor.get(), key.txid, coins, stats.nSerializedSize);
+            ss << key.txid;
+            ss << VARINT(coins.nVersion);
+            ss << (coins.fCoinBase ? 'c' : 'n');
+            ss << VARINT(coins.nHeight);
+            stats.nTransactions++;
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                const CTxOut& out = coins.vout[i];
+                if (!out.IsNull()) {
+                    stats.nTransactionOutputs++;
+                    ss << VARINT(i + 1);
+                    ss << out;
+                    nTotalAmount += out.nValue;
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
             }
-            pcursor->Next();
+            ss << VARINT(0);
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
@@ -208,160 +510,293 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+bool CBlockTreeDB::WriteInvalidOutPoints(const CInvalidOutPointSet& set)
+{
+    return Write('v', set, true);
+}
+
+bool CBlockTreeDB::ReadInvalidOutPoints(CInvalidOutPointSet& set)
+{
+    return Read('v', set);
+}
+
+/** State shared by the threads loading a range of the block index each */
+struct CBlockIndexLoadState {
+    boost::mutex mutex;
+    std::set<uint256> setCheckpoints; // accumulator checkpoints to load once all entries are in
+    std::string strError;             // first failure, the others stop at their next entry
+    size_t nLoaded;
+
+    CBlockIndexLoadState() : nLoaded(0) {}
+
+    bool Failed()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return !strError.empty();
+    }
+
+    void Fail(const std::string& str)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (strError.empty())
+            strError = str;
+    }
+};
+
+/**
+ * Load the entries whose hash starts with a byte in [nBegin, nEnd). Deserializing them, hashing
+ * the headers and checking proof of work happens concurrently; linking them into mapBlockIndex
+ * is done under the state's lock.
+ */
+void static LoadBlockIndexRange(CBlockTreeDB* pdb, unsigned int nBegin, unsigned int nEnd, CBlockIndexLoadState* pstate)
 {
-    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator());
 
+    uint256 hashStart = 0;
+    *hashStart.begin() = nBegin;
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
+    ssKeySet << make_pair('b', hashStart);
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    uint256 nPreviousCheckpoint;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
+    try {
+        // keys are 'b' and the hash, least significant byte first
+        for (; pcursor->Valid(); pcursor->Next()) {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //zerocoin
-                pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
-                pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
-                pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-                //populate accumulator checksum map in memory
-                if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
-                    //Don't load any invalid checkpoints
-                    if (!InvalidCheckpointRange(pindexNew->nHeight))
-                        LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
-
-                    nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
+            if (slKey.size() < 2 || slKey[0] != 'b' || (unsigned char)slKey[1] >= nEnd)
+                break;
+            if (pstate->Failed())
+                return;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+            uint256 hash = diskindex.GetBlockHash();
+
+            if (diskindex.nHeight <= Params().LAST_POW_BLOCK()) {
+                if (!CheckProofOfWork(hash, diskindex.nBits)) {
+                    pstate->Fail(strprintf("CheckProofOfWork failed: %s", hash.ToString()));
+                    return;
                 }
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+
+            boost::unique_lock<boost::mutex> lock(pstate->mutex);
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(hash);
+            pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nHeight = diskindex.nHeight;
+            pindexNew->nFile = diskindex.nFile;
+            pindexNew->nDataPos = diskindex.nDataPos;
+            pindexNew->nUndoPos = diskindex.nUndoPos;
+            pindexNew->nVersion = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime = diskindex.nTime;
+            pindexNew->nBits = diskindex.nBits;
+            pindexNew->nNonce = diskindex.nNonce;
+            pindexNew->nStatus = diskindex.nStatus;
+            pindexNew->nTx = diskindex.nTx;
+
+            //zerocoin
+            pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
+            pindexNew->zerocoinSupply = diskindex.zerocoinSupply;
+            pindexNew->mintDenominationsInBlock = diskindex.mintDenominationsInBlock;
+
+            //Proof Of Stake
+            pindexNew->nMint = diskindex.nMint;
+            pindexNew->nMoneySupply = diskindex.nMoneySupply;
+            pindexNew->nFlags = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake = diskindex.prevoutStake;
+            pindexNew->nStakeTime = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+
+            // ppcoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+            //Don't load any invalid checkpoints
+            if (pindexNew->nAccumulatorCheckpoint != 0 && !InvalidCheckpointRange(pindexNew->nHeight))
+                pstate->setCheckpoints.insert(pindexNew->nAccumulatorCheckpoint);
+
+            pstate->nLoaded++;
         }
+        HandleError(pcursor->status());
+    } catch (const std::exception& e) {
+        pstate->Fail(strprintf("Deserialize or I/O error - %s", e.what()));
     }
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    // Hashes are uniformly distributed, so splitting on their first byte gives every thread a similar share
+    unsigned int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    CBlockIndexLoadState state;
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&LoadBlockIndexRange, this, 256 * i / nThreads, 256 * (i + 1) / nThreads, &state));
+    threads.join_all();
+
+    if (!state.strError.empty())
+        return error("%s : %s", __func__, state.strError);
+    LogPrint("coindb", "%s : %u entries loaded by %u threads\n", __func__, (unsigned int)state.nLoaded, nThreads);
+
+    boost::this_thread::interruption_point();
+
+    //populate accumulator checksum map in memory
+    BOOST_FOREACH (const uint256& nCheckpoint, state.setCheckpoints)
+        LoadAccumulatorValuesFromDB(nCheckpoint);
 
     return true;
 }
 
-CZerocoinDB::CZerocoinDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "zerocoin", nCacheSize, fMemory, fWipe)
+CZerocoinDB::CZerocoinDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "zerocoin", nCacheSize, fMemory, fWipe),
+                                                                        fBatch(false)
 {
 }
 
-bool CZerocoinDB::WriteCoinMint(const PublicCoin& pubCoin, const uint256& hashTx)
+static uint256 HashBigNum(const CBigNum& bn)
 {
-    CBigNum bnValue = pubCoin.getValue();
     CDataStream ss(SER_GETHASH, 0);
-    ss << pubCoin.getValue();
-    uint256 hash = Hash(ss.begin(), ss.end());
+    ss << bn;
+    return Hash(ss.begin(), ss.end());
+}
 
-    return Write(make_pair('m', hash), hashTx, true);
+bool CZerocoinDB::WriteTx(char chType, const uint256& hash, const uint256& txHash)
+{
+    LOCK(cs);
+    if (fBatch) {
+        batch.Write(make_pair(chType, hash), txHash);
+        mapPendingTx[make_pair(chType, hash)] = txHash;
+        return true;
+    }
+    // Records made outside of a block are made again when the block is connected, no need to sync them
+    return Write(make_pair(chType, hash), txHash);
 }
 
-bool CZerocoinDB::ReadCoinMint(const CBigNum& bnPubcoin, uint256& hashTx)
+bool CZerocoinDB::ReadTx(char chType, const uint256& hash, uint256& txHash)
 {
-    CDataStream ss(SER_GETHASH, 0);
-    ss << bnPubcoin;
-    uint256 hash = Hash(ss.begin(), ss.end());
+    LOCK(cs);
+    std::map<std::pair<char, uint256>, uint256>::const_iterator it = mapPendingTx.find(make_pair(chType, hash));
+    if (it != mapPendingTx.end()) {
+        if (it->second == 0)
+            return false;
+        txHash = it->second;
+        return true;
+    }
+    return Read(make_pair(chType, hash), txHash);
+}
+
+bool CZerocoinDB::EraseTx(char chType, const uint256& hash)
+{
+    LOCK(cs);
+    if (fBatch) {
+        batch.Erase(make_pair(chType, hash));
+        mapPendingTx[make_pair(chType, hash)] = 0;
+        return true;
+    }
+    return Erase(make_pair(chType, hash));
+}
 
-    return Read(make_pair('m', hash), hashTx);
+bool CZerocoinDB::WriteCoinMint(const PublicCoin& pubCoin, const uint256& hashTx)
+{
+    return WriteTx('m', HashBigNum(pubCoin.getValue()), hashTx);
 }
 
-bool CZerocoinDB::EraseCoinMint(const CBigNum& bnPubcoin)
+bool CZerocoinDB::ReadCoinMint(const CBigNum& bnPubcoin, uint256& hashTx)
 {
-    CDataStream ss(SER_GETHASH, 0);
-    ss << bnPubcoin;
-    uint256 hash = Hash(ss.begin(), ss.end());
+    return ReadTx('m', HashBigNum(bnPubcoin), hashTx);
+}
 
-    return Erase(make_pair('m', hash));
+bool CZerocoinDB::EraseCoinMint(const CBigNum& bnPubcoin)
+{
+    return EraseTx('m', HashBigNum(bnPubcoin));
 }
 
 bool CZerocoinDB::WriteCoinSpend(const CBigNum& bnSerial, const uint256& txHash)
 {
-    CDataStream ss(SER_GETHASH, 0);
-    ss << bnSerial;
-    uint256 hash = Hash(ss.begin(), ss.end());
-
-    return Write(make_pair('s', hash), txHash, true);
+    return WriteTx('s', HashBigNum(bnSerial), txHash);
 }
 
 bool CZerocoinDB::ReadCoinSpend(const CBigNum& bnSerial, uint256& txHash)
 {
-    CDataStream ss(SER_GETHASH, 0);
-    ss << bnSerial;
-    uint256 hash = Hash(ss.begin(), ss.end());
-
-    return Read(make_pair('s', hash), txHash);
+    return ReadTx('s', HashBigNum(bnSerial), txHash);
 }
 
 bool CZerocoinDB::EraseCoinSpend(const CBigNum& bnSerial)
 {
-    CDataStream ss(SER_GETHASH, 0);
-    ss << bnSerial;
-    uint256 hash = Hash(ss.begin(), ss.end());
-
-    return Erase(make_pair('s', hash));
+    return EraseTx('s', HashBigNum(bnSerial));
 }
 
 bool CZerocoinDB::WriteAccumulatorValue(const uint32_t& nChecksum, const CBigNum& bnValue)
 {
     LogPrint("zero","%s : checksum:%d val:%s\n", __func__, nChecksum, bnValue.GetHex());
+    LOCK(cs);
+    if (fBatch) {
+        batch.Write(make_pair('a', nChecksum), bnValue);
+        mapPendingAccumulators[nChecksum] = bnValue;
+        return true;
+    }
     return Write(make_pair('a', nChecksum), bnValue);
 }
 
 bool CZerocoinDB::ReadAccumulatorValue(const uint32_t& nChecksum, CBigNum& bnValue)
 {
+    LOCK(cs);
+    std::map<uint32_t, CBigNum>::const_iterator it = mapPendingAccumulators.find(nChecksum);
+    if (it != mapPendingAccumulators.end()) {
+        if (it->second == 0)
+            return false;
+        bnValue = it->second;
+        return true;
+    }
     return Read(make_pair('a', nChecksum), bnValue);
 }
 
 bool CZerocoinDB::EraseAccumulatorValue(const uint32_t& nChecksum)
 {
     LogPrint("zero", "%s : checksum:%d\n", __func__, nChecksum);
+    LOCK(cs);
+    if (fBatch) {
+        batch.Erase(make_pair('a', nChecksum));
+        mapPendingAccumulators[nChecksum] = 0;
+        return true;
+    }
     return Erase(make_pair('a', nChecksum));
 }
+
+void CZerocoinDB::StartBatch()
+{
+    LOCK(cs);
+    assert(!fBatch);
+    fBatch = true;
+}
+
+bool CZerocoinDB::IsBatching() const
+{
+    LOCK(cs);
+    return fBatch;
+}
+
+bool CZerocoinDB::CommitBatch()
+{
+    LOCK(cs);
+    assert(fBatch);
+    bool fOk = true;
+    if (!mapPendingTx.empty() || !mapPendingAccumulators.empty()) {
+        LogPrint("zero", "%s : %u records, %u accumulator values\n", __func__, mapPendingTx.size(), mapPendingAccumulators.size());
+        fOk = WriteBatch(batch, true);
+    }
+    AbortBatch();
+    return fOk;
+}
+
+void CZerocoinDB::AbortBatch()
+{
+    LOCK(cs);
+    fBatch = false;
+    batch.Clear();
+    mapPendingTx.clear();
+    mapPendingAccumulators.clear();
+}
@@ -16,6 +16,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+
 class CCoins;
 class uint256;
 
@@ -25,6 +27,8 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! Maximum number of threads reading the block index at startup
+static const int MAX_BLOCK_INDEX_LOAD_THREADS = 8;
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -32,6 +36,13 @@ class CCoinsViewDB : public CCoinsView
 protected:
     CLevelDBWrapper db;
 
+    //! Cursor reused by lookups, taken anew after every write so they see it
+    mutable CCriticalSection cs_lookup;
+    mutable boost::scoped_ptr<leveldb::Iterator> pLookupCursor;
+
+    leveldb::Iterator* GetLookupCursor() const;
+    void ResetLookupCursor();
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -40,6 +51,11 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Whether the database was not written by a newer version, or by an older one after Upgrade
+    bool CheckVersion() const;
+    //! Convert per-transaction records written by earlier versions to one record per output
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -58,6 +74,8 @@ public:
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo& fileinfo);
     bool ReadLastBlockFile(int& nFile);
     bool WriteLastBlockFile(int nFile);
+    /** Write block file information and block index entries as one synced batch; nLastFile < 0 leaves it alone */
+    bool WriteBatchSync(const std::vector<std::pair<int, CBlockFileInfo> >& vFileInfo, int nLastFile, const std::vector<CDiskBlockIndex>& vBlockIndex);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool& fReindex);
     bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
@@ -66,9 +84,16 @@ public:
     bool ReadFlag(const std::string& name, bool& fValue);
     bool WriteInt(const std::string& name, int nValue);
     bool ReadInt(const std::string& name, int& nValue);
+    bool WriteInvalidOutPoints(const CInvalidOutPointSet& set);
+    bool ReadInvalidOutPoints(CInvalidOutPointSet& set);
     bool LoadBlockIndexGuts();
 };
 
+/**
+ * Access to the zerocoin database (zerocoin/). Between StartBatch and CommitBatch the writes and
+ * erases are collected and written as one synced batch, so a block's mints, spends and accumulator
+ * values reach the disk together; reads see the collected changes meanwhile.
+ */
 class CZerocoinDB : public CLevelDBWrapper
 {
 public:
@@ -88,6 +113,24 @@ public:
     bool WriteAccumulatorValue(const uint32_t& nChecksum, const CBigNum& bnValue);
     bool ReadAccumulatorValue(const uint32_t& nChecksum, CBigNum& bnValue);
     bool EraseAccumulatorValue(const uint32_t& nChecksum);
+
+    void StartBatch();
+    bool IsBatching() const;
+    bool CommitBatch();
+    void AbortBatch();
+
+private:
+    mutable CCriticalSection cs;
+    bool fBatch;
+    CLevelDBBatch batch;
+    // Mint and spend records of the batch, a zero transaction hash marks an erased one
+    std::map<std::pair<char, uint256>, uint256> mapPendingTx;
+    // Accumulator values of the batch, a zero value marks an erased one
+    std::map<uint32_t, CBigNum> mapPendingAccumulators;
+
+    bool WriteTx(char chType, const uint256& hash, const uint256& txHash);
+    bool ReadTx(char chType, const uint256& hash, uint256& txHash);
+    bool EraseTx(char chType, const uint256& hash);
 };
 
 #endif // BITCOIN_TXDB_H
@@ -0,0 +1,148 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "writebehind.h"
+
+#include "txdb.h"
+#include "util.h"
+#include "validationinterface.h"
+
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsView* viewIn, CBlockTreeDB* pblocktreeIn) : CCoinsViewBacked(viewIn),
+                                                                                               pblocktree(pblocktreeIn),
+                                                                                               hashPending(0),
+                                                                                               fPending(false),
+                                                                                               fWriting(false),
+                                                                                               fFailed(false)
+{
+}
+
+bool CCoinsViewWriteBehind::GetCoins(const uint256& txid, CCoins& coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CCoinsMap::const_iterator it = mapPending.find(txid);
+        if (it != mapPending.end()) {
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    // Written before it leaves mapPending, so a miss there is answered correctly from below
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewWriteBehind::HaveCoins(const uint256& txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CCoinsMap::const_iterator it = mapPending.find(txid);
+        if (it != mapPending.end())
+            return !it->second.coins.vout.empty();
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewWriteBehind::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if ((fPending || fFailed) && hashPending != 0)
+            return hashPending;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitIdle(lock);
+    // After a failed write the snapshot stays for lookups, the node is shutting down
+    if (fFailed)
+        return false;
+
+    mapPending.swap(mapCoins);
+    hashPending = hashBlock;
+    fPending = true;
+    cond.notify_all();
+    return true;
+}
+
+void CCoinsViewWriteBehind::SetBlockTreeChanges(CBlockTreeChanges& changes)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitIdle(lock);
+    std::swap(changesPending, changes);
+}
+
+bool CCoinsViewWriteBehind::Sync()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitIdle(lock);
+    return !fFailed;
+}
+
+bool CCoinsViewWriteBehind::IsPending() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return fPending;
+}
+
+void CCoinsViewWriteBehind::WaitIdle(boost::unique_lock<boost::mutex>& lock)
+{
+    while (fPending) {
+        if (!fWriting)
+            WritePending(lock);
+        else
+            cond.wait(lock);
+    }
+}
+
+void CCoinsViewWriteBehind::WritePending(boost::unique_lock<boost::mutex>& lock)
+{
+    assert(fPending && !fWriting);
+    fWriting = true;
+    lock.unlock();
+
+    int64_t nStart = GetTimeMicros();
+    bool fOk = true;
+    try {
+        const CBlockTreeChanges& changes = changesPending;
+        // Block files were flushed before the snapshot was taken; the index goes next, then the coins referring to it
+        if (!pblocktree->WriteBatchSync(changes.vFileInfo, changes.nLastBlockFile, changes.vBlockIndex))
+            fOk = error("%s : failed to write to block index", __func__);
+        else if (!base->BatchWrite(mapPending, hashPending))
+            fOk = error("%s : failed to write to coin database", __func__);
+    } catch (const std::runtime_error& e) {
+        fOk = error("%s : %s", __func__, e.what());
+    }
+
+    if (fOk) {
+        LogPrint("coindb", "%s : wrote %u block index entries and %u coins in %.2fms\n", __func__,
+            changesPending.vBlockIndex.size(), mapPending.size(), (GetTimeMicros() - nStart) * 0.001);
+        // Update best block in wallet (so we can detect restored wallets).
+        if (!changesPending.locator.IsNull())
+            GetMainSignals().SetBestChain(changesPending.locator);
+    } else
+        AbortNode("Failed to write chainstate to disk");
+
+    lock.lock();
+    if (fOk)
+        mapPending.clear();
+    else
+        fFailed = true;
+    changesPending = CBlockTreeChanges();
+    fWriting = false;
+    fPending = false;
+    cond.notify_all();
+}
+
+void CCoinsViewWriteBehind::ThreadFlush()
+{
+    RenameThread("donate-flush");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        while (!fPending || fWriting)
+            cond.wait(lock);
+        WritePending(lock);
+    }
+}
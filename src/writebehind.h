@@ -0,0 +1,83 @@
+// Copyright (c) 2018 The Donate developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WRITEBEHIND_H
+#define BITCOIN_WRITEBEHIND_H
+
+#include "chain.h"
+#include "coins.h"
+#include "main.h"
+#include "primitives/block.h"
+
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlockTreeDB;
+
+/** Block index changes frozen together with a coins snapshot, written ahead of it */
+struct CBlockTreeChanges {
+    std::vector<std::pair<int, CBlockFileInfo> > vFileInfo;
+    int nLastBlockFile; // -1 when unchanged
+    std::vector<CDiskBlockIndex> vBlockIndex;
+    CBlockLocator locator; // passed to SetBestChain once everything is on disk
+
+    CBlockTreeChanges() : nLastBlockFile(-1) {}
+};
+
+/**
+ * Coins view between pcoinsTip and the coin database that takes the cache over when it is
+ * flushed and writes it from the flush thread, so cs_main is only held for freezing it.
+ *
+ * BatchWrite swaps the flushed map in as the pending snapshot and returns; lookups that miss
+ * the (now empty) tip cache are answered from the snapshot until it is on disk. The block
+ * index changes handed over with it go out first as one synced batch, then the coins with
+ * their best block in one batch, so after a crash the coin database never refers to block
+ * index entries that were not written, and its best block tells where to reconnect from.
+ *
+ * Only one snapshot is in flight: a new one waits for the previous one. The view below must
+ * leave the map it is given untouched (CCoinsViewDB does), lookups keep using it meanwhile.
+ */
+class CCoinsViewWriteBehind : public CCoinsViewBacked
+{
+public:
+    CCoinsViewWriteBehind(CCoinsView* viewIn, CBlockTreeDB* pblocktreeIn);
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const;
+    bool HaveCoins(const uint256& txid) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+
+    /** Block index changes for the next snapshot; call right before flushing the cache into this view */
+    void SetBlockTreeChanges(CBlockTreeChanges& changes);
+    /** Write the pending snapshot in the calling thread, or wait for the flush thread to finish it. False if a write failed. */
+    bool Sync();
+    /** Whether a snapshot is waiting to be written or being written */
+    bool IsPending() const;
+
+    /** Body of the flush thread */
+    void ThreadFlush();
+
+private:
+    CBlockTreeDB* pblocktree;
+
+    mutable boost::mutex mutex;
+    boost::condition_variable cond;
+    // Snapshot being written; no one modifies it until it is on disk and cleared, protected by mutex
+    CCoinsMap mapPending;
+    uint256 hashPending;
+    CBlockTreeChanges changesPending;
+    bool fPending;
+    bool fWriting;
+    bool fFailed;
+
+    /** Return once nothing is pending, writing the snapshot here if the flush thread has not taken it */
+    void WaitIdle(boost::unique_lock<boost::mutex>& lock);
+    /** Write the pending snapshot; lock is released during the write */
+    void WritePending(boost::unique_lock<boost::mutex>& lock);
+};
+
+#endif // BITCOIN_WRITEBEHIND_H